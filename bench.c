@@ -0,0 +1,768 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ */
+
+/*
+ * fatdisk-bench, formats reproducible FAT12/16/32 images, times the common
+ * commands against them and prints the results as JSON on stdout.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ftw.h>
+#include <sys/resource.h>
+
+#include "main.h"
+#include "disk.h"
+#include "fat.h"
+#include "command.h"
+
+typedef enum {
+    BENCH_DIST_UNIFORM,
+    BENCH_DIST_LOG,
+} bench_dist_t;
+
+typedef struct bench_config_ {
+    uint32_t fat;
+    uint64_t image_size;
+    uint32_t files;
+    uint64_t min_size;
+    uint64_t max_size;
+    bench_dist_t dist;
+    uint32_t frag;
+} bench_config_t;
+
+typedef struct bench_io_ {
+    uint64_t syscr;
+    uint64_t syscw;
+    uint64_t rchar;
+    uint64_t wchar;
+} bench_io_t;
+
+typedef uint32_t (*bench_op_t)(disk_t *, const char *);
+
+static const char *opt_work_dir;
+static uint64_t opt_seed = 1;
+static uint64_t rand_state;
+static boolean opt_keep;
+static int json_fd = -1;
+static char *image;
+static uint64_t single_size;
+static uint64_t payload_size;
+
+/*
+ * bench_usage
+ */
+static void bench_usage (void)
+{
+    fprintf(stderr,
+"usage: fatdisk-bench [options]\n"
+"\n"
+"  --fat <12|16|32>       : only bench this FAT type, may be repeated\n"
+"  --files <count>        : number of files in the generated tree\n"
+"  --min-size <bytes>     : smallest generated file\n"
+"  --max-size <bytes>     : largest generated file\n"
+"  --dist <uniform|log>   : file size distribution, log favours small files\n"
+"  --frag <0-100>         : percent of free space left as one cluster holes\n"
+"                           before the tree is added\n"
+"  --size <bytes>         : image size\n"
+"  --seed <n>             : random seed, the same seed gives the same images\n"
+"  --dir <dir>            : scratch dir, default /tmp/fatdisk-bench.<pid>\n"
+"  --keep                 : do not delete the scratch dir\n"
+"\n"
+"Results are printed as JSON on stdout.\n");
+}
+
+/*
+ * bench_rand
+ *
+ * Small xorshift generator so runs are the same everywhere for a seed.
+ */
+static uint64_t bench_rand (void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+
+    return (rand_state);
+}
+
+/*
+ * bench_file_size
+ *
+ * Pick a file size. The log distribution picks a power of two band first
+ * and then a size in that band, giving many more small files than big.
+ */
+static uint64_t bench_file_size (const bench_config_t *cfg)
+{
+    uint64_t lo = cfg->min_size;
+    uint64_t hi = cfg->max_size;
+
+    if (hi <= lo) {
+        return (lo);
+    }
+
+    if (cfg->dist == BENCH_DIST_LOG) {
+        uint32_t bands = 0;
+        uint64_t band;
+
+        for (band = lo; band < hi; band <<= 1) {
+            bands++;
+        }
+
+        band = lo << (bench_rand() % bands);
+
+        lo = band;
+        hi = min(band << 1, hi);
+    }
+
+    return (lo + (bench_rand() % (hi - lo + 1)));
+}
+
+/*
+ * bench_write_file
+ */
+static void bench_write_file (const char *filename, uint64_t size)
+{
+    uint8_t *buf;
+    uint64_t i;
+
+    buf = (typeof(buf)) mymalloc((uint32_t) max(size, (uint64_t) 1),
+                                 __FUNCTION__);
+
+    for (i = 0; i < size; i++) {
+        buf[i] = (uint8_t) bench_rand();
+    }
+
+    if (file_write(filename, buf, (int64_t) size) < 0) {
+        DIE("cannot write %s", filename);
+    }
+
+    myfree(buf);
+}
+
+/*
+ * bench_rm
+ */
+static int bench_rm (const char *path, const struct stat *sb,
+                     int flag, struct FTW *ftw)
+{
+    return (remove(path));
+}
+
+/*
+ * bench_make_tree
+ *
+ * Generate the local files to add: one big single file, a tree of files
+ * spread over a few dirs, and one cluster filler files used to fragment
+ * free space.
+ */
+static void bench_make_tree (const bench_config_t *cfg,
+                             uint32_t cluster_sz,
+                             uint32_t fillers)
+{
+    char *path;
+    uint32_t i;
+
+    /*
+     * Start from nothing so each FAT type sees the same tree.
+     */
+    path = dynprintf("%s/src", opt_work_dir);
+    nftw(path, bench_rm, 16, FTW_DEPTH | FTW_PHYS);
+    myfree(path);
+
+    path = dynprintf("%s/out", opt_work_dir);
+    nftw(path, bench_rm, 16, FTW_DEPTH | FTW_PHYS);
+    myfree(path);
+
+    path = dynprintf("%s/src/tree", opt_work_dir);
+    mkpath(path, 0755);
+    myfree(path);
+
+    path = dynprintf("%s/fill", opt_work_dir);
+    nftw(path, bench_rm, 16, FTW_DEPTH | FTW_PHYS);
+    mkpath(path, 0755);
+    myfree(path);
+
+    path = dynprintf("%s/out", opt_work_dir);
+    mkpath(path, 0755);
+    myfree(path);
+
+    single_size = cfg->max_size;
+
+    path = dynprintf("%s/src/single.bin", opt_work_dir);
+    bench_write_file(path, single_size);
+    myfree(path);
+
+    payload_size = 0;
+
+    for (i = 0; i < cfg->files; i++) {
+        uint64_t size = bench_file_size(cfg);
+
+        if ((i % 64) == 0) {
+            path = dynprintf("%s/src/tree/d%03" PRIu32, opt_work_dir, i / 64);
+            mkpath(path, 0755);
+            myfree(path);
+        }
+
+        path = dynprintf("%s/src/tree/d%03" PRIu32 "/f%05" PRIu32 ".bin",
+                         opt_work_dir, i / 64, i);
+        bench_write_file(path, size);
+        myfree(path);
+
+        payload_size += size;
+    }
+
+    for (i = 0; i < fillers; i++) {
+        path = dynprintf("%s/fill/f%05" PRIu32 ".bin", opt_work_dir, i);
+        bench_write_file(path, cluster_sz);
+        myfree(path);
+    }
+}
+
+/*
+ * bench_format
+ *
+ * Make a fresh image of the wanted FAT type, the same way format does for
+ * a single partition disk.
+ */
+static void bench_format (const bench_config_t *cfg)
+{
+    unsigned char tmp = '\0';
+    uint8_t os_id;
+    disk_t *disk;
+
+    switch (cfg->fat) {
+    case 12:
+        os_id = DISK_FAT12;
+        break;
+    case 16:
+        os_id = DISK_FAT16;
+        break;
+    default:
+        os_id = DISK_FAT32;
+        break;
+    }
+
+    unlink(image);
+
+    if (file_write(image, 0, 0) < 0) {
+        DIE("cannot write to %s", image);
+    }
+
+    if (file_write_at(image, (int64_t) cfg->image_size - 1, &tmp,
+                      (uint32_t) sizeof(tmp))) {
+        DIE("cannot write to end of file of %s", image);
+    }
+
+    disk = disk_command_format(image, 0, 0, false, cfg->image_size,
+                               "BENCH", 0,
+                               (uint32_t) (cfg->image_size /
+                                           opt_sector_size) - 1,
+                               os_id, false, 0, 0);
+    if (!disk) {
+        DIE("format of %s failed", image);
+    }
+
+    disk_command_close(disk);
+}
+
+/*
+ * bench_open
+ */
+static disk_t *bench_open (void)
+{
+    int64_t offset;
+    disk_t *disk;
+
+    offset = disk_command_query(image, 0, false, false /* hunt */);
+
+    disk = disk_command_open(image, offset, 0, true);
+    if (!disk) {
+        DIE("disk open of %s failed", image);
+    }
+
+    return (disk);
+}
+
+/*
+ * bench_io_read
+ *
+ * Syscall and byte counts for this process, zero where /proc is missing.
+ * Writes done on io_uring are not in there, so are added on as if each
+ * were a write call.
+ */
+static void bench_io_read (bench_io_t *io)
+{
+    char line[MAX_STR];
+    FILE *fp;
+
+    memset(io, 0, sizeof(*io));
+
+    fp = fopen("/proc/self/io", "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            sscanf(line, "syscr: %" SCNu64, &io->syscr);
+            sscanf(line, "syscw: %" SCNu64, &io->syscw);
+            sscanf(line, "rchar: %" SCNu64, &io->rchar);
+            sscanf(line, "wchar: %" SCNu64, &io->wchar);
+        }
+
+        fclose(fp);
+    }
+
+    io->syscw += uring_writes;
+    io->wchar += uring_written;
+}
+
+static double bench_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((double) ts.tv_sec + ((double) ts.tv_nsec / 1e9));
+}
+
+static void bench_json (const char *fmt, ...)
+{
+    va_list args;
+    char *s;
+
+    va_start(args, fmt);
+    s = dynvprintf(fmt, args);
+    va_end(args);
+
+    if (write(json_fd, s, strlen(s)) < 0) {
+        DIE("cannot write results");
+    }
+
+    myfree(s);
+}
+
+/*
+ * bench_run_op
+ *
+ * Time one command including opening and closing the disk, as the command
+ * line would. Anything the command prints is thrown away.
+ */
+static void bench_run_op (const char *name,
+                          bench_op_t op,
+                          const char *arg,
+                          uint64_t bytes,
+                          boolean first)
+{
+    bench_io_t before;
+    bench_io_t after;
+    struct rusage usage;
+    double start;
+    double secs;
+    uint32_t count;
+    disk_t *disk;
+
+    bench_io_read(&before);
+    start = bench_now();
+
+    disk = bench_open();
+    count = (*op)(disk, arg);
+    disk_command_close(disk);
+
+    fflush(stdout);
+    secs = bench_now() - start;
+    bench_io_read(&after);
+    getrusage(RUSAGE_SELF, &usage);
+
+    if (secs <= 0) {
+        secs = 1e-9;
+    }
+
+    bench_json("%s\n        {\"op\": \"%s\", \"entries\": %" PRIu32
+               ", \"bytes\": %" PRIu64 ", \"seconds\": %.6f"
+               ", \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f"
+               ", \"syscr\": %" PRIu64 ", \"syscw\": %" PRIu64
+               ", \"rchar\": %" PRIu64 ", \"wchar\": %" PRIu64
+               ", \"peak_rss_kb\": %ld}",
+               first ? "" : ",",
+               name, count, bytes, secs,
+               (double) count / secs,
+               ((double) bytes / ONE_MEG) / secs,
+               after.syscr - before.syscr,
+               after.syscw - before.syscw,
+               after.rchar - before.rchar,
+               after.wchar - before.wchar,
+               (long) usage.ru_maxrss);
+}
+
+static uint32_t bench_add (disk_t *disk, const char *arg)
+{
+    return (disk_add(disk, arg, 0));
+}
+
+static uint32_t bench_list (disk_t *disk, const char *arg)
+{
+    return (disk_command_list(disk, arg));
+}
+
+static uint32_t bench_find (disk_t *disk, const char *arg)
+{
+    return (disk_command_find(disk, arg));
+}
+
+static uint32_t bench_cat (disk_t *disk, const char *arg)
+{
+    return (disk_command_cat(disk, arg));
+}
+
+static uint32_t bench_extract (disk_t *disk, const char *arg)
+{
+    char *out = dynprintf("%s/out", opt_work_dir);
+    char cwd[MAX_STR];
+    uint32_t count;
+
+    if (!getcwd(cwd, sizeof(cwd)) || chdir(out)) {
+        DIE("cannot change to %s", out);
+    }
+
+    count = disk_command_extract(disk, arg);
+
+    if (chdir(cwd)) {
+        DIE("cannot change back to %s", cwd);
+    }
+
+    myfree(out);
+
+    return (count);
+}
+
+static uint32_t bench_remove (disk_t *disk, const char *arg)
+{
+    return (disk_command_remove(disk, arg));
+}
+
+static uint32_t bench_summary (disk_t *disk, const char *arg)
+{
+    disk_command_summary(disk, image, false, 0, false, false);
+
+    return (1);
+}
+
+/*
+ * bench_fragment
+ *
+ * Fill free space with one cluster files and delete frag percent of them,
+ * spread evenly by the last digit of their index, so the tree is later
+ * added into scattered holes.
+ */
+static void bench_fragment (uint32_t frag)
+{
+    char *filter;
+    disk_t *disk;
+    uint32_t digits = frag / 10;
+
+    disk = bench_open();
+    disk_add(disk, "fill", 0);
+
+    if (digits >= 10) {
+        disk_command_remove(disk, "fill");
+    } else if (digits) {
+        filter = dynprintf("fill/f[0-9]*[0-%" PRIu32 "][.]bin", digits - 1);
+        disk_command_remove(disk, filter);
+        myfree(filter);
+    }
+
+    disk_command_close(disk);
+}
+
+/*
+ * bench_run
+ *
+ * One full pass over an image of one FAT type.
+ */
+static void bench_run (bench_config_t *cfg, boolean first)
+{
+    uint32_t cluster_sz;
+    uint32_t fillers;
+    disk_t *disk;
+    int devnull;
+
+    rand_state = opt_seed * 0x9E3779B97F4A7C15ULL + cfg->fat;
+    if (!rand_state) {
+        rand_state = 1;
+    }
+
+    image = dynprintf("%s/fat%" PRIu32 ".img", opt_work_dir, cfg->fat);
+
+    bench_format(cfg);
+
+    disk = bench_open();
+    cluster_sz = cluster_size(disk);
+    disk_command_close(disk);
+
+    /*
+     * Enough filler to cover the space the tree needs, but leave room for
+     * the tree itself.
+     */
+    fillers = 0;
+    if (cfg->frag) {
+        fillers = (uint32_t) min((uint64_t) 4096,
+                    ((cfg->image_size / 4) / cluster_sz));
+    }
+
+    bench_make_tree(cfg, cluster_sz, fillers);
+
+    if (chdir(opt_work_dir)) {
+        DIE("cannot change to %s", opt_work_dir);
+    }
+
+    /*
+     * Command output goes to /dev/null; results go to the real stdout.
+     */
+    fflush(stdout);
+    devnull = open("/dev/null", O_WRONLY);
+    if ((devnull < 0) || (dup2(devnull, 1) < 0)) {
+        DIE("cannot redirect output");
+    }
+    close(devnull);
+
+    if (cfg->frag) {
+        bench_fragment(cfg->frag);
+    }
+
+    bench_json("%s\n    {\"fat\": %" PRIu32 ", \"image_size\": %" PRIu64
+               ", \"cluster_size\": %" PRIu32 ", \"files\": %" PRIu32
+               ", \"tree_bytes\": %" PRIu64 ", \"dist\": \"%s\""
+               ", \"frag\": %" PRIu32 ",\n     \"ops\": [",
+               first ? "" : ",",
+               cfg->fat, cfg->image_size, cluster_sz, cfg->files, payload_size,
+               cfg->dist == BENCH_DIST_LOG ? "log" : "uniform", cfg->frag);
+
+    bench_run_op("add_single", bench_add, "src/single.bin",
+                 single_size, true);
+    bench_run_op("add_many", bench_add, "src/tree", payload_size, false);
+    bench_run_op("ls_recursive", bench_list, 0, 0, false);
+    bench_run_op("find_glob", bench_find, "src/tree/*/*.bin", 0,
+                 false);
+    bench_run_op("find_regex", bench_find,
+                 "src/tree/d00[0-9]/f[0-9][0-9][0-9][0-9]7[.]bin$", 0, false);
+    bench_run_op("cat", bench_cat, "src/tree/*/*.bin", payload_size,
+                 false);
+    bench_run_op("extract", bench_extract, "src", payload_size + single_size,
+                 false);
+    bench_run_op("summary", bench_summary, 0, 0, false);
+    bench_run_op("rm", bench_remove, "src", 0, false);
+
+    bench_json("\n     ]}");
+
+    fflush(stdout);
+    if (dup2(json_fd, 1) < 0) {
+        DIE("cannot restore output");
+    }
+
+    if (!opt_keep) {
+        unlink(image);
+    }
+
+    myfree(image);
+    image = 0;
+}
+
+/*
+ * bench_default
+ *
+ * Sizes that keep each FAT type honest without taking all day.
+ */
+static void bench_default (bench_config_t *cfg, uint32_t fat)
+{
+    memset(cfg, 0, sizeof(*cfg));
+
+    cfg->fat = fat;
+    cfg->dist = BENCH_DIST_LOG;
+
+    switch (fat) {
+    case 12:
+        cfg->image_size = 2 * ONE_MEG;
+        cfg->files = 64;
+        cfg->min_size = 256;
+        cfg->max_size = 8 * ONE_K;
+        break;
+    case 16:
+        cfg->image_size = 64 * ONE_MEG;
+        cfg->files = 512;
+        cfg->min_size = 512;
+        cfg->max_size = 64 * ONE_K;
+        break;
+    default:
+        cfg->image_size = 512 * ONE_MEG;
+        cfg->files = 1024;
+        cfg->min_size = ONE_K;
+        cfg->max_size = 256 * ONE_K;
+        break;
+    }
+}
+
+int32_t main (int32_t argc, char *argv[])
+{
+    bench_config_t overrides;
+    bench_config_t cfg;
+    boolean fats[33] = { false };
+    boolean any_fat = false;
+    boolean first = true;
+    char *default_dir = 0;
+    char cwd[MAX_STR];
+    int32_t i;
+    uint32_t fat;
+
+    memset(&overrides, 0, sizeof(overrides));
+    overrides.dist = (bench_dist_t) -1;
+
+    for (i = 1; i < argc; i++) {
+        const char *val = (i + 1 < argc) ? argv[i + 1] : 0;
+
+        if (!strcmp(argv[i], "--keep")) {
+            opt_keep = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+            bench_usage();
+            exit(0);
+        }
+
+        if (!val) {
+            bench_usage();
+            DIE("missing value for %s", argv[i]);
+        }
+
+        if (!strcmp(argv[i], "--fat")) {
+            fat = (uint32_t) strtoul(val, 0, 10);
+            if ((fat != 12) && (fat != 16) && (fat != 32)) {
+                DIE("FAT type must be 12, 16 or 32");
+            }
+            fats[fat] = true;
+            any_fat = true;
+        } else if (!strcmp(argv[i], "--files")) {
+            overrides.files = (uint32_t) strtoul(val, 0, 10);
+        } else if (!strcmp(argv[i], "--min-size")) {
+            overrides.min_size = strtoull(val, 0, 10);
+        } else if (!strcmp(argv[i], "--max-size")) {
+            overrides.max_size = strtoull(val, 0, 10);
+        } else if (!strcmp(argv[i], "--size")) {
+            overrides.image_size = strtoull(val, 0, 10);
+        } else if (!strcmp(argv[i], "--frag")) {
+            overrides.frag = (uint32_t) strtoul(val, 0, 10);
+            if (overrides.frag > 100) {
+                DIE("fragmentation is a percentage");
+            }
+        } else if (!strcmp(argv[i], "--dist")) {
+            if (!strcmp(val, "log")) {
+                overrides.dist = BENCH_DIST_LOG;
+            } else if (!strcmp(val, "uniform")) {
+                overrides.dist = BENCH_DIST_UNIFORM;
+            } else {
+                DIE("unknown distribution %s", val);
+            }
+        } else if (!strcmp(argv[i], "--seed")) {
+            opt_seed = strtoull(val, 0, 10);
+        } else if (!strcmp(argv[i], "--dir")) {
+            opt_work_dir = val;
+        } else {
+            bench_usage();
+            DIE("unknown argument, %s", argv[i]);
+        }
+
+        i++;
+    }
+
+    if (!any_fat) {
+        fats[12] = fats[16] = fats[32] = true;
+    }
+
+    opt_quiet = true;
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        DIE("cannot read current dir");
+    }
+
+    if (!opt_work_dir) {
+        default_dir = dynprintf("/tmp/fatdisk-bench.%d", (int) getpid());
+        opt_work_dir = default_dir;
+    }
+
+    if (!mkpath(opt_work_dir, 0755)) {
+        DIE("cannot make %s", opt_work_dir);
+    }
+
+    json_fd = dup(1);
+    if (json_fd < 0) {
+        DIE("cannot dup stdout");
+    }
+
+    bench_json("{\"version\": \"%s\", \"seed\": %" PRIu64 ", \"runs\": [",
+               VERSION, opt_seed);
+
+    for (fat = 12; fat <= 32; fat++) {
+        if (!fats[fat]) {
+            continue;
+        }
+
+        bench_default(&cfg, fat);
+
+        if (overrides.image_size) {
+            cfg.image_size = overrides.image_size;
+        }
+        if (overrides.files) {
+            cfg.files = overrides.files;
+        }
+        if (overrides.min_size) {
+            cfg.min_size = overrides.min_size;
+        }
+        if (overrides.max_size) {
+            cfg.max_size = overrides.max_size;
+        }
+        if (overrides.dist != (bench_dist_t) -1) {
+            cfg.dist = overrides.dist;
+        }
+        cfg.frag = overrides.frag;
+
+        if (cfg.min_size > cfg.max_size) {
+            DIE("min size is bigger than max size");
+        }
+
+        if ((uint64_t) cfg.files * cfg.max_size + cfg.max_size >
+            cfg.image_size) {
+            WARN("FAT%" PRIu32 ": %" PRIu32 " files of up to %" PRIu64
+                 " bytes may not fit in %" PRIu64 " bytes",
+                 fat, cfg.files, cfg.max_size, cfg.image_size);
+        }
+
+        bench_run(&cfg, first);
+        first = false;
+
+        if (chdir(cwd)) {
+            DIE("cannot change back to %s", cwd);
+        }
+    }
+
+    bench_json("\n]}\n");
+
+    if (!opt_keep) {
+        nftw(opt_work_dir, bench_rm, 16, FTW_DEPTH | FTW_PHYS);
+    }
+
+    if (default_dir) {
+        myfree(default_dir);
+    }
+
+    quit();
+
+    return (0);
+}
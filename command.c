@@ -10,11 +10,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include "main.h"
 
 #include "disk.h"
 #include "fat.h"
 #include "command.h"
+#include "store.h"
 
 /*
  * disk_command_open
@@ -26,6 +29,7 @@ disk_t *disk_command_open (const char *filename,
                            uint32_t partition,
                            boolean partition_set)
 {
+    uint64_t start = opt_stats ? time_now_ns() : 0;
     disk_t *disk;
 
     disk = (typeof(disk)) myzalloc(sizeof(*disk), __FUNCTION__);
@@ -34,21 +38,34 @@ disk_t *disk_command_open (const char *filename,
     disk->offset = offset;
     disk->partition = partition;
     disk->partition_set = partition_set;
+    disk->stats.regcomps_at_open = regcomp_count;
+    disk->stats.allocs_at_open = alloc_count;
+
+    TRACE_BEGIN("disk_command_open", filename);
+
+    if (!journal_replay(filename)) {
+        myfree(disk);
+        TRACE_END("disk_command_open");
+        return (0);
+    }
 
     disk->mbr = (typeof(disk->mbr))
                     disk_read_from(disk, 0, sizeof(*disk->mbr));
     if (!disk->mbr) {
         ERR("File, \"%s\" has no boot record", filename);
         myfree(disk);
+        TRACE_END("disk_command_open");
         return (0);
     }
 
     disk->sector0 = (typeof(disk->sector0))
                     disk_read_from(disk, 0, sector_size(disk) * 2);
     if (!disk->sector0) {
-        disk_hex_dump(disk, disk->mbr, 0, sizeof(*disk->mbr));
+        if (!log_silent) {
+            disk_hex_dump(disk, disk->mbr, 0, sizeof(*disk->mbr));
 
-        disk_command_info(disk);
+            disk_command_info(disk);
+        }
 
         ERR("File, \"%s\" failed to read boot sector 0 (sector %" 
             PRIu32 ") (%" PRIu32 " bytes) for offset %" PRIx64,
@@ -58,6 +75,7 @@ disk_t *disk_command_open (const char *filename,
             offset);
 
         myfree(disk);
+        TRACE_END("disk_command_open");
         return (0);
     }
 
@@ -70,6 +88,12 @@ disk_t *disk_command_open (const char *filename,
 
     fat_read(disk);
 
+    if (opt_stats) {
+        disk->stats.phase_ns[DISK_PHASE_OPEN] += time_now_ns() - start;
+    }
+
+    TRACE_END("disk_command_open");
+
     return (disk);
 }
 
@@ -319,10 +343,11 @@ boolean disk_command_info (disk_t *disk)
     uint32_t f;
 
     for (f = 0; f < disk->mbr->number_of_fats; f++) {
-        uint8_t *fat = sector_read(disk, sector_reserved_count(disk) +
-                                   f * fat_size_sectors(disk),
-                                   fat_size_sectors(disk));
-        if (!fat) {
+        sector_view_t fat;
+
+        if (!sector_view(disk, sector_reserved_count(disk) +
+                         f * fat_size_sectors(disk),
+                         fat_size_sectors(disk), &fat)) {
             ERR("Failed to read FAT %" PRIu32 "", f);
             continue;
         }
@@ -338,23 +363,22 @@ boolean disk_command_info (disk_t *disk)
             fat_size_bytes(disk));
 
         if (opt_verbose) {
-            disk_hex_dump(disk, fat,
+            disk_hex_dump(disk, (void *) fat.data,
                         (sector_reserved_count(disk) * sector_size(disk)) +
                         (f * fat_size_bytes(disk)),
                         128 /* fat_size_bytes(disk) */);
         }
 
-        myfree(fat);
+        sector_view_release(disk, &fat);
     }
 
     /*
      * Dump the root dir.
      */
-    uint8_t *root_dir_data;
+    sector_view_t root_dir_data;
 
-    root_dir_data = sector_read(disk, sector_root_dir(disk),
-                                disk->mbr->sectors_per_cluster);
-    if (!root_dir_data) {
+    if (!sector_view(disk, sector_root_dir(disk),
+                     disk->mbr->sectors_per_cluster, &root_dir_data)) {
         ERR("Failed to read root dir cluster");
         return (false);
     }
@@ -364,19 +388,19 @@ boolean disk_command_info (disk_t *disk)
             sector_root_dir(disk),
             sector_offset(disk) + sector_root_dir(disk));
 
-        disk_hex_dump(disk, root_dir_data, 0, 128 /* cluster_size(disk) */);
+        disk_hex_dump(disk, (void *) root_dir_data.data, 0,
+                      128 /* cluster_size(disk) */);
     }
 
-    myfree(root_dir_data);
+    sector_view_release(disk, &root_dir_data);
 
     /*
      * Dump the first cluster.
      */
-    uint8_t *cluster_data;
+    sector_view_t cluster_data;
 
-    cluster_data = sector_read(disk, sector_first_data_sector(disk),
-                                disk->mbr->sectors_per_cluster);
-    if (!cluster_data) {
+    if (!sector_view(disk, sector_first_data_sector(disk),
+                     disk->mbr->sectors_per_cluster, &cluster_data)) {
         ERR("Failed to read root dir cluster");
         return (false);
     }
@@ -386,14 +410,109 @@ boolean disk_command_info (disk_t *disk)
             sector_first_data_sector(disk),
             sector_offset(disk) + sector_first_data_sector(disk));
 
-        disk_hex_dump(disk, cluster_data, 0, 128 /* cluster_size(disk) */);
+        disk_hex_dump(disk, (void *) cluster_data.data, 0,
+                      128 /* cluster_size(disk) */);
     }
 
-    myfree(cluster_data);
+    sector_view_release(disk, &cluster_data);
 
     return (true);
 }
 
+/*
+ * disk_command_stats
+ *
+ * Print the --stats counters for this disk session.
+ */
+static void disk_command_stats (disk_t *disk)
+{
+    disk_stats_t *st = &disk->stats;
+    uint32_t sector_sz = sector_size(disk);
+    static const char *phase_names[DISK_PHASE_MAX] = {
+        "open",
+        "FAT read",
+        "walk",
+        "data I/O",
+        "FAT write",
+    };
+    struct rusage usage;
+    uint32_t i;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(stderr, "Stats for %s:\n", disk->filename);
+
+    fprintf(stderr, "  %*s%" PRIu64 " calls, %" PRIu64 " sectors, %"
+            PRIu64 " bytes\n", -OUTPUT_FORMAT_WIDTH, "read",
+            st->read_calls, st->bytes_read / sector_sz, st->bytes_read);
+
+    fprintf(stderr, "  %*s%" PRIu64 " calls, %" PRIu64 " sectors, %"
+            PRIu64 " bytes\n", -OUTPUT_FORMAT_WIDTH, "written",
+            st->write_calls, st->bytes_written / sector_sz,
+            st->bytes_written);
+
+    fprintf(stderr, "  %*s%" PRIu64 " hits, %" PRIu64 " misses, %"
+            PRIu64 " sectors, %" PRIu64 " peak\n",
+            -OUTPUT_FORMAT_WIDTH, "sector cache",
+            st->cache_hits, st->cache_misses, st->cache_sectors,
+            st->cache_sectors_peak);
+
+    fprintf(stderr, "  %*s%" PRIu64 " cached, %" PRIu64 " mapped, %" PRIu64
+            " copied\n", -OUTPUT_FORMAT_WIDTH, "sector views",
+            st->views_cached, st->views_mapped, st->views_copied);
+
+    fprintf(stderr, "  %*s%" PRIu64 " batches, %" PRIu64 " on io_uring, %"
+            PRIu32 " peak queue depth\n", -OUTPUT_FORMAT_WIDTH,
+            "write batches", st->write_batches, st->writes_queued,
+            st->queue_depth_peak);
+
+    if (opt_direct) {
+        fprintf(stderr, "  %*s%" PRIu64 " edge blocks read back\n",
+                -OUTPUT_FORMAT_WIDTH, "direct writes",
+                st->direct_edge_reads);
+    }
+
+    fprintf(stderr, "  %*s%" PRIu64 " flushes, %" PRIu64 " sectors\n",
+            -OUTPUT_FORMAT_WIDTH, "write-back", st->flushes,
+            st->sectors_flushed);
+
+    fprintf(stderr, "  %*s%" PRIu64 " calls, %" PRIu64 " bytes\n",
+            -OUTPUT_FORMAT_WIDTH, "kernel copies",
+            st->copy_calls, st->bytes_copied);
+
+    fprintf(stderr, "  %*s%" PRIu64 "\n", -OUTPUT_FORMAT_WIDTH,
+            "cluster next hops", st->cluster_next_hops);
+
+    fprintf(stderr, "  %*s%" PRIu64 " calls, %" PRIu64 " clusters scanned\n",
+            -OUTPUT_FORMAT_WIDTH, "cluster alloc",
+            st->cluster_allocs, st->cluster_alloc_scanned);
+
+    fprintf(stderr, "  %*s%" PRIu64 " dirs, %" PRIu64 " dirents\n",
+            -OUTPUT_FORMAT_WIDTH, "walked",
+            st->dirs_walked, st->dirents_walked);
+
+    fprintf(stderr, "  %*s%" PRIu64 "\n", -OUTPUT_FORMAT_WIDTH,
+            "regcomp calls", regcomp_count - st->regcomps_at_open);
+
+    fprintf(stderr, "  %*s%" PRIu64 " heap, %" PRIu64 " arena, %" PRIu64
+            " slab peak\n", -OUTPUT_FORMAT_WIDTH, "allocations",
+            alloc_count - st->allocs_at_open, disk->arena.allocs,
+            disk->sector_slab.objects_peak + disk->dirent_slab.objects_peak);
+
+    fprintf(stderr, "  %*s%" PRIu64 " bytes arena peak, %ld KB RSS peak\n",
+            -OUTPUT_FORMAT_WIDTH, "memory", disk->arena.bytes_peak,
+            usage.ru_maxrss);
+
+    for (i = 0; i < DISK_PHASE_MAX; i++) {
+        char *what = dynprintf("time %s", phase_names[i]);
+
+        fprintf(stderr, "  %*s%.3f ms\n", -OUTPUT_FORMAT_WIDTH, what,
+                (double) st->phase_ns[i] / 1e6);
+
+        myfree(what);
+    }
+}
+
 /*
  * disk_command_close
  *
@@ -411,16 +530,81 @@ void disk_command_close (disk_t *disk)
 
     fat_write(disk);
 
+    if (!disk_flush(disk)) {
+        ERR("Failed to flush %s", disk->filename);
+    }
+
+    if (opt_stats) {
+        disk_command_stats(disk);
+    }
+
     for (i = 0; i < MAX_PARTITON; i++) {
         myfree(disk->parts[i]);
     }
 
+    fat_extent_map_free(disk);
+    fat_free_extents_free(disk);
     sector_cache_destroy(disk);
+    disk_unmap(disk);
+    disk_uring_destroy(disk);
+    disk_direct_close(disk);
+    slab_destroy(&disk->dirent_slab);
+    arena_destroy(&disk->arena);
     myfree(disk->sector0);
     myfree(disk->mbr);
     myfree(disk->fat);
     myfree(disk);
 }
+
+/*
+ * disk_command_sync
+ *
+ * Flush the in memory FAT and all other metadata to disk without closing
+ * the session.
+ */
+void disk_command_sync (disk_t *disk)
+{
+    if (!disk) {
+        return;
+    }
+
+    fat_write(disk);
+
+    if (!disk_flush(disk)) {
+        ERR("Failed to flush %s", disk->filename);
+    }
+}
+
+/*
+ * disk_command_defrag
+ *
+ * Report on fragmentation and, unless only reporting, compact the disk.
+ * Returns false if any file is left fragmented.
+ */
+boolean disk_command_defrag (disk_t *disk, boolean report_only)
+{
+    if (!disk) {
+        return (false);
+    }
+
+    return (fat_defrag(disk, report_only));
+}
+
+/*
+ * disk_command_check
+ *
+ * Check the filesystem for damage and, if asked, repair it. Returns how
+ * many problems are left.
+ */
+uint32_t disk_command_check (disk_t *disk, boolean repair)
+{
+    if (!disk) {
+        return (0);
+    }
+
+    return (fat_check(disk, repair));
+}
+
 /*
  * disk_command_summary
  *
@@ -637,6 +821,317 @@ sector_to_chs (uint32_t sector, uint32_t *c, uint32_t *h, uint32_t *s)
     *c = (sector & 0x3ff0000) >> 16;
 }
 
+/*
+ * disk_partition_resize
+ *
+ * Resize the partition entry this filesystem lives in, if new_sectors is
+ * given. Only an entry that starts here and is exactly the size of the
+ * filesystem is trusted; without a partition table these bytes are boot
+ * code. Sets others_after if another partition ends past our start.
+ */
+static boolean
+disk_partition_resize (disk_t *disk, uint64_t old_sectors,
+                       uint64_t new_sectors, boolean *others_after)
+{
+    uint32_t scale = sector_size(disk) / opt_sector_size;
+    uint32_t i;
+
+    *others_after = false;
+
+    for (i = 0; i < MAX_PARTITON; i++) {
+        part_t *part = disk->parts[i];
+        uint32_t c, h, s;
+
+        if (!part || !part->os_id || !part->sectors_in_partition) {
+            continue;
+        }
+
+        if (((uint64_t) part->LBA * opt_sector_size != disk->offset) ||
+            (part->sectors_in_partition != old_sectors * scale)) {
+            if ((uint64_t) (part->LBA + part->sectors_in_partition) *
+                    opt_sector_size > disk->offset) {
+                *others_after = true;
+            }
+
+            continue;
+        }
+
+        if (!new_sectors) {
+            continue;
+        }
+
+        part->sectors_in_partition = (uint32_t) (new_sectors * scale);
+
+        sector_to_chs(part->LBA + part->sectors_in_partition - 1, &c, &h, &s);
+        part->cyl_end = c & 0xff;
+        part->head_end = h;
+        part->sector_end = (s & 0x3f) | ((c & 0x300) >> 2);
+
+        if (!partition_table_write(disk)) {
+            ERR("Failed in writing partition %" PRIu32 "", i);
+            return (false);
+        }
+    }
+
+    return (true);
+}
+
+/*
+ * disk_command_shrink
+ *
+ * Move data down out of the end of the filesystem, then cut it, its
+ * partition and the image file down to fit. The FAT keeps its size, as
+ * changing that would shift the whole data area.
+ */
+boolean disk_command_shrink (disk_t *disk)
+{
+    uint64_t old_sectors;
+    uint64_t new_sectors;
+    uint64_t new_end;
+    boolean others_after;
+    uint32_t clusters;
+    int64_t size;
+
+    if (!disk) {
+        return (false);
+    }
+
+    clusters = fat_shrink(disk);
+    if (!clusters) {
+        return (false);
+    }
+
+    old_sectors = sector_count_total(disk);
+    new_sectors = old_sectors - sector_count_data(disk) +
+                    ((uint64_t) clusters * disk->mbr->sectors_per_cluster);
+
+    if (new_sectors >= old_sectors) {
+        OUT("Already as small as it can be, %" PRIu64 " sectors",
+            old_sectors);
+        return (true);
+    }
+
+    sector_count_total_set(disk, new_sectors);
+
+    /*
+     * Nothing may be left to write past the new end.
+     */
+    if (!disk_flush(disk)) {
+        return (false);
+    }
+
+    if (!boot_record_write(disk)) {
+        return (false);
+    }
+
+    if (!disk_partition_resize(disk, old_sectors, new_sectors,
+                               &others_after)) {
+        return (false);
+    }
+
+    disk_sync(disk);
+
+    OUT("Shrunk from %" PRIu64 " to %" PRIu64 " sectors",
+        old_sectors, new_sectors);
+
+    /*
+     * Only cut the image if nothing lies after this filesystem.
+     */
+    new_end = disk->offset + (new_sectors * sector_size(disk));
+
+    size = overlay_file_size(disk->filename);
+    if ((size < 0) || (new_end >= (uint64_t) size)) {
+        return (true);
+    }
+
+    if (others_after) {
+        WARN("Not the last thing in %s, leaving its size alone",
+             disk->filename);
+        return (true);
+    }
+
+    disk_unmap(disk);
+
+    if (!overlay_truncate(disk->filename, new_end)) {
+        ERR("Failed to truncate %s to %" PRIu64 " bytes",
+            disk->filename, new_end);
+        return (false);
+    }
+
+    OUT("Image %s is now %" PRIu64 " bytes", disk->filename, new_end);
+
+    return (true);
+}
+
+/*
+ * disk_command_resize
+ *
+ * Grow the filesystem to size bytes in place, extending the image file
+ * and its partition to fit.
+ */
+boolean disk_command_resize (disk_t *disk, uint64_t size)
+{
+    uint64_t old_sectors;
+    uint64_t new_sectors;
+    uint64_t new_end;
+    boolean others_after;
+    int64_t file_len;
+
+    if (!disk) {
+        return (false);
+    }
+
+    old_sectors = sector_count_total(disk);
+    new_sectors = size / sector_size(disk);
+
+    if (new_sectors < old_sectors) {
+        ERR("Can only grow, from %" PRIu64 " bytes; shrink makes it smaller",
+            old_sectors * sector_size(disk));
+        return (false);
+    }
+
+    if (new_sectors == old_sectors) {
+        OUT("Already %" PRIu64 " sectors", old_sectors);
+        return (true);
+    }
+
+    if (new_sectors > 0xffffffff) {
+        ERR("Cannot grow past %" PRIu64 " bytes",
+            (uint64_t) 0xffffffff * sector_size(disk));
+        return (false);
+    }
+
+    if (!disk_partition_resize(disk, old_sectors, 0, &others_after)) {
+        return (false);
+    }
+
+    if (others_after) {
+        ERR("Another partition follows this one, cannot grow it");
+        return (false);
+    }
+
+    /*
+     * Room on the host first; the new space reads as zero and takes no
+     * blocks until written.
+     */
+    new_end = disk->offset + (new_sectors * sector_size(disk));
+
+    file_len = overlay_file_size(disk->filename);
+    if ((file_len >= 0) && ((uint64_t) file_len < new_end)) {
+        disk_unmap(disk);
+
+        if (!overlay_truncate(disk->filename, new_end)) {
+            ERR("Failed to extend %s to %" PRIu64 " bytes",
+                disk->filename, new_end);
+            return (false);
+        }
+    }
+
+    if (!fat_grow(disk, new_sectors)) {
+        /*
+         * Give the room back unless the new layout is already in use.
+         */
+        if ((file_len >= 0) && ((uint64_t) file_len < new_end) &&
+            (sector_count_total(disk) == old_sectors)) {
+            disk_unmap(disk);
+
+            if (!overlay_truncate(disk->filename, (uint64_t) file_len)) {
+                WARN("Failed to cut %s back to %" PRIu64 " bytes",
+                     disk->filename, (uint64_t) file_len);
+            }
+        }
+
+        return (false);
+    }
+
+    if (!disk_partition_resize(disk, old_sectors, new_sectors,
+                               &others_after)) {
+        return (false);
+    }
+
+    disk_sync(disk);
+
+    OUT("Grown from %" PRIu64 " to %" PRIu64 " sectors, %" PRIu32
+        " clusters", old_sectors, new_sectors, total_clusters(disk));
+
+    return (true);
+}
+
+/*
+ * disk_command_commit
+ *
+ * Write everything pending, then fold the --overlay delta into its base.
+ */
+boolean disk_command_commit (disk_t *disk)
+{
+    if (!disk) {
+        return (false);
+    }
+
+    if (!overlay_active(disk->filename)) {
+        ERR("%s has no --overlay to commit", disk->filename);
+        return (false);
+    }
+
+    fat_write(disk);
+
+    if (!disk_flush(disk)) {
+        ERR("Failed to flush %s", disk->filename);
+        return (false);
+    }
+
+    return (overlay_commit());
+}
+
+/*
+ * disk_command_flatten
+ *
+ * Write everything pending, then write the image as seen through the
+ * --overlay delta out as a standalone image.
+ */
+boolean disk_command_flatten (disk_t *disk, const char *out)
+{
+    if (!disk) {
+        return (false);
+    }
+
+    if (!overlay_active(disk->filename)) {
+        ERR("%s has no --overlay to flatten", disk->filename);
+        return (false);
+    }
+
+    fat_write(disk);
+
+    if (!disk_flush(disk)) {
+        ERR("Failed to flush %s", disk->filename);
+        return (false);
+    }
+
+    return (overlay_flatten(out));
+}
+
+/*
+ * disk_command_snapshot
+ *
+ * Write everything pending, then keep the image in the --store dir.
+ */
+boolean disk_command_snapshot (disk_t *disk, const char *store,
+                               const char *name)
+{
+    if (!disk) {
+        return (false);
+    }
+
+    fat_write(disk);
+
+    if (!disk_flush(disk)) {
+        ERR("Failed to flush %s", disk->filename);
+        return (false);
+    }
+
+    return (store_snapshot(disk, store, name));
+}
+
 /*
  * disk_command_format
  *
@@ -1242,16 +1737,790 @@ disk_command_cat (disk_t *disk, const char *filter)
 }
 
 /*
- * disk_command_extract
+ * disk_command_read_at
  *
- * Extract files on disk
+ * cat part of a file on disk, reading only the sectors in the range. A zero
+ * length means to the end of the file.
  */
-uint32_t
-disk_command_extract (disk_t *disk, const char *filter)
+boolean
+disk_command_read_at (disk_t *disk, const char *filename,
+                      uint64_t offset, uint64_t length)
 {
-    disk_walk_args_t args = {0};
-    const char *dir_name = "";
-    uint32_t count;
+    fat_dirent_t dirent;
+    uint64_t done;
+    int64_t got;
+    uint8_t *buf;
+
+    if (!filename[strspn(filename, "/")]) {
+        ERR("Cannot read %s, it is a dir", filename);
+        return (false);
+    }
+
+    if (!fat_lookup_exact(disk, filename, &dirent)) {
+        ERR("Cannot find %s", filename);
+        return (false);
+    }
+
+    if (dirent.attr & 0x10) {
+        ERR("Cannot read %s, it is a dir", filename);
+        return (false);
+    }
+
+    if (!length || (offset + length > dirent.size)) {
+        length = offset < dirent.size ? dirent.size - offset : 0;
+    }
+
+    buf = (typeof(buf)) mymalloc(ONE_MEG, __FUNCTION__);
+
+    done = 0;
+
+    while (done < length) {
+        got = fat_file_read_at(disk, &dirent, offset + done, buf,
+                               min(length - done, (uint64_t) ONE_MEG));
+        if (got <= 0) {
+            ERR("Failed to read %s at offset %" PRIu64, filename,
+                offset + done);
+            break;
+        }
+
+        fwrite(buf, 1, (size_t) got, stdout);
+
+        done += (uint64_t) got;
+    }
+
+    myfree(buf);
+
+    return (done == length);
+}
+
+/*
+ * disk_map_quote
+ *
+ * Print a string as a JSON string.
+ */
+static void disk_map_quote (const char *s)
+{
+    putchar('"');
+
+    for (; *s; s++) {
+        if ((*s == '"') || (*s == '\\')) {
+            putchar('\\');
+            putchar(*s);
+        } else if ((unsigned char) *s < ' ') {
+            printf("\\u%04x", (unsigned char) *s);
+        } else {
+            putchar(*s);
+        }
+    }
+
+    putchar('"');
+}
+
+/*
+ * disk_map_file
+ *
+ * Print each run of a file or dir: where it starts in the file, where it
+ * starts in the image file, and how long it is. Runs are whole clusters,
+ * so the last may hold more than the file size.
+ */
+static void
+disk_map_file (disk_t *disk, const char *path, const fat_dirent_t *dirent,
+               boolean json, uint32_t *count)
+{
+    uint64_t cluster_sz = cluster_size(disk);
+    const fat_extent_t *extents;
+    uint32_t number_of_extents;
+    boolean is_dir = (dirent->attr & 0x10) != 0;
+    const fat_extent_t *extent;
+    uint64_t physical;
+    uint32_t i;
+
+    extents = fat_file_extents(disk, dirent, &number_of_extents);
+
+    if (json) {
+        printf("%s\n  {\"path\": ", *count ? "," : "");
+        disk_map_quote(path);
+        printf(", \"dir\": %s, \"size\": %" PRIu32 ", \"extents\": [",
+               is_dir ? "true" : "false", dirent->size);
+    } else if (is_dir) {
+        printf("%s/: dir, %" PRIu32 " extent%s\n", path, number_of_extents,
+               number_of_extents == 1 ? "" : "s");
+    } else {
+        printf("%s: %" PRIu32 " bytes, %" PRIu32 " extent%s\n", path,
+               dirent->size, number_of_extents,
+               number_of_extents == 1 ? "" : "s");
+    }
+
+    if (!json && number_of_extents) {
+        printf("  %12s %14s %12s %10s\n",
+               "logical", "physical", "length", "cluster");
+    }
+
+    for (i = 0; i < number_of_extents; i++) {
+        extent = &extents[i];
+
+        physical = (uint64_t) cluster_to_sector(disk, extent->cluster - 2) *
+                   sector_size(disk) + (uint64_t) disk->offset;
+
+        if (json) {
+            printf("%s\n    {\"logical\": %" PRIu64 ", \"physical\": %" PRIu64
+                   ", \"length\": %" PRIu64 ", \"cluster\": %" PRIu32
+                   ", \"clusters\": %" PRIu32 "}",
+                   i ? "," : "",
+                   (uint64_t) extent->logical * cluster_sz, physical,
+                   (uint64_t) extent->count * cluster_sz,
+                   extent->cluster, extent->count);
+        } else {
+            printf("  %12" PRIu64 " %14" PRIu64 " %12" PRIu64 " %10" PRIu32
+                   "\n",
+                   (uint64_t) extent->logical * cluster_sz, physical,
+                   (uint64_t) extent->count * cluster_sz, extent->cluster);
+        }
+    }
+
+    if (json) {
+        printf("%s]}", number_of_extents ? "\n  " : "");
+    }
+
+    (*count)++;
+}
+
+/*
+ * disk_map_dir
+ *
+ * Map every file and dir under a dir on the disk image.
+ */
+static void
+disk_map_dir (disk_t *disk, fat_dirent_t *dir, const char *prefix,
+              boolean json, uint32_t *count, uint32_t depth)
+{
+    char name[MAX_STR];
+    fat_dirent_t dirent;
+    dirent_t *dirents;
+    uint32_t index;
+
+    if (depth > MAX_DIR_DEPTH) {
+        ERR("runaway directory recursion at depth %" PRIu32 ", dir %s",
+            depth, prefix);
+        return;
+    }
+
+    dirents = fat_dir_open(disk, dir);
+    if (!dirents) {
+        return;
+    }
+
+    index = 0;
+
+    while (fat_dir_next(disk, dirents, &index, &dirent, name, sizeof(name))) {
+        char *path = dynprintf("%s%s", prefix, name);
+
+        disk_map_file(disk, path, &dirent, json, count);
+
+        if (dirent.attr & 0x10) {
+            char *subdir = dynprintf("%s/", path);
+
+            disk_map_dir(disk, &dirent, subdir, json, count, depth + 1);
+            myfree(subdir);
+        }
+
+        myfree(path);
+    }
+
+    fat_dir_close(disk, dirents);
+}
+
+/*
+ * disk_command_map
+ *
+ * Print where the clusters of a file lie in the image, as runs of bytes,
+ * so tools can patch or load it in place. A dir maps all below it, and
+ * an empty path or / the whole disk.
+ */
+boolean
+disk_command_map (disk_t *disk, const char *path, boolean json)
+{
+    fat_dirent_t dirent;
+    uint32_t count = 0;
+    char *name;
+    char *prefix;
+    boolean whole_disk;
+
+    while (*path == '/') {
+        path++;
+    }
+
+    name = dupstr(path, __FUNCTION__);
+    while (*name && (name[strlen(name) - 1] == '/')) {
+        name[strlen(name) - 1] = '\0';
+    }
+
+    whole_disk = !*name;
+
+    if (!whole_disk && !fat_lookup(disk, name, &dirent)) {
+        ERR("Cannot find %s", name);
+        myfree(name);
+        return (false);
+    }
+
+    if (json) {
+        printf("{\"files\": [");
+    }
+
+    if (whole_disk) {
+        disk_map_dir(disk, 0, "", json, &count, 0);
+    } else {
+        disk_map_file(disk, name, &dirent, json, &count);
+
+        if (dirent.attr & 0x10) {
+            prefix = dynprintf("%s/", name);
+            disk_map_dir(disk, &dirent, prefix, json, &count, 1);
+            myfree(prefix);
+        }
+    }
+
+    if (json) {
+        printf("%s]}\n", count ? "\n" : "");
+    }
+
+    fflush(stdout);
+    myfree(name);
+
+    return (true);
+}
+
+/*
+ * disk_modify
+ *
+ * Write, append or truncate an existing file in place. The name is taken
+ * literally, so only the one file it names is ever changed.
+ */
+static uint32_t
+disk_modify (disk_t *disk, const char *filename, const char *local_file,
+             disk_walk_args_t *args)
+{
+    const char *dir_name = "";
+    fat_dirent_t dirent;
+    uint8_t *data = 0;
+    int64_t len = 0;
+    uint32_t count;
+
+    if (strpbrk(filename, "*?")) {
+        ERR("Cannot modify %s, wildcards are not allowed", filename);
+        return (0);
+    }
+
+    if (!filename[strspn(filename, "/")]) {
+        ERR("Cannot modify %s, it is a dir", filename);
+        return (0);
+    }
+
+    if (!fat_lookup_exact(disk, filename, &dirent)) {
+        ERR("Cannot modify %s, no such file on disk", filename);
+        return (0);
+    }
+
+    if (dirent.attr & 0x10) {
+        ERR("Cannot modify %s, it is a dir", filename);
+        return (0);
+    }
+
+    if (local_file) {
+        if (!file_exists(local_file)) {
+            ERR("Cannot find local file %s", local_file);
+            return (0);
+        }
+
+        if (file_size(local_file)) {
+            data = file_read(local_file, &len);
+            if (!data) {
+                ERR("Cannot read local file %s", local_file);
+                return (0);
+            }
+        }
+    }
+
+    args->modify = true;
+    args->exact = true;
+    args->data = data;
+    args->data_len = (uint64_t) len;
+
+    count = disk_walk(disk, filename, dir_name, 0, 0, 0, args);
+    if (!count) {
+        ERR("Cannot modify %s", filename);
+    }
+
+    myfree(data);
+
+    return (count);
+}
+
+/*
+ * disk_command_write_at
+ *
+ * Overwrite part of a file on disk with a local file, growing it if needed.
+ */
+uint32_t
+disk_command_write_at (disk_t *disk, const char *filename, uint64_t offset,
+                       const char *local_file)
+{
+    disk_walk_args_t args = {0};
+
+    args.modify_offset = offset;
+
+    return (disk_modify(disk, filename, local_file, &args));
+}
+
+/*
+ * disk_command_append
+ *
+ * Append a local file onto the end of a file on disk.
+ */
+uint32_t
+disk_command_append (disk_t *disk, const char *filename,
+                     const char *local_file)
+{
+    disk_walk_args_t args = {0};
+
+    args.modify_append = true;
+
+    return (disk_modify(disk, filename, local_file, &args));
+}
+
+/*
+ * disk_command_truncate
+ *
+ * Cut or extend a file on disk to a size. Extending pads with zeros.
+ */
+uint32_t
+disk_command_truncate (disk_t *disk, const char *filename, uint64_t size)
+{
+    disk_walk_args_t args = {0};
+
+    args.modify_truncate = true;
+    args.modify_offset = size;
+
+    return (disk_modify(disk, filename, 0, &args));
+}
+
+/*
+ * An entry on the disk image, keyed by lower case path relative to the
+ * sync target dir.
+ */
+typedef struct tree_sync_node_ {
+    tree_key_string tree;
+    char *path;
+    fat_dirent_t dirent;
+    boolean on_host;
+    boolean host_is_dir;
+} tree_sync_node;
+
+/*
+ * disk_sync_node_free
+ */
+static boolean disk_sync_node_free (tree_node *n)
+{
+    tree_sync_node *node = (typeof(node)) n;
+
+    myfree(node->path);
+
+    return (true);
+}
+
+/*
+ * disk_sync_collect
+ *
+ * Record every file and dir under a dir on the disk image.
+ */
+static void
+disk_sync_collect (disk_t *disk, tree_root *root, fat_dirent_t *dir,
+                   const char *prefix, uint32_t depth)
+{
+    char name[MAX_STR];
+    fat_dirent_t dirent;
+    tree_sync_node *node;
+    dirent_t *dirents;
+    uint32_t index;
+
+    if (depth > MAX_DIR_DEPTH) {
+        ERR("runaway directory recursion at depth %" PRIu32 ", dir %s",
+            depth, prefix);
+        return;
+    }
+
+    dirents = fat_dir_open(disk, dir);
+    if (!dirents) {
+        return;
+    }
+
+    index = 0;
+
+    while (fat_dir_next(disk, dirents, &index, &dirent, name, sizeof(name))) {
+        char *path = dynprintf("%s%s", prefix, name);
+
+        node = (typeof(node)) myzalloc(sizeof(*node), "TREE NODE: sync");
+        node->tree.key = duplstr(path, "TREE KEY: sync");
+        node->path = dupstr(path, __FUNCTION__);
+        node->dirent = dirent;
+
+        if (!tree_insert(root, &node->tree.node)) {
+            myfree(node->tree.key);
+            myfree(node->path);
+            myfree(node);
+            myfree(path);
+            continue;
+        }
+
+        if (dirent.attr & 0x10) {
+            char *subdir = dynprintf("%s/", path);
+
+            disk_sync_collect(disk, root, &dirent, subdir, depth + 1);
+            myfree(subdir);
+        }
+
+        myfree(path);
+    }
+
+    fat_dir_close(disk, dirents);
+}
+
+/*
+ * disk_sync_same_time
+ *
+ * Does the local file have the same modify time as the dirent, to the two
+ * seconds FAT can hold?
+ */
+static boolean
+disk_sync_same_time (const char *local_file, fat_dirent_t *dirent)
+{
+    int32_t year;
+    int32_t month;
+    int32_t day;
+    int32_t hour;
+    int32_t min;
+    int32_t sec;
+
+    if (!file_mtime(local_file, &day, &month, &year, &hour, &min, &sec)) {
+        return (false);
+    }
+
+    return ((dirent->lm_date.year == (uint32_t) (year - 1980)) &&
+            (dirent->lm_date.month == (uint32_t) month) &&
+            (dirent->lm_date.day == (uint32_t) day) &&
+            (dirent->lm_time.hour == (uint32_t) hour) &&
+            (dirent->lm_time.min == (uint32_t) min) &&
+            (dirent->lm_time.sec == (uint32_t) (sec / 2)));
+}
+
+/*
+ * disk_sync_same_data
+ *
+ * Compare a local file with a file on the disk image by checksum.
+ */
+static boolean
+disk_sync_same_data (disk_t *disk, const char *local_file,
+                     fat_dirent_t *dirent)
+{
+    uint32_t local_crc;
+    uint32_t disk_crc;
+    uint64_t offset;
+    uint8_t *data;
+    int64_t len;
+    int64_t got;
+    uint8_t *buf;
+
+    data = file_read(local_file, &len);
+    if (!data && len) {
+        return (false);
+    }
+
+    local_crc = crc32c(0, data, (uint64_t) len);
+    myfree(data);
+
+    buf = (typeof(buf)) mymalloc(ONE_MEG, __FUNCTION__);
+
+    disk_crc = 0;
+    offset = 0;
+
+    while (offset < dirent->size) {
+        got = fat_file_read_at(disk, dirent, offset, buf, ONE_MEG);
+        if (got <= 0) {
+            myfree(buf);
+            return (false);
+        }
+
+        disk_crc = crc32c(disk_crc, buf, (uint64_t) got);
+        offset += (uint64_t) got;
+    }
+
+    myfree(buf);
+
+    return (local_crc == disk_crc);
+}
+
+/*
+ * disk_sync_replace
+ *
+ * Rewrite a changed file in place, reusing its clusters.
+ */
+static boolean
+disk_sync_replace (disk_t *disk, const char *local_file, const char *target)
+{
+    disk_walk_args_t args = {0};
+    const char *dir_name = "";
+    uint8_t *data;
+    int64_t len;
+    boolean ok;
+
+    data = file_read(local_file, &len);
+    if (!data && len) {
+        ERR("Cannot read local file %s", local_file);
+        return (false);
+    }
+
+    args.modify = true;
+    args.modify_replace = true;
+    args.exact = true;
+    args.data = data;
+    args.data_len = (uint64_t) len;
+    args.source = (char*) local_file;
+
+    ok = disk_walk(disk, target, dir_name, 0, 0, 0, &args) != 0;
+
+    myfree(data);
+
+    return (ok);
+}
+
+/*
+ * disk_sync_mark
+ *
+ * Flag which entries on the disk image are also in the local dir.
+ */
+static void
+disk_sync_mark (tree_root *image, tree_root *host, const char *source)
+{
+    tree_sync_node *node;
+    tree_sync_node key;
+    tree_file_node *n;
+
+    TREE_WALK(host, n) {
+        const char *rel = n->tree.key + strlen(source);
+
+        while (*rel == '/') {
+            rel++;
+        }
+
+        memset(&key, 0, sizeof(key));
+        key.tree.key = duplstr(rel, __FUNCTION__);
+        node = (typeof(node)) tree_find(image, &key.tree.node);
+        myfree(key.tree.key);
+
+        if (node) {
+            node->on_host = true;
+            node->host_is_dir = !n->is_file;
+        }
+    }
+}
+
+/*
+ * disk_sync_remove
+ *
+ * Remove what is no longer in the local dir, or has changed between file
+ * and dir. Children of removed dirs go with them.
+ */
+static uint32_t
+disk_sync_remove (disk_t *disk, tree_root *image, const char *target)
+{
+    char *last_removed = 0;
+    tree_sync_node *node;
+    uint32_t removed = 0;
+
+    TREE_WALK(image, node) {
+        boolean is_dir = (node->dirent.attr & 0x10) != 0;
+
+        if (node->on_host && (is_dir == node->host_is_dir)) {
+            continue;
+        }
+
+        node->on_host = false;
+
+        if (last_removed &&
+            !strncmp(node->tree.key, last_removed, strlen(last_removed))) {
+            continue;
+        }
+
+        char *path = *target ? dynprintf("%s/%s", target, node->path) :
+                               dupstr(node->path, __FUNCTION__);
+
+        disk_command_remove_exact(disk, path);
+        removed++;
+
+        myfree(path);
+        myfree(last_removed);
+        last_removed = dynprintf("%s/", node->tree.key);
+    }
+
+    myfree(last_removed);
+
+    return (removed);
+}
+
+/*
+ * disk_command_sync_dir
+ *
+ * Make a dir on the disk image match a local dir, touching only what
+ * differs. Files are compared by size and modify time and, if asked, by a
+ * checksum of their data.
+ */
+uint32_t
+disk_command_sync_dir (disk_t *disk, const char *source_dir,
+                       const char *target_dir, boolean hash)
+{
+    uint32_t added = 0;
+    uint32_t updated = 0;
+    uint32_t removed = 0;
+    uint32_t unchanged = 0;
+    fat_dirent_t target_dirent;
+    tree_sync_node *node;
+    tree_sync_node key;
+    tree_file_node *n;
+    tree_root *image;
+    tree_root *host;
+    char *target;
+    char *source;
+
+    if (!dir_exists(source_dir)) {
+        ERR("Cannot sync from %s, not a dir", source_dir);
+        return (0);
+    }
+
+    source = dupstr(source_dir, __FUNCTION__);
+    strchopc(source, '/');
+
+    if (target_dir) {
+        target = filename_cleanup(target_dir);
+        strchopc(target, '/');
+    } else {
+        target = dupstr("", __FUNCTION__);
+    }
+
+    /*
+     * What is on the disk image now.
+     */
+    image = tree_alloc(TREE_KEY_STRING, "TREE ROOT: sync");
+
+    if (!*target) {
+        disk_sync_collect(disk, image, 0, "", 0);
+    } else if (fat_lookup_exact(disk, target, &target_dirent)) {
+        if (!(target_dirent.attr & 0x10)) {
+            ERR("Cannot sync to %s, not a dir", target);
+            tree_destroy(&image, disk_sync_node_free);
+            myfree(source);
+            myfree(target);
+            return (0);
+        }
+
+        disk_sync_collect(disk, image, &target_dirent, "", 0);
+    }
+
+    /*
+     * What is in the local dir.
+     */
+    host = dirlist_recurse(source, 0, 0, true /* include dirs */);
+    if (!host) {
+        DIE("Cannot list dir %s", source);
+    }
+
+    disk_sync_mark(image, host, source);
+
+    removed = disk_sync_remove(disk, image, target);
+
+    /*
+     * Add what is new and update what has changed.
+     */
+    TREE_WALK(host, n) {
+        const char *local = n->tree.key;
+        const char *rel = local + strlen(source);
+
+        while (*rel == '/') {
+            rel++;
+        }
+
+        if (!*rel) {
+            continue;
+        }
+
+        char *path = *target ? dynprintf("%s/%s", target, rel) :
+                               dupstr(rel, __FUNCTION__);
+
+        memset(&key, 0, sizeof(key));
+        key.tree.key = duplstr(rel, __FUNCTION__);
+        node = (typeof(node)) tree_find(image, &key.tree.node);
+        myfree(key.tree.key);
+
+        if (!node || !node->on_host) {
+            if (n->is_file) {
+                disk_command_add_file_or_dir(disk, local, path,
+                                             true /* addfile */);
+            } else {
+                int64_t mtime;
+
+                if (file_mtime_secs(local, &mtime)) {
+                    disk_command_mkdir_mtime(disk, path, mtime);
+                } else {
+                    disk_command_mkdir(disk, path);
+                }
+            }
+
+            added++;
+        } else if (n->is_file) {
+            boolean same = (node->dirent.size == (uint64_t) file_size(local));
+
+            if (same) {
+                if (hash) {
+                    same = disk_sync_same_data(disk, local, &node->dirent);
+                } else {
+                    same = disk_sync_same_time(local, &node->dirent);
+                }
+            }
+
+            if (same) {
+                unchanged++;
+            } else if (disk_sync_replace(disk, local, path)) {
+                updated++;
+            }
+        }
+
+        myfree(path);
+    }
+
+    if (!opt_quiet) {
+        OUT("Synced %s to %s: %" PRIu32 " added, %" PRIu32 " updated, %"
+            PRIu32 " removed, %" PRIu32 " unchanged",
+            source, *target ? target : "/", added, updated, removed,
+            unchanged);
+    }
+
+    tree_destroy(&host, 0);
+    tree_destroy(&image, disk_sync_node_free);
+    myfree(source);
+    myfree(target);
+
+    return (added + updated + removed);
+}
+
+/*
+ * disk_command_extract
+ *
+ * Extract files on disk
+ */
+uint32_t
+disk_command_extract (disk_t *disk, const char *filter)
+{
+    disk_walk_args_t args = {0};
+    const char *dir_name = "";
+    uint32_t count;
 
     args.extract = true;
     count = disk_walk(disk, filter, dir_name, 0, 0, 0, &args);
@@ -1259,6 +2528,186 @@ disk_command_extract (disk_t *disk, const char *filter)
     return (count);
 }
 
+/*
+ * disk_command_export_tar
+ *
+ * Write files on disk to stdout as a tar archive, without extracting them
+ * to the local disk first.
+ */
+uint32_t
+disk_command_export_tar (disk_t *disk, const char *filter)
+{
+    disk_walk_args_t args = {0};
+    const char *dir_name = "";
+    uint32_t count;
+
+    if (isatty(1)) {
+        ERR("Will not write an archive to a terminal");
+        return (0);
+    }
+
+    args.tar = true;
+    count = disk_walk(disk, filter, dir_name, 0, 0, 0, &args);
+
+    if (!tar_write_end(1)) {
+        return (0);
+    }
+
+    return (count);
+}
+
+/*
+ * disk_import_tar_name
+ *
+ * Where an archive entry goes on the disk: under the target dir, without
+ * any leading / or ./ or trailing /. Names that climb out with .. are
+ * refused.
+ */
+static char *
+disk_import_tar_name (const char *target_dir, const char *name)
+{
+    char *path;
+    char *p;
+
+    while ((name[0] == '/') || ((name[0] == '.') && (name[1] == '/'))) {
+        name += (name[0] == '/') ? 1 : 2;
+    }
+
+    if (!strcmp(name, "..") || !strncmp(name, "../", 3) ||
+        strstr(name, "/../") ||
+        ((strlen(name) >= 3) && !strcmp(name + strlen(name) - 3, "/.."))) {
+        return (0);
+    }
+
+    if (target_dir && *target_dir) {
+        path = dynprintf("%s/%s", target_dir, name);
+    } else {
+        path = dupstr(name, __FUNCTION__);
+    }
+
+    for (p = path + strlen(path); (p > path) && (p[-1] == '/'); p--) {
+        p[-1] = '\0';
+    }
+
+    if (!*path || !strcmp(path, ".")) {
+        myfree(path);
+        return (0);
+    }
+
+    return (path);
+}
+
+/*
+ * disk_command_import_tar
+ *
+ * Add the files and dirs of a tar archive read from stdin, writing file
+ * data to the disk as it is read, with no copy on the local disk. Hard
+ * links get a copy of the data of what they link to. Returns false if the
+ * archive was bad or anything in it could not be added.
+ */
+boolean
+disk_command_import_tar (disk_t *disk, const char *target_dir,
+                         uint32_t *count)
+{
+    boolean failed = false;
+    tar_entry_t entry;
+    uint32_t attr;
+    char *path;
+
+    *count = 0;
+
+    if (isatty(0)) {
+        ERR("Will not read an archive from a terminal");
+        return (false);
+    }
+
+    while (tar_read_header(0, &entry, &failed)) {
+        boolean is_file = (entry.type == TAR_TYPE_FILE) ||
+                          (entry.type == TAR_TYPE_FILE_OLD);
+        boolean is_link = (entry.type == TAR_TYPE_LINK);
+        boolean is_dir = (entry.type == TAR_TYPE_DIR);
+        uint64_t done = 0;
+        char *link;
+
+        path = disk_import_tar_name(target_dir, entry.name);
+
+        /*
+         * Hidden and system come from the archive, read only from the
+         * mode.
+         */
+        attr = entry.attr & 0x06;
+
+        if (!(entry.mode & 0222)) {
+            attr |= 0x01;
+        }
+
+        if (!path) {
+            if (strcmp(entry.name, ".") && strcmp(entry.name, "./")) {
+                WARN("Skipping %s, it is outside the target dir",
+                     entry.name);
+            }
+        } else if (is_dir) {
+            disk_command_mkdir_mtime(disk, path, (int64_t) entry.mtime);
+            (*count)++;
+        } else if (is_link) {
+            link = disk_import_tar_name(target_dir, entry.linkname);
+
+            if (!link) {
+                WARN("Skipping %s, it links outside the target dir",
+                     entry.name);
+            } else if (disk_command_copy_file(disk, link, path,
+                                              (int64_t) entry.mtime, attr)) {
+                (*count)++;
+            } else {
+                ERR("Failed to add %s, a link to %s", path, link);
+                failed = true;
+            }
+
+            myfree(link);
+        } else if (!is_file) {
+            WARN("Skipping %s, not a file or dir", entry.name);
+        } else if (entry.size > 0xffffffffULL) {
+            ERR("Skipping %s, too large for FAT", entry.name);
+            failed = true;
+        } else if (!disk_command_write_fd(disk, path, 0, entry.size,
+                                          (int64_t) entry.mtime, attr,
+                                          &done)) {
+            ERR("Failed to add %s", path);
+            failed = true;
+        } else if (done != entry.size) {
+            /*
+             * The archive ran out; what was added is padded with zeroes
+             * and must not be left looking whole.
+             */
+            disk_command_remove_exact(disk, path);
+            ERR("Failed to add %s, the archive ends inside it", path);
+            failed = true;
+
+            tar_entry_free(&entry);
+            myfree(path);
+            break;
+        } else {
+            (*count)++;
+        }
+
+        /*
+         * Whatever was not read still has to be read past.
+         */
+        if (!tar_skip(0, is_dir ? 0 : entry.size, done)) {
+            failed = true;
+
+            tar_entry_free(&entry);
+            myfree(path);
+            break;
+        }
+
+        tar_entry_free(&entry);
+        myfree(path);
+    }
+
+    return (!failed);
+}
+
 /*
  * disk_command_remove
  *
@@ -1277,6 +2726,25 @@ disk_command_remove (disk_t *disk, const char *filter)
     return (count);
 }
 
+/*
+ * disk_command_remove_exact
+ *
+ * Delete one file or dir on disk, taking each name in the path literally.
+ */
+uint32_t
+disk_command_remove_exact (disk_t *disk, const char *path)
+{
+    const char *dir_name = "";
+    uint32_t count;
+    disk_walk_args_t args = {0};
+
+    args.remove = true;
+    args.exact = true;
+    count = disk_walk(disk, path, dir_name, 0, 0, 0, &args);
+
+    return (count);
+}
+
 /*
  * disk_add
  *
@@ -1411,7 +2879,7 @@ disk_command_query_at_offset (const char *filename, int64_t offset)
     uint32_t fat;
     disk_t *disk;
 
-    disk = (typeof(disk)) myzalloc(opt_sector_size, __FUNCTION__);
+    disk = (typeof(disk)) myzalloc(sizeof(*disk), __FUNCTION__);
     if (!disk) {
         return (0);
     }
@@ -1498,7 +2966,7 @@ disk_command_query_at_offset (const char *filename, int64_t offset)
 static uint64_t
 disk_command_query_hunt (const char *filename, uint32_t *fat_type)
 {
-    uint64_t sz = file_size(filename);
+    uint64_t sz = overlay_file_size(filename);
     uint64_t first_one_found;
     uint32_t found_fat_type;
     uint64_t offset;
@@ -1567,7 +3035,7 @@ disk_command_query (const char *filename,
         offset = (typeof(offset)) (PART_BASE + (sizeof(part_t) * i));
         amount = sizeof(part_t);
 
-        p = (part_t *) file_read_from(filename, offset, amount);
+        p = (part_t *) overlay_read_from(filename, offset, amount);
         if (!p) {
             continue;
         }
@@ -37,8 +37,30 @@ uint32_t disk_command_list(disk_t *, const char *filter);
 uint32_t disk_command_find(disk_t *, const char *filter);
 uint32_t disk_command_hex_dump(disk_t *, const char *filter);
 uint32_t disk_command_cat(disk_t *, const char *filter);
+boolean disk_command_read_at(disk_t *, const char *filename,
+                              uint64_t offset, uint64_t length);
+boolean disk_command_map(disk_t *, const char *path, boolean json);
+uint32_t disk_command_write_at(disk_t *, const char *filename,
+                               uint64_t offset, const char *local_file);
+uint32_t disk_command_append(disk_t *, const char *filename,
+                             const char *local_file);
+uint32_t disk_command_truncate(disk_t *, const char *filename, uint64_t size);
 uint32_t disk_command_extract(disk_t *, const char *filter);
+uint32_t disk_command_export_tar(disk_t *, const char *filter);
+boolean disk_command_import_tar(disk_t *, const char *target_dir,
+                                uint32_t *count);
 uint32_t disk_command_remove(disk_t *, const char *filter);
+uint32_t disk_command_remove_exact(disk_t *, const char *path);
 uint32_t disk_add(disk_t *, const char *filter, const char *add_as);
 uint32_t disk_addfile(disk_t *, const char *filter, const char *add_as);
+void disk_command_sync(disk_t *);
+uint32_t disk_command_sync_dir(disk_t *, const char *source_dir,
+                               const char *target_dir, boolean hash);
+boolean disk_command_defrag(disk_t *, boolean report_only);
+uint32_t disk_command_check(disk_t *, boolean repair);
+boolean disk_command_shrink(disk_t *);
+boolean disk_command_resize(disk_t *, uint64_t size);
+boolean disk_command_commit(disk_t *);
+boolean disk_command_flatten(disk_t *, const char *out);
+boolean disk_command_snapshot(disk_t *, const char *store, const char *name);
 void disk_command_close(disk_t *);
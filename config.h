@@ -29,11 +29,33 @@
  */
 #define ENABLE_ERR_BACKTRACE
 
+/*
+ * Debug output for -d to -ddddd. Change to nENABLE_DEBUG_LOGGING to compile
+ * all debug logging out of the hot paths.
+ */
+#define ENABLE_DEBUG_LOGGING
+
 /*
  * This uses more memory but speads up disk reads.
  */
 #define ENABLE_CACHING_OF_SECTORS
 
+/*
+ * Map the disk image read only so metadata reads can borrow it in place.
+ */
+#define ENABLE_MMAP_READS
+
+/*
+ * Let the kernel move file data between the image and local files on
+ * extract and add, sharing blocks where the host filesystem can.
+ */
+#define ENABLE_KERNEL_COPY
+
+/*
+ * Queue batches of writes on io_uring, so more than one is in flight.
+ */
+#define ENABLE_IO_URING
+
 /*
  * FAT debugging
  */
@@ -57,6 +79,58 @@
  */
 #define MAX_DIR_DEPTH                       1024
 
+/*
+ * Most times defrag walks the disk packing files down.
+ */
+#define MAX_DEFRAG_PASSES                   16
+
+/*
+ * Most threads check walks the tree with.
+ */
+#define MAX_CHECK_THREADS                   16
+
+/*
+ * Most writes one batch keeps in flight on io_uring.
+ */
+#define IO_URING_QUEUE_DEPTH                64
+
+/*
+ * --direct writes go out in blocks of this alignment, reading back the
+ * edges of any that are partly written, and at most this much at a time.
+ */
+#define DIRECT_IO_ALIGN                     4096
+#define DIRECT_IO_CHUNK                     ONE_MEG
+
+/*
+ * --overlay keeps changed blocks of this size in the delta.
+ */
+#define OVERLAY_BLOCK                       512
+
+/*
+ * --store cuts clusters in use into chunks of at most STORE_CHUNK_MAX,
+ * ending after a cluster whose checksum has all of STORE_CHUNK_MASK set;
+ * the rest of the image is cut every STORE_RAW_CHUNK.
+ */
+#define STORE_CHUNK_MAX                     ONE_MEG
+#define STORE_CHUNK_MASK                    0x1f
+#define STORE_RAW_CHUNK                     (64 * ONE_K)
+
+/*
+ * Events kept for --trace; older ones are dropped once full.
+ */
+#define TRACE_RING_EVENTS                   65536
+
+/*
+ * Arena block size for walk temporaries, and sector cache slab chunking.
+ */
+#define ARENA_BLOCK_SIZE                    (64 * 1024)
+#define SLAB_OBJS_PER_CHUNK                 256
+
+/*
+ * Max words on one shell command line.
+ */
+#define MAX_SHELL_ARGS                      256
+
 #define ONE_K                               1024
 #define ONE_MEG                             (1024 * 1024)
 #define ONE_GIG                             (1024 * 1024 * 1024)
@@ -6,13 +6,23 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(ENABLE_KERNEL_COPY) && defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #include "main.h"
 
 #include "disk.h"
+#include "fat.h"
 
 /*
  * msdos_get_systype
@@ -528,9 +538,190 @@ msdos_get_media_type (uint32_t index)
 uint8_t *
 disk_read_from (disk_t *disk, uint64_t offset, uint64_t len)
 {
+    uint64_t start = (opt_stats || trace_enabled) ? time_now_ns() : 0;
+    uint8_t *data;
+
     DBG4("Read from disk, len %" PRIu64 " bytes", len);
 
-    return (file_read_from(disk->filename, offset + disk->offset, len));
+    data = overlay_read_from(disk->filename, offset + disk->offset, len);
+
+    if (data && disk->dirty_sectors) {
+        sector_cache_overlay(disk, offset, data, len);
+    }
+
+    TRACE_IO("read", start, offset + disk->offset, len, false);
+
+    disk->stats.read_calls++;
+    disk->stats.bytes_read += len;
+
+    if (opt_stats) {
+        disk->stats.phase_ns[DISK_PHASE_DATA_IO] += time_now_ns() - start;
+    }
+
+    return (data);
+}
+
+/*
+ * disk_direct_open
+ *
+ * For --direct, open the image O_DIRECT the first time it is written. False
+ * if it cannot be, e.g. on tmpfs, and writes go through the page cache.
+ */
+static boolean
+disk_direct_open (disk_t *disk)
+{
+    void *buf;
+    int fd;
+
+    if (disk->direct_tried) {
+        return (disk->direct_buf != 0);
+    }
+
+    disk->direct_tried = true;
+
+#ifdef O_DIRECT
+    fd = open(disk->filename, O_RDWR | O_DIRECT);
+    if (fd < 0) {
+        WARN("Cannot open %s for direct I/O, using the page cache: %s",
+             disk->filename, strerror(errno));
+        return (false);
+    }
+
+    if (posix_memalign(&buf, DIRECT_IO_ALIGN, DIRECT_IO_CHUNK)) {
+        ERR("Cannot allocate a buffer for direct I/O");
+        close(fd);
+        return (false);
+    }
+
+    disk->direct_fd = fd;
+    disk->direct_buf = (typeof(disk->direct_buf)) buf;
+
+    return (true);
+#else
+    WARN("No direct I/O here, using the page cache");
+
+    return (false);
+#endif
+}
+
+/*
+ * disk_direct_close
+ *
+ * Close the O_DIRECT image and free its buffer.
+ */
+void
+disk_direct_close (disk_t *disk)
+{
+    if (disk->direct_buf) {
+        close(disk->direct_fd);
+        free(disk->direct_buf);
+    }
+
+    disk->direct_buf = 0;
+    disk->direct_tried = false;
+}
+
+/*
+ * disk_direct_read_block
+ *
+ * Read back one aligned block that a write only covers part of. Past the
+ * end of a file it reads as zero.
+ */
+static boolean
+disk_direct_read_block (disk_t *disk, uint8_t *buf, uint64_t offset)
+{
+    ssize_t done;
+
+    disk->stats.direct_edge_reads++;
+
+    memset(buf, 0, DIRECT_IO_ALIGN);
+
+    do {
+        done = pread(disk->direct_fd, buf, DIRECT_IO_ALIGN, (off_t) offset);
+    } while ((done < 0) && (errno == EINTR));
+
+    return (done >= 0);
+}
+
+/*
+ * disk_direct_write
+ *
+ * Write at an absolute offset in the image through the aligned buffer, a
+ * chunk at a time, each chunk widened to whole aligned blocks. The edges
+ * of the first and last block are read back first if the write does not
+ * cover them. A file is cut back if that takes it past its end.
+ */
+static boolean
+disk_direct_write (disk_t *disk, uint64_t offset, const uint8_t *data,
+                   uint64_t len)
+{
+    uint8_t *buf = disk->direct_buf;
+    struct stat st;
+
+    while (len) {
+        uint64_t start = offset & ~((uint64_t) DIRECT_IO_ALIGN - 1);
+        uint64_t head = offset - start;
+        uint64_t n = min(len, (uint64_t) DIRECT_IO_CHUNK - head);
+        uint64_t span = (head + n + DIRECT_IO_ALIGN - 1) &
+                        ~((uint64_t) DIRECT_IO_ALIGN - 1);
+        uint64_t done = 0;
+        ssize_t ret;
+
+        if (head && !disk_direct_read_block(disk, buf, start)) {
+            ERR("Cannot read %s at %" PRIu64 ": %s", disk->filename,
+                start, strerror(errno));
+            return (false);
+        }
+
+        if (((head + n) % DIRECT_IO_ALIGN) &&
+            (!head || (span > DIRECT_IO_ALIGN)) &&
+            !disk_direct_read_block(disk, buf + span - DIRECT_IO_ALIGN,
+                                    start + span - DIRECT_IO_ALIGN)) {
+            ERR("Cannot read %s at %" PRIu64 ": %s", disk->filename,
+                start + span - DIRECT_IO_ALIGN, strerror(errno));
+            return (false);
+        }
+
+        memcpy(buf + head, data, n);
+
+        if (fstat(disk->direct_fd, &st) || !S_ISREG(st.st_mode)) {
+            st.st_size = -1;
+        }
+
+        while (done < span) {
+            ret = pwrite(disk->direct_fd, buf + done, span - done,
+                         (off_t) (start + done));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                ERR("Cannot write %s at %" PRIu64 ": %s", disk->filename,
+                    start + done, strerror(errno));
+                return (false);
+            }
+
+            done += (uint64_t) ret;
+        }
+
+        /*
+         * Whole blocks may have gone past the end of an image file.
+         */
+        if ((st.st_size >= 0) && ((uint64_t) st.st_size < start + span)) {
+            uint64_t end = max((uint64_t) st.st_size, offset + n);
+
+            if (ftruncate(disk->direct_fd, (off_t) end) < 0) {
+                WARN("Cannot cut %s back to %" PRIu64 " bytes",
+                     disk->filename, end);
+            }
+        }
+
+        offset += n;
+        data += n;
+        len -= n;
+    }
+
+    return (true);
 }
 
 /*
@@ -542,10 +733,310 @@ boolean
 disk_write_at (disk_t *disk, uint64_t offset, uint8_t *data,
                uint64_t len)
 {
+    uint64_t start = (opt_stats || trace_enabled) ? time_now_ns() : 0;
+    boolean ret;
+
     DBG4("Write to disk, len %" PRIu64 " bytes", len);
 
-    return (file_write_at(disk->filename, offset + disk->offset,
-                          data, len) == 0);
+    if (opt_direct && disk_direct_open(disk)) {
+        ret = disk_direct_write(disk, offset + disk->offset, data, len);
+    } else {
+        ret = (overlay_write_at(disk->filename, offset + disk->offset,
+                                data, len) == 0);
+    }
+
+    TRACE_IO("write", start, offset + disk->offset, len, false);
+
+    disk->stats.write_calls++;
+    disk->stats.bytes_written += len;
+
+    if (opt_stats) {
+        disk->stats.phase_ns[DISK_PHASE_DATA_IO] += time_now_ns() - start;
+    }
+
+    return (ret);
+}
+
+/*
+ * disk_write_batch
+ *
+ * Write many byte ranges of the disk at once. Queued together on io_uring
+ * where we can have it so the device can work on them in any order, else
+ * one after the other. The data must not overlap.
+ */
+boolean
+disk_write_batch (disk_t *disk, const uring_write_t *writes, uint32_t count)
+{
+    uint64_t start = (opt_stats || trace_enabled) ? time_now_ns() : 0;
+    uint32_t depth = 0;
+    boolean queued;
+    boolean ret;
+    uint32_t i;
+    int fd;
+
+    /*
+     * Direct writes all go through the one aligned buffer.
+     */
+    if ((count == 1) || opt_direct) {
+        for (i = 0; i < count; i++) {
+            if (!disk_write_at(disk, writes[i].offset,
+                               (uint8_t *) writes[i].data, writes[i].len)) {
+                return (false);
+            }
+        }
+
+        return (true);
+    }
+
+    if (!count) {
+        return (true);
+    }
+
+    if (!disk->uring_tried) {
+        disk->uring_tried = true;
+        disk->uring = uring_create(IO_URING_QUEUE_DEPTH);
+    }
+
+    queued = false;
+    ret = true;
+
+    if (disk->uring && !overlay_active(disk->filename)) {
+        fd = open(disk->filename, O_WRONLY);
+        if (fd < 0) {
+            ERR("Cannot open %s to write", disk->filename);
+            return (false);
+        }
+
+        queued = uring_write(disk->uring, fd, disk->offset, writes, count,
+                             &ret, &depth);
+
+        close(fd);
+
+        if (!queued) {
+            /*
+             * Refused, e.g. by a seccomp filter. Don't ask again.
+             */
+            uring_destroy(disk->uring);
+            disk->uring = 0;
+        }
+    }
+
+    if (!queued) {
+        for (i = 0; i < count; i++) {
+            if (!disk_write_at(disk, writes[i].offset,
+                               (uint8_t *) writes[i].data, writes[i].len)) {
+                ret = false;
+            }
+        }
+
+        disk->stats.write_batches++;
+
+        return (ret);
+    }
+
+    for (i = 0; i < count; i++) {
+        TRACE_IO("write", start, writes[i].offset + disk->offset,
+                 writes[i].len, false);
+
+        disk->stats.write_calls++;
+        disk->stats.bytes_written += writes[i].len;
+    }
+
+    disk->stats.write_batches++;
+    disk->stats.writes_queued += count;
+    disk->stats.queue_depth_peak = max(disk->stats.queue_depth_peak, depth);
+
+    if (opt_stats) {
+        disk->stats.phase_ns[DISK_PHASE_DATA_IO] += time_now_ns() - start;
+    }
+
+    return (ret);
+}
+
+/*
+ * disk_uring_destroy
+ *
+ * Drop the write ring, if one was set up.
+ */
+void
+disk_uring_destroy (disk_t *disk)
+{
+    uring_destroy(disk->uring);
+
+    disk->uring = 0;
+    disk->uring_tried = false;
+}
+
+/*
+ * disk_sync_image
+ *
+ * Wait until what the image has been given so far is on it.
+ */
+static boolean
+disk_sync_image (disk_t *disk)
+{
+    int fd;
+
+    if (overlay_active(disk->filename)) {
+        return (overlay_sync());
+    }
+
+    fd = open(disk->filename, O_RDWR);
+    if (fd < 0) {
+        ERR("Cannot open %s to sync", disk->filename);
+        return (false);
+    }
+
+    if (fdatasync(fd) < 0) {
+        ERR("Cannot sync %s", disk->filename);
+        close(fd);
+        return (false);
+    }
+
+    close(fd);
+
+    return (true);
+}
+
+/*
+ * disk_sync
+ *
+ * Wait until what has been written so far is on the image, so that steps
+ * which must not be reordered by a crash are not.
+ */
+boolean
+disk_sync (disk_t *disk)
+{
+    if (disk->dirty_sectors) {
+        return (disk_flush(disk));
+    }
+
+    return (disk_sync_image(disk));
+}
+
+/*
+ * disk_flush_runs
+ *
+ * Gather the dirty sectors in [from, to) into runs in one buffer, for
+ * writing in a batch.
+ */
+static uint32_t
+disk_flush_runs (disk_t *disk, uint32_t from, uint32_t to, uint8_t **buf,
+                 uring_write_t *writes, uint32_t nwrites)
+{
+    uint32_t datalen = sector_size(disk);
+    tree_sector_cache_node *node;
+
+    TREE_WALK_UNSAFE(disk->tree_sector_cache, node) {
+        uint32_t sector = (uint32_t) node->tree.key;
+        uint64_t offset = (uint64_t) sector * datalen;
+
+        if (!node->dirty || (sector < from) || (sector >= to)) {
+            continue;
+        }
+
+        memcpy(*buf, node->buf, datalen);
+
+        if (nwrites &&
+            (writes[nwrites - 1].offset + writes[nwrites - 1].len == offset) &&
+            (writes[nwrites - 1].data + writes[nwrites - 1].len == *buf)) {
+            writes[nwrites - 1].len += datalen;
+        } else {
+            writes[nwrites].offset = offset;
+            writes[nwrites].data = *buf;
+            writes[nwrites].len = datalen;
+            nwrites++;
+        }
+
+        *buf += datalen;
+    }
+
+    return (nwrites);
+}
+
+/*
+ * disk_flush
+ *
+ * Write out the sectors held dirty in the cache, in an order that leaves
+ * the image consistent if it stops part way: file data, which goes out as
+ * it is written, is made durable first, then every copy of the FAT, then
+ * directories, then the boot sectors and FSInfo, waiting for each. With
+ * --journal the lot is logged first, so a flush that stops part way can
+ * be finished on the next open.
+ */
+boolean
+disk_flush (disk_t *disk)
+{
+    tree_sector_cache_node *node;
+    uint32_t fat_start;
+    uint32_t data_start;
+    uring_write_t *writes;
+    uint32_t first[4];
+    uint8_t *buf;
+    uint8_t *b;
+    boolean ret;
+    uint32_t i;
+
+    if (!disk->dirty_sectors || !disk->tree_sector_cache) {
+        disk->freed_unflushed = false;
+        return (true);
+    }
+
+    fat_start = sector_reserved_count(disk);
+    data_start = fat_start +
+                    (uint32_t) (fat_size_sectors(disk) *
+                                disk->mbr->number_of_fats);
+
+    TRACE_BEGIN("flush", 0);
+
+    b = buf = (typeof(buf))
+                    myzalloc((uint64_t) disk->dirty_sectors * sector_size(disk),
+                             __FUNCTION__);
+    writes = (typeof(writes))
+                    myzalloc(sizeof(*writes) * disk->dirty_sectors,
+                             __FUNCTION__);
+
+    first[0] = 0;
+    first[1] = disk_flush_runs(disk, fat_start, data_start, &b,
+                               writes, first[0]);
+    first[2] = disk_flush_runs(disk, data_start, UINT32_MAX, &b,
+                               writes, first[1]);
+    first[3] = disk_flush_runs(disk, 0, fat_start, &b,
+                               writes, first[2]);
+
+    ret = disk_sync_image(disk);
+
+    if (ret && opt_journal) {
+        ret = journal_write(disk->filename, disk->offset, writes, first[3]);
+    }
+
+    for (i = 0; ret && (i < 3); i++) {
+        ret = disk_write_batch(disk, writes + first[i],
+                               first[i + 1] - first[i]);
+        ret = ret && disk_sync_image(disk);
+    }
+
+    if (ret) {
+        TREE_WALK_UNSAFE(disk->tree_sector_cache, node) {
+            node->dirty = false;
+        }
+
+        disk->stats.flushes++;
+        disk->stats.sectors_flushed += disk->dirty_sectors;
+        disk->dirty_sectors = 0;
+        disk->freed_unflushed = false;
+
+        if (opt_journal) {
+            journal_remove(disk->filename);
+        }
+    }
+
+    myfree(writes);
+    myfree(buf);
+
+    TRACE_END("flush");
+
+    return (ret);
 }
 
 /*
@@ -665,6 +1156,23 @@ sector_count_total (disk_t *disk)
     return (disk->mbr->sector_count);
 }
 
+/*
+ * sector_count_total_set
+ *
+ * Resize the filesystem in the boot record, keeping to the 16 bit count
+ * if it was used and the new size fits.
+ */
+void
+sector_count_total_set (disk_t *disk, uint64_t sectors)
+{
+    if (!disk->mbr->sector_count_large && (sectors <= 0xffff)) {
+        disk->mbr->sector_count = (uint16_t) sectors;
+    } else {
+        disk->mbr->sector_count = 0;
+        disk->mbr->sector_count_large = (uint32_t) sectors;
+    }
+}
+
 /*
  * root_dir_size_sectors
  *
@@ -707,7 +1215,41 @@ partition_table_read (disk_t *disk)
         int64_t amount = sizeof(part_t);
 
         disk->parts[i] =
-            (part_t *) file_read_from(disk->filename, offset, amount);
+            (part_t *) overlay_read_from(disk->filename, offset, amount);
+    }
+
+    return (true);
+}
+
+/*
+ * boot_record_write
+ *
+ * Write the boot record back, and its FAT32 backup copy if it has one.
+ */
+boolean
+boot_record_write (disk_t *disk)
+{
+    if (!disk_write_at(disk, 0, (uint8_t *) disk->mbr, sizeof(*disk->mbr))) {
+        ERR("Failed to write the boot record");
+        return (false);
+    }
+
+    /*
+     * FAT32 has no FAT size here.
+     */
+    if (!disk->mbr->fat_size_sectors &&
+        disk->mbr->fat.fat32.backup_boot_sector) {
+        if (!disk_write_at(disk,
+                           (uint64_t) disk->mbr->fat.fat32.backup_boot_sector *
+                                sector_size(disk),
+                           (uint8_t *) disk->mbr, sizeof(*disk->mbr))) {
+            ERR("Failed to write the backup boot record");
+            return (false);
+        }
+    }
+
+    if (disk->sector0) {
+        memcpy(disk->sector0, disk->mbr, sizeof(*disk->mbr));
     }
 
     return (true);
@@ -727,8 +1269,8 @@ partition_table_write (disk_t *disk)
         int64_t offset = (typeof(offset)) (PART_BASE + (sizeof(part_t) * i));
         int64_t amount = sizeof(part_t);
 
-        if (file_write_at(disk->filename, offset,
-                          (uint8_t *) disk->parts[i], amount) < 0) {
+        if (overlay_write_at(disk->filename, offset,
+                             (uint8_t *) disk->parts[i], amount) < 0) {
             ERR("failed writing partition info");
             return (false);
         }
@@ -839,24 +1381,36 @@ sector_cache_add (disk_t *disk, uint32_t sector, uint8_t *buf)
 
     tree_sector_cache_node *node;
 
+    datalen = sector_size(disk);
+
     if (!disk->tree_sector_cache) {
         disk->tree_sector_cache = tree_alloc(TREE_KEY_INTEGER,
                                              "TREE ROOT: sector cache");
+
+        /*
+         * Node and sector data come as one slab object.
+         */
+        slab_init(&disk->sector_slab, sizeof(*node) + 16 + datalen,
+                  SLAB_OBJS_PER_CHUNK);
     }
 
-    node = (typeof(node)) myzalloc(sizeof(*node), "TREE NODE: sector cache");
+    node = (typeof(node)) slab_alloc(&disk->sector_slab);
+    memset(node, 0, sizeof(*node));
     node->tree.key = sector;
 
-    datalen = sector_size(disk);
-
     if (!tree_insert(disk->tree_sector_cache, &node->tree.node)) {
         DIE("cache sector %" PRIu32 " fail", sector);
     }
 
-    node->buf = (typeof(node->buf)) myzalloc(datalen, "sector cache");;
+    node->buf = ((uint8_t *) node) + ((sizeof(*node) + 15) & ~15);
     memcpy(node->buf, buf, datalen);
 
-    return (false);
+    disk->stats.cache_sectors++;
+    if (disk->stats.cache_sectors > disk->stats.cache_sectors_peak) {
+        disk->stats.cache_sectors_peak = disk->stats.cache_sectors;
+    }
+
+    return (false);
 }
 
 /*
@@ -880,14 +1434,13 @@ sectors_cache_add (disk_t * disk, uint32_t sector, uint32_t count,
 }
 
 /*
- * sector_cache_find
+ * sector_cache_find_node
  *
- * Find a sector in the cache.
+ * Find the cache node for a sector.
  */
-uint8_t *
-sector_cache_find (disk_t *disk, uint32_t sector)
+static tree_sector_cache_node *
+sector_cache_find_node (disk_t *disk, uint32_t sector)
 {
-    tree_sector_cache_node *result;
     tree_sector_cache_node target;
 
     if (!disk->tree_sector_cache) {
@@ -897,8 +1450,86 @@ sector_cache_find (disk_t *disk, uint32_t sector)
     memset(&target, 0, sizeof(target));
     target.tree.key = sector;
 
-    result = (typeof(result)) tree_find(disk->tree_sector_cache,
-                                        &target.tree.node);
+    return ((tree_sector_cache_node *)
+            tree_find(disk->tree_sector_cache, &target.tree.node));
+}
+
+/*
+ * sector_cache_dirty_in
+ *
+ * Is any of a run of sectors waiting in the cache to be flushed, so that
+ * the image itself cannot be read for it?
+ */
+static boolean
+sector_cache_dirty_in (disk_t *disk, uint32_t sector, uint32_t count)
+{
+    tree_sector_cache_node *node;
+    uint32_t i;
+
+    if (!disk->dirty_sectors) {
+        return (false);
+    }
+
+    for (i = 0; i < count; i++) {
+        node = sector_cache_find_node(disk, sector + i);
+        if (node && node->dirty) {
+            return (true);
+        }
+    }
+
+    return (false);
+}
+
+/*
+ * sector_cache_overlay
+ *
+ * Copy any sectors waiting to be flushed over a byte range just read from
+ * the image, so the caller sees what the image is going to hold.
+ */
+void
+sector_cache_overlay (disk_t *disk, uint64_t offset, uint8_t *data,
+                      uint64_t len)
+{
+    tree_sector_cache_node *node;
+    uint32_t datalen;
+    uint64_t sector;
+    uint64_t end;
+
+    if (!disk->dirty_sectors || !len) {
+        return;
+    }
+
+    datalen = sector_size(disk);
+    end = offset + len;
+
+    for (sector = offset / datalen; sector * datalen < end; sector++) {
+        uint64_t from;
+        uint64_t to;
+
+        node = sector_cache_find_node(disk, (uint32_t) sector);
+        if (!node || !node->dirty) {
+            continue;
+        }
+
+        from = max(offset, sector * datalen);
+        to = min(end, (sector + 1) * datalen);
+
+        memcpy(data + (from - offset), node->buf + (from - sector * datalen),
+               to - from);
+    }
+}
+
+/*
+ * sector_cache_find
+ *
+ * Find a sector in the cache.
+ */
+uint8_t *
+sector_cache_find (disk_t *disk, uint32_t sector)
+{
+    tree_sector_cache_node *result;
+
+    result = sector_cache_find_node(disk, sector);
     if (!result) {
         return (0);
     }
@@ -906,10 +1537,103 @@ sector_cache_find (disk_t *disk, uint32_t sector)
     return (result->buf);
 }
 
+/*
+ * sector_cache_update
+ *
+ * Writes that bypass the cache may land on sectors it still holds, e.g. a
+ * freed dir cluster reused for file data. Keep any such copies current.
+ */
+void
+sector_cache_update (disk_t *disk, uint32_t sector, uint32_t count,
+                     const uint8_t *data)
+{
+    tree_sector_cache_node *first;
+    tree_sector_cache_node *last;
+    tree_sector_cache_node *node;
+    uint32_t datalen;
+    uint32_t i;
+
+    if (!disk->tree_sector_cache) {
+        return;
+    }
+
+    first = (typeof(first)) tree_root_first(disk->tree_sector_cache);
+    last = (typeof(last)) tree_root_last(disk->tree_sector_cache);
+
+    if (!first || (sector > (uint32_t) last->tree.key) ||
+        (sector + count <= (uint32_t) first->tree.key)) {
+        return;
+    }
+
+    datalen = sector_size(disk);
+
+    for (i = 0; i < count; i++) {
+        node = (typeof(node)) sector_cache_find_node(disk, sector + i);
+        if (node) {
+            memcpy(node->buf, data + (uint64_t) i * datalen, datalen);
+
+            if (node->dirty) {
+                node->dirty = false;
+                disk->dirty_sectors--;
+            }
+        }
+    }
+}
+
+/*
+ * sector_cache_reload
+ *
+ * As sector_cache_update, for writes the kernel made from a local file;
+ * read any of the sectors the cache holds back from the image.
+ */
+static void
+sector_cache_reload (disk_t *disk, uint32_t sector, uint32_t count)
+{
+    tree_sector_cache_node *first;
+    tree_sector_cache_node *last;
+    tree_sector_cache_node *node;
+    uint32_t datalen;
+    uint8_t *data;
+    uint32_t i;
+
+    if (!disk->tree_sector_cache) {
+        return;
+    }
+
+    first = (typeof(first)) tree_root_first(disk->tree_sector_cache);
+    last = (typeof(last)) tree_root_last(disk->tree_sector_cache);
+
+    if (!first || (sector > (uint32_t) last->tree.key) ||
+        (sector + count <= (uint32_t) first->tree.key)) {
+        return;
+    }
+
+    datalen = sector_size(disk);
+
+    for (i = 0; i < count; i++) {
+        node = (typeof(node)) sector_cache_find_node(disk, sector + i);
+        if (!node) {
+            continue;
+        }
+
+        if (node->dirty) {
+            node->dirty = false;
+            disk->dirty_sectors--;
+        }
+
+        data = disk_read_from(disk, (uint64_t) (sector + i) * datalen,
+                              datalen);
+        if (data) {
+            memcpy(node->buf, data, datalen);
+            myfree(data);
+        }
+    }
+}
+
 /*
  * sector_cache_destroy
  *
- * Destroy all sectors. Anticipation is they've been written.
+ * Destroy all sectors, flushing any not yet written.
  */
 void
 sector_cache_destroy (disk_t *disk)
@@ -920,14 +1644,26 @@ sector_cache_destroy (disk_t *disk)
         return;
     }
 
+    if (!disk_flush(disk)) {
+        ERR("Failed to flush %" PRIu32 " sectors to %s",
+            disk->dirty_sectors, disk->filename);
+    }
+
     TREE_WALK(disk->tree_sector_cache, node) {
+        if (node->refs) {
+            ERR("sector %" PRIu32 " still has %" PRIu32 " views",
+                (uint32_t) node->tree.key, node->refs);
+        }
+
         tree_remove(disk->tree_sector_cache, &node->tree.node);
-        myfree(node->buf);
-        myfree(node);
     }
 
+    slab_destroy(&disk->sector_slab);
+
     myfree(disk->tree_sector_cache);
     disk->tree_sector_cache = 0;
+    disk->stats.cache_sectors = 0;
+    disk->dirty_sectors = 0;
 }
 
 /*
@@ -962,6 +1698,8 @@ sector_read (disk_t *disk, uint32_t sector_, uint32_t count)
         /*
          * Nothing was found in the cache. Read from the disk.
          */
+        disk->stats.cache_misses += count;
+
         DBG4("Read sector block %" PRIu32 " .. %" PRIu32 "", sector,
              sector + count);
 
@@ -998,6 +1736,11 @@ sector_read (disk_t *disk, uint32_t sector_, uint32_t count)
             DBG4("Read from sector cache %" PRIu32 "", sector);
 
             memcpy(b, cached, datalen);
+            disk->stats.cache_hits++;
+
+            TRACE_IO("read", 0,
+                     (uint64_t) sector * datalen + disk->offset,
+                     datalen, true);
         } else {
             /*
              * Read from disk.
@@ -1005,6 +1748,7 @@ sector_read (disk_t *disk, uint32_t sector_, uint32_t count)
             DBG4("Read from sector %" PRIu32 "", sector);
 
             offset = sector * datalen;
+            disk->stats.cache_misses++;
 
             uint8_t *tmp = disk_read_from(disk, offset, datalen);
             memcpy(b, tmp, datalen);
@@ -1022,10 +1766,202 @@ sector_read (disk_t *disk, uint32_t sector_, uint32_t count)
     return (data);
 }
 
+/*
+ * sector_read_no_cache
+ *
+ * Read a block of sectors straight from disk. No cache. Writes go through
+ * to disk so this never sees stale data.
+ */
+uint8_t *
+sector_read_no_cache (disk_t *disk, uint32_t sector, uint32_t count)
+{
+    uint64_t offset;
+    uint8_t *data;
+
+    DBG4("Read sector block %" PRIu32 " .. %" PRIu32 " (no cache)", sector,
+         sector + count);
+
+    offset = (uint64_t) sector * sector_size(disk);
+
+    data = disk_read_from(disk, offset, (uint64_t) sector_size(disk) * count);
+    if (!data) {
+        DIE("failed to read disk sector %" PRIu32 "", sector);
+    }
+
+    return (data);
+}
+
+/*
+ * disk_map_ptr
+ *
+ * Where a byte range of the disk is in the read only mapping of the image,
+ * mapping it first if need be. Zero if it cannot be mapped.
+ */
+static const uint8_t *
+disk_map_ptr (disk_t *disk, uint64_t offset, uint64_t len)
+{
+#ifdef ENABLE_MMAP_READS
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (!disk->map && !disk->map_tried) {
+        disk->map_tried = true;
+
+        /*
+         * The base alone is not the image.
+         */
+        if (overlay_active(disk->filename)) {
+            return (0);
+        }
+
+        fd = open(disk->filename, O_RDONLY);
+        if (fd < 0) {
+            return (0);
+        }
+
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size) {
+            map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED) {
+                disk->map = (typeof(disk->map)) map;
+                disk->map_len = st.st_size;
+            }
+        }
+
+        close(fd);
+    }
+
+    offset += disk->offset;
+
+    if (!disk->map || (offset + len > disk->map_len)) {
+        return (0);
+    }
+
+    return (disk->map + offset);
+#else
+    return (0);
+#endif
+}
+
+/*
+ * disk_unmap
+ *
+ * Drop the image mapping. Views into it must all have been released.
+ */
+void
+disk_unmap (disk_t *disk)
+{
+#ifdef ENABLE_MMAP_READS
+    if (disk->map_refs) {
+        ERR("%" PRIu32 " sector views still out on %s", disk->map_refs,
+            disk->filename);
+    }
+
+    if (disk->map) {
+        munmap((void *) disk->map, disk->map_len);
+    }
+#endif
+
+    disk->map = 0;
+    disk->map_len = 0;
+    disk->map_tried = false;
+}
+
+/*
+ * sector_view
+ *
+ * Borrow a run of sectors without copying them if we can: one sector
+ * straight from the cache, or any run from the mapped image. Otherwise a
+ * private copy is read. Runs with sectors waiting to be flushed are not
+ * taken from the mapping.
+ */
+boolean
+sector_view (disk_t *disk, uint32_t sector, uint32_t count,
+             sector_view_t *view)
+{
+    uint32_t datalen = sector_size(disk);
+    tree_sector_cache_node *node;
+    tree_sector_cache_node target;
+    const uint8_t *mapped;
+    uint64_t offset;
+
+    memset(view, 0, sizeof(*view));
+
+    offset = (uint64_t) sector * datalen;
+    view->len = (uint64_t) count * datalen;
+
+    if ((count == 1) && disk->tree_sector_cache) {
+        memset(&target, 0, sizeof(target));
+        target.tree.key = sector;
+
+        node = (typeof(node)) tree_find(disk->tree_sector_cache,
+                                        &target.tree.node);
+        if (node) {
+            node->refs++;
+
+            view->node = node;
+            view->data = node->buf;
+
+            disk->stats.views_cached++;
+            disk->stats.cache_hits++;
+
+            TRACE_IO("read", 0, offset + disk->offset, view->len, true);
+
+            return (true);
+        }
+    }
+
+    mapped = sector_cache_dirty_in(disk, sector, count) ?
+                    0 : disk_map_ptr(disk, offset, view->len);
+    if (mapped) {
+        disk->map_refs++;
+
+        view->data = mapped;
+
+        disk->stats.views_mapped++;
+
+        TRACE_IO("read", 0, offset + disk->offset, view->len, true);
+
+        return (true);
+    }
+
+    view->copy = sector_read(disk, sector, count);
+    if (!view->copy) {
+        return (false);
+    }
+
+    view->data = view->copy;
+
+    disk->stats.views_copied++;
+
+    return (true);
+}
+
+/*
+ * sector_view_release
+ *
+ * Done with a view from sector_view.
+ */
+void
+sector_view_release (disk_t *disk, sector_view_t *view)
+{
+    if (view->node) {
+        view->node->refs--;
+    } else if (view->copy) {
+        myfree(view->copy);
+    } else if (view->data) {
+        disk->map_refs--;
+    }
+
+    memset(view, 0, sizeof(*view));
+}
+
 /*
  * sector_write
  *
- * Write a block of sectors.
+ * Write a block of sectors. Changed sectors are kept dirty in the cache
+ * for disk_flush to write in order; only if they cannot be cached do they
+ * go straight out.
  */
 boolean
 sector_write (disk_t *disk, uint32_t sector_, uint8_t *data,
@@ -1033,6 +1969,8 @@ sector_write (disk_t *disk, uint32_t sector_, uint8_t *data,
 {
     tree_sector_cache_node *result;
     tree_sector_cache_node target;
+    uring_write_t *writes;
+    uint32_t nwrites;
     uint32_t datalen;
     boolean write;
     uint32_t i;
@@ -1042,15 +1980,17 @@ sector_write (disk_t *disk, uint32_t sector_, uint8_t *data,
     boolean ret;
 
     b = data;
-    ret = true;
     datalen = sector_size(disk);
     sector = sector_;
+    nwrites = 0;
+    writes = (typeof(writes)) myzalloc(sizeof(*writes) * max(count, 1U),
+                                       __FUNCTION__);
 
     DBG4("Write sector block %" PRIu32 " .. %" PRIu32 "", sector_,
          sector_ + count);
 
     /*
-     * Write only changed sectors.
+     * Write only changed sectors; any not cached in runs in one batch.
      */
     for (i = 0; i < count; i++, sector++) {
         memset(&target, 0, sizeof(target));
@@ -1065,8 +2005,6 @@ sector_write (disk_t *disk, uint32_t sector_, uint8_t *data,
             /*
              * If there is a change from the cache, update and write.
              */
-            verify(result->buf);
-
             if (memcmp(result->buf, b, datalen)) {
                 /*
                  * Update cache.
@@ -1086,30 +2024,51 @@ sector_write (disk_t *disk, uint32_t sector_, uint8_t *data,
                 write = false;
             }
         } else {
+            const uint8_t *mapped =
+                disk_map_ptr(disk, (uint64_t) sector * datalen, datalen);
+
             /*
-             * Add to cache and write to disk.
+             * Add to cache and mark it to be written, unless the image
+             * already has this.
              */
             DBG4("Not cached, write to sector %" PRIu32 " and cache it",
                  sector);
 
             sector_cache_add(disk, sector, b);
-            write = true;
+            write = !mapped || memcmp(mapped, b, datalen);
         }
 
-        if (write) {
-            /*
-             * Write to disk.
-             */
-            offset = sector * datalen;
+        if (!result) {
+            result = sector_cache_find_node(disk, sector);
+        }
 
-            if (!disk_write_at(disk, offset, b, datalen)) {
-                ret = false;
+        if (write && result) {
+            if (!result->dirty) {
+                result->dirty = true;
+                disk->dirty_sectors++;
+            }
+        } else if (write) {
+            offset = (uint64_t) sector * datalen;
+
+            if (nwrites &&
+                (writes[nwrites - 1].offset +
+                 writes[nwrites - 1].len == offset)) {
+                writes[nwrites - 1].len += datalen;
+            } else {
+                writes[nwrites].offset = offset;
+                writes[nwrites].data = b;
+                writes[nwrites].len = datalen;
+                nwrites++;
             }
         }
 
         b += datalen;
     }
 
+    ret = disk_write_batch(disk, writes, nwrites);
+
+    myfree(writes);
+
     return (ret);
 }
 
@@ -1157,8 +2116,6 @@ sector_pre_write_print_dirty_sectors (disk_t *disk, uint32_t sector_,
             /*
              * If there is a change from the cache, update and write.
              */
-            verify(result->buf);
-
             if (memcmp(result->buf, b, datalen)) {
                 if (first) {
                     if (opt_debug) {
@@ -1199,7 +2156,9 @@ sector_write_no_cache (disk_t *disk, uint32_t sector, uint8_t *data,
     uint64_t offset;
 
     datalen = sector_size(disk) * count;
-    offset = sector * sector_size(disk);
+    offset = (uint64_t) sector * sector_size(disk);
+
+    sector_cache_update(disk, sector, count, data);
 
     return (disk_write_at(disk, offset, data, datalen));
 }
@@ -1276,3 +2235,187 @@ cluster_write_no_cache (disk_t *disk, uint32_t cluster, uint8_t *data,
 
     return (ret);
 }
+
+/*
+ * disk_copy_fds
+ *
+ * Copy len bytes from one file to another in the kernel. The part that is
+ * aligned to the host block size is shared with FICLONERANGE if both files
+ * are on a filesystem that can, the rest goes with copy_file_range. Neither
+ * moves the file positions. Returns false if the kernel cannot do it, maybe
+ * after copying some; the caller then copies the whole range itself.
+ */
+boolean disk_copy_fds (int fd_in, uint64_t off_in,
+                       int fd_out, uint64_t off_out, uint64_t len)
+{
+#if defined(ENABLE_KERNEL_COPY) && defined(__linux__)
+    struct file_clone_range clone;
+    struct stat st;
+    loff_t in = (loff_t) off_in;
+    loff_t out = (loff_t) off_out;
+    ssize_t done;
+
+    if (!fstat(fd_out, &st) && (st.st_blksize > 0)) {
+        uint64_t block = (uint64_t) st.st_blksize;
+
+        if (!(off_in % block) && !(off_out % block) && (len >= block)) {
+            memset(&clone, 0, sizeof(clone));
+            clone.src_fd = fd_in;
+            clone.src_offset = off_in;
+            clone.src_length = len - (len % block);
+            clone.dest_offset = off_out;
+
+            if (!ioctl(fd_out, FICLONERANGE, &clone)) {
+                in += (loff_t) clone.src_length;
+                out += (loff_t) clone.src_length;
+                len -= clone.src_length;
+            }
+        }
+    }
+
+    while (len) {
+        done = copy_file_range(fd_in, &in, fd_out, &out, len, 0);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return (false);
+        }
+
+        /*
+         * The source is shorter than it should be.
+         */
+        if (!done) {
+            return (false);
+        }
+
+        len -= (uint64_t) done;
+    }
+
+    return (true);
+#else
+    return (false);
+#endif
+}
+
+/*
+ * cluster_copy_out
+ *
+ * Copy len bytes from the start of a run of clusters to a local file at
+ * fd_offset, without passing the data through here. Returns false if the
+ * kernel cannot, and the caller should read and write it instead.
+ */
+boolean
+cluster_copy_out (disk_t *disk, uint32_t cluster, int fd, uint64_t fd_offset,
+                  uint64_t len)
+{
+    uint64_t start = (opt_stats || trace_enabled) ? time_now_ns() : 0;
+    uint64_t offset;
+    boolean ret;
+    int disk_fd;
+
+    offset = (uint64_t) (sector_first_data_sector(disk) +
+                         (cluster * disk->mbr->sectors_per_cluster)) *
+                    sector_size(disk) + disk->offset;
+
+    /*
+     * The image file does not hold all of it, yet or through an overlay.
+     */
+    if (overlay_active(disk->filename) ||
+        sector_cache_dirty_in(disk, cluster_to_sector(disk, cluster),
+                              (uint32_t) ((len + sector_size(disk) - 1) /
+                                          sector_size(disk)))) {
+        return (false);
+    }
+
+    disk_fd = open(disk->filename, O_RDONLY);
+    if (disk_fd < 0) {
+        return (false);
+    }
+
+    ret = disk_copy_fds(disk_fd, offset, fd, fd_offset, len);
+
+    close(disk_fd);
+
+    TRACE_IO("copy out", start, offset, len, false);
+
+    if (ret) {
+        disk->stats.copy_calls++;
+        disk->stats.bytes_copied += len;
+    }
+
+    if (opt_stats) {
+        disk->stats.phase_ns[DISK_PHASE_DATA_IO] += time_now_ns() - start;
+    }
+
+    return (ret);
+}
+
+/*
+ * cluster_copy_in
+ *
+ * Fill a run of clusters with len bytes from a local file at fd_offset,
+ * zeroing the tail of the last cluster. Any of the sectors the cache holds
+ * are read back so it does not go stale. Returns false if the kernel cannot
+ * copy the data, and the caller should read and write it instead.
+ */
+boolean
+cluster_copy_in (disk_t *disk, uint32_t cluster, uint32_t count, int fd,
+                 uint64_t fd_offset, uint64_t len)
+{
+    uint64_t start = (opt_stats || trace_enabled) ? time_now_ns() : 0;
+    uint64_t block_size = (uint64_t) count * cluster_size(disk);
+    uint32_t sector;
+    uint32_t amount;
+    uint64_t offset;
+    boolean ret;
+    int disk_fd;
+
+    sector = sector_first_data_sector(disk) +
+                    (cluster * disk->mbr->sectors_per_cluster);
+    amount = count * disk->mbr->sectors_per_cluster;
+    offset = (uint64_t) sector * sector_size(disk);
+
+    /*
+     * That would go through the page cache, or into the base.
+     */
+    if (opt_direct || overlay_active(disk->filename)) {
+        return (false);
+    }
+
+    disk_fd = open(disk->filename, O_WRONLY);
+    if (disk_fd < 0) {
+        return (false);
+    }
+
+    ret = disk_copy_fds(fd, fd_offset, disk_fd, offset + disk->offset, len);
+
+    close(disk_fd);
+
+    TRACE_IO("copy in", start, offset + disk->offset, len, false);
+
+    if (!ret) {
+        return (false);
+    }
+
+    disk->stats.copy_calls++;
+    disk->stats.bytes_copied += len;
+
+    if (opt_stats) {
+        disk->stats.phase_ns[DISK_PHASE_DATA_IO] += time_now_ns() - start;
+    }
+
+    if (len < block_size) {
+        uint8_t *zero = (typeof(zero)) myzalloc(block_size - len,
+                                                __FUNCTION__);
+
+        ret = disk_write_at(disk, offset + len, zero, block_size - len);
+
+        myfree(zero);
+    }
+
+    sector_cache_reload(disk, sector, amount);
+
+    return (ret);
+}
@@ -200,9 +200,51 @@ typedef struct disk_walk_args_t_ {
     boolean find;
     boolean stop_walk;
     boolean walk_whole_tree;
+
+    /*
+     * Treat the filter as a literal path, comparing one name per path
+     * component, so names like a[1].txt are not wildcards.
+     */
+    boolean exact;
+
     fat_dirent_t dirent;
     char *add_dir;
     char *source;
+
+    /*
+     * When set, import this buffer instead of reading the source file.
+     */
+    const uint8_t *data;
+    uint64_t data_len;
+    boolean data_set;
+
+    /*
+     * Or read data_len bytes from this fd as the file is written, giving
+     * it this modify time and these extra attributes. How much was read
+     * is added to data_fd_read if it is set.
+     */
+    int data_fd;
+    boolean data_fd_set;
+    uint64_t *data_fd_read;
+    int64_t mtime;
+    boolean mtime_set;
+    uint32_t attr;
+
+    /*
+     * Write data at an offset into an existing file, append it, replace
+     * all of it, or truncate the file to the offset; all in place. If
+     * source is set, the file takes its modify time.
+     */
+    boolean modify;
+    boolean modify_append;
+    boolean modify_truncate;
+    boolean modify_replace;
+    uint64_t modify_offset;
+
+    /*
+     * Write what matches to stdout as a tar archive.
+     */
+    boolean tar;
 } disk_walk_args_t;
 
 /*
@@ -241,8 +283,98 @@ typedef struct {
 typedef struct tree_sector_cache_node_ {
     tree_key_int tree;
     uint8_t *buf;
+    uint32_t refs;
+    boolean dirty;
 } tree_sector_cache_node;
 
+/*
+ * A read only borrow of a run of sectors. The data is in the sector cache,
+ * in the mapped disk image, or failing those a private copy. Callers that
+ * want to change it must copy it. Release with sector_view_release.
+ */
+typedef struct sector_view_ {
+    const uint8_t *data;
+    uint64_t len;
+    tree_sector_cache_node *node;
+    uint8_t *copy;
+} sector_view_t;
+
+/*
+ * A run of physically contiguous clusters within a file.
+ */
+typedef struct {
+    /*
+     * Cluster index within the file where this run starts.
+     */
+    uint32_t logical;
+
+    /*
+     * First disk cluster of the run and how many follow it.
+     */
+    uint32_t cluster;
+    uint32_t count;
+} fat_extent_t;
+
+/*
+ * A file's cluster chain as a sorted list of runs, so we can seek by
+ * binary search instead of walking the chain.
+ */
+typedef struct {
+    uint32_t first_cluster;
+    uint32_t number_of_clusters;
+    uint32_t number_of_extents;
+    uint32_t max_extents;
+    fat_extent_t *extents;
+} fat_extent_map_t;
+
+/*
+ * Phases timed for --stats. They nest, e.g. the FAT read is part of the
+ * open and data I/O happens inside a walk.
+ */
+enum {
+    DISK_PHASE_OPEN,
+    DISK_PHASE_FAT_READ,
+    DISK_PHASE_WALK,
+    DISK_PHASE_DATA_IO,
+    DISK_PHASE_FAT_WRITE,
+    DISK_PHASE_MAX,
+};
+
+/*
+ * Counters for --stats. Only ever incremented so they stay cheap enough to
+ * keep on all the time; the clock is only read when --stats is given.
+ */
+typedef struct {
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t cache_sectors;
+    uint64_t cache_sectors_peak;
+    uint64_t cluster_next_hops;
+    uint64_t cluster_allocs;
+    uint64_t cluster_alloc_scanned;
+    uint64_t dirs_walked;
+    uint64_t dirents_walked;
+    uint64_t regcomps_at_open;
+    uint64_t views_cached;
+    uint64_t views_mapped;
+    uint64_t views_copied;
+    uint64_t copy_calls;
+    uint64_t bytes_copied;
+    uint64_t write_batches;
+    uint64_t writes_queued;
+    uint32_t queue_depth_peak;
+    uint64_t direct_edge_reads;
+    uint64_t flushes;
+    uint64_t sectors_flushed;
+    uint64_t allocs_at_open;
+    uint32_t walk_depth;
+    uint64_t phase_ns[DISK_PHASE_MAX];
+} disk_stats_t;
+
 /*
  * My disk structure context.
  */
@@ -292,6 +424,68 @@ typedef struct disk_t_ {
      * To speed up disk reads of sectors.
      */
     tree_root *tree_sector_cache;
+
+    /*
+     * Cached sectors written to but not yet flushed to the image.
+     */
+    uint32_t dirty_sectors;
+
+    /*
+     * Clusters freed since the last flush, whose old owners the image may
+     * still point at. They must not be written to before a flush.
+     */
+    boolean freed_unflushed;
+
+    /*
+     * Cache nodes with their sector data, and dirent block headers.
+     */
+    slab_t sector_slab;
+    slab_t dirent_slab;
+
+    /*
+     * Path names and other temporaries for the walk.
+     */
+    arena_t arena;
+
+    /*
+     * Read only mapping of the image for sector views, and how many views
+     * into it are out.
+     */
+    const uint8_t *map;
+    uint64_t map_len;
+    uint32_t map_refs;
+    boolean map_tried;
+
+    /*
+     * io_uring for batches of writes, set up on the first batch.
+     */
+    uring_t *uring;
+    boolean uring_tried;
+
+    /*
+     * For --direct, the image opened O_DIRECT and an aligned buffer that
+     * all writes go through.
+     */
+    int direct_fd;
+    boolean direct_tried;
+    uint8_t *direct_buf;
+
+    /*
+     * Extent map of the last file read at an offset. Any FAT change drops it.
+     */
+    fat_extent_map_t *extent_map;
+
+    /*
+     * Runs of free clusters in cluster order, built on the first alloc.
+     * Freeing any cluster drops it.
+     */
+    fat_extent_t *free_extents;
+    uint32_t number_of_free_extents;
+
+    /*
+     * Counters for --stats.
+     */
+    disk_stats_t stats;
 } disk_t;
 
 /*
@@ -404,10 +598,31 @@ void sectors_cache_add(disk_t * disk, uint32_t sector, uint32_t count,
                        uint8_t *buf);
 uint8_t *sector_cache_find(disk_t *disk, uint32_t sector);
 void sector_cache_destroy(disk_t *disk);
+void sector_cache_update(disk_t *disk, uint32_t sector, uint32_t count,
+                         const uint8_t *data);
+void sector_cache_overlay(disk_t *disk, uint64_t offset, uint8_t *data,
+                          uint64_t len);
 uint8_t *sector_read(disk_t *disk, uint32_t sector_, uint32_t count);
+uint8_t *sector_read_no_cache(disk_t *disk, uint32_t sector, uint32_t count);
+boolean sector_view(disk_t *disk, uint32_t sector, uint32_t count,
+                    sector_view_t *view);
+void sector_view_release(disk_t *disk, sector_view_t *view);
+void disk_unmap(disk_t *disk);
 uint8_t *cluster_read(disk_t *disk, uint32_t cluster, uint32_t count);
 boolean disk_write_at(disk_t *disk, uint64_t offset,
                       uint8_t *data, uint64_t len);
+boolean disk_write_batch(disk_t *disk, const uring_write_t *writes,
+                         uint32_t count);
+void disk_uring_destroy(disk_t *disk);
+void disk_direct_close(disk_t *disk);
+boolean disk_sync(disk_t *disk);
+boolean disk_flush(disk_t *disk);
+boolean disk_copy_fds(int fd_in, uint64_t off_in, int fd_out, uint64_t off_out,
+                      uint64_t len);
+boolean cluster_copy_out(disk_t *disk, uint32_t cluster, int fd,
+                         uint64_t fd_offset, uint64_t len);
+boolean cluster_copy_in(disk_t *disk, uint32_t cluster, uint32_t count,
+                        int fd, uint64_t fd_offset, uint64_t len);
 boolean sector_write(disk_t *disk, uint32_t sector_, uint8_t *data,
                      uint32_t count);
 boolean sector_pre_write_print_dirty_sectors(disk_t *disk, uint32_t sector_,
@@ -429,10 +644,12 @@ uint32_t sector_offset(disk_t *disk);
 uint32_t sector_first_data_sector(disk_t *disk);
 uint64_t sector_count_data(disk_t *disk);
 uint64_t sector_count_total(disk_t *disk);
+void sector_count_total_set(disk_t *disk, uint64_t sectors);
 uint32_t root_dir_size_bytes(disk_t *disk);
 uint32_t root_dir_size_sectors(disk_t *disk);
 uint32_t total_clusters(disk_t *disk);
 boolean partition_table_read(disk_t *disk);
 boolean partition_table_write(disk_t *disk);
+boolean boot_record_write(disk_t *disk);
 boolean partition_table_print(disk_t *disk);
 boolean dos_dir_is_subset_of_dir(const char *a, const char *b);
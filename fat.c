@@ -16,6 +16,9 @@
 #include "main.h"
 #include <unistd.h>
 #include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "disk.h"
 #include "fat.h"
@@ -31,10 +34,10 @@ static const uint32_t FAT_FILE_DELETE_CHAR          = 0xE5;
 /*
  * FAT file attr flags.
  */
-//static const uint32_t FAT_ATTR_IS_READ_ONLY         = 0x01;
-//static const uint32_t FAT_ATTR_IS_HIDDEN            = 0x02;
-//static const uint32_t FAT_ATTR_IS_SYSTEM            = 0x04;
-//static const uint32_t FAT_ATTR_IS_LABEL             = 0x08;
+static const uint32_t FAT_ATTR_IS_READ_ONLY         = 0x01;
+static const uint32_t FAT_ATTR_IS_HIDDEN            = 0x02;
+static const uint32_t FAT_ATTR_IS_SYSTEM            = 0x04;
+static const uint32_t FAT_ATTR_IS_LABEL             = 0x08;
 static const uint32_t FAT_ATTR_IS_DIR               = 0x10;
 static const uint32_t FAT_ATTR_IS_ARCHIVE           = 0x20;
 
@@ -47,6 +50,12 @@ static char *dos_last_dot(char *in);
 static char *dirent_read_name(disk_t *disk, fat_dirent_t *dirent,
                               char *vfat_filename);
 static boolean dos_file_match(const char *a, const char *b, boolean is_dir);
+static boolean dos_path_match_exact(const char *path,
+                                    const char *name,
+                                    boolean prefix);
+static fat_extent_map_t *fat_extent_map_get(disk_t *disk,
+                                            uint32_t first_cluster);
+static fat_extent_t *fat_extent_find(fat_extent_map_t *map, uint32_t logical);
 
 /*
  * fat_type
@@ -202,11 +211,11 @@ uint32_t root_dir_size_bytes (disk_t *disk)
 }
 
 /*
- * cluster_next
+ * cluster_next_raw
  *
- * Given a cluster, return the next cluster.
+ * Given a cluster, return the next cluster. Not counted in the stats.
  */
-static uint32_t cluster_next (disk_t *disk, uint32_t cluster)
+static uint32_t cluster_next_raw (disk_t *disk, uint32_t cluster)
 {
     uint32_t fat_byte_offset;
     uint32_t cluster_next;
@@ -254,6 +263,18 @@ static uint32_t cluster_next (disk_t *disk, uint32_t cluster)
     return (cluster_next);
 }
 
+/*
+ * cluster_next
+ *
+ * Given a cluster, return the next cluster.
+ */
+static uint32_t cluster_next (disk_t *disk, uint32_t cluster)
+{
+    disk->stats.cluster_next_hops++;
+
+    return (cluster_next_raw(disk, cluster));
+}
+
 /*
  * cluster_next_set
  *
@@ -268,6 +289,20 @@ static uint32_t cluster_next_set (disk_t *disk,
     uint8_t *fat;
     uint16_t old;
 
+    /*
+     * Any cached file layout may now be wrong, and freeing a cluster makes
+     * the free run index stale.
+     */
+    fat_extent_map_free(disk);
+
+    if (!cluster_next) {
+        fat_free_extents_free(disk);
+
+        if (cluster_next_raw(disk, cluster)) {
+            disk->freed_unflushed = true;
+        }
+    }
+
     /*
      * Find the array index of the current cluster.
      */
@@ -377,117 +412,330 @@ static uint32_t cluster_next_set (disk_t *disk,
 }
 
 /*
- * cluster_alloc
+ * fat_free_extents_free
  *
- * Find a free cluster.
+ * Drop the index of free cluster runs. It is rebuilt on the next alloc.
  */
-static uint32_t cluster_alloc (disk_t *disk)
+void fat_free_extents_free (disk_t *disk)
 {
-    /*
-     * Start from the first valid cluster.
-     */
-    static uint32_t last_cluster = 2;
-    uint32_t fat_byte_offset;
-    uint32_t cluster_next;
+    myfree(disk->free_extents);
+    disk->free_extents = 0;
+    disk->number_of_free_extents = 0;
+}
+
+/*
+ * fat_free_extents_build
+ *
+ * Scan the FAT once for runs of free clusters, in cluster order.
+ */
+static void fat_free_extents_build (disk_t *disk)
+{
+    uint32_t max_extents = 64;
     uint32_t cluster;
-    uint8_t *fat;
+    fat_extent_t *extent;
 
-redo:
-    /*
-     * Try from the last cluster found to speed things up and give us
-     * a chance for things to be sequential.
-     */
-    for (cluster = last_cluster; cluster < total_clusters(disk); cluster++) {
-        /*
-         * Find the array index of the current cluster.
-         */
-        if (fat_type(disk) == 12) {
-            /*
-             * Ignore root cluster if FAT32.
-             */
-            if (cluster == disk->mbr->fat.fat32.root_cluster) {
-                continue;
-            }
+    if (disk->free_extents) {
+        return;
+    }
 
-            fat_byte_offset = cluster + (cluster / 2); // multiply by 1.5
-        } else if (fat_type(disk) == 16) {
-            fat_byte_offset = cluster * sizeof(uint16_t);
-        } else if (fat_type(disk) == 32) {
-            fat_byte_offset = cluster * sizeof(uint32_t);
-        } else {
-            DIE("bug");
+    disk->free_extents = (typeof(disk->free_extents))
+                    myzalloc(max_extents * sizeof(fat_extent_t), __FUNCTION__);
+
+    extent = 0;
+
+    for (cluster = 2; cluster < total_clusters(disk); cluster++) {
+        disk->stats.cluster_alloc_scanned++;
+
+        if (cluster_next_raw(disk, cluster)) {
+            extent = 0;
+            continue;
         }
 
-        /*
-         * Only look at the first FAT. I think this is ok. The others are
-         * backups.
-         */
-        fat = disk->fat;
+        if (extent) {
+            extent->count++;
+            continue;
+        }
 
-        fat_byte_offset = fat_byte_offset % fat_size_bytes(disk);
+        if (disk->number_of_free_extents == max_extents) {
+            max_extents *= 2;
+            disk->free_extents = (typeof(disk->free_extents))
+                    myrealloc(disk->free_extents,
+                              max_extents * sizeof(fat_extent_t),
+                              __FUNCTION__);
+        }
 
-        /*
-         * Find the cluster in this next array index.
-         */
-        if (fat_type(disk) == 12) {
-            cluster_next = *(uint16_t*) (fat + fat_byte_offset);
+        extent = &disk->free_extents[disk->number_of_free_extents++];
+        extent->logical = 0;
+        extent->cluster = cluster;
+        extent->count = 1;
+    }
+}
 
-            if (cluster & 0x0001) {
-                cluster_next = cluster_next >> 4;
-            } else {
-                cluster_next = cluster_next & 0x0FFF;
-            }
+/*
+ * fat_used_extents
+ *
+ * Runs of clusters in use, in cluster order: the gaps between the free
+ * runs. Free with myfree.
+ */
+fat_extent_t *fat_used_extents (disk_t *disk, uint32_t *number_of_extents)
+{
+    fat_extent_t *extents;
+    fat_extent_t *extent;
+    uint32_t cluster = 2;
+    uint32_t n = 0;
+    uint32_t i;
 
-        } else if (fat_type(disk) == 16) {
-            cluster_next = *(uint16_t*) (fat + fat_byte_offset);
-        } else if (fat_type(disk) == 32) {
-            cluster_next = (*((uint32_t*)
-                              (fat + fat_byte_offset))) & 0x0FFFFFFF;
+    fat_free_extents_build(disk);
+
+    extents = (typeof(extents))
+                    myzalloc((disk->number_of_free_extents + 1) *
+                             sizeof(fat_extent_t), __FUNCTION__);
+
+    for (i = 0; i <= disk->number_of_free_extents; i++) {
+        uint32_t end;
+
+        if (i < disk->number_of_free_extents) {
+            end = disk->free_extents[i].cluster;
         } else {
-            DIE("bug");
+            end = total_clusters(disk);
         }
 
-        if (!cluster_next) {
-#ifdef FAT_WRITE_EMPTY_CLUSTERS_ON_ALLOC
-            /*
-             * This is too slow for file importing. It is needed when making
-             * writing unless paranoid about removing old info.
-             */
-            uint8_t *tmp;
+        if (end > cluster) {
+            extent = &extents[n++];
+            extent->logical = 0;
+            extent->cluster = cluster;
+            extent->count = end - cluster;
+        }
 
-            tmp = myzalloc(cluster_size(disk), __FUNCTION__);
+        if (i < disk->number_of_free_extents) {
+            cluster = end + disk->free_extents[i].count;
+        }
+    }
 
-            cluster_write(disk, cluster - 2, tmp, 1);
+    *number_of_extents = n;
 
-            myfree(tmp);
-#endif
-            DBG2("Allocated cluster %" PRIu32, cluster);
+    return (extents);
+}
 
-            /*
-             * Next time, search from this cluster onwards, for speed.
-             */
-            last_cluster = cluster;
+/*
+ * fat_free_extent_take
+ *
+ * Take count clusters off the front of a free run.
+ */
+static void fat_free_extent_take (disk_t *disk, uint32_t index,
+                                  uint32_t count)
+{
+    fat_extent_t *extent = &disk->free_extents[index];
+
+    extent->cluster += count;
+    extent->count -= count;
+
+    if (extent->count) {
+        return;
+    }
+
+    disk->number_of_free_extents--;
+
+    memmove(extent, extent + 1,
+            (disk->number_of_free_extents - index) * sizeof(fat_extent_t));
+}
+
+/*
+ * fat_free_extent_best_fit
+ *
+ * Index of the smallest free run that holds count clusters, or the number
+ * of runs if none does. If none does, total is all the free clusters.
+ */
+static uint32_t fat_free_extent_best_fit (disk_t *disk, uint32_t count,
+                                          uint64_t *total)
+{
+    uint32_t best;
+    uint32_t i;
+
+    fat_free_extents_build(disk);
+
+    best = disk->number_of_free_extents;
+    *total = 0;
+
+    for (i = 0; i < disk->number_of_free_extents; i++) {
+        fat_extent_t *extent = &disk->free_extents[i];
 
-            return (cluster);
+        *total += extent->count;
+
+        if (extent->count < count) {
+            continue;
+        }
+
+        if ((best == disk->number_of_free_extents) ||
+            (extent->count < disk->free_extents[best].count)) {
+            best = i;
+
+            if (extent->count == count) {
+                break;
+            }
         }
     }
 
+    return (best);
+}
+
+static int fat_extent_cmp_largest (const void *a, const void *b)
+{
+    const fat_extent_t *ea = (const fat_extent_t *) a;
+    const fat_extent_t *eb = (const fat_extent_t *) b;
+
+    if (ea->count != eb->count) {
+        return ((ea->count > eb->count) ? -1 : 1);
+    }
+
+    return ((ea->cluster < eb->cluster) ? -1 : 1);
+}
+
+static int fat_extent_cmp_cluster (const void *a, const void *b)
+{
+    const fat_extent_t *ea = (const fat_extent_t *) a;
+    const fat_extent_t *eb = (const fat_extent_t *) b;
+
+    return ((ea->cluster < eb->cluster) ? -1 : 1);
+}
+
+/*
+ * cluster_alloc_extents
+ *
+ * Find room for count clusters. Best fit: the smallest free run that holds
+ * them all. Failing that, the fewest, largest runs, returned in disk order.
+ * The clusters are only taken from the free index; the caller chains them
+ * in the FAT. Returns how many extents were filled in, 0 if out of space.
+ */
+static uint32_t cluster_alloc_extents (disk_t *disk, uint32_t count,
+                                       fat_extent_t *out)
+{
+    fat_extent_t *by_size;
+    uint64_t total;
+    uint32_t best;
+    uint32_t need;
+    uint32_t n;
+    uint32_t i;
+
+    disk->stats.cluster_allocs++;
+
     /*
-     * Out of clusters? Retry once.
+     * Freed clusters may be handed out and written to at once; the image
+     * must stop pointing at them first.
      */
-    if (last_cluster > 2) {
-        last_cluster = 2;
-        goto redo;
+    if (disk->freed_unflushed) {
+        fat_write(disk);
+        disk_flush(disk);
     }
 
-    ERR("Out of clusters, total clusters on disk, %u, "
-        "data sectors %" PRIu64 ", "
-        "sectors per cluster %u",
-        total_clusters(disk),
-        sector_count_data(disk),
-        disk->mbr->sectors_per_cluster);
+    best = fat_free_extent_best_fit(disk, count, &total);
 
-    return (0);
+    if (best < disk->number_of_free_extents) {
+        out[0].logical = 0;
+        out[0].cluster = disk->free_extents[best].cluster;
+        out[0].count = count;
+
+        fat_free_extent_take(disk, best, count);
+
+        DBG2("Allocated %" PRIu32 " clusters at %" PRIu32, count,
+             out[0].cluster);
+
+        return (1);
+    }
+
+    if (total < count) {
+        ERR("Out of clusters, total clusters on disk, %u, "
+            "data sectors %" PRIu64 ", "
+            "sectors per cluster %u",
+            total_clusters(disk),
+            sector_count_data(disk),
+            disk->mbr->sectors_per_cluster);
+
+        return (0);
+    }
+
+    /*
+     * Nothing big enough. Take the largest runs first so the file is in as
+     * few pieces as possible.
+     */
+    by_size = (typeof(by_size))
+                    myzalloc(disk->number_of_free_extents * sizeof(fat_extent_t),
+                             __FUNCTION__);
+
+    memcpy(by_size, disk->free_extents,
+           disk->number_of_free_extents * sizeof(fat_extent_t));
+
+    qsort(by_size, disk->number_of_free_extents, sizeof(fat_extent_t),
+          fat_extent_cmp_largest);
+
+    need = count;
+
+    for (n = 0; need; n++) {
+        out[n] = by_size[n];
+
+        if (out[n].count > need) {
+            out[n].count = need;
+        }
+
+        need -= out[n].count;
+    }
+
+    myfree(by_size);
+
+    qsort(out, n, sizeof(fat_extent_t), fat_extent_cmp_cluster);
+
+    /*
+     * Take them out of the free index, which is in cluster order too.
+     */
+    total = 0;
+
+    for (i = 0; i < n; i++) {
+        uint32_t j;
+
+        out[i].logical = (uint32_t) total;
+        total += out[i].count;
+
+        for (j = 0; j < disk->number_of_free_extents; j++) {
+            if (disk->free_extents[j].cluster == out[i].cluster) {
+                fat_free_extent_take(disk, j, out[i].count);
+                break;
+            }
+        }
+    }
+
+    DBG2("Allocated %" PRIu32 " clusters in %" PRIu32 " extents", count, n);
+
+    return (n);
+}
+
+/*
+ * cluster_alloc
+ *
+ * Find a free cluster.
+ */
+static uint32_t cluster_alloc (disk_t *disk)
+{
+    fat_extent_t extent;
+
+    if (!cluster_alloc_extents(disk, 1, &extent)) {
+        return (0);
+    }
+
+#ifdef FAT_WRITE_EMPTY_CLUSTERS_ON_ALLOC
+    /*
+     * This is too slow for file importing. It is needed when making
+     * writing unless paranoid about removing old info.
+     */
+    uint8_t *tmp;
+
+    tmp = myzalloc(cluster_size(disk), __FUNCTION__);
+
+    cluster_write(disk, extent.cluster - 2, tmp, 1);
+
+    myfree(tmp);
+#endif
+
+    return (extent.cluster);
 }
 
 /*
@@ -596,9 +844,20 @@ void fat_read (disk_t *disk)
     DBG2("Read FAT, %" PRIu64 " sectors...",
          sector_reserved_count(disk) * fat_size_sectors(disk));
 
+    uint64_t start = opt_stats ? time_now_ns() : 0;
+
+    TRACE_BEGIN("fat_read", 0);
+
     disk->fat = sector_read(disk,
                             sector_reserved_count(disk),
                             fat_size_sectors(disk));
+
+    TRACE_END("fat_read");
+
+    if (opt_stats) {
+        disk->stats.phase_ns[DISK_PHASE_FAT_READ] += time_now_ns() - start;
+    }
+
     if (!disk->fat) {
         ERR("Cannot read fat at sector %" PRIu32 "", 
             sector_reserved_count(disk));
@@ -615,7 +874,12 @@ void fat_write (disk_t *disk)
 {
     uint32_t sector;
     uint32_t sectors;
+    uint32_t size;
+    uint8_t *cached;
     uint8_t *data;
+    uint32_t copy;
+    uint32_t i;
+    uint32_t j;
 
     data = (uint8_t*) disk->fat;
     if (!data) {
@@ -630,8 +894,43 @@ void fat_write (disk_t *disk)
 
     sector_pre_write_print_dirty_sectors(disk, sector, data, sectors);
 
-    if (!sector_write(disk, sector, data, sectors)) {
-        DIE("cannot write FAT at sector %" PRIu32 "", sector);
+    uint64_t start = opt_stats ? time_now_ns() : 0;
+
+    size = sector_size(disk);
+
+    /*
+     * Runs of changed sectors go to every copy of the FAT, to be written
+     * together by disk_flush. A backup that differs elsewhere is left as
+     * it is for check to find.
+     */
+    for (i = 0; i < sectors; i = j) {
+        for (j = i; j < sectors; j++) {
+            cached = sector_cache_find(disk, sector + j);
+            if (cached && !memcmp(cached, data + (j * size), size)) {
+                break;
+            }
+        }
+
+        if (j == i) {
+            j++;
+            continue;
+        }
+
+        if (!sector_write(disk, sector + i, data + (i * size), j - i)) {
+            DIE("cannot write FAT at sector %" PRIu32 "", sector + i);
+        }
+
+        for (copy = 1; copy < disk->mbr->number_of_fats; copy++) {
+            if (!sector_write(disk, sector + (copy * sectors) + i,
+                              data + (i * size), j - i)) {
+                DIE("cannot write FAT %" PRIu32 " at sector %" PRIu32 "",
+                    copy, sector + (copy * sectors) + i);
+            }
+        }
+    }
+
+    if (opt_stats) {
+        disk->stats.phase_ns[DISK_PHASE_FAT_WRITE] += time_now_ns() - start;
     }
 }
 
@@ -674,17 +973,12 @@ static uint32_t cluster_max (disk_t *disk)
  */
 static uint32_t cluster_endchain (disk_t *disk, uint32_t cluster)
 {
-    if (fat_type(disk) == 32) {
-        /*
-         * Root cluster sector cannot be a next sector.
-         */
-        if (cluster <= 2) {
-            return (true);
-        }
-    } else {
-        if (cluster < 2) {
-            return (true);
-        }
+    /*
+     * Cluster 2 is the FAT32 root dir after a format, so never a next
+     * cluster, but resize can move the root and reuse it.
+     */
+    if (cluster < 2) {
+        return (true);
     }
 
     if (fat_type(disk) == 12) {
@@ -934,28 +1228,203 @@ static boolean dirent_has_extension (fat_dirent_t *dirent)
 }
 
 /*
- * file_import
+ * dirent_mtime_set
  *
- * Read in the file and create it (or directory). For directories we make
- * the subdir too.
+ * Stamp a dirent as modified at a given time.
  */
-static uint32_t file_import (disk_t *disk,
-                             disk_walk_args_t *args,
-                             fat_dirent_t *dirent,
-                             const char *filename,
-                             uint32_t parent_cluster,
-                             uint32_t depth)
+static void dirent_mtime_set (fat_dirent_t *dirent, time_t when)
 {
-    char *base = mybasename(filename, __FUNCTION__);
+    struct tm *tm = localtime(&when);
+    struct tm epoch = {0};
+
+    /*
+     * FAT dates start in 1980.
+     */
+    if (tm->tm_year + 1900 < 1980) {
+        epoch.tm_year = 1980 - 1900;
+        epoch.tm_mday = 1;
+        tm = &epoch;
+    }
+
+    dirent->lm_date.year = tm->tm_year + 1900 - 1980;
+    dirent->lm_date.month = tm->tm_mon + 1;
+    dirent->lm_date.day = tm->tm_mday;
+    dirent->lm_time.hour = tm->tm_hour;
+    dirent->lm_time.min = tm->tm_min;
+    dirent->lm_time.sec = tm->tm_sec / 2;
+}
+
+/*
+ * dirent_mtime_now
+ *
+ * Stamp a dirent as modified now.
+ */
+static void dirent_mtime_now (fat_dirent_t *dirent)
+{
+    dirent_mtime_set(dirent, time(0));
+}
+
+/*
+ * dirent_mtime_from_file
+ *
+ * Copy the modify time of a local file into a dirent.
+ */
+static boolean dirent_mtime_from_file (fat_dirent_t *dirent,
+                                       const char *filename)
+{
+    int32_t year;
+    int32_t month;
+    int32_t day;
+    int32_t hour;
+    int32_t min;
+    int32_t sec;
+
+    if (!file_mtime(filename, &day, &month, &year, &hour, &min, &sec)) {
+        return (false);
+    }
+
+    dirent->lm_date.year = year - 1980;
+    dirent->lm_date.month = month;
+    dirent->lm_date.day = day;
+    dirent->lm_time.hour = hour;
+    dirent->lm_time.min = min;
+    dirent->lm_time.sec = sec / 2;
+
+    return (true);
+}
+
+/*
+ * file_import_fd
+ *
+ * Fill the runs of a new file with len bytes read from an fd, a megabyte or
+ * so at a time, zeroing the tail of the last cluster. If the fd runs out
+ * the rest is zeroed too. What was read is added to read, if set.
+ */
+static boolean file_import_fd (disk_t *disk, int fd, uint64_t len,
+                               const char *filename,
+                               fat_extent_t *extents,
+                               uint32_t number_of_extents,
+                               uint64_t *read)
+{
+    uint32_t frag_size = cluster_size(disk);
+    uint32_t clusters_per_chunk = max(1U, ONE_MEG / frag_size);
+    uint64_t chunk_size = (uint64_t) clusters_per_chunk * frag_size;
+    boolean ok = true;
+    uint8_t *buf;
+    uint32_t e;
+
+    buf = (typeof(buf)) mymalloc((uint32_t) chunk_size, __FUNCTION__);
+
+    for (e = 0; e < number_of_extents; e++) {
+        uint32_t done = 0;
+
+        while (done < extents[e].count) {
+            uint32_t n = min(extents[e].count - done, clusters_per_chunk);
+            uint64_t want = min(len, (uint64_t) n * frag_size);
+
+            if (want && ok) {
+                if (!tar_read(fd, buf, want)) {
+                    ERR("Failed to read data for %s", filename);
+                    ok = false;
+                } else if (read) {
+                    *read += want;
+                }
+            }
+
+            if (!ok) {
+                want = 0;
+            }
+
+            memset(buf + want, 0, (uint64_t) n * frag_size - want);
+
+            cluster_write_no_cache(disk, extents[e].cluster + done - 2,
+                                   buf, n);
+
+            len -= min(len, (uint64_t) n * frag_size);
+            done += n;
+        }
+    }
+
+    myfree(buf);
+
+    return (ok);
+}
+
+/*
+ * file_import_data
+ *
+ * Fill the runs of a new file with len bytes from memory, queueing the
+ * writes of all runs together and zeroing the tail of the last cluster.
+ */
+static boolean file_import_data (disk_t *disk, const uint8_t *data,
+                                 uint64_t len, fat_extent_t *extents,
+                                 uint32_t number_of_extents)
+{
+    uint32_t frag_size = cluster_size(disk);
+    uint8_t *cluster_data = 0;
+    uring_write_t *writes;
+    uint64_t offset = 0;
+    boolean ok;
+    uint32_t e;
+
+    writes = (typeof(writes))
+                    myzalloc(sizeof(*writes) * number_of_extents,
+                             __FUNCTION__);
+
+    for (e = 0; e < number_of_extents; e++) {
+        uint64_t block_size = (uint64_t) extents[e].count * frag_size;
+        uint64_t data_size = len - min(len, offset);
+        uint32_t sector = cluster_to_sector(disk, extents[e].cluster - 2);
+
+        writes[e].offset = (uint64_t) sector * sector_size(disk);
+        writes[e].len = block_size;
+
+        if (data_size >= block_size) {
+            writes[e].data = data + offset;
+        } else {
+            cluster_data = (typeof(cluster_data))
+                            myzalloc(block_size, __FUNCTION__);
+
+            memcpy(cluster_data, data + offset, data_size);
+
+            writes[e].data = cluster_data;
+        }
+
+        sector_cache_update(disk, sector,
+                            extents[e].count * disk->mbr->sectors_per_cluster,
+                            writes[e].data);
+
+        offset += block_size;
+    }
+
+    ok = disk_write_batch(disk, writes, number_of_extents);
+
+    myfree(cluster_data);
+    myfree(writes);
+
+    return (ok);
+}
+
+/*
+ * file_import
+ *
+ * Read in the file and create it (or directory). For directories we make
+ * the subdir too.
+ */
+static uint32_t file_import (disk_t *disk,
+                             disk_walk_args_t *args,
+                             fat_dirent_t *dirent,
+                             const char *filename,
+                             uint32_t parent_cluster,
+                             uint32_t depth)
+{
+    char *base = mybasename(filename, __FUNCTION__);
     fat_dirent_t *dirent_in = dirent;
     fat_dirent_long_t *fat_dirent;
     char tmp[MAX_STR] = {0};
     uint32_t cluster;
     uint8_t *data;
     uint32_t count;
-    int32_t year;
-    int32_t day;
-    int32_t month;
 
     count = 0;
 
@@ -1181,17 +1650,33 @@ static uint32_t file_import (disk_t *disk,
     /*
      * Add modify time values.
      */
-    if (file_mtime(args->source, &day, &month, &year)) {
-        dirent->lm_date.year = year - 1980;
-        dirent->lm_date.month = month;
-        dirent->lm_date.day = day;
+    if (args->mtime_set) {
+        dirent_mtime_set(dirent, (time_t) args->mtime);
+    } else if (args->data_set) {
+        dirent_mtime_now(dirent);
+    } else if (!dirent_mtime_from_file(dirent, args->source)) {
+        /*
+         * A dir made on the disk only, like a missing parent, has no local
+         * file to take a time from.
+         */
+        dirent_mtime_now(dirent);
     }
 
+    /*
+     * In memory imports are always files.
+     */
+    boolean is_dir = args->is_intermediate_dir ||
+                     (!args->data_set && !args->data_fd_set &&
+                      dir_exists(args->source));
+
     /*
      * Add dir or file.
      */
-    if (args->is_intermediate_dir || dir_exists(args->source)) {
+    if (is_dir) {
         dirent->attr = FAT_ATTR_IS_DIR;
+    } else if (args->data_set || args->data_fd_set) {
+        dirent->size = (uint32_t) args->data_len;
+        dirent->attr = FAT_ATTR_IS_ARCHIVE | args->attr;
     } else {
         dirent->size = (uint32_t) file_size(args->source);
         dirent->attr = FAT_ATTR_IS_ARCHIVE;
@@ -1200,7 +1685,7 @@ static uint32_t file_import (disk_t *disk,
     /*
      * Are we adding a dir?
      */
-    if (args->is_intermediate_dir || dir_exists(args->source)) {
+    if (is_dir) {
         /*
          * Yes.
          */
@@ -1299,15 +1784,33 @@ static uint32_t file_import (disk_t *disk,
 
         boolean first = true;
         uint32_t last_cluster;
+        struct stat st;
         int64_t len;
+        int fd = -1;
 
         /*
-         * Read the whole file in one go.
+         * Local files are copied by the kernel or read as they are written,
+         * rather than read in whole first.
          */
-        data = file_read(args->source, &len);
-        if (!data) {
-            WARN("Failed to read local %s for placing on disk image", filename);
-            return (0);
+        if (args->data_fd_set) {
+            data = 0;
+            len = (int64_t) args->data_len;
+        } else if (args->data_set) {
+            data = (uint8_t*) args->data;
+            len = args->data_len;
+        } else {
+            data = 0;
+            fd = open(args->source, O_RDONLY);
+            if ((fd < 0) || fstat(fd, &st)) {
+                WARN("Failed to read local %s for placing on disk image",
+                     filename);
+                if (fd >= 0) {
+                    close(fd);
+                }
+                return (0);
+            }
+
+            len = (int64_t) st.st_size;
         }
 
         last_cluster = 0;
@@ -1324,177 +1827,104 @@ static uint32_t file_import (disk_t *disk,
         }
 
         /*
-         * An array of clusters we allocate and how much data is in each.
-         * Only the last will be less than the cluster size.
+         * Find room for the whole file up front, in one run if there is a
+         * free run that fits, so it goes out in one write and reads back
+         * in one read.
          */
-        uint32_t *cluster_array =
-                    (typeof(cluster_array))
-                    myzalloc(sizeof(uint32_t) * cluster_count, __FUNCTION__);
+        fat_extent_t *extents =
+                    (typeof(extents))
+                    myzalloc(sizeof(fat_extent_t) * cluster_count,
+                             __FUNCTION__);
 
-        uint32_t *cluster_len =
-                    (typeof(cluster_len))
-                    myzalloc(sizeof(uint32_t) * cluster_count, __FUNCTION__);
+        uint32_t number_of_extents =
+                    cluster_alloc_extents(disk, cluster_count, extents);
 
-        uint32_t c = 0;
+        if (!number_of_extents) {
+            DIE("Out of clusters/disk space when adding file %s", filename);
+        }
 
         /*
-         * Allocate all clusters in one go so we can find out the contiguous 
-         * clusters. Don't write to the disk yet.
+         * Chain the clusters. Don't write to the disk yet.
          */
-        while (len >= 0) {
-            cluster_array[c] = cluster = cluster_alloc(disk);
-            if (!cluster) {
-                DIE("Out of clusters/disk space when adding file %s", filename);
-            }
+        uint32_t e;
 
-            if (last_cluster) {
-                cluster_next_set(disk, last_cluster, cluster,
-                                 false /* update FAT */);
-            }
+        for (e = 0; e < number_of_extents; e++) {
+            uint32_t i;
 
-            /*
-             * This line may seem not needed but is to prevent cluster alloc
-             * returning this cluster again.
-             */
-            cluster_next_set(disk, cluster, cluster_max(disk),
-                             false /* update FAT */);
+            for (i = 0; i < extents[e].count; i++) {
+                cluster = extents[e].cluster + i;
 
-            /*
-             * Point the file at its first cluster.
-             */
-            if (first) {
-                first = false;
-                dirent->h_first_cluster = (cluster & 0xffff0000) >> 16;
-                dirent->l_first_cluster = (cluster & 0x0000ffff);
-            } else {
-                if (!last_cluster) {
-                    DIE("bug, no last cluster");
+                if (last_cluster) {
+                    cluster_next_set(disk, last_cluster, cluster,
+                                     false /* update FAT */);
                 }
-            }
-
-            /*
-             * Save the size of the data in this cluster. Normally this is a 
-             * full cluster except for the last fragment. Could do this 
-             * better. Lazy, but simple.
-             */
-            if (len < cluster_size(disk)) {
-                cluster_len[c] = len;
-            } else {
-                cluster_len[c] = cluster_size(disk);
-            }
 
-            len -= cluster_len[c++];
-
-            /*
-             * Record the cluster chain.
-             */
-            last_cluster = cluster;
+                /*
+                 * Point the file at its first cluster.
+                 */
+                if (first) {
+                    first = false;
+                    dirent->h_first_cluster = (cluster & 0xffff0000) >> 16;
+                    dirent->l_first_cluster = (cluster & 0x0000ffff);
+                }
 
-            if (!len) {
-                break;
+                last_cluster = cluster;
             }
         }
 
+        cluster_next_set(disk, last_cluster, cluster_max(disk),
+                         false /* update FAT */);
+
         /*
-         * Write contiguous cluster blocks of file data now. This should be 
-         * quite fast.
+         * Streamed data goes out as it is read.
          */
-        uint32_t frag_size = cluster_size(disk);
-        uint32_t block_size = 0;
-        uint32_t data_size = 0;
-        uint32_t frag_count = 0;
-        int32_t cluster_start = -1;
-        int32_t cluster_end = -1;
-
-        for (c = 0; c < cluster_count; c++) {
-
-            cluster = cluster_array[c];
-            if (!cluster) {
-                DIE("no cluster allocated when adding file %s", filename);
-            }
+        if (args->data_fd_set) {
+            file_import_fd(disk, args->data_fd, (uint64_t) len, filename,
+                           extents, number_of_extents, args->data_fd_read);
+        }
 
-            if (c < cluster_count - 1) {
-                /*
-                 * If the next cluster is contigious, tack it onto the block.
-                 */
-                if (cluster + 1 == cluster_array[c + 1]) {
-                    if (cluster_start == -1) {
-                        cluster_start = c;
+        /*
+         * A local file goes an extent at a time by kernel copy; from the
+         * first extent it cannot do, the rest is read and written here.
+         */
+        if (fd >= 0) {
+            uint64_t at = 0;
+
+            for (e = 0; e < number_of_extents; e++) {
+                uint64_t block_size =
+                    (uint64_t) extents[e].count * cluster_size(disk);
+                uint64_t want = min((uint64_t) len - at, block_size);
+
+                if (!cluster_copy_in(disk, extents[e].cluster - 2,
+                                     extents[e].count, fd, at, want)) {
+                    if (lseek(fd, (off_t) at, SEEK_SET) < 0) {
+                        WARN("Failed to read local %s for placing on "
+                             "disk image", filename);
                     }
 
-                    cluster_end = c;
-                    frag_count++;
-                    continue;
+                    file_import_fd(disk, fd, (uint64_t) len - at, filename,
+                                   extents + e, number_of_extents - e, 0);
+                    break;
                 }
-            }
-
-            /*
-             * Write x contiguous clusters of data.
-             */
-            if (!frag_count) {
-                continue;
-            }
-
-            block_size = 0;
-            data_size = 0;
-
-            /*
-             * Clean out those clusters so they will not be looked at later.
-             */
-            int32_t i;
 
-            cluster = cluster_array[cluster_start];
-
-            for (i = cluster_start; i <= cluster_end; i++) {
-                block_size += frag_size;
-                data_size += cluster_len[i];
-                cluster_array[i] = 0;
-                cluster_len[i] = 0;
+                at += want;
             }
 
-            /*
-             * Write the block of data.
-             */
-            uint8_t *cluster_data =
-                (typeof(cluster_data)) myzalloc(block_size, __FUNCTION__);
-
-            memset(cluster_data, 0, block_size);
-            memcpy(cluster_data, data + cluster_start * frag_size, data_size);
-
-            cluster_write_no_cache(disk, cluster - 2, cluster_data, frag_count);
-
-            myfree(cluster_data);
-
-            frag_count = 0;
-            cluster_start = -1;
-            cluster_end = -1;
+            close(fd);
         }
 
         /*
-         * Write remaining non contigious clusters. Slow.
+         * Write each extent of file data in one go, and all the extents in
+         * one batch. Whole extents go straight from the file data; only the
+         * one holding the end of the file is copied to pad out its last
+         * cluster.
          */
-        for (c = 0; c < cluster_count; c++) {
-            cluster = cluster_array[c];
-            if (!cluster) {
-                continue;
-            }
-
-            uint32_t data_size = cluster_len[c];
-            uint32_t frag_size = cluster_size(disk);
-
-            uint8_t *cluster_data = 
-                (typeof(cluster_data)) myzalloc(frag_size, __FUNCTION__);
-
-            memcpy(cluster_data, data + c * frag_size, data_size);
-
-            cluster_write_no_cache(disk, cluster - 2, cluster_data, 1);
-
-            myfree(cluster_data);
+        if (data) {
+            file_import_data(disk, data, (uint64_t) len, extents,
+                             number_of_extents);
         }
 
-        myfree(cluster_array);
-        myfree(cluster_len);
-        myfree(data);
+        myfree(extents);
 
         count++;
     }
@@ -1571,14 +2001,15 @@ static boolean dirent_entry_exists (disk_t *disk,
                           vfat_filename);
         }
 
+        /*
+         * The name being added is literal, never a wildcard.
+         */
         boolean matched;
 
         if (*vfat_filename) {
-            matched = dos_file_match(find, vfat_full_path_name,
-                                     dirent_is_dir(dirent));
+            matched = dos_path_match_exact(find, vfat_full_path_name, false);
         } else {
-            matched = dos_file_match(find, dos_full_path_name,
-                                     dirent_is_dir(dirent));
+            matched = dos_path_match_exact(find, dos_full_path_name, false);
         }
 
         vfat_filename[0] = '\0';
@@ -1688,13 +2119,24 @@ static dirent_t *dirents_alloc (disk_t *disk, uint32_t cluster)
     uint32_t next_cluster;
     uint32_t sector;
     uint32_t sectors;
-    uint8_t *sectordata;
+    sector_view_t view;
     uint32_t datalen;
     uint8_t *data;
     dirent_t *d;
 
-    d = (typeof(d)) myzalloc(sizeof(*d), __FUNCTION__);
+    /*
+     * The header is large but only the chain counts need clearing; the
+     * sector arrays are filled as far as they are used.
+     */
+    if (!disk->dirent_slab.obj_size) {
+        slab_init(&disk->dirent_slab, sizeof(*d), 8);
+    }
+
+    d = (typeof(d)) slab_alloc(&disk->dirent_slab);
     d->cluster = cluster;
+    d->number_of_chains = 0;
+    d->number_of_dirents = 0;
+    d->modified = false;
 
     /*
      * Allocate the contiguous block.
@@ -1746,18 +2188,18 @@ static dirent_t *dirents_alloc (disk_t *disk, uint32_t cluster)
         d->number_of_dirents += datalen / FAT_DIRENT_SIZE;
         d->number_of_chains++;
 
-        sectordata = sector_read(disk, sector, sectors);
-        if (!sectordata) {
+        if (!sector_view(disk, sector, sectors, &view)) {
             DIE("Failed to read sectors whilst reading block of dirents");
         }
 
         /*
-         * Copy into the contiguous block.
+         * Copy into the contiguous block; the only copy, as dirents are
+         * changed in place.
          */
-        memcpy(data, sectordata, datalen);
+        memcpy(data, view.data, datalen);
         data += datalen;
 
-        myfree(sectordata);
+        sector_view_release(disk, &view);
 
         next_cluster = cluster_next(disk, cluster);
 
@@ -1820,7 +2262,7 @@ static void dirents_free (disk_t *disk, dirent_t *d)
 {
     dirents_write(disk, d);
     myfree(d->dirents);
-    myfree(d);
+    slab_free(&disk->dirent_slab, d);
 }
 
 /*
@@ -2366,7 +2808,6 @@ static boolean file_extract (disk_t *disk, const char *filename,
                              fat_dirent_t *dirent)
 {
     uint32_t cluster;
-    uint8_t *data;
     mode_t mask = getumask();
     int64_t size;
 
@@ -2394,40 +2835,67 @@ static boolean file_extract (disk_t *disk, const char *filename,
     uint32_t last_ok_cluster = 0;
 
     while (!cluster_endchain(disk, cluster)) {
+        uint32_t next_cluster;
+        sector_view_t view;
+        uint32_t run;
 
         VER("Extract cluster %" PRIu32 " (%s) to disk image",
             cluster, filename);
 
-        data = cluster_read(disk, cluster - 2, 1);
-        if (!data) {
-            ERR("Failed to read cluster %" PRIu32 " for file %s",
-                cluster, filename);
+        /*
+         * Files laid out contiguously come back in one read per run.
+         */
+        run = 1;
+        next_cluster = cluster_next(disk, cluster);
 
-            close(fd);
-            return (false);
+        while ((next_cluster == cluster + run) &&
+               ((int64_t) run * cluster_size(disk) < size)) {
+            run++;
+            next_cluster = cluster_next(disk, next_cluster);
         }
 
         /*
-         * Write this cluster to the real disk.
+         * Let the kernel copy the run if it can, else write these clusters
+         * to the real disk. Either way by offset, as the kernel copy does
+         * not move the file position.
          */
-        if (write(fd, data, min(size, cluster_size(disk))) < 0) {
-            DIE("Failed to write cluster %" PRIu32 " for file %s: %s",
-                cluster, filename,
-                strerror(errno));
+        int64_t want = min(size, (int64_t) run * cluster_size(disk));
+        int64_t at = (int64_t) dirent->size - size;
+
+        if ((want > 0) &&
+            !cluster_copy_out(disk, cluster - 2, fd, (uint64_t) at,
+                              (uint64_t) want)) {
+            if (!sector_view(disk,
+                             sector_first_data_sector(disk) +
+                                ((cluster - 2) *
+                                 disk->mbr->sectors_per_cluster),
+                             run * disk->mbr->sectors_per_cluster, &view)) {
+                ERR("Failed to read cluster %" PRIu32 " for file %s",
+                    cluster, filename);
+
+                close(fd);
+                return (false);
+            }
 
-            close(fd);
-            return (false);
-        }
+            if (pwrite(fd, view.data, want, at) < 0) {
+                DIE("Failed to write cluster %" PRIu32 " for file %s: %s",
+                    cluster, filename,
+                    strerror(errno));
 
-        size -= cluster_size(disk);
+                close(fd);
+                return (false);
+            }
 
-        myfree(data);
+            sector_view_release(disk, &view);
+        }
+
+        size -= (int64_t) run * cluster_size(disk);
 
         DBG5("Finished cluster %" PRIu32 " (%08X)", cluster, cluster);
 
-        last_ok_cluster = cluster;
+        last_ok_cluster = cluster + run - 1;
 
-        cluster = cluster_next(disk, cluster);
+        cluster = next_cluster;
 
         DBG5("Next     cluster %" PRIu32 " (%08X)", cluster, cluster);
 
@@ -2492,6 +2960,145 @@ static boolean file_extract (disk_t *disk, const char *filename,
     return (true);
 }
 
+/*
+ * dirent_mtime
+ *
+ * The modify time of a dirent, taken as local time as FAT has no zone. A
+ * zero or bad date, as left by tools that never set one, is taken as the
+ * start of 1 Jan 1980 rather than letting mktime roll it back into 1979.
+ */
+static time_t dirent_mtime (fat_dirent_t *dirent)
+{
+    struct tm tm = {0};
+
+    tm.tm_year = dirent->lm_date.year + 1980 - 1900;
+    tm.tm_mon = dirent->lm_date.month - 1;
+    tm.tm_mday = dirent->lm_date.day;
+    tm.tm_hour = dirent->lm_time.hour;
+    tm.tm_min = dirent->lm_time.min;
+    tm.tm_sec = dirent->lm_time.sec * 2;
+    tm.tm_isdst = -1;
+
+    if ((dirent->lm_date.month < 1) || (dirent->lm_date.month > 12) ||
+        (dirent->lm_date.day < 1) ||
+        (dirent->lm_time.hour > 23) || (dirent->lm_time.min > 59) ||
+        (dirent->lm_time.sec > 29)) {
+        tm.tm_year = 1980 - 1900;
+        tm.tm_mon = 0;
+        tm.tm_mday = 1;
+        tm.tm_hour = 0;
+        tm.tm_min = 0;
+        tm.tm_sec = 0;
+    }
+
+    return (mktime(&tm));
+}
+
+/*
+ * file_tar
+ *
+ * Write a file or dir to stdout as a tar entry. File data goes out a run
+ * of clusters at a time, straight from the sector cache or mapped image,
+ * so memory use does not grow with the file.
+ */
+static boolean file_tar (disk_t *disk, const char *filename,
+                         fat_dirent_t *dirent)
+{
+    uint32_t clusters_per_run = max(1U, ONE_MEG / cluster_size(disk));
+    uint32_t attr = dirent->attr & (FAT_ATTR_IS_HIDDEN | FAT_ATTR_IS_SYSTEM);
+    uint32_t mode;
+    uint32_t cluster;
+    int64_t size;
+    char type;
+
+    if (dirent_is_dir(dirent)) {
+        type = TAR_TYPE_DIR;
+        mode = 0755;
+        size = 0;
+    } else {
+        type = TAR_TYPE_FILE;
+        mode = 0644;
+        size = dirent->size;
+    }
+
+    if (dirent->attr & FAT_ATTR_IS_READ_ONLY) {
+        mode &= ~0222U;
+    }
+
+    if (!tar_write_header(1, filename, type, mode, (uint64_t) size,
+                          dirent_mtime(dirent), attr)) {
+        return (false);
+    }
+
+    if (type == TAR_TYPE_DIR) {
+        return (true);
+    }
+
+    cluster = dirent_first_cluster(dirent);
+
+    while ((size > 0) && !cluster_endchain(disk, cluster)) {
+        uint32_t next_cluster;
+        sector_view_t view;
+        uint32_t run;
+        boolean ok;
+
+        run = 1;
+        next_cluster = cluster_next(disk, cluster);
+
+        while ((next_cluster == cluster + run) &&
+               (run < clusters_per_run) &&
+               ((int64_t) run * cluster_size(disk) < size)) {
+            run++;
+            next_cluster = cluster_next(disk, next_cluster);
+        }
+
+        if (!sector_view(disk,
+                         sector_first_data_sector(disk) +
+                            ((cluster - 2) * disk->mbr->sectors_per_cluster),
+                         run * disk->mbr->sectors_per_cluster, &view)) {
+            ERR("Failed to read cluster %" PRIu32 " for file %s",
+                cluster, filename);
+            break;
+        }
+
+        ok = tar_write(1, view.data,
+                       (uint64_t) min(size,
+                                      (int64_t) run * cluster_size(disk)));
+
+        sector_view_release(disk, &view);
+
+        if (!ok) {
+            return (false);
+        }
+
+        size -= (int64_t) run * cluster_size(disk);
+
+        cluster = next_cluster;
+    }
+
+    /*
+     * The header promised the full size, so a short chain is made up with
+     * zeros to keep the archive readable.
+     */
+    if (size > 0) {
+        ERR("Premature end of file %s, %" PRId64 " bytes missing",
+            filename, size);
+
+        while (size > 0) {
+            static const uint8_t zero[TAR_BLOCK_SIZE];
+            uint64_t chunk = min((uint64_t) size, (uint64_t) TAR_BLOCK_SIZE);
+
+            if (!tar_write(1, zero, chunk)) {
+                return (false);
+            }
+
+            size -= (int64_t) chunk;
+        }
+    }
+
+    return (tar_write_pad(1, dirent->size));
+}
+
 /*
  * dir_extract
  *
@@ -2572,7 +3179,15 @@ static boolean dirent_remove (disk_t *disk,
         }
     }
 
-    cluster = dirent_first_cluster(dirent);
+    /*
+     * . and .. only point at this dir and its parent; freeing their chains
+     * would free the parent out from under it.
+     */
+    if (!strcmp(vfat_or_dos_name, ".") || !strcmp(vfat_or_dos_name, "..")) {
+        cluster = 0;
+    } else {
+        cluster = dirent_first_cluster(dirent);
+    }
 
     while (!cluster_endchain(disk, cluster)) {
         /*
@@ -2867,10 +3482,298 @@ boolean dos_dir_is_subset_of_dir (const char *a, const char *b)
 }
 
 /*
- * The main directory walker. Walk dirs, creatig, printing, deleting files...
+ * dos_path_match_exact
+ *
+ * Compare a literal path with a full path name one name at a time,
+ * ignoring case and leading or trailing slashes. If prefix is set, the
+ * name need only match the leading components of the path.
  */
-static uint32_t disk_walk_ (disk_t *disk,
-                            const char *filter,
+static boolean dos_path_match_exact (const char *path,
+                                     const char *name,
+                                     boolean prefix)
+{
+    size_t path_len;
+    size_t name_len;
+
+    if (!path) {
+        return (true);
+    }
+
+    for (;;) {
+        while (*path == '/') {
+            path++;
+        }
+
+        while (*name == '/') {
+            name++;
+        }
+
+        if (!*name) {
+            return (prefix || !*path);
+        }
+
+        path_len = strcspn(path, "/");
+        name_len = strcspn(name, "/");
+
+        if ((path_len != name_len) || strncasecmp(path, name, name_len)) {
+            return (false);
+        }
+
+        path += path_len;
+        name += name_len;
+    }
+}
+
+/*
+ * file_chain_resize
+ *
+ * Grow or shrink a file's cluster chain in place to hold size bytes,
+ * keeping the clusters it already has.
+ */
+static boolean file_chain_resize (disk_t *disk,
+                                  fat_dirent_t *dirent,
+                                  uint64_t size)
+{
+    uint32_t want;
+    uint32_t have;
+    uint32_t cluster;
+    uint32_t last_cluster;
+    uint32_t next_cluster;
+
+    want = (uint32_t) ((size + cluster_size(disk) - 1) / cluster_size(disk));
+
+    /*
+     * Keep the clusters we want, remembering the last one kept.
+     */
+    have = 0;
+    last_cluster = 0;
+    cluster = dirent_first_cluster(dirent);
+
+    while (!cluster_endchain(disk, cluster) && (have < want)) {
+        last_cluster = cluster;
+        cluster = cluster_next(disk, cluster);
+        have++;
+    }
+
+    /*
+     * Free any clusters beyond the new end of file.
+     */
+    if (!cluster_endchain(disk, cluster)) {
+        if (last_cluster) {
+            cluster_next_set(disk, last_cluster, cluster_max(disk),
+                             false /* update FAT */);
+        } else {
+            dirent->h_first_cluster = 0;
+            dirent->l_first_cluster = 0;
+        }
+
+        while (!cluster_endchain(disk, cluster)) {
+            next_cluster = cluster_next(disk, cluster);
+            cluster_next_set(disk, cluster, 0, false /* update FAT */);
+            cluster = next_cluster;
+        }
+
+        return (true);
+    }
+
+    /*
+     * Or tack new clusters onto the end.
+     */
+    while (have < want) {
+        cluster = cluster_alloc(disk);
+        if (!cluster) {
+            ERR("Out of clusters/disk space growing file to %" PRIu64
+                " bytes", size);
+            return (false);
+        }
+
+        cluster_next_set(disk, cluster, cluster_max(disk),
+                         false /* update FAT */);
+
+        if (last_cluster) {
+            cluster_next_set(disk, last_cluster, cluster,
+                             false /* update FAT */);
+        } else {
+            dirent->h_first_cluster = (cluster & 0xffff0000) >> 16;
+            dirent->l_first_cluster = (cluster & 0x0000ffff);
+        }
+
+        last_cluster = cluster;
+        have++;
+    }
+
+    return (true);
+}
+
+/*
+ * file_write_range
+ *
+ * Write bytes into a file's existing clusters. Whole sectors are written
+ * straight out; partial sectors at either end are read first.
+ */
+static boolean file_write_range (disk_t *disk,
+                                 fat_dirent_t *dirent,
+                                 uint64_t offset,
+                                 const uint8_t *buf,
+                                 uint64_t len)
+{
+    uint32_t sector_sz = sector_size(disk);
+    uint32_t cluster_sz = cluster_size(disk);
+    fat_extent_map_t *map;
+    fat_extent_t *extent;
+    uint64_t done;
+    uint64_t pos;
+    uint32_t i;
+
+    map = fat_extent_map_get(disk, dirent_first_cluster(dirent));
+
+    done = 0;
+
+    while (done < len) {
+        pos = offset + done;
+
+        extent = fat_extent_find(map, (uint32_t) (pos / cluster_sz));
+        if (!extent) {
+            ERR("Write beyond end of cluster chain at offset %" PRIu64 "",
+                pos);
+            return (false);
+        }
+
+        uint32_t in_run = (uint32_t) (pos / cluster_sz) - extent->logical;
+        uint64_t run_start = ((uint64_t) extent->logical + in_run) * cluster_sz;
+        uint64_t run_left = ((uint64_t) (extent->count - in_run)) * cluster_sz -
+                            (pos - run_start);
+        uint64_t chunk = min(min(len - done, run_left), (uint64_t) ONE_MEG);
+
+        uint64_t in_cluster = pos - run_start;
+        uint32_t sector = cluster_to_sector(disk,
+                                            extent->cluster + in_run - 2) +
+                          (uint32_t) (in_cluster / sector_sz);
+        uint32_t skip = (uint32_t) (in_cluster % sector_sz);
+        uint32_t count = (uint32_t) ((skip + chunk + sector_sz - 1) /
+                                     sector_sz);
+        uint8_t *data;
+
+        if (skip || ((skip + chunk) % sector_sz)) {
+            /*
+             * Partial sectors, so keep what is around the new bytes.
+             */
+            data = sector_read_no_cache(disk, sector, count);
+        } else {
+            data = (typeof(data)) mymalloc(count * sector_sz, __FUNCTION__);
+        }
+
+        memcpy(data + skip, buf + done, chunk);
+
+        if (!sector_write_no_cache(disk, sector, data, count)) {
+            myfree(data);
+            return (false);
+        }
+
+        /*
+         * Keep any cached copies of these sectors in step.
+         */
+        for (i = 0; i < count; i++) {
+            uint8_t *cached = sector_cache_find(disk, sector + i);
+            if (cached) {
+                memcpy(cached, data + (i * sector_sz), sector_sz);
+            }
+        }
+
+        myfree(data);
+
+        done += chunk;
+    }
+
+    return (true);
+}
+
+/*
+ * file_modify
+ *
+ * Change a file in place: write at an offset, append, truncate or replace
+ * the contents. The existing cluster chain is kept and only grown or shrunk
+ * at the end.
+ */
+static boolean file_modify (disk_t *disk,
+                            fat_dirent_t *dirent,
+                            const char *full_filename,
+                            disk_walk_args_t *args)
+{
+    uint64_t old_size = dirent->size;
+    uint64_t new_size;
+    uint64_t offset;
+
+    if (args->modify_truncate) {
+        offset = args->modify_offset;
+        new_size = args->modify_offset;
+    } else if (args->modify_replace) {
+        offset = 0;
+        new_size = args->data_len;
+    } else {
+        offset = args->modify_append ? old_size : args->modify_offset;
+        new_size = max(old_size, offset + args->data_len);
+    }
+
+    if (new_size > 0xFFFFFFFFULL) {
+        ERR("%s would be too big for FAT at %" PRIu64 " bytes",
+            full_filename, new_size);
+        return (false);
+    }
+
+    if (!file_chain_resize(disk, dirent, new_size)) {
+        return (false);
+    }
+
+    /*
+     * FAT has no holes, so zero anything between the old end of file and
+     * where the new data starts.
+     */
+    if (offset > old_size) {
+        uint8_t *zeros = (typeof(zeros)) myzalloc(ONE_MEG, __FUNCTION__);
+        uint64_t gap = offset - old_size;
+        uint64_t done = 0;
+
+        while (done < gap) {
+            uint64_t chunk = min(gap - done, (uint64_t) ONE_MEG);
+
+            if (!file_write_range(disk, dirent, old_size + done,
+                                  zeros, chunk)) {
+                myfree(zeros);
+                return (false);
+            }
+
+            done += chunk;
+        }
+
+        myfree(zeros);
+    }
+
+    if (!args->modify_truncate && args->data_len) {
+        if (!file_write_range(disk, dirent, offset, args->data,
+                              args->data_len)) {
+            return (false);
+        }
+    }
+
+    dirent->size = (uint32_t) new_size;
+
+    if (!args->source || !dirent_mtime_from_file(dirent, args->source)) {
+        dirent_mtime_now(dirent);
+    }
+
+    if (!opt_quiet) {
+        OUT("%-50s modified, %" PRIu64 " bytes", full_filename, new_size);
+    }
+
+    return (true);
+}
+
+/*
+ * The main directory walker. Walk dirs, creatig, printing, deleting files...
+ */
+static uint32_t disk_walk_ (disk_t *disk,
+                            const char *filter,
                             const char *dir_name,
                             uint32_t cluster,
                             uint32_t parent_cluster,
@@ -2883,6 +3786,7 @@ static uint32_t disk_walk_ (disk_t *disk,
     dirent_t *dirents;
     char *dir_lower_name;
     char *slash_dir_name;
+    arena_mark_t walk_mark;
     uint32_t d;
     uint32_t count;
 
@@ -2916,21 +3820,29 @@ static uint32_t disk_walk_ (disk_t *disk,
         return (false);
     }
 
+    disk->stats.dirs_walked++;
+
     dirent = dirents->dirents;
 
     if (!dir_name) {
         dir_name = "/";
     }
 
+    /*
+     * Names built for this level come from the arena and are all dropped
+     * when we leave it; each dirent's names likewise when we move on.
+     */
+    walk_mark = arena_mark(&disk->arena);
+
     /*
      * Keep a lower case copy of the name for regexp matching.
      */
-    dir_lower_name = duplstr(dir_name, __FUNCTION__);
+    dir_lower_name = arena_duplstr(&disk->arena, dir_name);
 
     if (*dir_name != '/') {
-        slash_dir_name = dynprintf("/%s", dir_name);
+        slash_dir_name = arena_printf(&disk->arena, "/%s", dir_name);
     } else {
-        slash_dir_name = dupstr(dir_name, __FUNCTION__);
+        slash_dir_name = arena_printf(&disk->arena, "%s", dir_name);
     }
 
     /*
@@ -2952,6 +3864,8 @@ static uint32_t disk_walk_ (disk_t *disk,
         dirent = (fat_dirent_t *)
                         (((uint8_t*) dirents->dirents) + (d * FAT_DIRENT_SIZE));
 
+        disk->stats.dirents_walked++;
+
         if (opt_debug3) {
             if (dirent_in_use(disk, dirent, 1)) {
                 hex_dump(dirent, 0, sizeof(*dirent));
@@ -2988,25 +3902,36 @@ static uint32_t disk_walk_ (disk_t *disk,
             found_dot_dot_dir = true;
         }
 
+        arena_mark_t dirent_mark = arena_mark(&disk->arena);
         char *dos_full_path_name;
         char *vfat_full_path_name;
 
         if (dirent_is_dir(dirent)) {
             dos_full_path_name =
-                dynprintf("%s%s/", dir_name ? dir_name : "", vfat_or_dos_name);
+                arena_printf(&disk->arena, "%s%s/",
+                             dir_name ? dir_name : "", vfat_or_dos_name);
             vfat_full_path_name =
-                dynprintf("%s%s/", dir_lower_name ? dir_lower_name : "",
-                          *vfat_filename ? vfat_filename: vfat_or_dos_name);
+                arena_printf(&disk->arena, "%s%s/",
+                             dir_lower_name ? dir_lower_name : "",
+                             *vfat_filename ? vfat_filename: vfat_or_dos_name);
         } else {
             dos_full_path_name =
-                dynprintf("%s%s", dir_name ? dir_name : "", vfat_or_dos_name);
+                arena_printf(&disk->arena, "%s%s",
+                             dir_name ? dir_name : "", vfat_or_dos_name);
             vfat_full_path_name =
-                dynprintf("%s%s", dir_lower_name ? dir_lower_name : "",
-                          vfat_filename);
+                arena_printf(&disk->arena, "%s%s",
+                             dir_lower_name ? dir_lower_name : "",
+                             vfat_filename);
         }
         boolean matched;
 
-        if (*vfat_filename) {
+        if (args->exact) {
+            matched = dos_path_match_exact(filter,
+                                           *vfat_filename ?
+                                               vfat_full_path_name :
+                                               dos_full_path_name,
+                                           false);
+        } else if (*vfat_filename) {
             matched = dos_file_match(filter, vfat_full_path_name,
                                      dirent_is_dir(dirent));
         } else {
@@ -3053,10 +3978,15 @@ static uint32_t disk_walk_ (disk_t *disk,
         }
 
         /*
-         * Cat a file.
+         * Cat a file. Files with no data have nothing to read but still
+         * count.
          */
         if (matched && args->cat) {
-            file_cat(disk, vfat_or_dos_name, dirent);
+            boolean catted = file_cat(disk, vfat_or_dos_name, dirent);
+
+            if (!dirent_is_dir(dirent) && (catted || !dirent->size)) {
+                count++;
+            }
         }
 
         /*
@@ -3069,8 +3999,38 @@ static uint32_t disk_walk_ (disk_t *disk,
             count += dir_extract(disk, dirent, vfat_full_path_name, args);
 
             if (!dirent_is_dir(dirent)) {
+                TRACE_BEGIN("file_extract", output_name);
                 count += file_extract(disk, output_name, dirent);
+                TRACE_END("file_extract");
+            }
+        }
+
+        /*
+         * Write a file or dir to a tar archive.
+         */
+        if (matched && args->tar &&
+            !dos_file_match(vfat_or_dos_name, ".", true) &&
+            !dos_file_match(vfat_or_dos_name, "..", true)) {
+            char *tar_name = *vfat_filename ? vfat_full_path_name :
+                                              dos_full_path_name;
+
+            TRACE_BEGIN("file_tar", tar_name);
+            if (file_tar(disk, tar_name, dirent)) {
+                count++;
+            }
+            TRACE_END("file_tar");
+        }
+
+        /*
+         * Change a file in place.
+         */
+        if (matched && args->modify && !dirent_is_dir(dirent)) {
+            if (file_modify(disk, dirent, output_name, args)) {
+                dirents->modified = true;
+                count++;
             }
+
+            args->stop_walk = true;
         }
 
         if (matched && args->find) {
@@ -3106,7 +4066,11 @@ static uint32_t disk_walk_ (disk_t *disk,
                 boolean enter_subdir = false;
 
                 if (filter) {
-                    if (strisregexp(filter)) {
+                    if (args->exact) {
+                        enter_subdir =
+                            dos_path_match_exact(filter, vfat_full_path_name,
+                                                 true);
+                    } else if (strisregexp(filter)) {
                         enter_subdir = true;
                     } else {
                         enter_subdir =
@@ -3160,8 +4124,7 @@ static uint32_t disk_walk_ (disk_t *disk,
         }
 
         myfree(vfat_or_dos_name);
-        myfree(dos_full_path_name);
-        myfree(vfat_full_path_name);
+        arena_release(&disk->arena, dirent_mark);
 
         vfat_filename[0] = '\0';
 
@@ -3184,14 +4147,13 @@ static uint32_t disk_walk_ (disk_t *disk,
 
         if (args->add) {
             char *add_dir_name =
-                dynprintf("%s/", args->add_dir ? args->add_dir : "");
+                arena_printf(&disk->arena, "%s/",
+                             args->add_dir ? args->add_dir : "");
 
             if (!strcasecmp(add_dir_name, dir_name) ||
                 !strcasecmp(add_dir_name, slash_dir_name)) {
                 add_here = true;
             }
-
-            myfree(add_dir_name);
         }
 
         /*
@@ -3242,7 +4204,9 @@ static uint32_t disk_walk_ (disk_t *disk,
             /*
              * Now add the file to the dirent.
              */
+            TRACE_BEGIN("file_import", filter);
             count += file_import(disk, args, dirent, filter, cluster, depth);
+            TRACE_END("file_import");
 
             dirents->modified = true;
 
@@ -3253,8 +4217,7 @@ static uint32_t disk_walk_ (disk_t *disk,
 cleanup:
     dirents_free(disk, dirents);
 
-    myfree(dir_lower_name);
-    myfree(slash_dir_name);
+    arena_release(&disk->arena, walk_mark);
 
     return (count);
 }
@@ -3275,11 +4238,27 @@ uint32_t disk_walk (disk_t *disk,
     char *filter = filter_ ? filename_cleanup(filter_) : 0;
     char *dir_name = dir_name_ ? filename_cleanup(dir_name_) : 0;
 
+    uint64_t start = 0;
     uint32_t ret;
 
+    /*
+     * Walks can start walks, e.g. to add a dir; only time the outermost.
+     */
+    if (opt_stats && !disk->stats.walk_depth++) {
+        start = time_now_ns();
+    }
+
+    TRACE_BEGIN("walk", (dir_name && *dir_name) ? dir_name : "/");
+
     ret = disk_walk_(disk, filter, dir_name, cluster, parent_cluster,
                      depth, args);
 
+    TRACE_END("walk");
+
+    if (opt_stats && !--disk->stats.walk_depth) {
+        disk->stats.phase_ns[DISK_PHASE_WALK] += time_now_ns() - start;
+    }
+
     if (filter) {
         myfree(filter);
     }
@@ -3456,11 +4435,13 @@ boolean fat_format (disk_t *disk, uint32_t partition, uint32_t os_id)
         }
 
         /*
-         * Very important here to have cluster 2, the root dir not marked
-         * as empty space as we skip it when allocating clusters and we
-         * would end up writing file data onto it instead.
+         * Very important here to have cluster 2, the FAT32 root dir not
+         * marked as empty space as we skip it when allocating clusters and
+         * we would end up writing file data onto it instead. FAT12/16 keep
+         * the root dir out of the data area, so there it is free.
          */
-        if (cluster <= 2) {
+        if ((cluster < 2) ||
+            ((cluster == 2) && (fat_type(disk) == 32))) {
             cluster_next_set(disk, cluster, cluster_max(disk),
                              false /* update FAT */);
         } else {
@@ -3481,13 +4462,31 @@ do_disk_command_add_file_or_dir_in (disk_t *disk,
                                     char *source,
                                     const char *parent_dir,
                                     char *file_or_dir_,
-                                    boolean is_intermediate_dir)
+                                    boolean is_intermediate_dir,
+                                    const disk_walk_args_t *from)
 {
     char *file_or_dir;
     uint32_t count;
 
     disk_walk_args_t args = {0};
+
+    /*
+     * Where the data comes from, if not the source file.
+     */
+    if (from) {
+        args.data = from->data;
+        args.data_len = from->data_len;
+        args.data_set = from->data_set;
+        args.data_fd = from->data_fd;
+        args.data_fd_set = from->data_fd_set;
+        args.data_fd_read = from->data_fd_read;
+        args.mtime = from->mtime;
+        args.mtime_set = from->mtime_set;
+        args.attr = from->attr;
+    }
+
     args.add = true;
+    args.exact = true;
     args.is_intermediate_dir = is_intermediate_dir;
 
     if (!strcmp(parent_dir, ".")) {
@@ -3536,7 +4535,8 @@ static uint32_t
 do_disk_command_add_file_or_dir (disk_t *disk,
                                  char *source,
                                  char *target,
-                                 boolean is_intermediate_dir)
+                                 boolean is_intermediate_dir,
+                                 const disk_walk_args_t *from)
 {
     uint32_t count;
 
@@ -3557,10 +4557,11 @@ do_disk_command_add_file_or_dir (disk_t *disk,
 
     disk_walk_args_t args = {0};
     args.find = true;
+    args.exact = true;
 
     if (disk_walk(disk, target, "", 0, 0, 0, &args)) {
         if (dirent_is_dir(&args.dirent)) {
-            if (dir_exists(target)) {
+            if (is_intermediate_dir || dir_exists(target)) {
                 VER("%s dir exists", target);
                 return (0);
             }
@@ -3571,6 +4572,7 @@ do_disk_command_add_file_or_dir (disk_t *disk,
 
             disk_walk_args_t args = {0};
             args.remove = true;
+            args.exact = true;
             count = disk_walk(disk, target, "", 0, 0, 0, &args);
             if (!count) {
                 ERR("failed to replace %s\n", target);
@@ -3582,13 +4584,49 @@ do_disk_command_add_file_or_dir (disk_t *disk,
     char *tmp = dupstr(target, __FUNCTION__);
 
     count = do_disk_command_add_file_or_dir_in(disk, source, dirname(tmp), 
-                                               target, is_intermediate_dir);
+                                               target, is_intermediate_dir,
+                                               from);
 
     myfree(tmp);
 
     return (count);
 }
 
+/*
+ * disk_add_intermediate_dirs
+ *
+ * Make sure all dirs leading up to a path exist. Any that are made take
+ * the modify time of what is being added, if it has one.
+ */
+static void disk_add_intermediate_dirs (disk_t *disk, char *path,
+                                        const disk_walk_args_t *from)
+{
+    disk_walk_args_t dir_from = {0};
+    char *pp;
+    char *sp;
+
+    if (from) {
+        dir_from.mtime = from->mtime;
+        dir_from.mtime_set = from->mtime_set;
+    }
+
+    pp = path;
+
+    while ((sp = strchr(pp, '/')) != 0) {
+        if (sp != pp) {
+            *sp = '\0';
+
+            do_disk_command_add_file_or_dir(disk, 0, path, 
+                                            true /* is_intermediate_dir */,
+                                            &dir_from);
+
+            *sp = '/';
+        }
+
+        pp = sp + 1;
+    }
+}
+
 /*
  * disk_command_add_file_or_dir
  *
@@ -3603,10 +4641,7 @@ disk_command_add_file_or_dir (disk_t *disk,
     char *source = dupstr(source_file_or_dir, __FUNCTION__);
     char *target = filename_cleanup(target_file_or_dir);
     char *copypath = dupstr(target, __FUNCTION__);
-    boolean status;
     uint32_t count;
-    char *pp;
-    char *sp;
 
     /*
      * If this is a path like ../foo ./foo ~/foo, then just take the name
@@ -3626,30 +4661,2979 @@ disk_command_add_file_or_dir (disk_t *disk,
     /*
      * Make sure all paths exist.
      */
-    status = true;
-    pp = copypath;
+    disk_add_intermediate_dirs(disk, copypath, 0);
 
-    while (status && (sp = strchr(pp, '/')) != 0) {
-        if (sp != pp) {
-            *sp = '\0';
+    myfree(copypath);
 
-            do_disk_command_add_file_or_dir(disk, 0, copypath, 
-                                            true /* is_intermediate_dir */);
+    count = do_disk_command_add_file_or_dir(disk, source, target, 
+                                            false /* is_intermediate_dir */,
+                                            0);
 
-            *sp = '/';
-        }
+    myfree(source);
+    myfree(target);
 
-        pp = sp + 1;
-    }
+    return (count);
+}
 
-    myfree(copypath);
+/*
+ * disk_command_mkdir
+ *
+ * Make a directory and any missing parents.
+ */
+uint32_t disk_command_mkdir (disk_t *disk, const char *target_dir)
+{
+    char *target = filename_cleanup(target_dir);
+    uint32_t count;
 
-    count = do_disk_command_add_file_or_dir(disk, source, target, 
-                                            false /* is_intermediate_dir */);
+    disk_add_intermediate_dirs(disk, target, 0);
 
-    myfree(source);
+    count = do_disk_command_add_file_or_dir(disk, 0, target,
+                                            true /* is_intermediate_dir */,
+                                            0);
+
+    myfree(target);
+
+    return (count);
+}
+
+/*
+ * disk_command_mkdir_mtime
+ *
+ * Make a directory and any missing parents, giving the new dir a modify
+ * time.
+ */
+uint32_t disk_command_mkdir_mtime (disk_t *disk, const char *target_dir,
+                                   int64_t mtime)
+{
+    char *target = filename_cleanup(target_dir);
+    disk_walk_args_t from = {0};
+    uint32_t count;
+    char *tmp;
+
+    from.mtime = mtime;
+    from.mtime_set = true;
+
+    disk_add_intermediate_dirs(disk, target, &from);
+
+    tmp = dupstr(target, __FUNCTION__);
+
+    count = do_disk_command_add_file_or_dir_in(disk, target, dirname(tmp),
+                                               target,
+                                               true /* is_intermediate_dir */,
+                                               &from);
+    myfree(tmp);
     myfree(target);
 
     return (count);
 }
 
+/*
+ * disk_write_file
+ *
+ * Create or replace a file on the disk with data from a buffer or an fd.
+ */
+static uint32_t disk_write_file (disk_t *disk,
+                                 const char *target_file,
+                                 const disk_walk_args_t *from)
+{
+    char *target = filename_cleanup(target_file);
+    disk_walk_args_t args = {0};
+    uint32_t count;
+    char *tmp;
+
+    disk_add_intermediate_dirs(disk, target, from);
+
+    /*
+     * Replace any existing file, but never a dir.
+     */
+    args.find = true;
+    args.exact = true;
+
+    if (disk_walk(disk, target, "", 0, 0, 0, &args)) {
+        if (dirent_is_dir(&args.dirent)) {
+            ERR("cannot write %s, it is a dir", target);
+            myfree(target);
+            return (0);
+        }
+
+        disk->do_not_output_add_and_remove_while_replacing = true;
+
+        memset(&args, 0, sizeof(args));
+        args.remove = true;
+        args.exact = true;
+
+        if (!disk_walk(disk, target, "", 0, 0, 0, &args)) {
+            ERR("failed to replace %s", target);
+            myfree(target);
+            return (0);
+        }
+    }
+
+    tmp = dupstr(target, __FUNCTION__);
+
+    count = do_disk_command_add_file_or_dir_in(disk, target, dirname(tmp),
+                                               target,
+                                               false /* is_intermediate_dir */,
+                                               from);
+    myfree(tmp);
+    myfree(target);
+
+    return (count);
+}
+
+/*
+ * disk_command_write_file
+ *
+ * Create or replace a file on the disk with the contents of a buffer.
+ */
+uint32_t disk_command_write_file (disk_t *disk,
+                                  const char *target_file,
+                                  const uint8_t *data,
+                                  uint64_t len)
+{
+    static const uint8_t empty[1];
+    disk_walk_args_t from = {0};
+
+    from.data = data ? data : empty;
+    from.data_len = len;
+    from.data_set = true;
+
+    return (disk_write_file(disk, target_file, &from));
+}
+
+/*
+ * disk_command_write_fd
+ *
+ * Create or replace a file on the disk with len bytes read from an fd as
+ * the file is written, so the data never needs to be held in memory. read
+ * is set to how many bytes were read; if that is short, the fd ran out and
+ * the file was padded with zeroes.
+ */
+uint32_t disk_command_write_fd (disk_t *disk,
+                                const char *target_file,
+                                int fd,
+                                uint64_t len,
+                                int64_t mtime,
+                                uint32_t attr,
+                                uint64_t *read)
+{
+    disk_walk_args_t from = {0};
+
+    *read = 0;
+
+    from.data_fd = fd;
+    from.data_fd_set = true;
+    from.data_fd_read = read;
+    from.data_len = len;
+    from.mtime = mtime;
+    from.mtime_set = true;
+    from.attr = attr;
+
+    return (disk_write_file(disk, target_file, &from));
+}
+
+/*
+ * disk_command_copy_file
+ *
+ * Create or replace a file on the disk with a copy of another file there,
+ * giving it this modify time and these extra attributes. The data is held
+ * in memory while it is copied.
+ */
+uint32_t disk_command_copy_file (disk_t *disk,
+                                 const char *source_file,
+                                 const char *target_file,
+                                 int64_t mtime,
+                                 uint32_t attr)
+{
+    static const uint8_t empty[1];
+    disk_walk_args_t from = {0};
+    fat_dirent_t dirent;
+    uint8_t *data = 0;
+    uint32_t count;
+
+    if (!fat_lookup_exact(disk, source_file, &dirent)) {
+        ERR("Cannot copy %s, it is not on the disk", source_file);
+        return (0);
+    }
+
+    if (dirent_is_dir(&dirent)) {
+        ERR("Cannot copy %s, it is a dir", source_file);
+        return (0);
+    }
+
+    if (dirent.size) {
+        data = (typeof(data)) mymalloc(dirent.size, __FUNCTION__);
+
+        if (fat_file_read_at(disk, &dirent, 0, data, dirent.size) !=
+            (int64_t) dirent.size) {
+            ERR("Cannot read %s to copy it", source_file);
+            myfree(data);
+            return (0);
+        }
+    }
+
+    from.data = data ? data : empty;
+    from.data_len = dirent.size;
+    from.data_set = true;
+    from.mtime = mtime;
+    from.mtime_set = true;
+    from.attr = attr;
+
+    count = disk_write_file(disk, target_file, &from);
+
+    myfree(data);
+
+    return (count);
+}
+
+/*
+ * fat_lookup
+ *
+ * Find the dirent for the first path on the disk matching a filter.
+ */
+boolean fat_lookup (disk_t *disk, const char *path, fat_dirent_t *out)
+{
+    disk_walk_args_t args = {0};
+
+    args.find = true;
+
+    if (!disk_walk(disk, path, "", 0, 0, 0, &args)) {
+        return (false);
+    }
+
+    *out = args.dirent;
+
+    return (true);
+}
+
+/*
+ * fat_lookup_exact
+ *
+ * Find the dirent for a full path on the disk, taking each name in the
+ * path literally.
+ */
+boolean fat_lookup_exact (disk_t *disk, const char *path, fat_dirent_t *out)
+{
+    disk_walk_args_t args = {0};
+
+    args.find = true;
+    args.exact = true;
+
+    if (!disk_walk(disk, path, "", 0, 0, 0, &args)) {
+        return (false);
+    }
+
+    *out = args.dirent;
+
+    return (true);
+}
+
+/*
+ * fat_dir_open
+ *
+ * Read all dirents of a dir into memory for iterating. A null dir means
+ * the root dir.
+ */
+dirent_t *fat_dir_open (disk_t *disk, fat_dirent_t *dir)
+{
+    uint32_t cluster = 0;
+
+    if (dir) {
+        if (!dirent_is_dir(dir)) {
+            return (0);
+        }
+
+        cluster = dirent_first_cluster(dir);
+    }
+
+    if ((fat_type(disk) == 32) && !cluster) {
+        cluster = disk->mbr->fat.fat32.root_cluster;
+    }
+
+    return (dirents_alloc(disk, cluster));
+}
+
+/*
+ * fat_dir_next
+ *
+ * Return the next real file or dir in an open dir, skipping . and .. and
+ * deleted entries. The name is the VFAT name if there is one.
+ */
+boolean fat_dir_next (disk_t *disk,
+                      dirent_t *dirents,
+                      uint32_t *index,
+                      fat_dirent_t *out,
+                      char *name,
+                      uint32_t name_len)
+{
+    char vfat_filename[MAX_STR];
+    char *vfat_or_dos_name;
+    fat_dirent_t *dirent;
+
+    vfat_filename[0] = '\0';
+
+    while (*index < dirents->number_of_dirents) {
+        dirent = (fat_dirent_t *)
+                (((uint8_t*) dirents->dirents) + (*index * FAT_DIRENT_SIZE));
+
+        (*index)++;
+
+        vfat_or_dos_name = dirent_read_name(disk, dirent, vfat_filename);
+        if (!vfat_or_dos_name) {
+            continue;
+        }
+
+        strchop(vfat_filename);
+
+        if ((dirent->attr & FAT_ATTR_IS_LABEL) ||
+            !strcmp(vfat_or_dos_name, ".") ||
+            !strcmp(vfat_or_dos_name, "..")) {
+            myfree(vfat_or_dos_name);
+            vfat_filename[0] = '\0';
+            continue;
+        }
+
+        snprintf(name, name_len, "%s",
+                 *vfat_filename ? vfat_filename : vfat_or_dos_name);
+
+        *out = *dirent;
+
+        myfree(vfat_or_dos_name);
+
+        return (true);
+    }
+
+    return (false);
+}
+
+/*
+ * fat_dir_close
+ *
+ * Free a dir opened by fat_dir_open.
+ */
+void fat_dir_close (disk_t *disk, dirent_t *dirents)
+{
+    dirents_free(disk, dirents);
+}
+
+/*
+ * fat_extent_map_free
+ *
+ * Drop the cached extent map.
+ */
+void fat_extent_map_free (disk_t *disk)
+{
+    if (!disk->extent_map) {
+        return;
+    }
+
+    myfree(disk->extent_map->extents);
+    myfree(disk->extent_map);
+    disk->extent_map = 0;
+}
+
+/*
+ * fat_extent_map_get
+ *
+ * Walk a cluster chain once and record it as runs of contiguous clusters.
+ * The last map built is kept until the FAT changes.
+ */
+static fat_extent_map_t *fat_extent_map_get (disk_t *disk,
+                                             uint32_t first_cluster)
+{
+    fat_extent_map_t *map;
+    fat_extent_t *extent;
+    uint32_t cluster;
+
+    map = disk->extent_map;
+    if (map && (map->first_cluster == first_cluster)) {
+        return (map);
+    }
+
+    fat_extent_map_free(disk);
+
+    map = (typeof(map)) myzalloc(sizeof(*map), __FUNCTION__);
+    map->first_cluster = first_cluster;
+
+    extent = 0;
+    cluster = first_cluster;
+
+    while (!cluster_endchain(disk, cluster)) {
+        if (map->number_of_clusters > total_clusters(disk)) {
+            ERR("Cluster chain loops at cluster %" PRIu32 "", cluster);
+            break;
+        }
+
+        if (extent && (extent->cluster + extent->count == cluster)) {
+            extent->count++;
+        } else {
+            if (map->number_of_extents == map->max_extents) {
+                map->max_extents = map->max_extents ? 
+                                map->max_extents * 2 : 16;
+
+                map->extents = (typeof(map->extents))
+                    myrealloc(map->extents,
+                              map->max_extents * sizeof(fat_extent_t),
+                              __FUNCTION__);
+            }
+
+            extent = &map->extents[map->number_of_extents++];
+            extent->logical = map->number_of_clusters;
+            extent->cluster = cluster;
+            extent->count = 1;
+        }
+
+        map->number_of_clusters++;
+
+        cluster = cluster_next(disk, cluster);
+    }
+
+    disk->extent_map = map;
+
+    return (map);
+}
+
+/*
+ * fat_extent_find
+ *
+ * Binary search for the run holding a cluster index within the file.
+ */
+static fat_extent_t *fat_extent_find (fat_extent_map_t *map,
+                                      uint32_t logical)
+{
+    uint32_t lo;
+    uint32_t hi;
+    uint32_t mid;
+
+    if (logical >= map->number_of_clusters) {
+        return (0);
+    }
+
+    lo = 0;
+    hi = map->number_of_extents;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+
+        if (map->extents[mid].logical <= logical) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (&map->extents[lo]);
+}
+
+/*
+ * fat_file_extents
+ *
+ * The runs of contiguous clusters holding a file or dir. They belong to the
+ * cached extent map, so only last until the FAT changes or another chain
+ * is mapped.
+ */
+const fat_extent_t *fat_file_extents (disk_t *disk,
+                                      const fat_dirent_t *dirent,
+                                      uint32_t *number_of_extents)
+{
+    fat_extent_map_t *map;
+
+    map = fat_extent_map_get(disk, dirent_first_cluster(dirent));
+
+    *number_of_extents = map->number_of_extents;
+
+    return (map->extents);
+}
+
+/*
+ * fat_file_read_at
+ *
+ * Read part of a file into a buffer, reading only the sectors that hold the
+ * range. Returns the number of bytes read, which is short at end of file.
+ */
+int64_t fat_file_read_at (disk_t *disk,
+                          const fat_dirent_t *dirent,
+                          uint64_t offset,
+                          uint8_t *buf,
+                          uint64_t len)
+{
+    uint32_t sector_sz = sector_size(disk);
+    uint32_t cluster_sz = cluster_size(disk);
+    fat_extent_map_t *map;
+    fat_extent_t *extent;
+    uint64_t pos;
+    uint64_t done;
+
+    if (offset >= dirent->size) {
+        return (0);
+    }
+
+    if (offset + len > dirent->size) {
+        len = dirent->size - offset;
+    }
+
+    map = fat_extent_map_get(disk, dirent_first_cluster(dirent));
+
+    done = 0;
+
+    while (done < len) {
+        pos = offset + done;
+
+        extent = fat_extent_find(map, (uint32_t) (pos / cluster_sz));
+        if (!extent) {
+            ERR("Premature end of file at offset %" PRIu64 "", pos);
+            return (-1);
+        }
+
+        /*
+         * Bytes we can read in one go from this run, from pos onwards.
+         */
+        uint32_t in_run = (uint32_t) (pos / cluster_sz) - extent->logical;
+        uint64_t run_start = ((uint64_t) extent->logical + in_run) * cluster_sz;
+        uint64_t run_left = ((uint64_t) (extent->count - in_run)) * cluster_sz -
+                            (pos - run_start);
+        uint64_t chunk = min(min(len - done, run_left), (uint64_t) ONE_MEG);
+
+        uint64_t in_cluster = pos - run_start;
+        uint32_t sector = cluster_to_sector(disk,
+                                            extent->cluster + in_run - 2) +
+                          (uint32_t) (in_cluster / sector_sz);
+        uint32_t skip = (uint32_t) (in_cluster % sector_sz);
+        uint32_t count = (uint32_t) ((skip + chunk + sector_sz - 1) /
+                                     sector_sz);
+
+        uint8_t *data = sector_read_no_cache(disk, sector, count);
+        if (!data) {
+            return (-1);
+        }
+
+        memcpy(buf + done, data + skip, chunk);
+        myfree(data);
+
+        done += chunk;
+    }
+
+    return ((int64_t) done);
+}
+
+/*
+ * One defrag run. The same walk reports, moves dirs, then moves files.
+ * Shrinking moves whatever lies at or past limit, growing whatever lies
+ * below it, and renumbering takes shift off every cluster number.
+ */
+typedef enum {
+    FAT_DEFRAG_REPORT,
+    FAT_DEFRAG_DIRS,
+    FAT_DEFRAG_FILES,
+    FAT_DEFRAG_SHRINK,
+    FAT_DEFRAG_GROW,
+    FAT_DEFRAG_RENUMBER,
+} fat_defrag_pass_t;
+
+typedef struct fat_defrag_ {
+    fat_defrag_pass_t pass;
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t fragmented;
+    uint64_t extents;
+    uint32_t moved_files;
+    uint32_t moved_dirs;
+    uint64_t moved_bytes;
+    uint32_t limit;
+    uint32_t shift;
+    uint32_t stuck;
+
+    /*
+     * Where the FAT32 root dir was, if it has been moved.
+     */
+    uint32_t old_root_cluster;
+
+    /*
+     * Files found by the walk, packed afterwards in disk order.
+     */
+    struct fat_defrag_file_ *found;
+    uint32_t number_of_found;
+    uint32_t max_found;
+} fat_defrag_t;
+
+/*
+ * A file's first cluster and where its dirent is, so the dirent can be
+ * changed without walking its dir again.
+ */
+typedef struct fat_defrag_file_ {
+    uint32_t first_cluster;
+    uint32_t sector;
+    uint32_t offset;
+} fat_defrag_file_t;
+
+/*
+ * A chain moved to a new run whose old clusters are freed once nothing on
+ * disk points at them any more.
+ */
+typedef struct fat_defrag_move_ {
+    uint32_t old_cluster;
+    uint32_t new_cluster;
+    uint32_t number_of_extents;
+    fat_extent_t *extents;
+} fat_defrag_move_t;
+
+/*
+ * fat_defrag_chain
+ *
+ * A copy of the runs making up a chain; the cached map goes with any FAT
+ * change.
+ */
+static fat_extent_t *fat_defrag_chain (disk_t *disk, uint32_t first_cluster,
+                                       uint32_t *number_of_extents,
+                                       uint32_t *number_of_clusters)
+{
+    fat_extent_map_t *map = fat_extent_map_get(disk, first_cluster);
+    fat_extent_t *extents;
+
+    *number_of_extents = map->number_of_extents;
+    *number_of_clusters = map->number_of_clusters;
+
+    if (!map->number_of_extents) {
+        return (0);
+    }
+
+    extents = (typeof(extents))
+            myzalloc(map->number_of_extents * sizeof(fat_extent_t),
+                     __FUNCTION__);
+
+    memcpy(extents, map->extents,
+           map->number_of_extents * sizeof(fat_extent_t));
+
+    return (extents);
+}
+
+/*
+ * fat_defrag_clip
+ *
+ * Keep only the free runs in clusters lo to hi in the index, so
+ * allocations come from there.
+ */
+static void fat_defrag_clip (disk_t *disk, uint32_t lo, uint32_t hi)
+{
+    uint32_t n = 0;
+    uint32_t e;
+
+    for (e = 0; e < disk->number_of_free_extents; e++) {
+        fat_extent_t extent = disk->free_extents[e];
+
+        if (extent.cluster < lo) {
+            if (extent.cluster + extent.count <= lo) {
+                continue;
+            }
+
+            extent.count -= lo - extent.cluster;
+            extent.cluster = lo;
+        }
+
+        if (extent.cluster >= hi) {
+            break;
+        }
+
+        if (extent.cluster + extent.count > hi) {
+            extent.count = hi - extent.cluster;
+        }
+
+        disk->free_extents[n++] = extent;
+    }
+
+    disk->number_of_free_extents = n;
+}
+
+/*
+ * fat_defrag_keep
+ *
+ * Whether a cluster stays put when shrinking or growing. Shrink clears
+ * everything at or past the limit, grow everything below it.
+ */
+static boolean fat_defrag_keep (fat_defrag_t *ctx, uint32_t cluster)
+{
+    if (ctx->pass == FAT_DEFRAG_SHRINK) {
+        return (cluster < ctx->limit);
+    }
+
+    return (cluster >= ctx->limit);
+}
+
+/*
+ * fat_defrag_place
+ *
+ * Where the clusters of a chain go when shrinking or growing. Clusters on
+ * the right side of the limit stay where they are; the rest are given
+ * free ones there. Returns how many runs make up the new chain.
+ */
+static uint32_t fat_defrag_place (disk_t *disk, fat_defrag_t *ctx,
+                                  fat_defrag_move_t *move, fat_extent_t *to)
+{
+    uint32_t number_of_to = 0;
+    uint32_t e;
+
+    if (ctx->pass == FAT_DEFRAG_SHRINK) {
+        fat_defrag_clip(disk, 2, ctx->limit);
+    } else {
+        fat_defrag_clip(disk, ctx->limit, total_clusters(disk));
+    }
+
+    for (e = 0; e < move->number_of_extents; e++) {
+        fat_extent_t *from = &move->extents[e];
+        fat_extent_t part[2];
+        uint32_t below = 0;
+        uint32_t p;
+
+        /*
+         * Split the run at the limit.
+         */
+        if (from->cluster < ctx->limit) {
+            below = min(from->count, ctx->limit - from->cluster);
+        }
+
+        part[0].logical = from->logical;
+        part[0].cluster = from->cluster;
+        part[0].count = below;
+
+        part[1].logical = from->logical + below;
+        part[1].cluster = from->cluster + below;
+        part[1].count = from->count - below;
+
+        for (p = 0; p < 2; p++) {
+            uint32_t got;
+            uint32_t n;
+
+            if (!part[p].count) {
+                continue;
+            }
+
+            if (fat_defrag_keep(ctx, part[p].cluster)) {
+                to[number_of_to++] = part[p];
+                continue;
+            }
+
+            got = cluster_alloc_extents(disk, part[p].count,
+                                        &to[number_of_to]);
+            if (!got) {
+                return (0);
+            }
+
+            for (n = number_of_to; n < number_of_to + got; n++) {
+                to[n].logical += part[p].logical;
+            }
+
+            number_of_to += got;
+        }
+    }
+
+    return (number_of_to);
+}
+
+/*
+ * fat_defrag_lowest
+ *
+ * Index of the lowest of the free runs that a chain should move to, or
+ * the number of runs if it is best left alone. A fragmented chain goes in
+ * the lowest run that holds it. A contiguous one only moves down, and
+ * only where that adds at most most runs to the free space, so that
+ * packing settles instead of shuffling holes about.
+ */
+static uint32_t fat_defrag_lowest (const fat_extent_t *runs,
+                                   uint32_t number_of_runs,
+                                   const fat_extent_t *chain,
+                                   uint32_t number_of_extents,
+                                   uint32_t number_of_clusters,
+                                   int32_t most)
+{
+    uint32_t start = chain[0].cluster;
+    uint32_t end = start + number_of_clusters;
+    int32_t more;
+    uint32_t e;
+    uint32_t j;
+
+    for (e = 0; e < number_of_runs; e++) {
+        const fat_extent_t *run = &runs[e];
+
+        if ((number_of_extents == 1) && (run->cluster >= start)) {
+            break;
+        }
+
+        if (run->count < number_of_clusters) {
+            continue;
+        }
+
+        if (number_of_extents > 1) {
+            return (e);
+        }
+
+        /*
+         * Filling a run exactly removes it; the clusters left behind are
+         * a new run unless they join free space either side.
+         */
+        more = (run->count == number_of_clusters) ? 0 : 1;
+
+        for (j = e; j < number_of_runs; j++) {
+            if (runs[j].cluster + runs[j].count == start) {
+                if ((j != e) || (run->count > number_of_clusters)) {
+                    more--;
+                }
+            }
+
+            if (runs[j].cluster == end) {
+                more--;
+                break;
+            }
+
+            if (runs[j].cluster > end) {
+                break;
+            }
+        }
+
+        if (more <= most) {
+            return (e);
+        }
+    }
+
+    return (number_of_runs);
+}
+
+/*
+ * fat_defrag_move
+ *
+ * Copy a chain to new clusters and chain them in the in memory FAT.
+ * Unless to_cluster names the free run to use, a dir goes where
+ * fat_defrag_lowest says, if that leaves fewer free runs; dirs are moved
+ * in walk order, not disk order, so moves that only shift a hole along
+ * would take a pass each to settle. When shrinking, only the clusters past the new
+ * end move. The old chain is left alone and move is left holding the
+ * clusters to free once the new one is in use. Returns false if there is
+ * nowhere better to put it.
+ */
+static boolean fat_defrag_move (disk_t *disk, fat_defrag_t *ctx,
+                                uint32_t first_cluster, boolean is_dir,
+                                uint32_t to_cluster,
+                                fat_defrag_move_t *move)
+{
+    uint32_t number_of_clusters;
+    uint32_t number_of_to;
+    fat_extent_t *to;
+    uint32_t lowest = 0xffffffff;
+    uint32_t last = 0;
+    uint32_t best;
+    uint32_t prev;
+    uint32_t e;
+    uint32_t n;
+    uint32_t c;
+
+    memset(move, 0, sizeof(*move));
+
+    move->extents = fat_defrag_chain(disk, first_cluster,
+                                     &move->number_of_extents,
+                                     &number_of_clusters);
+    if (!move->extents) {
+        return (false);
+    }
+
+    for (e = 0; e < move->number_of_extents; e++) {
+        lowest = min(lowest, move->extents[e].cluster);
+        last = max(last, move->extents[e].cluster +
+                         move->extents[e].count - 1);
+    }
+
+    fat_free_extents_build(disk);
+
+    to = (typeof(to))
+            myzalloc(sizeof(fat_extent_t) * (number_of_clusters + 1),
+                     __FUNCTION__);
+
+    number_of_to = 0;
+
+    if (ctx->pass == FAT_DEFRAG_SHRINK) {
+        if (last >= ctx->limit) {
+            number_of_to = fat_defrag_place(disk, ctx, move, to);
+            if (!number_of_to) {
+                ctx->stuck++;
+            }
+        }
+    } else if (ctx->pass == FAT_DEFRAG_GROW) {
+        if (lowest < ctx->limit) {
+            number_of_to = fat_defrag_place(disk, ctx, move, to);
+            if (!number_of_to) {
+                ctx->stuck++;
+            }
+        }
+    } else {
+        if (to_cluster) {
+            for (best = 0; best < disk->number_of_free_extents; best++) {
+                if (disk->free_extents[best].cluster == to_cluster) {
+                    break;
+                }
+            }
+        } else {
+            best = fat_defrag_lowest(disk->free_extents,
+                                     disk->number_of_free_extents,
+                                     move->extents, move->number_of_extents,
+                                     number_of_clusters, -1);
+        }
+
+        if ((best < disk->number_of_free_extents) &&
+            (disk->free_extents[best].count >= number_of_clusters)) {
+            to[0].logical = 0;
+            to[0].cluster = disk->free_extents[best].cluster;
+            to[0].count = number_of_clusters;
+            number_of_to = 1;
+
+            fat_free_extent_take(disk, best, number_of_clusters);
+        }
+    }
+
+    if (!number_of_to) {
+        myfree(to);
+        myfree(move->extents);
+        move->extents = 0;
+        return (false);
+    }
+
+    move->old_cluster = first_cluster;
+    move->new_cluster = to[0].cluster;
+
+    /*
+     * Copy the data where old and new runs overlap; the new clusters are
+     * free on disk so a crash now loses nothing.
+     */
+    for (e = 0; e < move->number_of_extents; e++) {
+        fat_extent_t *from = &move->extents[e];
+
+        for (n = 0; n < number_of_to; n++) {
+            uint32_t start = max(from->logical, to[n].logical);
+            uint32_t end = min(from->logical + from->count,
+                               to[n].logical + to[n].count);
+            sector_view_t view;
+
+            if (start >= end) {
+                continue;
+            }
+
+            /*
+             * Kept in place.
+             */
+            if (from->cluster + start - from->logical ==
+                to[n].cluster + start - to[n].logical) {
+                continue;
+            }
+
+            if (!sector_view(disk,
+                             cluster_to_sector(disk, from->cluster +
+                                               start - from->logical - 2),
+                             (end - start) * disk->mbr->sectors_per_cluster,
+                             &view)) {
+                DIE("cannot read cluster %" PRIu32 " to move it",
+                    from->cluster + start - from->logical);
+            }
+
+            cluster_write_no_cache(disk,
+                                   to[n].cluster + start - to[n].logical - 2,
+                                   (uint8_t *) view.data, end - start);
+
+            sector_view_release(disk, &view);
+
+            ctx->moved_bytes += (uint64_t) (end - start) * cluster_size(disk);
+        }
+    }
+
+    prev = 0;
+
+    for (n = 0; n < number_of_to; n++) {
+        for (c = 0; c < to[n].count; c++) {
+            if (prev) {
+                cluster_next_set(disk, prev, to[n].cluster + c,
+                                 false /* update FAT */);
+            }
+
+            prev = to[n].cluster + c;
+        }
+    }
+
+    cluster_next_set(disk, prev, cluster_max(disk), false /* update FAT */);
+
+    /*
+     * When shrinking or growing, the clusters kept in place must not be
+     * freed.
+     */
+    if ((ctx->pass == FAT_DEFRAG_SHRINK) || (ctx->pass == FAT_DEFRAG_GROW)) {
+        for (e = 0; e < move->number_of_extents; e++) {
+            fat_extent_t *from = &move->extents[e];
+            uint32_t below = 0;
+
+            if (from->cluster < ctx->limit) {
+                below = min(from->count, ctx->limit - from->cluster);
+            }
+
+            if (ctx->pass == FAT_DEFRAG_SHRINK) {
+                from->cluster += below;
+                from->count -= below;
+            } else {
+                from->count = below;
+            }
+        }
+    }
+
+    myfree(to);
+
+    if (is_dir) {
+        ctx->moved_dirs++;
+    } else {
+        ctx->moved_files++;
+    }
+
+    return (true);
+}
+
+/*
+ * fat_defrag_free
+ *
+ * Free the old chain of a moved file or dir.
+ */
+static void fat_defrag_free (disk_t *disk, fat_defrag_move_t *move)
+{
+    uint32_t e;
+    uint32_t c;
+
+    for (e = 0; e < move->number_of_extents; e++) {
+        for (c = 0; c < move->extents[e].count; c++) {
+            cluster_next_set(disk, move->extents[e].cluster + c, 0,
+                             false /* update FAT */);
+        }
+    }
+
+    myfree(move->extents);
+    move->extents = 0;
+}
+
+/*
+ * fat_defrag_found
+ *
+ * Note a file for packing, and where its dirent lies on disk.
+ */
+static void fat_defrag_found (disk_t *disk, fat_defrag_t *ctx,
+                              dirent_t *dirents, uint32_t index,
+                              uint32_t first_cluster)
+{
+    fat_defrag_file_t *file;
+    uint64_t offset = (uint64_t) index * FAT_DIRENT_SIZE;
+    uint32_t chain;
+
+    for (chain = 0; chain < dirents->number_of_chains; chain++) {
+        uint64_t len = (uint64_t) dirents->sectors[chain] * sector_size(disk);
+
+        if (offset < len) {
+            break;
+        }
+
+        offset -= len;
+    }
+
+    if (chain == dirents->number_of_chains) {
+        return;
+    }
+
+    if (ctx->number_of_found == ctx->max_found) {
+        ctx->max_found = ctx->max_found ? ctx->max_found * 2 : 64;
+        ctx->found = (typeof(ctx->found))
+            myrealloc(ctx->found, ctx->max_found * sizeof(*ctx->found),
+                      __FUNCTION__);
+    }
+
+    file = &ctx->found[ctx->number_of_found++];
+    file->first_cluster = first_cluster;
+    file->sector = dirents->sector[chain] +
+                    (uint32_t) (offset / sector_size(disk));
+    file->offset = (uint32_t) (offset % sector_size(disk));
+}
+
+/*
+ * fat_defrag_dir
+ *
+ * Report on or move what is in one dir, then recurse into its subdirs.
+ * Files are only noted here; fat_defrag_files packs them afterwards.
+ *
+ * Moves are made crash safe by ordering: data is copied into free
+ * clusters, the new chains are written to the FAT and synced, then the
+ * dirents are pointed at them and synced, and only then are the old
+ * chains freed. A crash at any point leaves either the old or the new
+ * copy reachable, at worst with some clusters leaked.
+ *
+ * A moved dir's . entry and its subdirs' .. entries still name its old
+ * first cluster, which is kept until they have been fixed.
+ */
+static void fat_defrag_dir (disk_t *disk, fat_defrag_t *ctx,
+                            uint32_t cluster, uint32_t old_cluster,
+                            uint32_t parent_cluster,
+                            uint32_t old_parent_cluster,
+                            uint32_t depth)
+{
+    fat_defrag_move_t *subdirs = 0;
+    fat_defrag_move_t *files = 0;
+    uint32_t number_of_subdirs = 0;
+    uint32_t number_of_files = 0;
+    uint32_t max_subdirs = 0;
+    uint32_t max_files = 0;
+    fat_dirent_t *dirent;
+    dirent_t *dirents;
+    uint32_t d;
+
+    if (depth > MAX_DIR_DEPTH) {
+        ERR("runaway directory recursion at depth %" PRIu32 "", depth);
+        return;
+    }
+
+    dirents = dirents_alloc(disk, cluster);
+    if (!dirents) {
+        return;
+    }
+
+    for (d = 0; d < dirents->number_of_dirents; d++) {
+        uint32_t number_of_extents;
+        uint32_t number_of_clusters;
+        fat_defrag_move_t move;
+        uint32_t first;
+
+        dirent = (fat_dirent_t *)
+                (((uint8_t*) dirents->dirents) + (d * FAT_DIRENT_SIZE));
+
+        if (!dirent->name[0] ||
+            (dirent->name[0] == FAT_FILE_DELETE_CHAR) ||
+            (dirent->attr == 0x0F) ||
+            (dirent->attr & FAT_ATTR_IS_LABEL)) {
+            continue;
+        }
+
+        first = dirent_first_cluster(dirent);
+
+        /*
+         * Renumbering shifts every reference, . and .. too, but the walk
+         * goes on by the old numbers as the FAT is not renumbered yet.
+         */
+        if ((ctx->pass == FAT_DEFRAG_RENUMBER) && (first >= ctx->limit)) {
+            uint32_t want = first - ctx->shift;
+
+            dirent->h_first_cluster = (want & 0xffff0000) >> 16;
+            dirent->l_first_cluster = (want & 0x0000ffff);
+            dirents->modified = true;
+        }
+
+        /*
+         * Point . and .. at where this dir and its parent now are. A ..
+         * naming a FAT32 root dir that has moved becomes 0, as for any
+         * subdir of the root.
+         */
+        if (dirent->name[0] == '.') {
+            uint32_t want = first;
+
+            if ((dirent->name[1] == '.') && (first == old_parent_cluster)) {
+                want = parent_cluster;
+            } else if ((dirent->name[1] == '.') && !old_parent_cluster &&
+                       ctx->old_root_cluster &&
+                       (first == ctx->old_root_cluster)) {
+                want = 0;
+            } else if ((dirent->name[1] == ' ') && (first == old_cluster)) {
+                want = cluster;
+            }
+
+            if (want != first) {
+                dirent->h_first_cluster = (want & 0xffff0000) >> 16;
+                dirent->l_first_cluster = (want & 0x0000ffff);
+                dirents->modified = true;
+            }
+
+            continue;
+        }
+
+        if (!first) {
+            if (!dirent_is_dir(dirent)) {
+                ctx->files++;
+            }
+
+            continue;
+        }
+
+        if (dirent_is_dir(dirent)) {
+            if (number_of_subdirs == max_subdirs) {
+                max_subdirs = max_subdirs ? max_subdirs * 2 : 16;
+                subdirs = (typeof(subdirs))
+                    myrealloc(subdirs, max_subdirs * sizeof(*subdirs),
+                              __FUNCTION__);
+            }
+
+            if (((ctx->pass == FAT_DEFRAG_DIRS) ||
+                 (ctx->pass == FAT_DEFRAG_SHRINK) ||
+                 (ctx->pass == FAT_DEFRAG_GROW)) &&
+                fat_defrag_move(disk, ctx, first, true, 0, &move)) {
+                dirent->h_first_cluster = (move.new_cluster & 0xffff0000) >> 16;
+                dirent->l_first_cluster = (move.new_cluster & 0x0000ffff);
+                dirents->modified = true;
+            } else {
+                memset(&move, 0, sizeof(move));
+                move.old_cluster = first;
+                move.new_cluster = first;
+            }
+
+            subdirs[number_of_subdirs++] = move;
+
+            ctx->dirs++;
+            continue;
+        }
+
+        ctx->files++;
+
+        if (ctx->pass == FAT_DEFRAG_REPORT) {
+            myfree(fat_defrag_chain(disk, first, &number_of_extents,
+                                    &number_of_clusters));
+
+            ctx->extents += number_of_extents;
+            if (number_of_extents > 1) {
+                ctx->fragmented++;
+            }
+
+            continue;
+        }
+
+        if (ctx->pass == FAT_DEFRAG_FILES) {
+            fat_defrag_found(disk, ctx, dirents, d, first);
+            continue;
+        }
+
+        if (((ctx->pass == FAT_DEFRAG_SHRINK) ||
+             (ctx->pass == FAT_DEFRAG_GROW)) &&
+            fat_defrag_move(disk, ctx, first, false, 0, &move)) {
+            if (number_of_files == max_files) {
+                max_files = max_files ? max_files * 2 : 16;
+                files = (typeof(files))
+                    myrealloc(files, max_files * sizeof(*files),
+                              __FUNCTION__);
+            }
+
+            files[number_of_files++] = move;
+
+            dirent->h_first_cluster = (move.new_cluster & 0xffff0000) >> 16;
+            dirent->l_first_cluster = (move.new_cluster & 0x0000ffff);
+            dirents->modified = true;
+        }
+    }
+
+    /*
+     * New chains reach the disk before the dirents that point at them.
+     * Renumbering leaves the FAT alone until every dirent is done.
+     */
+    if (dirents->modified && (ctx->pass != FAT_DEFRAG_RENUMBER)) {
+        fat_write(disk);
+        disk_sync(disk);
+
+        dirents_write(disk, dirents);
+        disk_sync(disk);
+    }
+
+    while (number_of_files) {
+        fat_defrag_free(disk, &files[--number_of_files]);
+    }
+
+    dirents_free(disk, dirents);
+
+    for (d = 0; d < number_of_subdirs; d++) {
+        fat_defrag_dir(disk, ctx,
+                       subdirs[d].new_cluster, subdirs[d].old_cluster,
+                       cluster, old_cluster, depth + 1);
+
+        if (subdirs[d].extents) {
+            fat_defrag_free(disk, &subdirs[d]);
+        }
+    }
+
+    myfree(subdirs);
+    myfree(files);
+}
+
+static int fat_defrag_file_cmp (const void *a, const void *b)
+{
+    const fat_defrag_file_t *fa = (const fat_defrag_file_t *) a;
+    const fat_defrag_file_t *fb = (const fat_defrag_file_t *) b;
+
+    return ((fa->first_cluster < fb->first_cluster) ? -1 : 1);
+}
+
+/*
+ * fat_defrag_runs
+ *
+ * The free runs as they will be once the pending old chains are freed.
+ */
+static fat_extent_t *fat_defrag_runs (disk_t *disk,
+                                      const fat_extent_t *pending,
+                                      uint32_t number_of_pending,
+                                      uint32_t *number_of_runs)
+{
+    fat_extent_t *runs;
+    uint32_t n = 0;
+    uint32_t f = 0;
+    uint32_t p = 0;
+
+    fat_free_extents_build(disk);
+
+    runs = (typeof(runs))
+            myzalloc((disk->number_of_free_extents + number_of_pending + 1) *
+                     sizeof(fat_extent_t), __FUNCTION__);
+
+    while ((f < disk->number_of_free_extents) || (p < number_of_pending)) {
+        fat_extent_t next;
+
+        if ((p == number_of_pending) ||
+            ((f < disk->number_of_free_extents) &&
+             (disk->free_extents[f].cluster < pending[p].cluster))) {
+            next = disk->free_extents[f++];
+        } else {
+            next = pending[p++];
+        }
+
+        if (n && (runs[n - 1].cluster + runs[n - 1].count == next.cluster)) {
+            runs[n - 1].count += next.count;
+        } else {
+            runs[n++] = next;
+        }
+    }
+
+    *number_of_runs = n;
+
+    return (runs);
+}
+
+/*
+ * fat_defrag_commit
+ *
+ * Point the dirents of a batch of moved files at their new chains and
+ * free the old ones, in the same crash safe order as fat_defrag_dir.
+ */
+static void fat_defrag_commit (disk_t *disk, fat_defrag_move_t *moves,
+                               fat_defrag_file_t **moved,
+                               uint32_t number_of_moves)
+{
+    uint32_t m;
+
+    if (!number_of_moves) {
+        return;
+    }
+
+    fat_write(disk);
+    disk_sync(disk);
+
+    for (m = 0; m < number_of_moves; m++) {
+        fat_dirent_t *dirent;
+        uint8_t *data;
+
+        data = sector_read(disk, moved[m]->sector, 1);
+        if (!data) {
+            DIE("cannot read dirent at sector %" PRIu32 "", moved[m]->sector);
+        }
+
+        dirent = (fat_dirent_t *) (data + moved[m]->offset);
+        dirent->h_first_cluster = (moves[m].new_cluster & 0xffff0000) >> 16;
+        dirent->l_first_cluster = (moves[m].new_cluster & 0x0000ffff);
+
+        if (!sector_write(disk, moved[m]->sector, data, 1)) {
+            DIE("cannot write dirent at sector %" PRIu32 "", moved[m]->sector);
+        }
+
+        myfree(data);
+
+        moved[m]->first_cluster = moves[m].new_cluster;
+    }
+
+    disk_sync(disk);
+
+    for (m = 0; m < number_of_moves; m++) {
+        fat_defrag_free(disk, &moves[m]);
+    }
+}
+
+/*
+ * fat_defrag_sweep
+ *
+ * Pack the files the walk found, lowest first, each into the lowest free
+ * run that fat_defrag_lowest allows. Old chains are only freed when a
+ * batch is committed, so the batch is committed early whenever the run
+ * wanted takes in clusters still waiting to be freed; that way a file
+ * can slide into the space the one before it has just left. moves and
+ * moved have room for every file found. Returns how many files moved.
+ */
+static uint32_t fat_defrag_sweep (disk_t *disk, fat_defrag_t *ctx,
+                                  fat_defrag_move_t *moves,
+                                  fat_defrag_file_t **moved)
+{
+    fat_extent_t *pending = 0;
+    uint32_t number_of_pending = 0;
+    uint32_t number_of_moves = 0;
+    uint32_t total = 0;
+    uint32_t f;
+
+    qsort(ctx->found, ctx->number_of_found, sizeof(fat_defrag_file_t),
+          fat_defrag_file_cmp);
+
+    for (f = 0; f < ctx->number_of_found; f++) {
+        fat_defrag_file_t *file = &ctx->found[f];
+        uint32_t number_of_extents;
+        uint32_t number_of_clusters;
+        uint32_t number_of_runs;
+        fat_extent_t *chain;
+        fat_extent_t *runs;
+        uint32_t best;
+        uint32_t to;
+        uint32_t p;
+
+        chain = fat_defrag_chain(disk, file->first_cluster,
+                                 &number_of_extents, &number_of_clusters);
+        if (!chain) {
+            continue;
+        }
+
+        runs = fat_defrag_runs(disk, pending, number_of_pending,
+                               &number_of_runs);
+
+        best = fat_defrag_lowest(runs, number_of_runs, chain,
+                                 number_of_extents, number_of_clusters, 0);
+
+        myfree(chain);
+
+        if (best == number_of_runs) {
+            myfree(runs);
+            continue;
+        }
+
+        to = runs[best].cluster;
+        myfree(runs);
+
+        for (p = 0; p < number_of_pending; p++) {
+            if ((pending[p].cluster < to + number_of_clusters) &&
+                (pending[p].cluster + pending[p].count > to)) {
+                fat_defrag_commit(disk, moves, moved, number_of_moves);
+                number_of_moves = 0;
+                number_of_pending = 0;
+                break;
+            }
+        }
+
+        if (!fat_defrag_move(disk, ctx, file->first_cluster, false, to,
+                             &moves[number_of_moves])) {
+            continue;
+        }
+
+        pending = (typeof(pending))
+            myrealloc(pending,
+                      (number_of_pending +
+                       moves[number_of_moves].number_of_extents) *
+                      sizeof(fat_extent_t), __FUNCTION__);
+
+        memcpy(pending + number_of_pending, moves[number_of_moves].extents,
+               moves[number_of_moves].number_of_extents *
+               sizeof(fat_extent_t));
+
+        number_of_pending += moves[number_of_moves].number_of_extents;
+
+        qsort(pending, number_of_pending, sizeof(fat_extent_t),
+              fat_extent_cmp_cluster);
+
+        moved[number_of_moves++] = file;
+        total++;
+    }
+
+    fat_defrag_commit(disk, moves, moved, number_of_moves);
+
+    myfree(pending);
+
+    return (total);
+}
+
+/*
+ * fat_defrag_files
+ *
+ * Sweep the files the walk found until they settle. A file passed over
+ * may only be able to move once those above it have.
+ */
+static void fat_defrag_files (disk_t *disk, fat_defrag_t *ctx)
+{
+    fat_defrag_file_t **moved;
+    fat_defrag_move_t *moves;
+    uint32_t sweep;
+
+    if (!ctx->number_of_found) {
+        return;
+    }
+
+    moves = (typeof(moves))
+            myzalloc(ctx->number_of_found * sizeof(*moves), __FUNCTION__);
+    moved = (typeof(moved))
+            myzalloc(ctx->number_of_found * sizeof(*moved), __FUNCTION__);
+
+    for (sweep = 0; sweep < MAX_DEFRAG_PASSES; sweep++) {
+        if (!fat_defrag_sweep(disk, ctx, moves, moved)) {
+            break;
+        }
+    }
+
+    myfree(moved);
+    myfree(moves);
+
+    myfree(ctx->found);
+    ctx->found = 0;
+    ctx->number_of_found = 0;
+    ctx->max_found = 0;
+}
+
+/*
+ * fat_defrag_count
+ *
+ * How many files are fragmented and how many runs the free space is in.
+ */
+static uint32_t fat_defrag_count (disk_t *disk, fat_defrag_t *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->pass = FAT_DEFRAG_REPORT;
+
+    fat_defrag_dir(disk, ctx, 0, 0, 0, 0, 0);
+
+    fat_free_extents_build(disk);
+
+    return (disk->number_of_free_extents);
+}
+
+/*
+ * fat_defrag_report
+ *
+ * Print how fragmented files and free space are.
+ */
+static void fat_defrag_report (disk_t *disk, const char *when)
+{
+    fat_defrag_t ctx;
+    uint32_t largest = 0;
+    uint64_t free_clusters = 0;
+    uint32_t e;
+
+    fat_defrag_count(disk, &ctx);
+
+    for (e = 0; e < disk->number_of_free_extents; e++) {
+        free_clusters += disk->free_extents[e].count;
+        largest = max(largest, disk->free_extents[e].count);
+    }
+
+    OUT("%s:", when);
+    OUT("  %*s%" PRIu32 ", %" PRIu32 " fragmented, %" PRIu64 " extents",
+        -OUTPUT_FORMAT_WIDTH, "files", ctx.files, ctx.fragmented,
+        ctx.extents);
+    OUT("  %*s%" PRIu32, -OUTPUT_FORMAT_WIDTH, "dirs", ctx.dirs);
+    OUT("  %*s%" PRIu64 " clusters in %" PRIu32 " runs, largest %" PRIu32,
+        -OUTPUT_FORMAT_WIDTH, "free", free_clusters,
+        disk->number_of_free_extents, largest);
+}
+
+/*
+ * fat_defrag_left
+ *
+ * Name each file under a dir that is still in more than one run.
+ */
+static void fat_defrag_left (disk_t *disk, fat_dirent_t *dir,
+                             const char *prefix, uint32_t depth)
+{
+    uint32_t number_of_extents;
+    uint32_t number_of_clusters;
+    char name[MAX_STR];
+    fat_dirent_t dirent;
+    dirent_t *dirents;
+    uint32_t index;
+    char *path;
+
+    if (depth > MAX_DIR_DEPTH) {
+        ERR("runaway directory recursion at depth %" PRIu32 ", dir %s",
+            depth, prefix);
+        return;
+    }
+
+    dirents = fat_dir_open(disk, dir);
+    if (!dirents) {
+        return;
+    }
+
+    index = 0;
+
+    while (fat_dir_next(disk, dirents, &index, &dirent, name, sizeof(name))) {
+        path = dynprintf("%s%s", prefix, name);
+
+        if (dirent_is_dir(&dirent)) {
+            char *subdir = dynprintf("%s/", path);
+
+            fat_defrag_left(disk, &dirent, subdir, depth + 1);
+            myfree(subdir);
+        } else if (dirent_first_cluster(&dirent)) {
+            myfree(fat_defrag_chain(disk, dirent_first_cluster(&dirent),
+                                    &number_of_extents,
+                                    &number_of_clusters));
+
+            if (number_of_extents > 1) {
+                WARN("%s is still in %" PRIu32 " runs", path,
+                     number_of_extents);
+            }
+        }
+
+        myfree(path);
+    }
+
+    fat_dir_close(disk, dirents);
+}
+
+/*
+ * fat_defrag
+ *
+ * Report on fragmentation and, unless only reporting, pack dirs towards
+ * the start of the disk and move fragmented files into single runs.
+ * Returns false if any file is left fragmented, as when no free run is
+ * big enough for it.
+ */
+boolean fat_defrag (disk_t *disk, boolean report_only)
+{
+    fat_defrag_t count;
+    fat_defrag_t ctx;
+    uint32_t pass;
+    uint32_t runs;
+
+    if (!disk->fat) {
+        ERR("No FAT to defrag");
+        return (false);
+    }
+
+    fat_defrag_report(disk, report_only ? "Fragmentation" : "Before");
+
+    if (report_only) {
+        return (true);
+    }
+
+    runs = fat_defrag_count(disk, &count);
+
+    memset(&ctx, 0, sizeof(ctx));
+
+    /*
+     * A fragmented file may only fit once enough has been packed down, so
+     * go round again while a pass leaves fewer fragmented files or fewer
+     * free runs. Files are swept until they settle and dirs only move to
+     * merge free runs, so a pass over a packed disk moves nothing.
+     */
+    for (pass = 0; pass < MAX_DEFRAG_PASSES; pass++) {
+        uint32_t moved = ctx.moved_files + ctx.moved_dirs;
+        uint32_t fragmented = count.fragmented;
+        uint32_t was = runs;
+
+        /*
+         * Cluster 0 is the root dir on every FAT type. It never moves.
+         */
+        ctx.pass = FAT_DEFRAG_DIRS;
+        fat_defrag_dir(disk, &ctx, 0, 0, 0, 0, 0);
+
+        ctx.pass = FAT_DEFRAG_FILES;
+        fat_defrag_dir(disk, &ctx, 0, 0, 0, 0, 0);
+        fat_defrag_files(disk, &ctx);
+
+        if (moved == ctx.moved_files + ctx.moved_dirs) {
+            break;
+        }
+
+        runs = fat_defrag_count(disk, &count);
+
+        if ((count.fragmented >= fragmented) && (runs >= was)) {
+            break;
+        }
+    }
+
+    fat_write(disk);
+    disk_sync(disk);
+
+    OUT("%" PRIu32 " file moves, %" PRIu32 " dir moves, %" PRIu64
+        " bytes copied",
+        ctx.moved_files, ctx.moved_dirs, ctx.moved_bytes);
+
+    fat_defrag_report(disk, "After");
+
+    fat_defrag_count(disk, &count);
+    if (count.fragmented) {
+        fat_defrag_left(disk, 0, "", 0);
+
+        ERR("%" PRIu32 " files are still fragmented, no free run is big "
+            "enough to hold them", count.fragmented);
+        return (false);
+    }
+
+    return (true);
+}
+
+/*
+ * fat_shrink
+ *
+ * Move whatever lies past the clusters in use down into free clusters
+ * below, so the data area can be cut short. Returns how many clusters the
+ * data area still needs.
+ */
+uint32_t fat_shrink (disk_t *disk)
+{
+    uint64_t free_clusters = 0;
+    uint32_t min_clusters = 0;
+    uint32_t clusters;
+    uint32_t cluster;
+    fat_defrag_t ctx;
+    uint32_t e;
+
+    if (!disk->fat) {
+        ERR("No FAT to shrink");
+        return (0);
+    }
+
+    /*
+     * The cluster count decides the FAT type, so never go below the least
+     * count for this one.
+     */
+    if (fat_type(disk) == 16) {
+        min_clusters = 4085;
+    } else if (fat_type(disk) == 32) {
+        min_clusters = 65525;
+    }
+
+    fat_free_extents_build(disk);
+
+    for (e = 0; e < disk->number_of_free_extents; e++) {
+        free_clusters += disk->free_extents[e].count;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pass = FAT_DEFRAG_SHRINK;
+    ctx.limit = max(min_clusters,
+                    total_clusters(disk) - (uint32_t) free_clusters);
+
+    if (ctx.limit < total_clusters(disk)) {
+        fat_defrag_dir(disk, &ctx, 0, 0, 0, 0, 0);
+    }
+
+    /*
+     * The index was cut short at the limit.
+     */
+    fat_free_extents_free(disk);
+
+    fat_write(disk);
+    disk_sync(disk);
+
+    /*
+     * Whatever could not move, like the FAT32 root dir, sets the end.
+     */
+    for (cluster = total_clusters(disk) - 1; cluster >= 2; cluster--) {
+        if (cluster_next_raw(disk, cluster)) {
+            break;
+        }
+    }
+
+    clusters = min(total_clusters(disk), max(min_clusters, cluster + 1));
+
+    OUT("%" PRIu32 " file moves, %" PRIu32 " dir moves, %" PRIu64
+        " bytes copied",
+        ctx.moved_files, ctx.moved_dirs, ctx.moved_bytes);
+
+    return (clusters);
+}
+
+/*
+ * fat_entry_bytes
+ *
+ * How many bytes of FAT it takes to describe this many clusters.
+ */
+static uint64_t fat_entry_bytes (disk_t *disk, uint64_t clusters)
+{
+    if (fat_type(disk) == 12) {
+        return (((clusters * 3) + 1) / 2);
+    } else if (fat_type(disk) == 16) {
+        return (clusters * 2);
+    }
+
+    return (clusters * 4);
+}
+
+/*
+ * fat_grow
+ *
+ * Grow the filesystem to new_sectors in place. If the FAT has to grow to
+ * cover the new clusters it takes over the first data clusters. What is
+ * in them is moved out first, crash safely as for defrag; then every
+ * cluster number is shifted down so the data itself stays put. That
+ * renumbering is not crash safe.
+ */
+boolean fat_grow (disk_t *disk, uint64_t new_sectors)
+{
+    uint64_t old_fat_sectors = fat_size_sectors(disk);
+    uint32_t old_root_sector = sector_root_dir(disk);
+    uint32_t old_clusters = total_clusters(disk);
+    uint32_t root_sectors = root_dir_size_sectors(disk);
+    uint32_t spc = disk->mbr->sectors_per_cluster;
+    uint32_t nfats = disk->mbr->number_of_fats;
+    uint32_t type = fat_type(disk);
+    uint64_t max_clusters;
+    uint64_t fat_sectors;
+    uint64_t overhead;
+    uint64_t clusters;
+    uint32_t *next = 0;
+    uint8_t *root = 0;
+    uint8_t *old_fat;
+    fat_defrag_t ctx;
+    uint32_t cluster;
+    uint32_t i;
+
+    if (!disk->fat) {
+        ERR("No FAT to grow");
+        return (false);
+    }
+
+    if (type == 12) {
+        max_clusters = 4084;
+    } else if (type == 16) {
+        max_clusters = 65524;
+    } else {
+        max_clusters = 0x0FFFFFF5;
+    }
+
+    /*
+     * Find a FAT size that covers what is left once it is taken out,
+     * growing it in steps that keep the data area cluster aligned.
+     */
+    fat_sectors = old_fat_sectors;
+
+    for (;;) {
+        overhead = sector_reserved_count(disk) + (nfats * fat_sectors) +
+                        root_sectors;
+
+        if (new_sectors <= overhead) {
+            ERR("%" PRIu64 " sectors is too small", new_sectors);
+            return (false);
+        }
+
+        clusters = (new_sectors - overhead) / spc;
+
+        if (fat_entry_bytes(disk, clusters + 2) <=
+                fat_sectors * sector_size(disk)) {
+            break;
+        }
+
+        do {
+            fat_sectors++;
+        } while ((nfats * (fat_sectors - old_fat_sectors)) % spc);
+    }
+
+    if (clusters > max_clusters) {
+        ERR("FAT%" PRIu32 " can have at most %" PRIu64 " clusters, "
+            "not %" PRIu64, type, max_clusters, clusters);
+        return (false);
+    }
+
+    if (clusters <= old_clusters) {
+        ERR("Growing to %" PRIu64 " sectors gains no clusters", new_sectors);
+        return (false);
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.shift = (uint32_t) ((nfats * (fat_sectors - old_fat_sectors)) / spc);
+    ctx.limit = ctx.shift + 2;
+
+    if (ctx.shift) {
+        if (ctx.limit >= old_clusters) {
+            ERR("Too small to make room for a larger FAT");
+            return (false);
+        }
+
+        ctx.pass = FAT_DEFRAG_GROW;
+
+        /*
+         * The FAT32 root dir has no dirent, so move it here.
+         */
+        if ((type == 32) &&
+            (disk->mbr->fat.fat32.root_cluster < ctx.limit)) {
+            fat_defrag_move_t move;
+
+            if (!fat_defrag_move(disk, &ctx, disk->mbr->fat.fat32.root_cluster,
+                                 true, 0, &move)) {
+                ERR("No room to move the root dir");
+                return (false);
+            }
+
+            fat_write(disk);
+            disk_sync(disk);
+
+            ctx.old_root_cluster = disk->mbr->fat.fat32.root_cluster;
+            disk->mbr->fat.fat32.root_cluster = move.new_cluster;
+            if (!boot_record_write(disk)) {
+                return (false);
+            }
+            disk_sync(disk);
+
+            fat_defrag_free(disk, &move);
+        }
+
+        fat_defrag_dir(disk, &ctx, 0, 0, 0, 0, 0);
+
+        fat_write(disk);
+        disk_sync(disk);
+
+        if (ctx.stuck) {
+            ERR("Not enough free space to make room for a larger FAT");
+            return (false);
+        }
+
+        /*
+         * Anything still in use below the limit is not reachable from any
+         * dir, like the cluster format leaves marked on FAT12/16.
+         */
+        for (cluster = 2; cluster < ctx.limit; cluster++) {
+            if (cluster_next_raw(disk, cluster)) {
+                DBG("Dropping leaked cluster %" PRIu32 "", cluster);
+            }
+        }
+
+        /*
+         * Nothing lives below the limit now. Shift every reference down.
+         */
+        ctx.pass = FAT_DEFRAG_RENUMBER;
+        fat_defrag_dir(disk, &ctx, 0, 0, 0, 0, 0);
+
+        if (type == 32) {
+            disk->mbr->fat.fat32.root_cluster -= ctx.shift;
+        }
+
+        next = (typeof(next))
+                myzalloc(old_clusters * sizeof(uint32_t), __FUNCTION__);
+
+        for (cluster = 0; cluster < old_clusters; cluster++) {
+            next[cluster] = cluster_next_raw(disk, cluster);
+        }
+
+        if (root_sectors) {
+            root = sector_read_no_cache(disk, old_root_sector, root_sectors);
+            if (!root) {
+                myfree(next);
+                ERR("Cannot read the root dir");
+                return (false);
+            }
+        }
+    }
+
+    /*
+     * What is pending was placed for the old layout; write it out under it.
+     */
+    if (!disk_flush(disk)) {
+        myfree(next);
+        myfree(root);
+        return (false);
+    }
+
+    /*
+     * Switch to the new layout.
+     */
+    if (disk->mbr->fat_size_sectors) {
+        disk->mbr->fat_size_sectors = (uint16_t) fat_sectors;
+    } else {
+        disk->mbr->fat.fat32.fat_size_sectors = (uint32_t) fat_sectors;
+    }
+
+    sector_count_total_set(disk, new_sectors);
+
+    sector_cache_destroy(disk);
+    fat_extent_map_free(disk);
+    fat_free_extents_free(disk);
+
+    old_fat = (uint8_t *) disk->fat;
+    disk->fat = (typeof(disk->fat))
+                    myzalloc(fat_sectors * sector_size(disk), __FUNCTION__);
+
+    if (!next) {
+        memcpy(disk->fat, old_fat, old_fat_sectors * sector_size(disk));
+
+        for (cluster = old_clusters; cluster < total_clusters(disk);
+             cluster++) {
+            if (cluster_next_raw(disk, cluster)) {
+                cluster_next_set(disk, cluster, 0, false /* update FAT */);
+            }
+        }
+    } else {
+        /*
+         * Entries 0 and 1 hold the media type and flags, not clusters.
+         */
+        cluster_next_set(disk, 0, next[0], false /* update FAT */);
+        cluster_next_set(disk, 1, next[1], false /* update FAT */);
+
+        for (cluster = ctx.limit; cluster < old_clusters; cluster++) {
+            uint32_t value = next[cluster];
+
+            if (!value) {
+                continue;
+            }
+
+            if ((value >= 2) && (value < old_clusters)) {
+                value -= ctx.shift;
+            }
+
+            cluster_next_set(disk, cluster - ctx.shift, value,
+                             false /* update FAT */);
+        }
+
+        myfree(next);
+    }
+
+    myfree(old_fat);
+
+    for (i = 0; i < nfats; i++) {
+        if (!sector_write_no_cache(disk,
+                                   sector_reserved_count(disk) +
+                                        (i * fat_sectors),
+                                   (uint8_t *) disk->fat, fat_sectors)) {
+            ERR("Cannot write FAT %" PRIu32 "", i);
+            return (false);
+        }
+    }
+
+    if (root) {
+        if (!sector_write_no_cache(disk, sector_root_dir(disk), root,
+                                   root_sectors)) {
+            myfree(root);
+            ERR("Cannot write the root dir");
+            return (false);
+        }
+
+        myfree(root);
+    }
+
+    if (!boot_record_write(disk)) {
+        return (false);
+    }
+
+    disk_sync(disk);
+
+    if (ctx.shift) {
+        OUT("FAT grown by %" PRIu64 " sectors, %" PRIu32 " file moves, "
+            "%" PRIu32 " dir moves, %" PRIu64 " bytes copied",
+            fat_sectors - old_fat_sectors,
+            ctx.moved_files, ctx.moved_dirs, ctx.moved_bytes);
+    }
+
+    return (true);
+}
+
+/*
+ * What check can find wrong with one dirent, or the FAT32 root chain.
+ */
+typedef enum {
+    FAT_CHECK_CROSS,
+    FAT_CHECK_LOOP,
+    FAT_CHECK_BROKEN,
+    FAT_CHECK_SIZE,
+    FAT_CHECK_DOT,
+} fat_check_kind_t;
+
+/*
+ * The chain is good up to keep clusters, ending at cut. For . and ..,
+ * cluster is what they should name and found what they do.
+ */
+typedef struct fat_check_problem_ {
+    fat_check_kind_t kind;
+    uint32_t dir;
+    uint32_t index;
+    uint32_t cluster;
+    uint32_t found;
+    uint32_t cut;
+    uint32_t keep;
+    uint32_t size;
+} fat_check_problem_t;
+
+/*
+ * A dir for the walk to read; dirs is also the work queue. The root is
+ * dirs[0]. index is where its dirent is in its parent, and dotdot what
+ * its .. entry should name.
+ */
+typedef struct fat_check_dir_ {
+    uint32_t first;
+    uint32_t clusters;
+    uint32_t parent;
+    uint32_t index;
+    uint32_t dotdot;
+} fat_check_dir_t;
+
+/*
+ * Marks the root chain rather than a dirent in a problem.
+ */
+#define FAT_CHECK_ROOT 0xffffffff
+
+/*
+ * Shared by the check threads. Each cluster reached from a dirent sets
+ * its bit in owned, atomically; finding it already set means two chains
+ * meet. The FAT is only read. Everything else is under lock, which also
+ * covers allocation as the allocator counts are not thread safe.
+ */
+typedef struct fat_check_ {
+    disk_t *disk;
+    uint64_t *owned;
+    uint32_t clusters;
+    uint32_t bad;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    fat_check_dir_t *dirs;
+    uint32_t number_of_dirs;
+    uint32_t max_dirs;
+    uint32_t next_dir;
+    uint32_t busy;
+    fat_check_problem_t *problems;
+    uint32_t number_of_problems;
+    uint32_t max_problems;
+    uint32_t files;
+    uint32_t used;
+    uint32_t read_errors;
+} fat_check_t;
+
+/*
+ * fat_check_claim
+ *
+ * Mark a cluster as owned. Returns true if something already had it.
+ */
+static boolean fat_check_claim (fat_check_t *ctx, uint32_t cluster)
+{
+    uint64_t bit = 1ULL << (cluster & 63);
+
+    return ((__atomic_fetch_or(&ctx->owned[cluster >> 6], bit,
+                               __ATOMIC_RELAXED) & bit) != 0);
+}
+
+/*
+ * fat_check_owned
+ */
+static boolean fat_check_owned (fat_check_t *ctx, uint32_t cluster)
+{
+    return ((ctx->owned[cluster >> 6] & (1ULL << (cluster & 63))) != 0);
+}
+
+/*
+ * fat_check_in_chain
+ *
+ * Is cluster one of the first count clusters of the chain?
+ */
+static boolean fat_check_in_chain (fat_check_t *ctx, uint32_t first,
+                                   uint32_t count, uint32_t cluster)
+{
+    while (count--) {
+        if (first == cluster) {
+            return (true);
+        }
+
+        first = cluster_next_raw(ctx->disk, first);
+    }
+
+    return (false);
+}
+
+/*
+ * fat_check_chain
+ *
+ * Follow a chain, claiming its clusters, up to limit of them if set.
+ * Returns false if it runs into another chain, back into itself, off
+ * into a free, bad or out of range cluster, or on past the limit, with
+ * problem saying where to cut it. What is past the limit is left for the
+ * chain it runs into, or is lost.
+ */
+static boolean fat_check_chain (fat_check_t *ctx, uint32_t first,
+                                uint32_t limit, fat_check_problem_t *problem)
+{
+    disk_t *disk = ctx->disk;
+    uint32_t cluster = first;
+    uint32_t prev = 0;
+    uint32_t next;
+
+    problem->keep = 0;
+    problem->cut = 0;
+
+    for (;;) {
+        if ((cluster < 2) || (cluster >= ctx->clusters)) {
+            problem->kind = FAT_CHECK_BROKEN;
+            break;
+        }
+
+        if (fat_check_claim(ctx, cluster)) {
+            if (fat_check_in_chain(ctx, first, problem->keep, cluster)) {
+                problem->kind = FAT_CHECK_LOOP;
+            } else {
+                problem->kind = FAT_CHECK_CROSS;
+            }
+            break;
+        }
+
+        next = cluster_next_raw(disk, cluster);
+
+        /*
+         * A bad cluster is dropped; one marked free ends the chain.
+         */
+        if (next == ctx->bad) {
+            problem->kind = FAT_CHECK_BROKEN;
+            break;
+        }
+
+        problem->keep++;
+        __atomic_fetch_add(&ctx->used, 1, __ATOMIC_RELAXED);
+
+        if (!next) {
+            problem->kind = FAT_CHECK_BROKEN;
+            prev = cluster;
+            cluster = 0;
+            break;
+        }
+
+        if (cluster_endchain(disk, next)) {
+            return (true);
+        }
+
+        prev = cluster;
+        cluster = next;
+
+        if (problem->keep == limit) {
+            problem->kind = FAT_CHECK_SIZE;
+            break;
+        }
+    }
+
+    problem->cluster = cluster;
+    problem->cut = prev;
+
+    return (false);
+}
+
+/*
+ * fat_check_need
+ *
+ * How many clusters a file of this size should have. Empty files added
+ * here are given one.
+ */
+static uint32_t fat_check_need (uint32_t size, uint64_t csize)
+{
+    if (!size) {
+        return (1);
+    }
+
+    return ((uint32_t) ((size + csize - 1) / csize));
+}
+
+/*
+ * fat_check_add_problem
+ */
+static void fat_check_add_problem (fat_check_t *ctx,
+                                   const fat_check_problem_t *problem)
+{
+    pthread_mutex_lock(&ctx->lock);
+
+    if (ctx->number_of_problems == ctx->max_problems) {
+        ctx->max_problems = ctx->max_problems ? ctx->max_problems * 2 : 16;
+        ctx->problems = (typeof(ctx->problems))
+            myrealloc(ctx->problems,
+                      ctx->max_problems * sizeof(fat_check_problem_t),
+                      __FUNCTION__);
+    }
+
+    ctx->problems[ctx->number_of_problems++] = *problem;
+
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * fat_check_add_dir
+ *
+ * Queue a dir for the walk. The caller holds the lock.
+ */
+static void fat_check_add_dir (fat_check_t *ctx, const fat_check_dir_t *dir)
+{
+    if (ctx->number_of_dirs == ctx->max_dirs) {
+        ctx->max_dirs = ctx->max_dirs ? ctx->max_dirs * 2 : 256;
+        ctx->dirs = (typeof(ctx->dirs))
+            myrealloc(ctx->dirs, ctx->max_dirs * sizeof(fat_check_dir_t),
+                      __FUNCTION__);
+    }
+
+    ctx->dirs[ctx->number_of_dirs++] = *dir;
+}
+
+/*
+ * fat_check_dir_read
+ *
+ * Read the good part of a dir with pread, so each thread needs only its
+ * own fd and none of the disk's caches. Runs of contiguous clusters are
+ * read at once. Returns the length read, 0 on error.
+ */
+static uint64_t fat_check_dir_read (fat_check_t *ctx, int fd,
+                                    const fat_check_dir_t *dir,
+                                    uint8_t **buf, uint64_t *buf_len)
+{
+    disk_t *disk = ctx->disk;
+    uint64_t csize = cluster_size(disk);
+    uint64_t len;
+    uint64_t done;
+    uint32_t cluster;
+    uint32_t run;
+    uint32_t n;
+
+    if (dir->first) {
+        len = dir->clusters * csize;
+    } else {
+        len = (uint64_t) root_dir_size_sectors(disk) * sector_size(disk);
+    }
+
+    if (len > *buf_len) {
+        pthread_mutex_lock(&ctx->lock);
+        myfree(*buf);
+        *buf = (typeof(*buf)) myzalloc(len, __FUNCTION__);
+        pthread_mutex_unlock(&ctx->lock);
+        *buf_len = len;
+    }
+
+    if (!dir->first) {
+        if (overlay_pread(disk->filename, fd, *buf, len,
+                          disk->offset +
+                          ((uint64_t) sector_root_dir(disk) *
+                           sector_size(disk))) != (ssize_t) len) {
+            return (0);
+        }
+
+        return (len);
+    }
+
+    done = 0;
+    cluster = dir->first;
+
+    for (n = 0; n < dir->clusters; n += run) {
+        uint32_t start = cluster;
+
+        run = 1;
+
+        for (;;) {
+            cluster = cluster_next_raw(disk, cluster);
+
+            if ((n + run == dir->clusters) || (cluster != start + run)) {
+                break;
+            }
+
+            run++;
+        }
+
+        if (overlay_pread(disk->filename, fd, *buf + done, run * csize,
+                          disk->offset +
+                          ((uint64_t) cluster_to_sector(disk, start - 2) *
+                           sector_size(disk))) != (ssize_t) (run * csize)) {
+            return (0);
+        }
+
+        done += run * csize;
+    }
+
+    return (len);
+}
+
+/*
+ * fat_check_scan_dir
+ *
+ * Check every dirent in one dir, claiming the chains they name and
+ * queueing subdirs.
+ */
+static void fat_check_scan_dir (fat_check_t *ctx, uint32_t d,
+                                const fat_check_dir_t *dir,
+                                const uint8_t *data, uint64_t len)
+{
+    disk_t *disk = ctx->disk;
+    uint64_t csize = cluster_size(disk);
+    fat_check_problem_t problem;
+    fat_check_dir_t subdir;
+    uint32_t i;
+
+    for (i = 0; i < len / FAT_DIRENT_SIZE; i++) {
+        const fat_dirent_t *dirent =
+            (const fat_dirent_t *) (data + (i * FAT_DIRENT_SIZE));
+        uint32_t first;
+        uint32_t need;
+
+        if (!dirent->name[0] ||
+            (dirent->name[0] == FAT_FILE_DELETE_CHAR) ||
+            (dirent->attr == 0x0F) ||
+            (dirent->attr & FAT_ATTR_IS_LABEL)) {
+            continue;
+        }
+
+        memset(&problem, 0, sizeof(problem));
+        problem.dir = d;
+        problem.index = i;
+
+        first = dirent_first_cluster(dirent);
+
+        /*
+         * A subdir of the root names it as 0 in .., though some name the
+         * FAT32 root cluster.
+         */
+        if (dirent->name[0] == '.') {
+            uint32_t want = dir->first;
+
+            if (dirent->name[1] == '.') {
+                want = dir->dotdot;
+
+                if (!want && (fat_type(disk) == 32) &&
+                    (first == disk->mbr->fat.fat32.root_cluster)) {
+                    want = first;
+                }
+            }
+
+            if (first != want) {
+                problem.kind = FAT_CHECK_DOT;
+                problem.cluster = want;
+                problem.found = first;
+                fat_check_add_problem(ctx, &problem);
+            }
+
+            continue;
+        }
+
+        if (!(dirent->attr & FAT_ATTR_IS_DIR)) {
+            __atomic_fetch_add(&ctx->files, 1, __ATOMIC_RELAXED);
+        }
+
+        if (!first) {
+            if (dirent->attr & FAT_ATTR_IS_DIR) {
+                problem.kind = FAT_CHECK_BROKEN;
+                fat_check_add_problem(ctx, &problem);
+            } else if (dirent->size) {
+                problem.kind = FAT_CHECK_SIZE;
+                problem.size = dirent->size;
+                fat_check_add_problem(ctx, &problem);
+            }
+
+            continue;
+        }
+
+        /*
+         * A file only claims as much as its size needs, so one that runs
+         * on into another file does not take it over.
+         */
+        need = 0;
+        if (!(dirent->attr & FAT_ATTR_IS_DIR)) {
+            need = fat_check_need(dirent->size, csize);
+        }
+
+        problem.size = dirent->size;
+
+        if (!fat_check_chain(ctx, first, need, &problem)) {
+            fat_check_add_problem(ctx, &problem);
+        } else if (problem.keep < need) {
+            problem.kind = FAT_CHECK_SIZE;
+            fat_check_add_problem(ctx, &problem);
+        }
+
+        if ((dirent->attr & FAT_ATTR_IS_DIR) && problem.keep) {
+            subdir.first = first;
+            subdir.clusters = problem.keep;
+            subdir.parent = d;
+            subdir.index = i;
+            subdir.dotdot = d ? dir->first : 0;
+
+            pthread_mutex_lock(&ctx->lock);
+            fat_check_add_dir(ctx, &subdir);
+            pthread_cond_signal(&ctx->wake);
+            pthread_mutex_unlock(&ctx->lock);
+        }
+    }
+}
+
+/*
+ * fat_check_worker
+ *
+ * Take dirs off the queue until it is empty and no one else can add to
+ * it.
+ */
+static void *fat_check_worker (void *arg)
+{
+    fat_check_t *ctx = (typeof(ctx)) arg;
+    fat_check_dir_t dir;
+    uint64_t buf_len = 0;
+    uint8_t *buf = 0;
+    uint64_t len;
+    uint32_t d;
+    int fd;
+
+    fd = open(ctx->disk->filename, O_RDONLY);
+
+    pthread_mutex_lock(&ctx->lock);
+
+    for (;;) {
+        while ((ctx->next_dir == ctx->number_of_dirs) && ctx->busy) {
+            pthread_cond_wait(&ctx->wake, &ctx->lock);
+        }
+
+        if ((ctx->next_dir == ctx->number_of_dirs) || (fd < 0)) {
+            break;
+        }
+
+        d = ctx->next_dir++;
+        dir = ctx->dirs[d];
+        ctx->busy++;
+
+        pthread_mutex_unlock(&ctx->lock);
+
+        len = fat_check_dir_read(ctx, fd, &dir, &buf, &buf_len);
+        if (len) {
+            fat_check_scan_dir(ctx, d, &dir, buf, len);
+        } else {
+            __atomic_fetch_add(&ctx->read_errors, 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+
+        ctx->busy--;
+        pthread_cond_broadcast(&ctx->wake);
+    }
+
+    if (fd < 0) {
+        ctx->read_errors++;
+    }
+
+    myfree(buf);
+
+    pthread_cond_broadcast(&ctx->wake);
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    return (0);
+}
+
+/*
+ * fat_check_fats
+ *
+ * Compare each backup FAT on disk with the first. Returns how many
+ * differ.
+ */
+static uint32_t fat_check_fats (disk_t *disk)
+{
+    uint64_t sectors = fat_size_sectors(disk);
+    uint32_t size = sector_size(disk);
+    uint32_t differ = 0;
+    uint32_t sector;
+    uint32_t count;
+    uint8_t *first;
+    uint8_t *copy;
+    uint32_t i;
+
+    first = sector_read_no_cache(disk, sector_reserved_count(disk), sectors);
+
+    for (i = 1; i < disk->mbr->number_of_fats; i++) {
+        copy = sector_read_no_cache(disk,
+                                    sector_reserved_count(disk) +
+                                        (i * sectors),
+                                    sectors);
+        count = 0;
+
+        for (sector = 0; sector < sectors; sector++) {
+            if (memcmp(copy + (sector * size),
+                       first + (sector * size), size)) {
+                count++;
+            }
+        }
+
+        myfree(copy);
+
+        if (count) {
+            WARN("FAT %" PRIu32 " differs from FAT 0 in %" PRIu32
+                 " sectors", i, count);
+            differ++;
+        }
+    }
+
+    myfree(first);
+
+    return (differ);
+}
+
+/*
+ * fat_check_name
+ *
+ * The name of a dirent, long if it has one.
+ */
+static void fat_check_name (fat_check_t *ctx, uint32_t d, uint32_t index,
+                            char *out, uint32_t out_len)
+{
+    char vfat_filename[MAX_STR];
+    uint64_t buf_len = 0;
+    uint8_t *buf = 0;
+    char *name;
+    uint32_t i;
+    int fd;
+
+    snprintf(out, out_len, "?");
+
+    fd = open(ctx->disk->filename, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    if (fat_check_dir_read(ctx, fd, &ctx->dirs[d], &buf, &buf_len)) {
+        vfat_filename[0] = '\0';
+
+        for (i = 0; i <= index; i++) {
+            name = dirent_read_name(ctx->disk, (fat_dirent_t *)
+                                        (buf + (i * FAT_DIRENT_SIZE)),
+                                    vfat_filename);
+            if (!name) {
+                continue;
+            }
+
+            if (i == index) {
+                strchop(vfat_filename);
+                snprintf(out, out_len, "%s",
+                         *vfat_filename ? vfat_filename : name);
+            }
+
+            vfat_filename[0] = '\0';
+            myfree(name);
+        }
+    }
+
+    myfree(buf);
+    close(fd);
+}
+
+/*
+ * fat_check_path
+ *
+ * Full path of a dirent, for the report.
+ */
+static void fat_check_path (fat_check_t *ctx, uint32_t d, uint32_t index,
+                            char *out, uint32_t out_len)
+{
+    char name[MAX_STR];
+    uint32_t len;
+
+    if (index == FAT_CHECK_ROOT) {
+        snprintf(out, out_len, "/");
+        return;
+    }
+
+    if (d) {
+        fat_check_path(ctx, ctx->dirs[d].parent, ctx->dirs[d].index,
+                       out, out_len);
+    } else {
+        out[0] = '\0';
+    }
+
+    fat_check_name(ctx, d, index, name, sizeof(name));
+
+    len = (uint32_t) strlen(out);
+    snprintf(out + len, out_len - len, "/%s", name);
+}
+
+/*
+ * fat_check_report
+ */
+static void fat_check_report (fat_check_t *ctx,
+                              const fat_check_problem_t *problem)
+{
+    char path[MAX_STR];
+
+    fat_check_path(ctx, problem->dir, problem->index, path, sizeof(path));
+
+    switch (problem->kind) {
+    case FAT_CHECK_CROSS:
+        WARN("%s: cross-linked with another chain at cluster %" PRIu32 "",
+             path, problem->cluster);
+        break;
+
+    case FAT_CHECK_LOOP:
+        WARN("%s: chain loops back to cluster %" PRIu32 "",
+             path, problem->cluster);
+        break;
+
+    case FAT_CHECK_BROKEN:
+        WARN("%s: chain broken after %" PRIu32 " clusters",
+             path, problem->keep);
+        break;
+
+    case FAT_CHECK_SIZE:
+        if (problem->cut) {
+            WARN("%s: chain runs on past its size %" PRIu32 " into "
+                 "cluster %" PRIu32 "", path, problem->size,
+                 problem->cluster);
+        } else {
+            WARN("%s: size %" PRIu32 " is more than its %" PRIu32
+                 " clusters hold", path, problem->size, problem->keep);
+        }
+        break;
+
+    case FAT_CHECK_DOT:
+        WARN("%s: names cluster %" PRIu32 ", not %" PRIu32 "",
+             path, problem->found, problem->cluster);
+        break;
+    }
+}
+
+/*
+ * fat_check_fix
+ *
+ * Make a dirent agree with what is left of its chain, once the chain has
+ * been cut. Files cut short lose the size they no longer hold; dirs with
+ * nothing left are removed.
+ */
+static void fat_check_fix (disk_t *disk, fat_check_t *ctx,
+                           const fat_check_problem_t *problem)
+{
+    uint64_t csize = cluster_size(disk);
+    fat_dirent_t *dirent;
+    dirent_t *dirents;
+
+    if (problem->index == FAT_CHECK_ROOT) {
+        return;
+    }
+
+    dirents = dirents_alloc(disk, ctx->dirs[problem->dir].first);
+    if (!dirents) {
+        return;
+    }
+
+    dirent = (fat_dirent_t *)
+            (((uint8_t*) dirents->dirents) +
+             (problem->index * FAT_DIRENT_SIZE));
+
+    dirents->modified = true;
+
+    if (problem->kind == FAT_CHECK_DOT) {
+        dirent->h_first_cluster = (problem->cluster & 0xffff0000) >> 16;
+        dirent->l_first_cluster = (problem->cluster & 0x0000ffff);
+    } else if (dirent_is_dir(dirent)) {
+        if (!problem->keep) {
+            dirent->name[0] = FAT_FILE_DELETE_CHAR;
+        }
+    } else if (problem->keep < fat_check_need(dirent->size, csize)) {
+        dirent->size = (uint32_t) (problem->keep * csize);
+
+        if (!problem->keep) {
+            dirent->h_first_cluster = 0;
+            dirent->l_first_cluster = 0;
+        }
+    }
+
+    dirents_free(disk, dirents);
+}
+
+/*
+ * fat_check
+ *
+ * Walk every dir, in parallel across the tree, checking that each chain
+ * is owned once, ends properly and matches its file size, then look for
+ * clusters in use that nothing owns and backup FATs that differ. With
+ * repair, chains are cut where they go wrong, dirents made to agree,
+ * lost clusters freed and the backup FATs rewritten. Returns how many
+ * problems are left.
+ */
+uint32_t fat_check (disk_t *disk, boolean repair)
+{
+    fat_check_problem_t problem;
+    pthread_t threads[MAX_CHECK_THREADS];
+    fat_check_dir_t root;
+    fat_check_t ctx;
+    uint64_t *heads;
+    uint32_t number_of_threads;
+    uint32_t lost_chains = 0;
+    uint32_t lost = 0;
+    uint32_t problems;
+    uint32_t fats;
+    uint32_t cluster;
+    uint32_t next;
+    uint32_t i;
+    long cpus;
+
+    if (!disk->fat) {
+        ERR("No FAT to check");
+        return (0);
+    }
+
+    /*
+     * The threads read the image itself.
+     */
+    fat_write(disk);
+    disk_flush(disk);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.disk = disk;
+    ctx.bad = cluster_max(disk) - 1;
+
+    /*
+     * Clusters 2 up, as far as the FAT reaches.
+     */
+    ctx.clusters = total_clusters(disk) + 2;
+    if (fat_type(disk) == 12) {
+        ctx.clusters = min(ctx.clusters, (fat_size_bytes(disk) * 2) / 3);
+    } else if (fat_type(disk) == 16) {
+        ctx.clusters = min(ctx.clusters, fat_size_bytes(disk) / 2);
+    } else {
+        ctx.clusters = min(ctx.clusters, fat_size_bytes(disk) / 4);
+    }
+
+    ctx.owned = (typeof(ctx.owned))
+        myzalloc(((ctx.clusters / 64) + 1) * sizeof(uint64_t), __FUNCTION__);
+
+    pthread_mutex_init(&ctx.lock, 0);
+    pthread_cond_init(&ctx.wake, 0);
+
+    memset(&root, 0, sizeof(root));
+
+    if (fat_type(disk) == 32) {
+        memset(&problem, 0, sizeof(problem));
+        problem.index = FAT_CHECK_ROOT;
+
+        root.first = disk->mbr->fat.fat32.root_cluster;
+
+        if (!fat_check_chain(&ctx, root.first, 0, &problem)) {
+            fat_check_add_problem(&ctx, &problem);
+        }
+
+        root.clusters = problem.keep;
+    }
+
+    if (root.clusters || !root.first) {
+        fat_check_add_dir(&ctx, &root);
+    }
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    number_of_threads = (uint32_t) max(1L, min(cpus, (long) MAX_CHECK_THREADS));
+
+    for (i = 0; i < number_of_threads; i++) {
+        if (pthread_create(&threads[i], 0, fat_check_worker, &ctx)) {
+            break;
+        }
+    }
+
+    number_of_threads = i;
+
+    if (!number_of_threads) {
+        fat_check_worker(&ctx);
+    }
+
+    for (i = 0; i < number_of_threads; i++) {
+        pthread_join(threads[i], 0);
+    }
+
+    if (ctx.read_errors) {
+        ERR("%" PRIu32 " dirs could not be read", ctx.read_errors);
+    }
+
+    /*
+     * Whatever is in use but owned by nothing is lost. Chains of lost
+     * clusters start where no other lost cluster points.
+     */
+    heads = (typeof(heads))
+        myzalloc(((ctx.clusters / 64) + 1) * sizeof(uint64_t), __FUNCTION__);
+
+    for (cluster = 2; cluster < ctx.clusters; cluster++) {
+        next = cluster_next_raw(disk, cluster);
+
+        if (!next || (next == ctx.bad) || fat_check_owned(&ctx, cluster)) {
+            continue;
+        }
+
+        lost++;
+
+        if ((next >= 2) && (next < ctx.clusters)) {
+            heads[next >> 6] |= 1ULL << (next & 63);
+        }
+    }
+
+    for (cluster = 2; lost && (cluster < ctx.clusters); cluster++) {
+        next = cluster_next_raw(disk, cluster);
+
+        if (!next || (next == ctx.bad) || fat_check_owned(&ctx, cluster)) {
+            continue;
+        }
+
+        if (!(heads[cluster >> 6] & (1ULL << (cluster & 63)))) {
+            lost_chains++;
+        }
+    }
+
+    myfree(heads);
+
+    for (i = 0; i < ctx.number_of_problems; i++) {
+        fat_check_report(&ctx, &ctx.problems[i]);
+    }
+
+    if (lost) {
+        WARN("%" PRIu32 " lost clusters in %" PRIu32 " chains",
+             lost, lost_chains);
+    }
+
+    fats = fat_check_fats(disk);
+
+    OUT("%" PRIu32 " dirs, %" PRIu32 " files, %" PRIu32 " clusters in use, "
+        "%" PRIu32 " threads",
+        ctx.number_of_dirs, ctx.files, ctx.used, max(1U, number_of_threads));
+
+    problems = ctx.number_of_problems + (lost ? 1 : 0) + fats +
+               ctx.read_errors;
+
+    if (!problems) {
+        OUT("No problems found");
+    } else if (!repair) {
+        OUT("%" PRIu32 " problems found, check --repair to fix them",
+            problems);
+    } else {
+        /*
+         * Cut the chains first, so the dirents are read as they will be.
+         */
+        for (i = 0; i < ctx.number_of_problems; i++) {
+            if (ctx.problems[i].cut) {
+                cluster_next_set(disk, ctx.problems[i].cut, cluster_max(disk),
+                                 false /* update FAT */);
+            }
+        }
+
+        for (i = 0; i < ctx.number_of_problems; i++) {
+            fat_check_fix(disk, &ctx, &ctx.problems[i]);
+        }
+
+        for (cluster = 2; lost && (cluster < ctx.clusters); cluster++) {
+            next = cluster_next_raw(disk, cluster);
+
+            if (next && (next != ctx.bad) &&
+                !fat_check_owned(&ctx, cluster)) {
+                cluster_next_set(disk, cluster, 0, false /* update FAT */);
+            }
+        }
+
+        fat_write(disk);
+
+        for (i = 1; fats && (i < disk->mbr->number_of_fats); i++) {
+            if (!sector_write_no_cache(disk,
+                                       sector_reserved_count(disk) +
+                                           (i * fat_size_sectors(disk)),
+                                       disk->fat, fat_size_sectors(disk))) {
+                ERR("Cannot write FAT %" PRIu32 "", i);
+            }
+        }
+
+        disk_sync(disk);
+
+        OUT("%" PRIu32 " problems repaired", problems - ctx.read_errors);
+
+        problems = ctx.read_errors;
+    }
+
+    pthread_mutex_destroy(&ctx.lock);
+    pthread_cond_destroy(&ctx.wake);
+
+    myfree(ctx.owned);
+    myfree(ctx.dirs);
+    myfree(ctx.problems);
+
+    return (problems);
+}
@@ -23,3 +23,47 @@ void fat_write(disk_t *disk);
 uint64_t fat_size_bytes(disk_t *disk);
 uint64_t fat_size_sectors(disk_t *disk);
 uint64_t cluster_how_many_free(disk_t *disk);
+uint32_t disk_command_mkdir(disk_t *disk, const char *target_dir);
+uint32_t disk_command_mkdir_mtime(disk_t *disk, const char *target_dir,
+                                  int64_t mtime);
+uint32_t disk_command_write_file(disk_t *disk,
+                                 const char *target_file,
+                                 const uint8_t *data,
+                                 uint64_t len);
+uint32_t disk_command_write_fd(disk_t *disk,
+                               const char *target_file,
+                               int fd,
+                               uint64_t len,
+                               int64_t mtime,
+                               uint32_t attr,
+                               uint64_t *read);
+uint32_t disk_command_copy_file(disk_t *disk,
+                                const char *source_file,
+                                const char *target_file,
+                                int64_t mtime,
+                                uint32_t attr);
+boolean fat_lookup(disk_t *disk, const char *path, fat_dirent_t *out);
+boolean fat_lookup_exact(disk_t *disk, const char *path, fat_dirent_t *out);
+dirent_t *fat_dir_open(disk_t *disk, fat_dirent_t *dir);
+boolean fat_dir_next(disk_t *disk,
+                     dirent_t *dirents,
+                     uint32_t *index,
+                     fat_dirent_t *out,
+                     char *name,
+                     uint32_t name_len);
+void fat_dir_close(disk_t *disk, dirent_t *dirents);
+void fat_extent_map_free(disk_t *disk);
+void fat_free_extents_free(disk_t *disk);
+fat_extent_t *fat_used_extents(disk_t *disk, uint32_t *number_of_extents);
+boolean fat_defrag(disk_t *disk, boolean report_only);
+uint32_t fat_shrink(disk_t *disk);
+boolean fat_grow(disk_t *disk, uint64_t new_sectors);
+uint32_t fat_check(disk_t *disk, boolean repair);
+const fat_extent_t *fat_file_extents(disk_t *disk,
+                                     const fat_dirent_t *dirent,
+                                     uint32_t *number_of_extents);
+int64_t fat_file_read_at(disk_t *disk,
+                         const fat_dirent_t *dirent,
+                         uint64_t offset,
+                         uint8_t *buf,
+                         uint64_t len);
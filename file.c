@@ -326,7 +326,10 @@ unsigned char *file_read_if_exists (const char *filename, int64_t *out_len)
 boolean file_mtime (const char *filename,
                     int32_t *day,
                     int32_t *month,
-                    int32_t *year)
+                    int32_t *year,
+                    int32_t *hour,
+                    int32_t *min,
+                    int32_t *sec)
 {
     struct stat buf;
 
@@ -340,6 +343,29 @@ boolean file_mtime (const char *filename,
         *day = mytime->tm_mday;
         *month = mytime->tm_mon + 1;
         *year = mytime->tm_year + 1900;
+        *hour = mytime->tm_hour;
+        *min = mytime->tm_min;
+        *sec = mytime->tm_sec;
+
+        return (true);
+    }
+
+    return (false);
+}
+
+/*
+ * When was the file or dir last modified, in seconds since the epoch?
+ */
+boolean file_mtime_secs (const char *filename, int64_t *when)
+{
+    struct stat buf;
+
+    if (!filename) {
+        DIE("no filename");
+    }
+
+    if (stat(filename, &buf) >= 0) {
+        *when = (int64_t) buf.st_mtime;
 
         return (true);
     }
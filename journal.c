@@ -0,0 +1,358 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * A sidecar journal of the metadata blocks a flush is about to write, so
+ * an interrupted flush can be finished on the next open. The journal is
+ * made durable before the image is touched and removed once the image is,
+ * so it either holds a whole flush, which is replayed, or it does not
+ * commit, and the image never saw any of it.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+
+#define JOURNAL_MAGIC                   "FATDISKJ"
+#define JOURNAL_COMMIT                  "FATDISKC"
+#define JOURNAL_VERSION                 1
+
+/*
+ * In host byte order; a journal is only replayed where it was written.
+ */
+typedef struct journal_header_ {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+} journal_header_t;
+
+typedef struct journal_record_ {
+    uint64_t offset;
+    uint64_t len;
+} journal_record_t;
+
+typedef struct journal_commit_ {
+    char magic[8];
+    uint32_t count;
+    uint32_t crc;
+} journal_commit_t;
+
+/*
+ * journal_name
+ *
+ * The journal that goes with an image.
+ */
+char *
+journal_name (const char *filename)
+{
+    return (dynprintf("%s.journal", filename));
+}
+
+/*
+ * journal_write_all
+ *
+ * Write all of a buffer, adding it to the running checksum.
+ */
+static boolean
+journal_write_all (int fd, const void *data, uint64_t len, uint32_t *crc)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    ssize_t done;
+
+    if (crc) {
+        *crc = crc32c(*crc, p, len);
+    }
+
+    while (len) {
+        done = write(fd, p, len);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return (false);
+        }
+
+        p += done;
+        len -= (uint64_t) done;
+    }
+
+    return (true);
+}
+
+/*
+ * journal_sync_dir
+ *
+ * Make the journal appearing or going away durable.
+ */
+static void
+journal_sync_dir (const char *name)
+{
+    char *tmp = dupstr(name, __FUNCTION__);
+    int fd;
+
+    fd = open(dirname(tmp), O_RDONLY);
+    if (fd >= 0) {
+        (void) fsync(fd);
+        close(fd);
+    }
+
+    myfree(tmp);
+}
+
+/*
+ * journal_write
+ *
+ * Log the blocks about to be written to the image at base plus their
+ * offsets, and wait for the log to be on disk.
+ */
+boolean
+journal_write (const char *filename, uint64_t base,
+               const uring_write_t *writes, uint32_t count)
+{
+    char *name = journal_name(filename);
+    journal_header_t header;
+    journal_record_t record;
+    journal_commit_t commit;
+    uint32_t crc = 0;
+    boolean ok;
+    uint32_t i;
+    int fd;
+
+    fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ERR("Cannot create journal %s: %s", name, strerror(errno));
+        myfree(name);
+        return (false);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.count = count;
+
+    ok = journal_write_all(fd, &header, sizeof(header), &crc);
+
+    for (i = 0; ok && (i < count); i++) {
+        memset(&record, 0, sizeof(record));
+        record.offset = base + writes[i].offset;
+        record.len = writes[i].len;
+
+        ok = journal_write_all(fd, &record, sizeof(record), &crc) &&
+             journal_write_all(fd, writes[i].data, writes[i].len, &crc);
+    }
+
+    memset(&commit, 0, sizeof(commit));
+    memcpy(commit.magic, JOURNAL_COMMIT, sizeof(commit.magic));
+    commit.count = count;
+    commit.crc = crc;
+
+    ok = ok && journal_write_all(fd, &commit, sizeof(commit), 0);
+    ok = ok && !fdatasync(fd);
+
+    if (!ok) {
+        ERR("Cannot write journal %s: %s", name, strerror(errno));
+    }
+
+    close(fd);
+
+    journal_sync_dir(name);
+
+    myfree(name);
+
+    return (ok);
+}
+
+/*
+ * journal_remove
+ *
+ * The flush it logged is on the image; drop it for good.
+ */
+void
+journal_remove (const char *filename)
+{
+    char *name = journal_name(filename);
+
+    if (unlink(name) < 0) {
+        if (errno != ENOENT) {
+            WARN("Cannot remove journal %s: %s", name, strerror(errno));
+        }
+    } else {
+        journal_sync_dir(name);
+    }
+
+    myfree(name);
+}
+
+/*
+ * journal_valid
+ *
+ * Does the journal hold a whole, committed flush?
+ */
+static boolean
+journal_valid (const uint8_t *data, uint64_t len)
+{
+    const journal_header_t *header = (const journal_header_t *) data;
+    journal_commit_t commit;
+    journal_record_t record;
+    uint64_t at;
+    uint32_t crc;
+    uint32_t i;
+
+    if (len < sizeof(journal_header_t) + sizeof(journal_commit_t)) {
+        return (false);
+    }
+
+    if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) ||
+        (header->version != JOURNAL_VERSION)) {
+        return (false);
+    }
+
+    at = sizeof(*header);
+
+    for (i = 0; i < header->count; i++) {
+        if (len - at < sizeof(record) + sizeof(commit)) {
+            return (false);
+        }
+
+        memcpy(&record, data + at, sizeof(record));
+        at += sizeof(record);
+
+        if (record.len > len - at - sizeof(commit)) {
+            return (false);
+        }
+
+        at += record.len;
+    }
+
+    if (len - at != sizeof(commit)) {
+        return (false);
+    }
+
+    memcpy(&commit, data + at, sizeof(commit));
+    crc = crc32c(0, data, at);
+
+    return (!memcmp(commit.magic, JOURNAL_COMMIT, sizeof(commit.magic)) &&
+            (commit.count == header->count) && (commit.crc == crc));
+}
+
+/*
+ * journal_replay
+ *
+ * Finish a flush that was cut short, before the image is read. A journal
+ * that never committed is thrown away; the image was not touched by it.
+ * False only if a good journal could not be applied, and it is kept.
+ */
+boolean
+journal_replay (const char *filename)
+{
+    char *name = journal_name(filename);
+    const journal_header_t *header;
+    journal_record_t record;
+    uint8_t *data;
+    int64_t len;
+    boolean ok;
+    uint64_t at;
+    uint32_t i;
+    int fd;
+
+    if (!file_exists(name)) {
+        myfree(name);
+        return (true);
+    }
+
+    /*
+     * It was logged against the image itself, not a delta over it.
+     */
+    if (overlay_active(filename)) {
+        ERR("Open %s without --overlay to replay journal %s", filename,
+            name);
+        myfree(name);
+        return (false);
+    }
+
+    data = file_read(name, &len);
+    if (!data) {
+        myfree(name);
+        return (false);
+    }
+
+    if (!journal_valid(data, (uint64_t) len)) {
+        WARN("Discarding uncommitted journal %s", name);
+
+        myfree(data);
+        myfree(name);
+        journal_remove(filename);
+
+        return (true);
+    }
+
+    fd = open(filename, O_WRONLY);
+    if (fd < 0) {
+        ERR("Cannot open %s to replay journal %s: %s", filename, name,
+            strerror(errno));
+        myfree(data);
+        myfree(name);
+        return (false);
+    }
+
+    header = (const journal_header_t *) data;
+    at = sizeof(*header);
+    ok = true;
+
+    for (i = 0; ok && (i < header->count); i++) {
+        uint64_t done = 0;
+        ssize_t ret;
+
+        memcpy(&record, data + at, sizeof(record));
+        at += sizeof(record);
+
+        while (done < record.len) {
+            ret = pwrite(fd, data + at + done, record.len - done,
+                         (off_t) (record.offset + done));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+
+                ok = false;
+                break;
+            }
+
+            done += (uint64_t) ret;
+        }
+
+        at += record.len;
+    }
+
+    ok = ok && !fdatasync(fd);
+
+    close(fd);
+
+    if (!ok) {
+        ERR("Cannot replay journal %s onto %s: %s", name, filename,
+            strerror(errno));
+        myfree(data);
+        myfree(name);
+        return (false);
+    }
+
+    WARN("Replayed %" PRIu32 " blocks from journal %s", header->count, name);
+
+    myfree(data);
+    myfree(name);
+
+    journal_remove(filename);
+
+    return (true);
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * A sidecar journal of the metadata blocks a flush is about to write, so
+ * an interrupted flush can be finished on the next open.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+char *journal_name(const char *filename);
+boolean journal_write(const char *filename, uint64_t base,
+                      const uring_write_t *writes, uint32_t count);
+boolean journal_replay(const char *filename);
+void journal_remove(const char *filename);
+
+#endif
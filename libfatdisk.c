@@ -0,0 +1,534 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+
+#include "main.h"
+#include "disk.h"
+#include "fat.h"
+#include "command.h"
+#include "libfatdisk.h"
+
+/*
+ * Global options
+ */
+boolean opt_verbose;
+boolean opt_quiet;
+boolean opt_stats;
+boolean opt_direct;
+boolean opt_journal;
+boolean opt_debug;
+boolean opt_debug2;
+boolean opt_debug3;
+boolean opt_debug4;
+boolean opt_debug5;
+
+/*
+ * Most common sector size.
+ */
+uint32_t opt_sector_size = DEFAULT_SECTOR_SIZE;
+
+/*
+ * Sectors per cluster.
+ */
+uint32_t opt_sectors_per_cluster;
+
+/*
+ * Die and print usage message.
+ */
+boolean die_with_usage;
+
+/*
+ * Where to jump back to if we die inside a library call.
+ */
+static jmp_buf *fatdisk_catch;
+
+struct fatdisk_ {
+    disk_t *disk;
+    char *image;
+};
+
+struct fatdisk_dir_ {
+    fatdisk_t *fd;
+    dirent_t *dirents;
+    uint32_t index;
+};
+
+/*
+ * Default for library users. The CLI provides its own.
+ */
+__attribute__ ((weak)) void usage (void)
+{
+}
+
+/*
+ * Called when a fatal error is about to end the process. The CLI provides
+ * its own.
+ */
+__attribute__ ((weak)) void die_hook (void)
+{
+}
+
+/*
+ * Cleanup operations on exit.
+ */
+void quit (void)
+{
+    static boolean quitting;
+
+    if (fatdisk_catch) {
+        return;
+    }
+
+    if (quitting) {
+        return;
+    }
+
+    quitting = true;
+
+    trace_flush();
+
+    overlay_close();
+
+    ptrcheck_fini();
+}
+
+void die (void)
+{
+    if (fatdisk_catch) {
+        longjmp(*fatdisk_catch, 1);
+    }
+
+    die_hook();
+
+    quit();
+
+    exit(1);
+}
+
+/*
+ * die_guard
+ *
+ * Make a call such that a fatal error inside it returns false instead of
+ * exiting, e.g. so one bad shell command does not end the session.
+ */
+boolean die_guard (void (*call)(void *), void *context)
+{
+    jmp_buf catch_;
+    jmp_buf *outer_catch = fatdisk_catch;
+
+    if (setjmp(catch_)) {
+        fatdisk_catch = outer_catch;
+        croaked = false;
+        return (false);
+    }
+
+    fatdisk_catch = &catch_;
+
+    call(context);
+
+    fatdisk_catch = outer_catch;
+
+    return (true);
+}
+
+/*
+ * Wrap a library call so a fatal error returns FATDISK_ERR_FATAL instead of
+ * exiting, and nothing is printed while inside it.
+ */
+#define FATDISK_TRY(ret)                                                      \
+    jmp_buf catch_;                                                           \
+    jmp_buf *outer_catch_ = fatdisk_catch;                                    \
+    boolean outer_silent_ = log_silent;                                       \
+                                                                              \
+    if (setjmp(catch_)) {                                                     \
+        fatdisk_catch = outer_catch_;                                         \
+        log_silent = outer_silent_;                                           \
+        croaked = false;                                                      \
+        return (ret);                                                         \
+    }                                                                         \
+                                                                              \
+    fatdisk_catch = &catch_;                                                  \
+    log_silent = true;
+
+#define FATDISK_RETURN(ret)                                                   \
+    {                                                                         \
+        fatdisk_catch = outer_catch_;                                         \
+        log_silent = outer_silent_;                                           \
+        return (ret);                                                         \
+    }
+
+/*
+ * fatdisk_stat_fill
+ *
+ * Convert a dirent into the public stat form.
+ */
+static void fatdisk_stat_fill (fatdisk_t *fd,
+                               const fat_dirent_t *dirent,
+                               const char *name,
+                               fatdisk_stat_t *out)
+{
+    memset(out, 0, sizeof(*out));
+
+    snprintf(out->name, sizeof(out->name), "%s", name);
+
+    out->size = dirent->size;
+    out->first_cluster = (((uint32_t) dirent->h_first_cluster) << 16) |
+                         dirent->l_first_cluster;
+    out->attr = dirent->attr;
+    out->is_dir = (dirent->attr & 0x10) ? 1 : 0;
+    out->year = 1980 + dirent->lm_date.year;
+    out->month = dirent->lm_date.month;
+    out->day = dirent->lm_date.day;
+    out->hour = dirent->lm_time.hour;
+    out->minute = dirent->lm_time.min;
+    out->second = dirent->lm_time.sec * 2;
+}
+
+/*
+ * fatdisk_is_root
+ */
+static boolean fatdisk_is_root (const char *path)
+{
+    if (!path) {
+        return (true);
+    }
+
+    while (*path == '/') {
+        path++;
+    }
+
+    return (*path == '\0');
+}
+
+/*
+ * fatdisk_open_disk
+ *
+ * Open the disk for a new handle. Kept apart from fatdisk_open so a fatal
+ * error part way leaves the handle for it to free.
+ */
+static int fatdisk_open_disk (fatdisk_t *fd, int partition)
+{
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    /*
+     * Find the DOS disk in the file the same way the command line does.
+     */
+    int64_t offset = disk_command_query(fd->image,
+                                        partition < 0 ? 0 : (uint32_t) partition,
+                                        partition >= 0,
+                                        false /* hunt */);
+
+    fd->disk = disk_command_open(fd->image, offset,
+                                 partition < 0 ? 0 : (uint32_t) partition,
+                                 true);
+    if (!fd->disk) {
+        FATDISK_RETURN(FATDISK_ERR_IO);
+    }
+
+    FATDISK_RETURN(FATDISK_OK);
+}
+
+int fatdisk_open (const char *image, int partition, fatdisk_t **out)
+{
+    fatdisk_t *fd;
+    int ret;
+
+    if (!image || !out) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    *out = 0;
+
+    fd = (typeof(fd)) myzalloc(sizeof(*fd), __FUNCTION__);
+    fd->image = dupstr(image, __FUNCTION__);
+
+    ret = fatdisk_open_disk(fd, partition);
+    if (ret != FATDISK_OK) {
+        myfree(fd->image);
+        myfree(fd);
+        return (ret);
+    }
+
+    *out = fd;
+
+    return (FATDISK_OK);
+}
+
+int fatdisk_close (fatdisk_t *fd)
+{
+    if (!fd) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    disk_command_close(fd->disk);
+    myfree(fd->image);
+    myfree(fd);
+
+    FATDISK_RETURN(FATDISK_OK);
+}
+
+int fatdisk_sync (fatdisk_t *fd)
+{
+    if (!fd) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    disk_command_sync(fd->disk);
+
+    FATDISK_RETURN(FATDISK_OK);
+}
+
+int fatdisk_stat (fatdisk_t *fd, const char *path, fatdisk_stat_t *out)
+{
+    fat_dirent_t dirent;
+
+    if (!fd || !path || !out) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    if (fatdisk_is_root(path)) {
+        memset(out, 0, sizeof(*out));
+        snprintf(out->name, sizeof(out->name), "/");
+        out->is_dir = 1;
+        out->attr = 0x10;
+        return (FATDISK_OK);
+    }
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    if (!fat_lookup_exact(fd->disk, path, &dirent)) {
+        FATDISK_RETURN(FATDISK_ERR_NOENT);
+    }
+
+    char *tmp = dupstr(path, __FUNCTION__);
+    strchopc(tmp, '/');
+    char *name = strrchr(tmp, '/');
+
+    fatdisk_stat_fill(fd, &dirent, name ? name + 1 : tmp, out);
+    myfree(tmp);
+
+    FATDISK_RETURN(FATDISK_OK);
+}
+
+int fatdisk_opendir (fatdisk_t *fd, const char *path, fatdisk_dir_t **out)
+{
+    fat_dirent_t dirent;
+    fatdisk_dir_t *dir;
+    dirent_t *dirents;
+
+    if (!fd || !out) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    *out = 0;
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    if (fatdisk_is_root(path)) {
+        dirents = fat_dir_open(fd->disk, 0);
+    } else {
+        if (!fat_lookup_exact(fd->disk, path, &dirent)) {
+            FATDISK_RETURN(FATDISK_ERR_NOENT);
+        }
+
+        if (!(dirent.attr & 0x10)) {
+            FATDISK_RETURN(FATDISK_ERR_NOTDIR);
+        }
+
+        dirents = fat_dir_open(fd->disk, &dirent);
+    }
+
+    if (!dirents) {
+        FATDISK_RETURN(FATDISK_ERR_IO);
+    }
+
+    dir = (typeof(dir)) myzalloc(sizeof(*dir), __FUNCTION__);
+    dir->fd = fd;
+    dir->dirents = dirents;
+    *out = dir;
+
+    FATDISK_RETURN(FATDISK_OK);
+}
+
+int fatdisk_readdir (fatdisk_dir_t *dir, fatdisk_stat_t *out)
+{
+    char name[FATDISK_NAME_MAX];
+    fat_dirent_t dirent;
+
+    if (!dir || !out) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    if (!fat_dir_next(dir->fd->disk, dir->dirents, &dir->index, &dirent,
+                      name, sizeof(name))) {
+        FATDISK_RETURN(0);
+    }
+
+    fatdisk_stat_fill(dir->fd, &dirent, name, out);
+
+    FATDISK_RETURN(1);
+}
+
+int fatdisk_closedir (fatdisk_dir_t *dir)
+{
+    if (!dir) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    fat_dir_close(dir->fd->disk, dir->dirents);
+    myfree(dir);
+
+    FATDISK_RETURN(FATDISK_OK);
+}
+
+int64_t fatdisk_read_at (fatdisk_t *fd, const char *path,
+                         uint64_t offset, void *buf, uint64_t len)
+{
+    fat_dirent_t dirent;
+    int64_t got;
+
+    if (!fd || !path || (!buf && len)) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    if (!fat_lookup_exact(fd->disk, path, &dirent)) {
+        FATDISK_RETURN(FATDISK_ERR_NOENT);
+    }
+
+    if (dirent.attr & 0x10) {
+        FATDISK_RETURN(FATDISK_ERR_ISDIR);
+    }
+
+    got = fat_file_read_at(fd->disk, &dirent, offset, (uint8_t*) buf, len);
+    if (got < 0) {
+        FATDISK_RETURN(FATDISK_ERR_IO);
+    }
+
+    FATDISK_RETURN(got);
+}
+
+int fatdisk_write (fatdisk_t *fd, const char *path,
+                   const void *buf, uint64_t len)
+{
+    fat_dirent_t dirent;
+
+    if (!fd || !path || fatdisk_is_root(path) || (!buf && len) ||
+        (len > 0xFFFFFFFFULL)) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    if (fat_lookup_exact(fd->disk, path, &dirent) && (dirent.attr & 0x10)) {
+        FATDISK_RETURN(FATDISK_ERR_ISDIR);
+    }
+
+    if (len > cluster_how_many_free(fd->disk) * cluster_size(fd->disk)) {
+        FATDISK_RETURN(FATDISK_ERR_NOSPC);
+    }
+
+    if (!disk_command_write_file(fd->disk, path, (const uint8_t*) buf, len)) {
+        FATDISK_RETURN(FATDISK_ERR_IO);
+    }
+
+    FATDISK_RETURN(FATDISK_OK);
+}
+
+int fatdisk_mkdir (fatdisk_t *fd, const char *path)
+{
+    fat_dirent_t dirent;
+
+    if (!fd || !path || fatdisk_is_root(path)) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    if (fat_lookup_exact(fd->disk, path, &dirent)) {
+        FATDISK_RETURN(FATDISK_ERR_EXIST);
+    }
+
+    if (!cluster_how_many_free(fd->disk)) {
+        FATDISK_RETURN(FATDISK_ERR_NOSPC);
+    }
+
+    disk_command_mkdir_mtime(fd->disk, path, (int64_t) time(0));
+
+    if (!fat_lookup_exact(fd->disk, path, &dirent)) {
+        FATDISK_RETURN(FATDISK_ERR_IO);
+    }
+
+    FATDISK_RETURN(FATDISK_OK);
+}
+
+int fatdisk_unlink (fatdisk_t *fd, const char *path)
+{
+    fat_dirent_t dirent;
+
+    if (!fd || !path || fatdisk_is_root(path)) {
+        return (FATDISK_ERR_INVAL);
+    }
+
+    FATDISK_TRY(FATDISK_ERR_FATAL);
+
+    if (!fat_lookup_exact(fd->disk, path, &dirent)) {
+        FATDISK_RETURN(FATDISK_ERR_NOENT);
+    }
+
+    if (dirent.attr & 0x10) {
+        FATDISK_RETURN(FATDISK_ERR_ISDIR);
+    }
+
+    if (!disk_command_remove_exact(fd->disk, path)) {
+        FATDISK_RETURN(FATDISK_ERR_IO);
+    }
+
+    FATDISK_RETURN(FATDISK_OK);
+}
+
+const char *fatdisk_strerror (int err)
+{
+    switch (err) {
+    case FATDISK_OK:
+        return ("success");
+    case FATDISK_ERR_INVAL:
+        return ("invalid argument");
+    case FATDISK_ERR_NOENT:
+        return ("no such file or dir");
+    case FATDISK_ERR_IO:
+        return ("disk read or write failed");
+    case FATDISK_ERR_EXIST:
+        return ("already exists");
+    case FATDISK_ERR_NOTDIR:
+        return ("not a dir");
+    case FATDISK_ERR_ISDIR:
+        return ("is a dir");
+    case FATDISK_ERR_NOSPC:
+        return ("no space left on disk");
+    case FATDISK_ERR_FATAL:
+        return ("fatal error in disk image");
+    }
+
+    return ("unknown error");
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ */
+
+/*
+ * libfatdisk, a handle based API for FAT disk images.
+ *
+ * All calls return FATDISK_OK (0) on success or a negative FATDISK_ERR_*
+ * code. Errors in the disk image never exit the process, and nothing is
+ * printed to stdout or stderr.
+ */
+
+#ifndef LIBFATDISK_H_INCLUDED
+#define LIBFATDISK_H_INCLUDED
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FATDISK_OK                          0
+#define FATDISK_ERR_INVAL                   -1
+#define FATDISK_ERR_NOENT                   -2
+#define FATDISK_ERR_IO                      -3
+#define FATDISK_ERR_EXIST                   -4
+#define FATDISK_ERR_NOTDIR                  -5
+#define FATDISK_ERR_ISDIR                   -6
+#define FATDISK_ERR_NOSPC                   -7
+#define FATDISK_ERR_FATAL                   -8
+
+#define FATDISK_NAME_MAX                    256
+
+/*
+ * The library is built with hidden symbols; only these calls are exported.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define FATDISK_API __attribute__ ((visibility ("default")))
+#else
+#define FATDISK_API
+#endif
+
+typedef struct fatdisk_ fatdisk_t;
+typedef struct fatdisk_dir_ fatdisk_dir_t;
+
+typedef struct fatdisk_stat_ {
+    char name[FATDISK_NAME_MAX];
+    uint64_t size;
+    uint32_t first_cluster;
+    uint8_t attr;
+    uint8_t is_dir;
+    uint16_t year;
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+} fatdisk_stat_t;
+
+/*
+ * Open a disk image. A negative partition means the first FAT partition.
+ */
+FATDISK_API int fatdisk_open(const char *image, int partition,
+                             fatdisk_t **out);
+
+/*
+ * Flush the FAT and free the handle.
+ */
+FATDISK_API int fatdisk_close(fatdisk_t *);
+
+/*
+ * Flush the FAT without closing.
+ */
+FATDISK_API int fatdisk_sync(fatdisk_t *);
+
+FATDISK_API int fatdisk_stat(fatdisk_t *, const char *path,
+                             fatdisk_stat_t *out);
+
+/*
+ * Iterate a dir. A null or empty path or "/" is the root dir. readdir
+ * returns 1 for an entry, 0 at the end or an error code.
+ */
+FATDISK_API int fatdisk_opendir(fatdisk_t *, const char *path,
+                                fatdisk_dir_t **out);
+FATDISK_API int fatdisk_readdir(fatdisk_dir_t *, fatdisk_stat_t *out);
+FATDISK_API int fatdisk_closedir(fatdisk_dir_t *);
+
+/*
+ * Read up to len bytes at offset. Returns bytes read or an error code.
+ */
+FATDISK_API int64_t fatdisk_read_at(fatdisk_t *, const char *path,
+                                    uint64_t offset, void *buf, uint64_t len);
+
+/*
+ * Create or replace a file with the given contents. Missing parent dirs
+ * are created.
+ */
+FATDISK_API int fatdisk_write(fatdisk_t *, const char *path,
+                              const void *buf, uint64_t len);
+
+FATDISK_API int fatdisk_mkdir(fatdisk_t *, const char *path);
+FATDISK_API int fatdisk_unlink(fatdisk_t *, const char *path);
+
+FATDISK_API const char *fatdisk_strerror(int err);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
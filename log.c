@@ -14,6 +14,18 @@
 static char buf[MAX_STR];
 boolean croaked;
 
+/*
+ * How many errors have been reported, so a caller can tell if a command
+ * it ran failed.
+ */
+uint32_t err_count;
+
+/*
+ * Set while inside a library call, so nothing is printed. Errors are still
+ * counted.
+ */
+boolean log_silent;
+
 static void out_ (const char *fmt, va_list args)
 {
     uint32_t len;
@@ -30,6 +42,10 @@ void OUT (const char *fmt, ...)
 {
     va_list args;
 
+    if (log_silent) {
+        return;
+    }
+
     va_start(args, fmt);
     out_(fmt, args);
     va_end(args);
@@ -51,7 +67,7 @@ void VER (const char *fmt, ...)
 {
     va_list args;
 
-    if (!opt_verbose && !opt_debug2) {
+    if (log_silent || (!opt_verbose && !opt_debug2)) {
         return;
     }
 
@@ -72,7 +88,7 @@ static void dbg_ (const char *fmt, va_list args)
     fflush(stdout);
 }
 
-void DBG (const char *fmt, ...)
+void DBG_ (const char *fmt, ...)
 {
     va_list args;
 
@@ -97,7 +113,7 @@ static void dbg2_ (const char *fmt, va_list args)
     fflush(stdout);
 }
 
-void DBG2 (const char *fmt, ...)
+void DBG2_ (const char *fmt, ...)
 {
     va_list args;
 
@@ -126,7 +142,7 @@ static void dbg3_ (const char *fmt, va_list args)
     fflush(stdout);
 }
 
-void DBG3 (const char *fmt, ...)
+void DBG3_ (const char *fmt, ...)
 {
     va_list args;
 
@@ -155,7 +171,7 @@ static void dbg4_ (const char *fmt, va_list args)
     fflush(stdout);
 }
 
-void DBG4 (const char *fmt, ...)
+void DBG4_ (const char *fmt, ...)
 {
     va_list args;
 
@@ -184,7 +200,7 @@ static void dbg5_ (const char *fmt, va_list args)
     fflush(stdout);
 }
 
-void DBG5 (const char *fmt, ...)
+void DBG5_ (const char *fmt, ...)
 {
     va_list args;
 
@@ -217,6 +233,10 @@ void WARN (const char *fmt, ...)
 {
     va_list args;
 
+    if (log_silent) {
+        return;
+    }
+
     va_start(args, fmt);
     warn_(fmt, args);
     va_end(args);
@@ -242,6 +262,12 @@ static void err_ (const char *fmt, va_list args)
 {
     uint32_t len;
 
+    err_count++;
+
+    if (log_silent) {
+        return;
+    }
+
     buf[0] = '\0';
     len = (uint32_t)strlen(buf);
 
@@ -263,19 +289,21 @@ static void croak_ (const char *fmt, va_list args)
 {
     uint32_t len;
 
-    backtrace_print();
-    fflush(stdout);
+    if (!log_silent) {
+        backtrace_print();
+        fflush(stdout);
 
-    buf[0] = '\0';
-    len = (uint32_t)strlen(buf);
+        buf[0] = '\0';
+        len = (uint32_t)strlen(buf);
 
-    snprintf(buf + len, sizeof(buf) - len, "\nFATAL ERROR: ");
+        snprintf(buf + len, sizeof(buf) - len, "\nFATAL ERROR: ");
 
-    len = (uint32_t)strlen(buf);
-    vsnprintf(buf + len, sizeof(buf) - len, fmt, args);
+        len = (uint32_t)strlen(buf);
+        vsnprintf(buf + len, sizeof(buf) - len, fmt, args);
 
-    puts(buf);
-    fflush(stdout);
+        puts(buf);
+        fflush(stdout);
+    }
 
     if (croaked) {
         return;
@@ -290,6 +318,10 @@ void DYING (const char *fmt, ...)
 {
     va_list args;
 
+    if (log_silent) {
+        return;
+    }
+
     va_start(args, fmt);
     dying_(fmt, args);
     va_end(args);
@@ -10,6 +10,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 
@@ -19,32 +21,7 @@
 #include "main.h"
 #include "disk.h"
 #include "command.h"
-
-/*
- * Global options
- */
-boolean opt_verbose;
-boolean opt_quiet;
-boolean opt_debug;
-boolean opt_debug2;
-boolean opt_debug3;
-boolean opt_debug4;
-boolean opt_debug5;
-
-/*
- * Most common sector size.
- */
-uint32_t opt_sector_size = DEFAULT_SECTOR_SIZE;
-
-/*
- * Sectors per cluster.
- */
-uint32_t opt_sectors_per_cluster;
-
-/*
- * Die and print usage message.
- */
-boolean die_with_usage;
+#include "store.h"
 
 /*
  * Tool usage.
@@ -84,6 +61,26 @@ void usage (void)
     fprintf(stderr, "        -quiet           :\n");
     fprintf(stderr, "        -q               :\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "        --stats          : print I/O, cache, memory and timing\n");
+    fprintf(stderr, "        -stats           : to stderr when the disk is closed\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        --direct         : write the image with O_DIRECT, in\n");
+    fprintf(stderr, "        -direct          : aligned blocks, bypassing the page cache\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        --journal        : log metadata to <disk>.journal before\n");
+    fprintf(stderr, "        -journal         : writing it; an interrupted flush is\n");
+    fprintf(stderr, "                         : finished on the next open\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        --overlay <file> : leave the image as a read only base and\n");
+    fprintf(stderr, "        -overlay <file>  : keep changed sectors in this delta file,\n");
+    fprintf(stderr, "                         : made if it does not exist\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        --store <dir>    : content addressed store of images for\n");
+    fprintf(stderr, "        -store <dir>     : snapshot and materialize\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        --trace <file>   : record I/O and walk events, written\n");
+    fprintf(stderr, "        -trace <file>    : at exit as Chrome trace JSON\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "        --debug          : print internal debug info\n");
     fprintf(stderr, "        -debug           :\n");
     fprintf(stderr, "        -d               :\n");
@@ -107,6 +104,10 @@ void usage (void)
     fprintf(stderr, "        --sectorsize     : default 512\n");
     fprintf(stderr, "        -sectorsize      :\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "        --script         : run shell commands from a file\n");
+    fprintf(stderr, "        -script          : e.g. -c build.fds, or -c - for stdin\n");
+    fprintf(stderr, "        -c               :\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "        --help           : this help\n");
     fprintf(stderr, "        -help            :\n");
     fprintf(stderr, "        -h               :\n");
@@ -135,6 +136,14 @@ void usage (void)
     fprintf(stderr, "        extract   <pat>  : extract a file or dir\n");
     fprintf(stderr, "        x         <pat>  :\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "        export-tar [<pat>]\n");
+    fprintf(stderr, "                         : write files or a dir to stdout as a\n");
+    fprintf(stderr, "                         : tar archive, e.g. export-tar > disk.tar\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        import-tar [<dir>]\n");
+    fprintf(stderr, "                         : add the files and dirs of a tar archive\n");
+    fprintf(stderr, "                         : read from stdin, e.g. import-tar < disk.tar\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "        add       <pat>  : add a file or dir, keeping same\n");
     fprintf(stderr, "        a         <pat>  : full pathname on the disk image\n");
     fprintf(stderr, "\n");
@@ -154,6 +163,66 @@ void usage (void)
     fprintf(stderr, "        ca               :\n");
     fprintf(stderr, "        c                :\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "        read-at   <file> <offset> [<length>]\n");
+    fprintf(stderr, "        ra               : raw dump of part of a file, reading only\n");
+    fprintf(stderr, "                         : the sectors needed, e.g. read-at log 900M 1M\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        map     [<pat>] [--json]\n");
+    fprintf(stderr, "                         : list the runs of clusters a file, or all\n");
+    fprintf(stderr, "                         : below a dir, lie in by byte offset in the\n");
+    fprintf(stderr, "                         : file and in the image\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        write-at  <file> <offset> <local-file>\n");
+    fprintf(stderr, "        wa               : overwrite part of a file in place\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        append    <file> <local-file>\n");
+    fprintf(stderr, "        app              : append to a file in place\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        truncate  <file> <size>\n");
+    fprintf(stderr, "        trunc            : cut or zero extend a file in place\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        sync      [--hash] local-dir [dir]\n");
+    fprintf(stderr, "                         : make dir on the disk match local-dir,\n");
+    fprintf(stderr, "                         : only adding, updating or removing what\n");
+    fprintf(stderr, "                         : differs by size and time, or by checksum\n");
+    fprintf(stderr, "                         : with --hash\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        defrag  [--report]\n");
+    fprintf(stderr, "                         : move fragmented files into single runs\n");
+    fprintf(stderr, "                         : and dirs towards the start of the disk,\n");
+    fprintf(stderr, "                         : or with --report just say how fragmented\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        check   [--repair]\n");
+    fprintf(stderr, "                         : look for cross-linked, looping, broken\n");
+    fprintf(stderr, "                         : and lost chains, wrong sizes and FAT\n");
+    fprintf(stderr, "                         : copies that differ, fixing with --repair\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        shrink           : move data down and cut the filesystem,\n");
+    fprintf(stderr, "                         : its partition and the image to fit\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        resize    <size> : grow the filesystem, its partition and\n");
+    fprintf(stderr, "                         : the image in place, e.g. resize 2G\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        commit           : write the --overlay delta into the base\n");
+    fprintf(stderr, "                         : and empty it\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        flatten  <image> : write the image as seen through the\n");
+    fprintf(stderr, "                         : --overlay delta to a standalone image\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        snapshot  <name> : keep the clusters in use and metadata in\n");
+    fprintf(stderr, "                         : the --store as deduplicated chunks\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        materialize <name>\n");
+    fprintf(stderr, "                         : rebuild the disk image from a --store\n");
+    fprintf(stderr, "                         : snapshot, sharing blocks where it can\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "        shell   [script] : run many commands against one open disk,\n");
+    fprintf(stderr, "        sh      [script] : read from the script or stdin; ls, find,\n");
+    fprintf(stderr, "                         : cat, extract, add, rm, summary etc...\n");
+    fprintf(stderr, "                         : the FAT is flushed on sync or exit;\n");
+    fprintf(stderr, "                         : a failed command does not end the\n");
+    fprintf(stderr, "                         : session, but the exit status is 1\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "        format\n");
     fprintf(stderr, "               size xG/xM\n");
     fprintf(stderr, "               [part 0-3]           select partiton\n");
@@ -194,6 +263,12 @@ void usage (void)
     fprintf(stderr, "  $ fatdisk mybootdisk hexdump foo.c\n");
     fprintf(stderr, "\t\t\t\t\t-- dump a file from the disk\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "  $ fatdisk mybootdisk sync build/root\n");
+    fprintf(stderr, "\t\t\t\t\t-- update the disk from a local tree\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  $ printf 'add dir\\nrm dir/*.o\\nls dir\\n' | fatdisk mybootdisk shell\n");
+    fprintf(stderr, "\t\t\t\t\t-- many commands, one disk open\n");
+    fprintf(stderr, "\n");
     fprintf(stderr, "  $ fatdisk mybootdisk format size 1G name MYDISK part 0 50%% \\\n");
     fprintf(stderr, "      bootloader grub_disk part 1 50%% fat32 bootloader grub_disk\n");
     fprintf(stderr, "\n");
@@ -216,29 +291,6 @@ static void fatdisk_version (void)
     fprintf(stderr, "fatdisk, version " VERSION "\n");
 }
 
-/*
- * Cleanup operations on exit.
- */
-void quit (void)
-{
-    static boolean quitting;
-
-    if (quitting) {
-        return;
-    }
-
-    quitting = true;
-
-    ptrcheck_fini();
-}
-
-void die (void)
-{
-    quit();
-
-    exit(1);
-}
-
 static disk_t *disk;
 
 static void killed (int sig)
@@ -251,6 +303,23 @@ static void killed (int sig)
     exit(2);
 }
 
+/*
+ * die_hook
+ *
+ * A fatal error outside the shell is ending the process without a flush,
+ * so the image keeps its metadata as of the last flush. What the failed
+ * command got done is consistent, and the shell flushes it so as to keep
+ * the commands before it; a one shot run has nothing before it to keep.
+ * Say what is being dropped rather than losing it quietly.
+ */
+void die_hook (void)
+{
+    if (disk && disk->dirty_sectors) {
+        WARN("Discarding %" PRIu32 " sectors of metadata changed since the "
+             "last flush of %s", disk->dirty_sectors, disk->filename);
+    }
+}
+
 /*
  * command_format
  *
@@ -861,6 +930,308 @@ static uint32_t command_cat (int32_t argc, int32_t arg, char *argv[])
     return (count);
 }
 
+/*
+ * parse_size
+ *
+ * Parse a number like 0x100, 4K, 10M, 1G or 8s (sectors). Anything else,
+ * or a size too large to hold, is an error.
+ */
+static boolean parse_size (const char *in, uint64_t *size)
+{
+    uint64_t unit = 1;
+    char *end;
+
+    errno = 0;
+
+    if (!strncasecmp(in, "0x", 2)) {
+        *size = strtoull(in + 2, &end, 16);
+        if (end == in + 2) {
+            end = (char *) in;
+        }
+    } else {
+        *size = strtoull(in, &end, 10);
+    }
+
+    if ((end == in) || (*in == '-') || (*in == '+') || (*in == ' ') ||
+        errno) {
+        ERR("Bad size %s", in);
+        return (false);
+    }
+
+    switch (*end) {
+    case '\0':
+        break;
+    case 'g': case 'G':
+        unit = (uint64_t) ONE_GIG;
+        end++;
+        break;
+    case 'm': case 'M':
+        unit = ONE_MEG;
+        end++;
+        break;
+    case 'k': case 'K':
+        unit = ONE_K;
+        end++;
+        break;
+    case 's': case 'S':
+        unit = opt_sector_size;
+        end++;
+        break;
+    }
+
+    if (*end || (*size > UINT64_MAX / unit)) {
+        ERR("Bad size %s", in);
+        return (false);
+    }
+
+    *size *= unit;
+
+    return (true);
+}
+
+/*
+ * command_read_at
+ *
+ * Execute the read-at command: read-at <file> <offset> [<length>]
+ */
+static boolean command_read_at (int32_t argc, int32_t arg, char *argv[])
+{
+    uint64_t offset;
+    uint64_t length;
+
+    if (arg + 2 >= argc) {
+        ERR("usage: read-at <file> <offset> [<length>]");
+        return (false);
+    }
+
+    if (!parse_size(argv[arg + 2], &offset)) {
+        return (false);
+    }
+
+    length = 0;
+
+    if ((arg + 3 < argc) && !parse_size(argv[arg + 3], &length)) {
+        return (false);
+    }
+
+    return (disk_command_read_at(disk, argv[arg + 1], offset, length));
+}
+
+/*
+ * command_map
+ *
+ * Execute the map command: map [<file>] [--json]
+ */
+static boolean command_map (int32_t argc, int32_t arg, char *argv[])
+{
+    const char *path = 0;
+    boolean json = false;
+
+    for (++arg; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "--json") ||
+            !strcmp(argv[arg], "-json")) {
+            json = true;
+        } else if (!path) {
+            path = argv[arg];
+        } else {
+            ERR("usage: map [<file>] [--json]");
+            return (false);
+        }
+    }
+
+    return (disk_command_map(disk, path ? path : "", json));
+}
+
+/*
+ * command_write_at
+ *
+ * Execute the write-at command: write-at <file> <offset> <local-file>
+ */
+static uint32_t command_write_at (int32_t argc, int32_t arg, char *argv[])
+{
+    uint64_t offset;
+
+    if (arg + 3 >= argc) {
+        ERR("usage: write-at <file> <offset> <local-file>");
+        return (0);
+    }
+
+    if (!parse_size(argv[arg + 2], &offset)) {
+        return (0);
+    }
+
+    return (disk_command_write_at(disk, argv[arg + 1], offset, argv[arg + 3]));
+}
+
+/*
+ * command_append
+ *
+ * Execute the append command: append <file> <local-file>
+ */
+static uint32_t command_append (int32_t argc, int32_t arg, char *argv[])
+{
+    if (arg + 2 >= argc) {
+        ERR("usage: append <file> <local-file>");
+        return (0);
+    }
+
+    return (disk_command_append(disk, argv[arg + 1], argv[arg + 2]));
+}
+
+/*
+ * command_truncate
+ *
+ * Execute the truncate command: truncate <file> <size>
+ */
+static uint32_t command_truncate (int32_t argc, int32_t arg, char *argv[])
+{
+    uint64_t size;
+
+    if (arg + 2 >= argc) {
+        ERR("usage: truncate <file> <size>");
+        return (0);
+    }
+
+    if (!parse_size(argv[arg + 2], &size)) {
+        return (0);
+    }
+
+    return (disk_command_truncate(disk, argv[arg + 1], size));
+}
+
+/*
+ * command_sync
+ *
+ * Execute the sync command: sync [--hash] <local-dir> [<dir>]
+ */
+static uint32_t command_sync (int32_t argc, int32_t arg, char *argv[])
+{
+    const char *source = 0;
+    const char *target = 0;
+    boolean hash = false;
+
+    for (++arg; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "--hash") ||
+            !strcmp(argv[arg], "-hash")) {
+            hash = true;
+        } else if (!source) {
+            source = argv[arg];
+        } else if (!target) {
+            target = argv[arg];
+        } else {
+            ERR("usage: sync [--hash] <local-dir> [<dir>]");
+            return (0);
+        }
+    }
+
+    if (!source) {
+        ERR("usage: sync [--hash] <local-dir> [<dir>]");
+        return (0);
+    }
+
+    return (disk_command_sync_dir(disk, source, target, hash));
+}
+
+/*
+ * command_defrag
+ *
+ * Execute the defrag command: defrag [--report]
+ */
+static boolean command_defrag (int32_t argc, int32_t arg, char *argv[])
+{
+    boolean report_only = false;
+
+    for (++arg; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "--report") ||
+            !strcmp(argv[arg], "-report")) {
+            report_only = true;
+        } else {
+            ERR("usage: defrag [--report]");
+            return (false);
+        }
+    }
+
+    return (disk_command_defrag(disk, report_only));
+}
+
+/*
+ * command_check
+ *
+ * Execute the check command: check [--repair]
+ */
+static uint32_t command_check (int32_t argc, int32_t arg, char *argv[])
+{
+    boolean repair = false;
+
+    for (++arg; arg < argc; arg++) {
+        if (!strcmp(argv[arg], "--repair") ||
+            !strcmp(argv[arg], "-repair")) {
+            repair = true;
+        } else {
+            ERR("usage: check [--repair]");
+            return (0);
+        }
+    }
+
+    return (disk_command_check(disk, repair));
+}
+
+/*
+ * command_shrink
+ *
+ * Execute the shrink command: shrink
+ */
+static boolean command_shrink (int32_t argc, int32_t arg, char *argv[])
+{
+    if (arg + 1 < argc) {
+        ERR("usage: shrink");
+        return (false);
+    }
+
+    return (disk_command_shrink(disk));
+}
+
+/*
+ * command_resize
+ *
+ * Execute the resize command: resize <size>
+ */
+static boolean command_resize (int32_t argc, int32_t arg, char *argv[])
+{
+    uint64_t size;
+
+    if (arg + 1 >= argc) {
+        ERR("usage: resize <size>");
+        return (false);
+    }
+
+    if (!parse_size(argv[arg + 1], &size)) {
+        return (false);
+    }
+
+    if (!size) {
+        ERR("Bad size %s, cannot resize to nothing", argv[arg + 1]);
+        return (false);
+    }
+
+    return (disk_command_resize(disk, size));
+}
+
+/*
+ * command_flatten
+ *
+ * Execute the flatten command: flatten <image>
+ */
+static boolean command_flatten (int32_t argc, int32_t arg, char *argv[])
+{
+    if (arg + 1 >= argc) {
+        ERR("usage: flatten <image>");
+        return (false);
+    }
+
+    return (disk_command_flatten(disk, argv[arg + 1]));
+}
+
 /*
  * command_extract
  *
@@ -897,6 +1268,50 @@ static uint32_t command_extract (int32_t argc, int32_t arg, char *argv[])
     return (count);
 }
 
+/*
+ * command_export_tar
+ *
+ * Execute the export-tar command: export-tar [<pat>]
+ */
+static uint32_t command_export_tar (int32_t argc, int32_t arg, char *argv[])
+{
+    if (arg + 2 < argc) {
+        ERR("usage: export-tar [<pat>]");
+        return (0);
+    }
+
+    return (disk_command_export_tar(disk, arg + 1 < argc ? argv[arg + 1] : 0));
+}
+
+/*
+ * command_import_tar
+ *
+ * Execute the import-tar command: import-tar [<dir>]
+ */
+static boolean command_import_tar (int32_t argc, int32_t arg, char *argv[])
+{
+    uint32_t count;
+    boolean ok;
+
+    if (arg + 2 < argc) {
+        ERR("usage: import-tar [<dir>]");
+        return (false);
+    }
+
+    ok = disk_command_import_tar(disk, arg + 1 < argc ? argv[arg + 1] : 0,
+                                 &count);
+
+    if (!opt_quiet) {
+        if (count == 1) {
+            printf("Imported %" PRIu32 " entry\n", count);
+        } else {
+            printf("Imported %" PRIu32 " entries\n", count);
+        }
+    }
+
+    return (ok);
+}
+
 /*
  * command_add
  *
@@ -1025,43 +1440,423 @@ static uint32_t command_fileadd (int32_t argc, int32_t arg, char *argv[])
 }
 
 /*
- * main
+ * shell_split
  *
- * Main entry point.
+ * Split a command line into words, in place. Words may be quoted with
+ * single or double quotes. Returns the number of words.
  */
-int32_t main (int32_t argc, char *argv[])
+static int32_t shell_split (char *line, char *argv[], int32_t max_args)
 {
-    int64_t opt_disk_start_offset = 0;
-    boolean opt_disk_start_offset_set = false;
-    uint32_t opt_disk_partition = 0;
-    boolean opt_disk_command_list_set = false;
-    boolean opt_disk_command_find_set = false;
-    boolean opt_disk_command_extract_set = false;
-    boolean opt_disk_add_set = false;
-    boolean opt_disk_file_add_set = false;
-    boolean opt_disk_command_remove_set = false;
-    boolean opt_disk_command_info_set = false;
-    boolean opt_disk_command_summary_set = false;
-    boolean opt_disk_command_hex_dump_set = false;
-    boolean opt_disk_command_cat_set = false;
-    boolean opt_disk_command_format_set = false;
-    boolean opt_disk_partition_set = false;
-    const char *opt_filename = 0;
-    boolean command_set = false;
-    int32_t i;
+    int32_t argc;
+    char *in;
+    char *out;
+    char quote;
 
-    ptrcheck_leak_snapshot();
+    argc = 0;
+    in = line;
 
-    signal(SIGINT, killed);
+    for (;;) {
+        while ((*in == ' ') || (*in == '\t') ||
+               (*in == '\n') || (*in == '\r')) {
+            in++;
+        }
 
-#ifdef REGEXP_TEST
-    regexp_test();
-    exit(0);
-#endif
+        if (!*in || (*in == '#')) {
+            break;
+        }
 
-    command_set = false;
+        if (argc >= max_args - 1) {
+            ERR("too many words on command line, max %" PRId32 "", max_args);
+            break;
+        }
 
-    if (argc < 2) {
+        argv[argc++] = in;
+        out = in;
+        quote = '\0';
+
+        while (*in) {
+            if (quote) {
+                if (*in == quote) {
+                    quote = '\0';
+                    in++;
+                    continue;
+                }
+            } else if ((*in == '"') || (*in == '\'')) {
+                quote = *in++;
+                continue;
+            } else if ((*in == ' ') || (*in == '\t') ||
+                       (*in == '\n') || (*in == '\r')) {
+                in++;
+                break;
+            }
+
+            *out++ = *in++;
+        }
+
+        *out = '\0';
+    }
+
+    argv[argc] = 0;
+
+    return (argc);
+}
+
+/*
+ * shell_help
+ *
+ * Commands understood in shell mode.
+ */
+static void shell_help (void)
+{
+    printf("Commands:\n");
+    printf("        list      <pat>  : list a file or dir\n");
+    printf("        find      <pat>  : find and raw list files\n");
+    printf("        cat       <pat>  : raw dump of file to console\n");
+    printf("        read-at   <file> <offset> [<length>]\n");
+    printf("        map       [<pat>] [--json]\n");
+    printf("        write-at  <file> <offset> <local-file>\n");
+    printf("        append    <file> <local-file>\n");
+    printf("        truncate  <file> <size>\n");
+    printf("        hexdump   <pat>  : hex dump of files\n");
+    printf("        extract   <pat>  : extract a file or dir\n");
+    printf("        add       <pat>  : add a file or dir\n");
+    printf("        fileadd   local-name [remote-name]\n");
+    printf("        remove    <pat>  : remove a file or dir\n");
+    printf("        info             : print disk info\n");
+    printf("        summary          : print partition summary\n");
+    printf("        sync             : flush the FAT to disk\n");
+    printf("        sync      [--hash] local-dir [dir]\n");
+    printf("                         : update dir to match local-dir\n");
+    printf("        defrag    [--report]\n");
+    printf("        check     [--repair]\n");
+    printf("        shrink           : cut the disk down to fit its data\n");
+    printf("        resize    <size> : grow the disk in place\n");
+    printf("        exit             : flush and leave the shell\n");
+}
+
+/*
+ * shell_command
+ *
+ * Execute one shell command line against the open disk. Returns false
+ * when the shell should exit.
+ */
+static boolean shell_command (int32_t argc, char *argv[])
+{
+    const char *cmd;
+
+    if (!argc) {
+        return (true);
+    }
+
+    cmd = argv[0];
+
+    if (!strcmp(cmd, "exit") ||
+        !strcmp(cmd, "quit") ||
+        !strcmp(cmd, "q")) {
+        return (false);
+    }
+
+    if (!strcmp(cmd, "help") ||
+        !strcmp(cmd, "?")) {
+        shell_help();
+        return (true);
+    }
+
+    if (!strcmp(cmd, "sync")) {
+        if (argc == 1) {
+            disk_command_sync(disk);
+        } else {
+            (void) command_sync(argc, 0, argv);
+        }
+        return (true);
+    }
+
+    if (!strcmp(cmd, "defrag")) {
+        (void) command_defrag(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "check")) {
+        (void) command_check(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "shrink")) {
+        (void) command_shrink(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "resize")) {
+        (void) command_resize(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "list") ||
+        !strcmp(cmd, "ls") ||
+        !strcmp(cmd, "l")) {
+        (void) command_list(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "find") ||
+        !strcmp(cmd, "fi")) {
+        (void) command_find(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "cat") ||
+        !strcmp(cmd, "ca") ||
+        !strcmp(cmd, "c")) {
+        (void) command_cat(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "read-at") ||
+        !strcmp(cmd, "readat") ||
+        !strcmp(cmd, "ra")) {
+        (void) command_read_at(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "map")) {
+        (void) command_map(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "write-at") ||
+        !strcmp(cmd, "writeat") ||
+        !strcmp(cmd, "wa")) {
+        (void) command_write_at(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "append") ||
+        !strcmp(cmd, "app")) {
+        (void) command_append(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "truncate") ||
+        !strcmp(cmd, "trunc")) {
+        (void) command_truncate(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "hexdump") ||
+        !strcmp(cmd, "hex") ||
+        !strcmp(cmd, "he") ||
+        !strcmp(cmd, "h")) {
+        (void) command_hexdump(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "extract") ||
+        !strcmp(cmd, "ex") ||
+        !strcmp(cmd, "x")) {
+        (void) command_extract(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "add") ||
+        !strcmp(cmd, "ad") ||
+        !strcmp(cmd, "a")) {
+        (void) command_add(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "fileadd") ||
+        !strcmp(cmd, "addfile") ||
+        !strcmp(cmd, "file") ||
+        !strcmp(cmd, "f")) {
+        (void) command_fileadd(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "remove") ||
+        !strcmp(cmd, "rm") ||
+        !strcmp(cmd, "r")) {
+        (void) command_remove(argc, 0, argv);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "info") ||
+        !strcmp(cmd, "in") ||
+        !strcmp(cmd, "i")) {
+        disk_command_info(disk);
+        return (true);
+    }
+
+    if (!strcmp(cmd, "summary") ||
+        !strcmp(cmd, "summ") ||
+        !strcmp(cmd, "sum") ||
+        !strcmp(cmd, "su") ||
+        !strcmp(cmd, "s")) {
+        disk_command_summary(disk, disk->filename,
+                             true /* partition set */,
+                             disk->partition,
+                             true /* show header */,
+                             true /* show trailer */);
+        return (true);
+    }
+
+    ERR("unknown shell command, %s", cmd);
+
+    return (true);
+}
+
+/*
+ * One shell command, run under die_guard.
+ */
+typedef struct shell_call_ {
+    int32_t argc;
+    char **argv;
+    boolean more;
+} shell_call_t;
+
+/*
+ * shell_call
+ *
+ * Run one shell command, noting if the session should go on.
+ */
+static void shell_call (void *context)
+{
+    shell_call_t *call = (typeof(call)) context;
+
+    call->more = shell_command(call->argc, call->argv);
+}
+
+/*
+ * command_shell
+ *
+ * Read commands from a script or stdin and run them all against the one
+ * open disk, so the FAT, sector cache and directory state are shared and
+ * the FAT is only flushed on sync or exit. A command that fails, even
+ * fatally, does not end the session; false is returned if any did.
+ */
+static boolean command_shell (const char *script)
+{
+    char *argv[MAX_SHELL_ARGS];
+    boolean interactive;
+    boolean failed;
+    shell_call_t call;
+    size_t line_size;
+    uint32_t errors;
+    char *line;
+    FILE *in;
+
+    if (script && strcmp(script, "-")) {
+        in = fopen(script, "r");
+        if (!in) {
+            DIE("cannot open script %s", script);
+        }
+    } else {
+        in = stdin;
+    }
+
+    interactive = (in == stdin) && isatty(fileno(stdin));
+
+    line = 0;
+    line_size = 0;
+    failed = false;
+
+    for (;;) {
+        if (interactive) {
+            printf("fatdisk> ");
+            fflush(stdout);
+        }
+
+        if (getline(&line, &line_size, in) < 0) {
+            break;
+        }
+
+        call.argc = shell_split(line, argv, MAX_SHELL_ARGS);
+        call.argv = argv;
+        call.more = true;
+
+        errors = err_count;
+
+        if (!die_guard(shell_call, &call) || (err_count != errors)) {
+            failed = true;
+        }
+
+        fflush(stdout);
+
+        if (!call.more) {
+            break;
+        }
+    }
+
+    /*
+     * Allocated by getline, so not tracked by ptrcheck.
+     */
+    free(line);
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    return (!failed);
+}
+
+/*
+ * main
+ *
+ * Main entry point.
+ */
+int32_t main (int32_t argc, char *argv[])
+{
+    int64_t opt_disk_start_offset = 0;
+    int32_t ret = 0;
+    boolean opt_disk_start_offset_set = false;
+    uint32_t opt_disk_partition = 0;
+    boolean opt_disk_command_list_set = false;
+    boolean opt_disk_command_find_set = false;
+    boolean opt_disk_command_extract_set = false;
+    boolean opt_disk_command_export_tar_set = false;
+    boolean opt_disk_command_import_tar_set = false;
+    boolean opt_disk_add_set = false;
+    boolean opt_disk_file_add_set = false;
+    boolean opt_disk_command_remove_set = false;
+    boolean opt_disk_command_info_set = false;
+    boolean opt_disk_command_summary_set = false;
+    boolean opt_disk_command_hex_dump_set = false;
+    boolean opt_disk_command_cat_set = false;
+    boolean opt_disk_command_read_at_set = false;
+    boolean opt_disk_command_map_set = false;
+    boolean opt_disk_command_write_at_set = false;
+    boolean opt_disk_command_append_set = false;
+    boolean opt_disk_command_truncate_set = false;
+    boolean opt_disk_command_sync_set = false;
+    boolean opt_disk_command_defrag_set = false;
+    boolean opt_disk_command_check_set = false;
+    boolean opt_disk_command_shrink_set = false;
+    boolean opt_disk_command_resize_set = false;
+    boolean opt_disk_command_commit_set = false;
+    boolean opt_disk_command_flatten_set = false;
+    boolean opt_disk_command_snapshot_set = false;
+    boolean opt_disk_command_materialize_set = false;
+    boolean opt_disk_command_format_set = false;
+    boolean opt_disk_command_shell_set = false;
+    boolean opt_disk_partition_set = false;
+    const char *opt_script = 0;
+    const char *opt_overlay = 0;
+    const char *opt_store = 0;
+    const char *opt_filename = 0;
+    boolean command_set = false;
+    int32_t i;
+
+    ptrcheck_leak_snapshot();
+
+    signal(SIGINT, killed);
+
+#ifdef REGEXP_TEST
+    regexp_test();
+    exit(0);
+#endif
+
+    command_set = false;
+
+    if (argc < 2) {
         die_with_usage = true;
         DIE("not enough arguments");
     }
@@ -1111,6 +1906,87 @@ int32_t main (int32_t argc, char *argv[])
             continue;
         }
 
+        /*
+         * --stats
+         */
+        if (!strcmp(argv[i], "--stats") ||
+            !strcmp(argv[i], "-stats")) {
+
+            opt_stats = true;
+            continue;
+        }
+
+        /*
+         * --direct
+         */
+        if (!strcmp(argv[i], "--direct") ||
+            !strcmp(argv[i], "-direct")) {
+
+            opt_direct = true;
+            continue;
+        }
+
+        /*
+         * --journal
+         */
+        if (!strcmp(argv[i], "--journal") ||
+            !strcmp(argv[i], "-journal")) {
+
+            opt_journal = true;
+            continue;
+        }
+
+        /*
+         * --overlay
+         */
+        if (!strcmp(argv[i], "--overlay") ||
+            !strcmp(argv[i], "-overlay")) {
+
+            if (i + 1 >= argc) {
+                DIE("no overlay file");
+            }
+
+            opt_overlay = argv[i + 1];
+
+            i++;
+
+            continue;
+        }
+
+        /*
+         * --store
+         */
+        if (!strcmp(argv[i], "--store") ||
+            !strcmp(argv[i], "-store")) {
+
+            if (i + 1 >= argc) {
+                DIE("no store dir");
+            }
+
+            opt_store = argv[i + 1];
+
+            i++;
+
+            continue;
+        }
+
+        /*
+         * --trace
+         */
+        if (!strcmp(argv[i], "--trace") ||
+            !strcmp(argv[i], "-trace")) {
+
+            if (i + 1 >= argc) {
+                DIE("no trace file");
+            }
+
+            trace_open(argv[i + 1]);
+
+            i++;
+
+            continue;
+        }
+
         /*
          * --debug
          */
@@ -1330,6 +2206,56 @@ int32_t main (int32_t argc, char *argv[])
             continue;
         }
 
+        /*
+         * --script
+         */
+        if (!strcmp(argv[i], "--script") ||
+            !strcmp(argv[i], "-script") ||
+            !strcmp(argv[i], "-c")) {
+
+            if (i + 1 >= argc) {
+                DIE("no script file");
+            }
+
+            opt_script = argv[i + 1];
+
+            i++;
+
+            continue;
+        }
+
+        /*
+         * --hash, only meaningful to sync which reads it itself.
+         */
+        if (!strcmp(argv[i], "--hash") ||
+            !strcmp(argv[i], "-hash")) {
+            continue;
+        }
+
+        /*
+         * --report, only meaningful to defrag which reads it itself.
+         */
+        if (!strcmp(argv[i], "--report") ||
+            !strcmp(argv[i], "-report")) {
+            continue;
+        }
+
+        /*
+         * --repair, only meaningful to check which reads it itself.
+         */
+        if (!strcmp(argv[i], "--repair") ||
+            !strcmp(argv[i], "-repair")) {
+            continue;
+        }
+
+        /*
+         * --json, only meaningful to map which reads it itself.
+         */
+        if (!strcmp(argv[i], "--json") ||
+            !strcmp(argv[i], "-json")) {
+            continue;
+        }
+
         /*
          * Bad argument.
          */
@@ -1392,11 +2318,9 @@ int32_t main (int32_t argc, char *argv[])
         }
 
         /*
-         * add
+         * export-tar
          */
-        if (!strcmp(argv[i], "add") ||
-            !strcmp(argv[i], "ad") ||
-            !strcmp(argv[i], "a")) {
+        if (!strcmp(argv[i], "export-tar")) {
 
             if (command_set) {
                 die_with_usage = true;
@@ -1404,17 +2328,14 @@ int32_t main (int32_t argc, char *argv[])
             }
             command_set = true;
 
-            opt_disk_add_set = true;
+            opt_disk_command_export_tar_set = true;
             break;
         }
 
         /*
-         * fileadd
+         * import-tar
          */
-        if (!strcmp(argv[i], "fileadd") ||
-            !strcmp(argv[i], "addfile") ||
-            !strcmp(argv[i], "file") ||
-            !strcmp(argv[i], "f")) {
+        if (!strcmp(argv[i], "import-tar")) {
 
             if (command_set) {
                 die_with_usage = true;
@@ -1422,15 +2343,50 @@ int32_t main (int32_t argc, char *argv[])
             }
             command_set = true;
 
-            opt_disk_file_add_set = true;
+            opt_disk_command_import_tar_set = true;
             break;
         }
 
         /*
-         * remove
+         * add
          */
-        if (!strcmp(argv[i], "remove") ||
-            !strcmp(argv[i], "rm") ||
+        if (!strcmp(argv[i], "add") ||
+            !strcmp(argv[i], "ad") ||
+            !strcmp(argv[i], "a")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_add_set = true;
+            break;
+        }
+
+        /*
+         * fileadd
+         */
+        if (!strcmp(argv[i], "fileadd") ||
+            !strcmp(argv[i], "addfile") ||
+            !strcmp(argv[i], "file") ||
+            !strcmp(argv[i], "f")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_file_add_set = true;
+            break;
+        }
+
+        /*
+         * remove
+         */
+        if (!strcmp(argv[i], "remove") ||
+            !strcmp(argv[i], "rm") ||
             !strcmp(argv[i], "r")) {
 
             if (command_set) {
@@ -1529,6 +2485,238 @@ int32_t main (int32_t argc, char *argv[])
             break;
         }
 
+        /*
+         * read-at
+         */
+        if (!strcmp(argv[i], "read-at") ||
+            !strcmp(argv[i], "readat") ||
+            !strcmp(argv[i], "ra")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_read_at_set = true;
+            break;
+        }
+
+        /*
+         * map
+         */
+        if (!strcmp(argv[i], "map")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_map_set = true;
+            break;
+        }
+
+        /*
+         * write-at
+         */
+        if (!strcmp(argv[i], "write-at") ||
+            !strcmp(argv[i], "writeat") ||
+            !strcmp(argv[i], "wa")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_write_at_set = true;
+            break;
+        }
+
+        /*
+         * append
+         */
+        if (!strcmp(argv[i], "append") ||
+            !strcmp(argv[i], "app")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_append_set = true;
+            break;
+        }
+
+        /*
+         * truncate
+         */
+        if (!strcmp(argv[i], "truncate") ||
+            !strcmp(argv[i], "trunc")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_truncate_set = true;
+            break;
+        }
+
+        /*
+         * sync
+         */
+        if (!strcmp(argv[i], "sync")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_sync_set = true;
+            break;
+        }
+
+        /*
+         * defrag
+         */
+        if (!strcmp(argv[i], "defrag")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_defrag_set = true;
+            break;
+        }
+
+        /*
+         * check
+         */
+        if (!strcmp(argv[i], "check")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_check_set = true;
+            break;
+        }
+
+        /*
+         * shrink
+         */
+        if (!strcmp(argv[i], "shrink")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_shrink_set = true;
+            break;
+        }
+
+        /*
+         * resize
+         */
+        if (!strcmp(argv[i], "resize")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_resize_set = true;
+            break;
+        }
+
+        /*
+         * commit
+         */
+        if (!strcmp(argv[i], "commit")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_commit_set = true;
+            break;
+        }
+
+        /*
+         * flatten
+         */
+        if (!strcmp(argv[i], "flatten")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_flatten_set = true;
+            break;
+        }
+
+        /*
+         * snapshot
+         */
+        if (!strcmp(argv[i], "snapshot")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_snapshot_set = true;
+            break;
+        }
+
+        /*
+         * materialize
+         */
+        if (!strcmp(argv[i], "materialize")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_materialize_set = true;
+            break;
+        }
+
+        /*
+         * shell
+         */
+        if (!strcmp(argv[i], "shell") ||
+            !strcmp(argv[i], "sh")) {
+
+            if (command_set) {
+                die_with_usage = true;
+                DIE("command already set");
+            }
+            command_set = true;
+
+            opt_disk_command_shell_set = true;
+            break;
+        }
+
         /*
          * Bad argument.
          */
@@ -1547,11 +2735,51 @@ int32_t main (int32_t argc, char *argv[])
 
     opt_filename = argv[i - 1];
 
+    /*
+     * A script implies shell mode.
+     */
+    if (opt_script && !command_set) {
+        command_set = true;
+        opt_disk_command_shell_set = true;
+    }
+
     if (!command_set) {
         die_with_usage = true;
         DIE("Please specify a command after the disk name");
     }
 
+    if ((opt_disk_command_snapshot_set ||
+         opt_disk_command_materialize_set) && !opt_store) {
+        DIE("snapshot and materialize need --store <dir>");
+    }
+
+    /*
+     * Materialize makes the disk image, so does not open it.
+     */
+    if (opt_disk_command_materialize_set) {
+        if (i + 1 >= argc) {
+            DIE("usage: materialize <name>");
+        }
+
+        if (!store_materialize(opt_store, argv[i + 1], opt_filename)) {
+            ret = 1;
+        }
+
+        quit();
+
+        return (ret);
+    }
+
+    if (opt_overlay) {
+        if (opt_disk_command_format_set) {
+            DIE("Cannot format through an overlay");
+        }
+
+        if (opt_direct || opt_journal) {
+            DIE("--overlay cannot be used with --direct or --journal");
+        }
+    }
+
     if (opt_disk_command_format_set) {
         command_format(argc,
                        opt_disk_start_offset,
@@ -1568,6 +2796,10 @@ int32_t main (int32_t argc, char *argv[])
         DIE("Disk image file %s does not exist", opt_filename);
     }
 
+    if (opt_overlay && !overlay_open(opt_filename, opt_overlay)) {
+        DIE("Cannot open overlay %s over %s", opt_overlay, opt_filename);
+    }
+
     /*
      * If not given an offset, try and find a viable DOS disk by scanning
      * the file.
@@ -1676,6 +2908,124 @@ int32_t main (int32_t argc, char *argv[])
         (void) command_cat(argc, i, argv);
     }
 
+    /*
+     * Command: read-at
+     */
+    if (opt_disk_command_read_at_set) {
+        if (!command_read_at(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: map
+     */
+    if (opt_disk_command_map_set) {
+        if (!command_map(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: write-at
+     */
+    if (opt_disk_command_write_at_set) {
+        if (!command_write_at(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: append
+     */
+    if (opt_disk_command_append_set) {
+        if (!command_append(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: truncate
+     */
+    if (opt_disk_command_truncate_set) {
+        if (!command_truncate(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: sync
+     */
+    if (opt_disk_command_sync_set) {
+        (void) command_sync(argc, i, argv);
+    }
+
+    /*
+     * Command: defrag
+     */
+    if (opt_disk_command_defrag_set) {
+        if (!command_defrag(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: check. Problems left unrepaired fail the run.
+     */
+    if (opt_disk_command_check_set) {
+        if (command_check(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: shrink
+     */
+    if (opt_disk_command_shrink_set) {
+        if (!command_shrink(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: resize
+     */
+    if (opt_disk_command_resize_set) {
+        if (!command_resize(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: commit
+     */
+    if (opt_disk_command_commit_set) {
+        if (!disk_command_commit(disk)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: flatten
+     */
+    if (opt_disk_command_flatten_set) {
+        if (!command_flatten(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
+    /*
+     * Command: snapshot
+     */
+    if (opt_disk_command_snapshot_set) {
+        if (i + 1 >= argc) {
+            ERR("usage: snapshot <name>");
+            ret = 1;
+        } else if (!disk_command_snapshot(disk, opt_store, argv[i + 1])) {
+            ret = 1;
+        }
+    }
+
     /*
      * Command: extract
      */
@@ -1683,6 +3033,22 @@ int32_t main (int32_t argc, char *argv[])
         (void) command_extract(argc, i, argv);
     }
 
+    /*
+     * Command: export-tar
+     */
+    if (opt_disk_command_export_tar_set) {
+        (void) command_export_tar(argc, i, argv);
+    }
+
+    /*
+     * Command: import-tar
+     */
+    if (opt_disk_command_import_tar_set) {
+        if (!command_import_tar(argc, i, argv)) {
+            ret = 1;
+        }
+    }
+
     /*
      * Command: add
      */
@@ -1704,6 +3070,19 @@ int32_t main (int32_t argc, char *argv[])
         (void) command_remove(argc, i, argv);
     }
 
+    /*
+     * Command: shell
+     */
+    if (opt_disk_command_shell_set) {
+        if (!opt_script && (i + 1 < argc)) {
+            opt_script = argv[i + 1];
+        }
+
+        if (!command_shell(opt_script)) {
+            ret = 1;
+        }
+    }
+
     /*
      * Default action.
      */
@@ -1724,5 +3103,5 @@ int32_t main (int32_t argc, char *argv[])
 
     quit();
 
-    return (0);
+    return (ret);
 }
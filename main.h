@@ -10,6 +10,7 @@
 
 #include <stdarg.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 /*
  * Types
@@ -106,14 +107,61 @@ void CROAK(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void DYING(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void OUT(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void VER(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
-void DBG(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
-void DBG2(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
-void DBG3(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
-void DBG4(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
-void DBG5(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+void DBG_(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+void DBG2_(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+void DBG3_(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+void DBG4_(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+void DBG5_(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void WARN(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 void ERR(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 
+/*
+ * Debug logging checks the level before the arguments are evaluated, as
+ * these sit in the sector, cluster and dirent loops. Without
+ * ENABLE_DEBUG_LOGGING they compile away; the if (0) keeps the arguments
+ * type checked and any variables only used in them still used.
+ */
+#ifdef ENABLE_DEBUG_LOGGING
+#define DBG_LEVEL(__level__)    (__level__)
+#else
+#define DBG_LEVEL(__level__)    (0)
+#endif
+
+#define DBG(...)                                                              \
+    do {                                                                      \
+        if (DBG_LEVEL(opt_debug)) {                                           \
+            DBG_(__VA_ARGS__);                                                \
+        }                                                                     \
+    } while (0)
+
+#define DBG2(...)                                                             \
+    do {                                                                      \
+        if (DBG_LEVEL(opt_debug2)) {                                          \
+            DBG2_(__VA_ARGS__);                                               \
+        }                                                                     \
+    } while (0)
+
+#define DBG3(...)                                                             \
+    do {                                                                      \
+        if (DBG_LEVEL(opt_debug3)) {                                          \
+            DBG3_(__VA_ARGS__);                                               \
+        }                                                                     \
+    } while (0)
+
+#define DBG4(...)                                                             \
+    do {                                                                      \
+        if (DBG_LEVEL(opt_debug4)) {                                          \
+            DBG4_(__VA_ARGS__);                                               \
+        }                                                                     \
+    } while (0)
+
+#define DBG5(...)                                                             \
+    do {                                                                      \
+        if (DBG_LEVEL(opt_debug5)) {                                          \
+            DBG5_(__VA_ARGS__);                                               \
+        }                                                                     \
+    } while (0)
+
 /*
  * util.c
  */
@@ -129,6 +177,61 @@ void *myrealloc_(void *ptr, uint32_t size, const char *what, const char *func,
 void myfree_(void *ptr, const char *func, const char *file,
              const uint32_t line);
 
+uint32_t crc32c(uint32_t crc, const uint8_t *buf, uint64_t len);
+void sha256(const uint8_t *buf, uint64_t len, uint8_t out[32]);
+uint64_t time_now_ns(void);
+
+/*
+ * Bump allocator for short lived strings and buffers. Take a mark on entry
+ * to a scope and release back to it on the way out.
+ */
+typedef struct arena_block_ {
+    struct arena_block_ *prev;
+    uint32_t size;
+    uint32_t used;
+} arena_block_t;
+
+typedef struct arena_ {
+    arena_block_t *block;
+    arena_block_t *spare;
+    uint64_t blocks;
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t bytes_peak;
+} arena_t;
+
+typedef struct arena_mark_ {
+    arena_block_t *block;
+    uint32_t used;
+    uint64_t bytes;
+} arena_mark_t;
+
+void *arena_alloc(arena_t *arena, uint32_t size);
+arena_mark_t arena_mark(arena_t *arena);
+void arena_release(arena_t *arena, arena_mark_t mark);
+void arena_destroy(arena_t *arena);
+char *arena_printf(arena_t *arena, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+char *arena_vprintf(arena_t *arena, const char *fmt, va_list args);
+char *arena_duplstr(arena_t *arena, const char *in);
+
+/*
+ * Pool of fixed size objects, all freed at once by slab_destroy.
+ */
+typedef struct slab_ {
+    void *chunks;
+    void *free_list;
+    uint32_t obj_size;
+    uint32_t objs_per_chunk;
+    uint64_t objects;
+    uint64_t objects_peak;
+} slab_t;
+
+void slab_init(slab_t *slab, uint32_t obj_size, uint32_t objs_per_chunk);
+void *slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *obj);
+void slab_destroy(slab_t *slab);
+
 char *dupstr_(const char *in, const char *what, const char *func,
               const char *file, const uint32_t line);
 
@@ -150,7 +253,11 @@ boolean file_non_zero_size_exists(const char *filename);
 boolean file_mtime(const char *filename,
                    int32_t *day,
                    int32_t *month,
-                   int32_t *year);
+                   int32_t *year,
+                   int32_t *hour,
+                   int32_t *min,
+                   int32_t *sec);
+boolean file_mtime_secs(const char *filename, int64_t *when);
 uint32_t getumask(void);
 boolean file_match(const char *regexp_in, const char *name_in, boolean is_dir);
 char *filename_cleanup(const char *in_);
@@ -244,22 +351,40 @@ char *duplstr_(const char *in, const char *what, const char *func,
                const char *file, const uint32_t line);
 
 #include "ptrcheck.h"
+#include "trace.h"
+#include "tar.h"
+#include "uring.h"
+#include "journal.h"
+#include "overlay.h"
 
 /*
- * main.c
+ * libfatdisk.c
  */
 void quit(void);
 void die(void);
+void die_hook(void);
+boolean die_guard(void (*call)(void *), void *context);
+
+/*
+ * main.c
+ */
 void usage(void);
 
 extern boolean opt_verbose;
 extern boolean opt_quiet;
+extern boolean opt_stats;
+extern boolean opt_direct;
+extern boolean opt_journal;
 extern boolean opt_debug5;
 extern boolean opt_debug4;
 extern boolean opt_debug3;
 extern boolean opt_debug2;
 extern boolean opt_debug;
 extern boolean croaked;
+extern uint32_t err_count;
+extern boolean log_silent;
 extern uint32_t opt_sector_size;
 extern uint32_t opt_sectors_per_cluster;
 extern boolean die_with_usage;
+extern uint64_t regcomp_count;
+extern uint64_t alloc_count;
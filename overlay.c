@@ -0,0 +1,961 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * A copy-on-write overlay: the image is read from a base that is never
+ * written, with the blocks that have changed kept in a delta file. A
+ * variant of a base costs only the blocks it changes. The delta is a
+ * header followed by records of a block number and its data; an index of
+ * them is built on open. A block written again is rewritten in place.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "main.h"
+
+#define OVERLAY_MAGIC                   "FATDISKO"
+#define OVERLAY_VERSION                 1
+
+/*
+ * Block number of a record no longer in use, e.g. cut off by a shrink.
+ */
+#define OVERLAY_DROPPED                 UINT64_MAX
+
+/*
+ * One record: the block number then the block.
+ */
+#define OVERLAY_RECORD                  (sizeof(uint64_t) + OVERLAY_BLOCK)
+
+/*
+ * Most records gathered into one read or write of the delta.
+ */
+#define OVERLAY_RUN                     (ONE_MEG / OVERLAY_BLOCK)
+
+/*
+ * In host byte order; a delta is only used where it was made.
+ */
+typedef struct overlay_header_ {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    /*
+     * Size of the base when the delta was made, to catch the wrong base.
+     */
+    uint64_t base_size;
+    /*
+     * The base shows through below here; above it, reads are of zeros.
+     */
+    uint64_t base_limit;
+    /*
+     * Size of the image as seen through the delta.
+     */
+    uint64_t size;
+} overlay_header_t;
+
+/*
+ * Where in the delta a block lives.
+ */
+typedef struct overlay_node_ {
+    tree_key_int tree;
+    uint64_t at;
+} overlay_node;
+
+typedef struct overlay_ {
+    char *filename;
+    char *delta;
+    int base_fd;
+    int fd;
+    overlay_header_t header;
+    boolean header_dirty;
+    /*
+     * Where the next new record goes.
+     */
+    uint64_t end;
+    tree_root *index;
+    uint32_t blocks;
+} overlay_t;
+
+static overlay_t *overlay;
+
+/*
+ * overlay_pread_all
+ *
+ * Read all of a range, or fail.
+ */
+static boolean
+overlay_pread_all (int fd, uint8_t *buf, uint64_t len, uint64_t offset)
+{
+    ssize_t done;
+
+    while (len) {
+        done = pread(fd, buf, len, (off_t) offset);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return (false);
+        }
+
+        if (!done) {
+            errno = EIO;
+            return (false);
+        }
+
+        buf += done;
+        offset += (uint64_t) done;
+        len -= (uint64_t) done;
+    }
+
+    return (true);
+}
+
+/*
+ * overlay_pwrite_all
+ *
+ * Write all of a range, or fail.
+ */
+static boolean
+overlay_pwrite_all (int fd, const uint8_t *buf, uint64_t len,
+                    uint64_t offset)
+{
+    ssize_t done;
+
+    while (len) {
+        done = pwrite(fd, buf, len, (off_t) offset);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return (false);
+        }
+
+        buf += done;
+        offset += (uint64_t) done;
+        len -= (uint64_t) done;
+    }
+
+    return (true);
+}
+
+/*
+ * overlay_find
+ *
+ * The record for a block, if the delta has one.
+ */
+static overlay_node *
+overlay_find (overlay_t *ov, uint64_t block)
+{
+    overlay_node target;
+
+    if (!ov->blocks) {
+        return (0);
+    }
+
+    memset(&target, 0, sizeof(target));
+    target.tree.key = (int32_t) (uint32_t) block;
+
+    return ((overlay_node *) tree_find(ov->index, &target.tree.node));
+}
+
+/*
+ * overlay_index_add
+ *
+ * Note where a block's data is in the delta.
+ */
+static overlay_node *
+overlay_index_add (overlay_t *ov, uint64_t block, uint64_t at)
+{
+    overlay_node *node;
+
+    node = overlay_find(ov, block);
+    if (node) {
+        node->at = at;
+        return (node);
+    }
+
+    node = (typeof(node)) myzalloc(sizeof(*node), __FUNCTION__);
+    node->tree.key = (int32_t) (uint32_t) block;
+    node->at = at;
+
+    if (!tree_insert(ov->index, &node->tree.node)) {
+        DIE("overlay block %" PRIu64 " insert fail", block);
+    }
+
+    ov->blocks++;
+
+    return (node);
+}
+
+/*
+ * overlay_header_write
+ *
+ * Write the header back if it has changed.
+ */
+static boolean
+overlay_header_write (overlay_t *ov)
+{
+    if (!ov->header_dirty) {
+        return (true);
+    }
+
+    if (!overlay_pwrite_all(ov->fd, (const uint8_t *) &ov->header,
+                            sizeof(ov->header), 0)) {
+        ERR("Cannot write overlay %s: %s", ov->delta, strerror(errno));
+        return (false);
+    }
+
+    ov->header_dirty = false;
+
+    return (true);
+}
+
+/*
+ * overlay_scan
+ *
+ * Index the records of a delta. A record cut short by a crash is left
+ * out, and written over by the next new block.
+ */
+static boolean
+overlay_scan (overlay_t *ov, uint64_t len)
+{
+    uint8_t *buf;
+    uint64_t at = sizeof(overlay_header_t);
+    uint64_t block;
+    uint64_t n;
+    uint64_t i;
+
+    buf = (typeof(buf)) myzalloc(OVERLAY_RUN * OVERLAY_RECORD, __FUNCTION__);
+
+    while (len - at >= OVERLAY_RECORD) {
+        n = min((len - at) / OVERLAY_RECORD, (uint64_t) OVERLAY_RUN);
+
+        if (!overlay_pread_all(ov->fd, buf, n * OVERLAY_RECORD, at)) {
+            ERR("Cannot read overlay %s: %s", ov->delta, strerror(errno));
+            myfree(buf);
+            return (false);
+        }
+
+        for (i = 0; i < n; i++) {
+            memcpy(&block, buf + (i * OVERLAY_RECORD), sizeof(block));
+
+            if (block != OVERLAY_DROPPED) {
+                overlay_index_add(ov, block,
+                                  at + (i * OVERLAY_RECORD) + sizeof(block));
+            }
+        }
+
+        at += n * OVERLAY_RECORD;
+    }
+
+    ov->end = at;
+
+    myfree(buf);
+
+    return (true);
+}
+
+/*
+ * overlay_open
+ *
+ * Read and write the image filename through the delta, which is made if
+ * it does not exist. The base is only ever read.
+ */
+boolean
+overlay_open (const char *filename, const char *delta)
+{
+    overlay_t *ov;
+    struct stat st;
+    struct stat dst;
+
+    if (overlay) {
+        ERR("Only one overlay can be open");
+        return (false);
+    }
+
+    ov = (typeof(ov)) myzalloc(sizeof(*ov), __FUNCTION__);
+    ov->filename = dupstr(filename, __FUNCTION__);
+    ov->delta = dupstr(delta, __FUNCTION__);
+    ov->index = tree_alloc(TREE_KEY_INTEGER, "TREE ROOT: overlay");
+    ov->fd = -1;
+
+    ov->base_fd = open(filename, O_RDONLY);
+    if ((ov->base_fd < 0) || (fstat(ov->base_fd, &st) < 0)) {
+        ERR("Cannot open base image %s: %s", filename, strerror(errno));
+        overlay = ov;
+        overlay_close();
+        return (false);
+    }
+
+    ov->fd = open(delta, O_RDWR | O_CREAT, 0644);
+    if ((ov->fd < 0) || (fstat(ov->fd, &dst) < 0)) {
+        ERR("Cannot open overlay %s: %s", delta, strerror(errno));
+        overlay = ov;
+        overlay_close();
+        return (false);
+    }
+
+    overlay = ov;
+
+    if (!dst.st_size) {
+        memcpy(ov->header.magic, OVERLAY_MAGIC, sizeof(ov->header.magic));
+        ov->header.version = OVERLAY_VERSION;
+        ov->header.block_size = OVERLAY_BLOCK;
+        ov->header.base_size = (uint64_t) st.st_size;
+        ov->header.base_limit = (uint64_t) st.st_size;
+        ov->header.size = (uint64_t) st.st_size;
+        ov->header_dirty = true;
+        ov->end = sizeof(ov->header);
+
+        if (!overlay_header_write(ov)) {
+            overlay_close();
+            return (false);
+        }
+
+        return (true);
+    }
+
+    if (((uint64_t) dst.st_size < sizeof(ov->header)) ||
+        !overlay_pread_all(ov->fd, (uint8_t *) &ov->header,
+                           sizeof(ov->header), 0) ||
+        memcmp(ov->header.magic, OVERLAY_MAGIC, sizeof(ov->header.magic)) ||
+        (ov->header.version != OVERLAY_VERSION) ||
+        (ov->header.block_size != OVERLAY_BLOCK)) {
+        ERR("%s is not a fatdisk overlay", delta);
+        overlay_close();
+        return (false);
+    }
+
+    if (ov->header.base_size != (uint64_t) st.st_size) {
+        ERR("Overlay %s was made from a base of %" PRIu64 " bytes, "
+            "%s is %" PRIu64 " bytes", delta, ov->header.base_size,
+            filename, (uint64_t) st.st_size);
+        overlay_close();
+        return (false);
+    }
+
+    if (!overlay_scan(ov, (uint64_t) dst.st_size)) {
+        overlay_close();
+        return (false);
+    }
+
+    DBG("Overlay %s has %" PRIu32 " blocks over %s", delta, ov->blocks,
+        filename);
+
+    return (true);
+}
+
+/*
+ * overlay_close
+ *
+ * Write the header back and let go of the delta.
+ */
+void
+overlay_close (void)
+{
+    overlay_t *ov = overlay;
+
+    if (!ov) {
+        return;
+    }
+
+    if (ov->fd >= 0) {
+        (void) overlay_header_write(ov);
+        close(ov->fd);
+    }
+
+    if (ov->base_fd >= 0) {
+        close(ov->base_fd);
+    }
+
+    tree_destroy(&ov->index, 0);
+    myfree(ov->filename);
+    myfree(ov->delta);
+    myfree(ov);
+
+    overlay = 0;
+}
+
+/*
+ * overlay_active
+ *
+ * Is this image being seen through an overlay?
+ */
+boolean
+overlay_active (const char *filename)
+{
+    return (overlay && filename && !strcmp(filename, overlay->filename));
+}
+
+/*
+ * overlay_patch
+ *
+ * Copy the blocks the delta has over a range already read from the base.
+ * Runs of blocks whose records are next to each other are read at once.
+ */
+static boolean
+overlay_patch (overlay_t *ov, uint64_t offset, uint8_t *buf, uint64_t len)
+{
+    uint64_t first = offset / OVERLAY_BLOCK;
+    uint64_t last = (offset + len - 1) / OVERLAY_BLOCK;
+    uint8_t *run_buf = 0;
+    overlay_node *node;
+    overlay_node *next;
+    uint64_t block;
+    uint64_t run;
+    uint64_t i;
+
+    if (!ov->blocks || !len) {
+        return (true);
+    }
+
+    for (block = first; block <= last; block += run) {
+        node = overlay_find(ov, block);
+        run = 1;
+
+        if (!node) {
+            continue;
+        }
+
+        while ((block + run <= last) && (run < OVERLAY_RUN)) {
+            next = overlay_find(ov, block + run);
+            if (!next || (next->at != node->at + (run * OVERLAY_RECORD))) {
+                break;
+            }
+
+            run++;
+        }
+
+        if (!run_buf) {
+            run_buf = (typeof(run_buf))
+                myzalloc(OVERLAY_RUN * OVERLAY_RECORD, __FUNCTION__);
+        }
+
+        if (!overlay_pread_all(ov->fd, run_buf,
+                               ((run - 1) * OVERLAY_RECORD) + OVERLAY_BLOCK,
+                               node->at)) {
+            ERR("Cannot read overlay %s: %s", ov->delta, strerror(errno));
+            myfree(run_buf);
+            return (false);
+        }
+
+        for (i = 0; i < run; i++) {
+            uint64_t start = (block + i) * OVERLAY_BLOCK;
+            uint64_t from = max(start, offset);
+            uint64_t to = min(start + OVERLAY_BLOCK, offset + len);
+
+            memcpy(buf + (from - offset),
+                   run_buf + (i * OVERLAY_RECORD) + (from - start),
+                   to - from);
+        }
+    }
+
+    myfree(run_buf);
+
+    return (true);
+}
+
+/*
+ * overlay_read
+ *
+ * Read a range of the image as seen through the delta. Past its end reads
+ * as zeros.
+ */
+static boolean
+overlay_read (overlay_t *ov, uint64_t offset, uint8_t *buf, uint64_t len)
+{
+    uint64_t visible = min(ov->header.base_limit, ov->header.size);
+    uint64_t n = 0;
+
+    if (offset < visible) {
+        n = min(len, visible - offset);
+
+        if (!overlay_pread_all(ov->base_fd, buf, n, offset)) {
+            ERR("Cannot read base image %s: %s", ov->filename,
+                strerror(errno));
+            return (false);
+        }
+    }
+
+    if (n < len) {
+        memset(buf + n, 0, len - n);
+    }
+
+    return (overlay_patch(ov, offset, buf, len));
+}
+
+/*
+ * overlay_write
+ *
+ * Write a range of the image into the delta. Blocks it only partly covers
+ * are read first; blocks already in the delta are rewritten where they
+ * are, new ones added at the end.
+ */
+static boolean
+overlay_write (overlay_t *ov, uint64_t offset, const uint8_t *data,
+               uint64_t len)
+{
+    uint64_t first = offset / OVERLAY_BLOCK;
+    uint64_t last = (offset + len - 1) / OVERLAY_BLOCK;
+    uint8_t *seg;
+    uint64_t seg_at = 0;
+    uint64_t seg_len = 0;
+    uint64_t seg_max;
+    overlay_node *node;
+    uint64_t block;
+    uint64_t at;
+    boolean ok = true;
+
+    if (!len) {
+        return (true);
+    }
+
+    seg_max = min(last - first + 1, (uint64_t) OVERLAY_RUN) * OVERLAY_RECORD;
+    seg = (typeof(seg)) myzalloc(seg_max, __FUNCTION__);
+
+    for (block = first; ok && (block <= last); block++) {
+        uint64_t start = block * OVERLAY_BLOCK;
+        uint64_t from = max(start, offset);
+        uint64_t to = min(start + OVERLAY_BLOCK, offset + len);
+        uint8_t *rec;
+
+        node = overlay_find(ov, block);
+        if (node) {
+            at = node->at - sizeof(uint64_t);
+        } else {
+            at = ov->end;
+        }
+
+        /*
+         * Only grow the segment with records next to it.
+         */
+        if (seg_len &&
+            ((at != seg_at + seg_len) || (seg_len == seg_max))) {
+            ok = overlay_pwrite_all(ov->fd, seg, seg_len, seg_at);
+            seg_len = 0;
+        }
+
+        if (!seg_len) {
+            seg_at = at;
+        }
+
+        rec = seg + seg_len;
+        memcpy(rec, &block, sizeof(block));
+
+        if ((to - from) < OVERLAY_BLOCK) {
+            ok = ok && overlay_read(ov, start, rec + sizeof(block),
+                                    OVERLAY_BLOCK);
+        }
+
+        memcpy(rec + sizeof(block) + (from - start), data + (from - offset),
+               to - from);
+
+        seg_len += OVERLAY_RECORD;
+
+        if (!node) {
+            overlay_index_add(ov, block, at + sizeof(uint64_t));
+            ov->end += OVERLAY_RECORD;
+        }
+    }
+
+    if (ok && seg_len) {
+        ok = overlay_pwrite_all(ov->fd, seg, seg_len, seg_at);
+    }
+
+    myfree(seg);
+
+    if (!ok) {
+        ERR("Cannot write overlay %s: %s", ov->delta, strerror(errno));
+        return (false);
+    }
+
+    if (offset + len > ov->header.size) {
+        ov->header.size = offset + len;
+        ov->header_dirty = true;
+    }
+
+    return (true);
+}
+
+/*
+ * overlay_read_from
+ *
+ * As file_read_from, through the overlay if the file has one.
+ */
+uint8_t *
+overlay_read_from (const char *filename, int64_t offset, int64_t len)
+{
+    uint8_t *buf;
+
+    if (!overlay_active(filename)) {
+        return (file_read_from(filename, offset, len));
+    }
+
+    if (!len) {
+        return (0);
+    }
+
+    if ((uint64_t) (offset + len) > overlay->header.size) {
+        ERR("Failed to read %" PRIu64 " bytes from file at "
+            "offset %" PRIu64 " \"%s\": past the end",
+            len, offset, filename);
+        return (0);
+    }
+
+    buf = (typeof(buf)) myzalloc((uint32_t) len + sizeof((char)'\0'),
+                                 "file read from");
+
+    if (!overlay_read(overlay, (uint64_t) offset, buf, (uint64_t) len)) {
+        myfree(buf);
+        return (0);
+    }
+
+    return (buf);
+}
+
+/*
+ * overlay_write_at
+ *
+ * As file_write_at, into the delta if the file has an overlay.
+ */
+int64_t
+overlay_write_at (const char *filename, int64_t offset, uint8_t *buf,
+                  int64_t len)
+{
+    if (!overlay_active(filename)) {
+        return (file_write_at(filename, offset, buf, len));
+    }
+
+    if (!overlay_write(overlay, (uint64_t) offset, buf, (uint64_t) len)) {
+        return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * overlay_pread
+ *
+ * As pread on fd, an open of filename, through the overlay if it has one.
+ */
+ssize_t
+overlay_pread (const char *filename, int fd, void *buf, size_t len,
+               off_t offset)
+{
+    if (!overlay_active(filename)) {
+        return (pread(fd, buf, len, offset));
+    }
+
+    if ((uint64_t) offset + len > overlay->header.size) {
+        if ((uint64_t) offset >= overlay->header.size) {
+            return (0);
+        }
+
+        len = overlay->header.size - (uint64_t) offset;
+    }
+
+    if (!overlay_read(overlay, (uint64_t) offset, (uint8_t *) buf, len)) {
+        return (-1);
+    }
+
+    return ((ssize_t) len);
+}
+
+/*
+ * overlay_file_size
+ *
+ * As file_size, of the image as seen through any overlay.
+ */
+int64_t
+overlay_file_size (const char *filename)
+{
+    if (!overlay_active(filename)) {
+        return (file_size(filename));
+    }
+
+    return ((int64_t) overlay->header.size);
+}
+
+/*
+ * overlay_truncate
+ *
+ * As truncate. Through an overlay the base is left alone; it stops
+ * showing through past the new size, and blocks of the delta past it are
+ * dropped.
+ */
+boolean
+overlay_truncate (const char *filename, uint64_t size)
+{
+    overlay_t *ov = overlay;
+    uint64_t dropped = OVERLAY_DROPPED;
+    overlay_node *node;
+    uint64_t start;
+
+    if (!overlay_active(filename)) {
+        return (truncate(filename, (off_t) size) == 0);
+    }
+
+    {
+        TREE_WALK(ov->index, node) {
+            start = (uint64_t) (uint32_t) node->tree.key * OVERLAY_BLOCK;
+
+            if (start + OVERLAY_BLOCK <= size) {
+                continue;
+            }
+
+            if (start < size) {
+                uint8_t zero[OVERLAY_BLOCK];
+
+                memset(zero, 0, sizeof(zero));
+
+                if (!overlay_pwrite_all(ov->fd, zero,
+                                        start + OVERLAY_BLOCK - size,
+                                        node->at + (size - start))) {
+                    return (false);
+                }
+
+                continue;
+            }
+
+            if (!overlay_pwrite_all(ov->fd, (const uint8_t *) &dropped,
+                                    sizeof(dropped),
+                                    node->at - sizeof(uint64_t))) {
+                return (false);
+            }
+
+            tree_remove(ov->index, &node->tree.node);
+            myfree(node);
+            ov->blocks--;
+        }
+    }
+
+    ov->header.base_limit = min(ov->header.base_limit, size);
+    ov->header.size = size;
+    ov->header_dirty = true;
+
+    return (overlay_header_write(ov));
+}
+
+/*
+ * overlay_sync
+ *
+ * Wait until what has been written to the delta is on disk.
+ */
+boolean
+overlay_sync (void)
+{
+    if (!overlay) {
+        return (true);
+    }
+
+    if (!overlay_header_write(overlay)) {
+        return (false);
+    }
+
+    if (fdatasync(overlay->fd) < 0) {
+        ERR("Cannot sync overlay %s: %s", overlay->delta, strerror(errno));
+        return (false);
+    }
+
+    return (true);
+}
+
+/*
+ * overlay_copy_runs
+ *
+ * Write every block of the delta to fd, at its place in the image, a run
+ * of neighbouring blocks at a time.
+ */
+static boolean
+overlay_copy_runs (overlay_t *ov, int fd)
+{
+    uint8_t *buf;
+    overlay_node *node;
+    uint64_t run_block = 0;
+    uint64_t run = 0;
+    uint64_t block;
+    boolean ok = true;
+
+    buf = (typeof(buf)) myzalloc(OVERLAY_RUN * OVERLAY_BLOCK, __FUNCTION__);
+
+    {
+        TREE_WALK_UNSAFE(ov->index, node) {
+            block = (uint64_t) (uint32_t) node->tree.key;
+
+            if (run && ((block != run_block + run) || (run == OVERLAY_RUN))) {
+                ok = ok &&
+                     overlay_read(ov, run_block * OVERLAY_BLOCK, buf,
+                                  run * OVERLAY_BLOCK) &&
+                     overlay_pwrite_all(fd, buf, run * OVERLAY_BLOCK,
+                                        run_block * OVERLAY_BLOCK);
+                run = 0;
+            }
+
+            if (!run) {
+                run_block = block;
+            }
+
+            run++;
+        }
+    }
+
+    if (run) {
+        ok = ok &&
+             overlay_read(ov, run_block * OVERLAY_BLOCK, buf,
+                          run * OVERLAY_BLOCK) &&
+             overlay_pwrite_all(fd, buf, run * OVERLAY_BLOCK,
+                                run_block * OVERLAY_BLOCK);
+    }
+
+    myfree(buf);
+
+    return (ok);
+}
+
+/*
+ * overlay_commit
+ *
+ * Write the delta into the base and empty it. The base is then the image
+ * as seen through the delta.
+ */
+boolean
+overlay_commit (void)
+{
+    overlay_t *ov = overlay;
+    uint32_t blocks;
+    int fd;
+
+    if (!ov) {
+        ERR("No overlay to commit");
+        return (false);
+    }
+
+    blocks = ov->blocks;
+
+    fd = open(ov->filename, O_WRONLY);
+    if (fd < 0) {
+        ERR("Cannot open %s to commit %s: %s", ov->filename, ov->delta,
+            strerror(errno));
+        return (false);
+    }
+
+    /*
+     * Cut off what no longer shows through, then lay the delta over it.
+     */
+    if ((ov->header.base_limit < ov->header.base_size) &&
+        (ftruncate(fd, (off_t) ov->header.base_limit) < 0)) {
+        ERR("Cannot cut %s to %" PRIu64 " bytes: %s", ov->filename,
+            ov->header.base_limit, strerror(errno));
+        close(fd);
+        return (false);
+    }
+
+    if (!overlay_copy_runs(ov, fd) ||
+        (ftruncate(fd, (off_t) ov->header.size) < 0) ||
+        (fdatasync(fd) < 0)) {
+        ERR("Cannot commit %s to %s: %s", ov->delta, ov->filename,
+            strerror(errno));
+        close(fd);
+        return (false);
+    }
+
+    close(fd);
+
+    tree_empty(ov->index, 0);
+    ov->blocks = 0;
+    ov->end = sizeof(ov->header);
+    ov->header.base_size = ov->header.size;
+    ov->header.base_limit = ov->header.size;
+    ov->header_dirty = true;
+
+    if ((ftruncate(ov->fd, (off_t) ov->end) < 0) ||
+        !overlay_sync()) {
+        ERR("Cannot empty overlay %s: %s", ov->delta, strerror(errno));
+        return (false);
+    }
+
+    OUT("Committed %" PRIu32 " blocks from %s to %s", blocks, ov->delta,
+        ov->filename);
+
+    return (true);
+}
+
+/*
+ * overlay_flatten
+ *
+ * Write the image as seen through the delta to a new, standalone file.
+ * Blocks of zeros are left as holes.
+ */
+boolean
+overlay_flatten (const char *out)
+{
+    overlay_t *ov = overlay;
+    uint8_t *buf;
+    uint64_t at;
+    uint64_t n;
+    uint64_t i;
+    boolean ok = true;
+    int fd;
+
+    if (!ov) {
+        ERR("No overlay to flatten");
+        return (false);
+    }
+
+    fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ERR("Cannot create %s: %s", out, strerror(errno));
+        return (false);
+    }
+
+    buf = (typeof(buf)) myzalloc(ONE_MEG, __FUNCTION__);
+
+    for (at = 0; ok && (at < ov->header.size); at += n) {
+        n = min((uint64_t) ONE_MEG, ov->header.size - at);
+
+        ok = overlay_read(ov, at, buf, n);
+
+        for (i = 0; ok && (i < n); i += OVERLAY_BLOCK) {
+            uint64_t len = min((uint64_t) OVERLAY_BLOCK, n - i);
+            uint64_t j;
+
+            for (j = 0; j < len; j++) {
+                if (buf[i + j]) {
+                    break;
+                }
+            }
+
+            if (j < len) {
+                ok = overlay_pwrite_all(fd, buf + i, len, at + i);
+            }
+        }
+    }
+
+    myfree(buf);
+
+    ok = ok && !ftruncate(fd, (off_t) ov->header.size) && !fdatasync(fd);
+
+    if (!ok) {
+        ERR("Cannot write %s: %s", out, strerror(errno));
+    }
+
+    close(fd);
+
+    if (ok) {
+        OUT("Flattened %s and %s to %s, %" PRIu64 " bytes", ov->filename,
+            ov->delta, out, ov->header.size);
+    }
+
+    return (ok);
+}
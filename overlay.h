@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * A copy-on-write overlay: the image is read from a base that is never
+ * written, with the blocks that have changed kept in a delta file.
+ */
+
+#ifndef __OVERLAY_H__
+#define __OVERLAY_H__
+
+boolean overlay_open(const char *filename, const char *delta);
+void overlay_close(void);
+boolean overlay_active(const char *filename);
+uint8_t *overlay_read_from(const char *filename, int64_t offset, int64_t len);
+int64_t overlay_write_at(const char *filename, int64_t offset, uint8_t *buf,
+                         int64_t len);
+ssize_t overlay_pread(const char *filename, int fd, void *buf, size_t len,
+                      off_t offset);
+int64_t overlay_file_size(const char *filename);
+boolean overlay_truncate(const char *filename, uint64_t size);
+boolean overlay_sync(void);
+boolean overlay_commit(void);
+boolean overlay_flatten(const char *out);
+
+#endif
@@ -0,0 +1,559 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * A content addressed store of images. A snapshot cuts the clusters in
+ * use, and the rest of the image outside the data area, into chunks named
+ * by their SHA-256, each kept once however many images hold it, plus a
+ * manifest of where each goes. Free clusters and zeros are not kept.
+ * Chunks of clusters end where a cluster's checksum says so, so the same
+ * file data cuts the same way wherever it lies.
+ *
+ *     <dir>/chunks/ab/abcd...     chunk data
+ *     <dir>/<name>.manifest       size, layout, then "chunk <at> <len> <sha>"
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "main.h"
+#include "disk.h"
+#include "fat.h"
+#include "store.h"
+
+#define STORE_MAGIC                     "fatdisk-store"
+#define STORE_VERSION                   1
+#define STORE_HASH_HEX                  64
+
+typedef struct store_ {
+    const char *dir;
+    FILE *manifest;
+    /*
+     * The chunk being built, and where in the image it starts.
+     */
+    uint8_t *chunk;
+    uint64_t chunk_len;
+    uint64_t chunk_at;
+    uint32_t chunks;
+    uint32_t chunks_new;
+    uint64_t bytes;
+    uint64_t bytes_new;
+    boolean ok;
+} store_t;
+
+/*
+ * store_mkdir
+ *
+ * Make a dir of the store if it is not there already.
+ */
+static boolean
+store_mkdir (const char *dir)
+{
+    if ((mkdir(dir, 0755) < 0) && (errno != EEXIST)) {
+        ERR("Cannot create %s: %s", dir, strerror(errno));
+        return (false);
+    }
+
+    return (true);
+}
+
+/*
+ * store_name_ok
+ *
+ * A snapshot name must stay inside the store.
+ */
+static boolean
+store_name_ok (const char *name)
+{
+    if (!*name || strchr(name, '/') || !strcmp(name, ".") ||
+        !strcmp(name, "..")) {
+        ERR("Bad snapshot name \"%s\"", name);
+        return (false);
+    }
+
+    return (true);
+}
+
+/*
+ * store_write_all
+ *
+ * Write all of a buffer to fd at offset.
+ */
+static boolean
+store_write_all (int fd, const uint8_t *data, uint64_t len, uint64_t offset)
+{
+    ssize_t done;
+
+    while (len) {
+        done = pwrite(fd, data, len, (off_t) offset);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return (false);
+        }
+
+        data += done;
+        offset += (uint64_t) done;
+        len -= (uint64_t) done;
+    }
+
+    return (true);
+}
+
+/*
+ * store_put
+ *
+ * Keep one chunk, unless the store has it already, and note it in the
+ * manifest. A chunk of zeros is a hole and is not kept at all.
+ */
+static void
+store_put (store_t *store, uint64_t at, const uint8_t *data, uint64_t len)
+{
+    uint8_t hash[32];
+    char hex[STORE_HASH_HEX + 1];
+    char *subdir;
+    char *path;
+    char *tmp;
+    uint64_t i;
+    int fd;
+
+    if (!store->ok || !len) {
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (data[i]) {
+            break;
+        }
+    }
+
+    if (i == len) {
+        return;
+    }
+
+    sha256(data, len, hash);
+
+    for (i = 0; i < sizeof(hash); i++) {
+        snprintf(hex + (i * 2), 3, "%02x", hash[i]);
+    }
+
+    subdir = dynprintf("%s/chunks/%.2s", store->dir, hex);
+    path = dynprintf("%s/%s", subdir, hex);
+
+    store->chunks++;
+    store->bytes += len;
+
+    if (!file_exists(path)) {
+        tmp = dynprintf("%s.tmp", path);
+
+        fd = -1;
+
+        if (store_mkdir(subdir)) {
+            fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        }
+
+        if ((fd < 0) || !store_write_all(fd, data, len, 0) ||
+            (fdatasync(fd) < 0) || (rename(tmp, path) < 0)) {
+            ERR("Cannot write chunk %s: %s", path, strerror(errno));
+            (void) unlink(tmp);
+            store->ok = false;
+        } else {
+            store->chunks_new++;
+            store->bytes_new += len;
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        myfree(tmp);
+    }
+
+    fprintf(store->manifest, "chunk %" PRIu64 " %" PRIu64 " %s\n",
+            at, len, hex);
+
+    myfree(path);
+    myfree(subdir);
+}
+
+/*
+ * store_raw
+ *
+ * Keep a range of the image outside the clusters, e.g. the boot record
+ * and FATs, in chunks at fixed offsets.
+ */
+static void
+store_raw (store_t *store, disk_t *disk, uint64_t from, uint64_t to)
+{
+    uint8_t *data;
+    uint64_t n;
+    uint64_t i;
+
+    while (store->ok && (from < to)) {
+        n = min(to - from, (uint64_t) STORE_CHUNK_MAX);
+
+        data = overlay_read_from(disk->filename, (int64_t) from, (int64_t) n);
+        if (!data) {
+            store->ok = false;
+            return;
+        }
+
+        for (i = 0; i < n; i += STORE_RAW_CHUNK) {
+            store_put(store, from + i, data + i,
+                      min(n - i, (uint64_t) STORE_RAW_CHUNK));
+        }
+
+        myfree(data);
+
+        from += n;
+    }
+}
+
+/*
+ * store_cut
+ *
+ * Keep the chunk built so far.
+ */
+static void
+store_cut (store_t *store)
+{
+    store_put(store, store->chunk_at, store->chunk, store->chunk_len);
+
+    store->chunk_len = 0;
+}
+
+/*
+ * store_extent
+ *
+ * Keep a run of clusters in use. A chunk ends after a cluster whose
+ * checksum has the STORE_CHUNK_MASK bits set, when full, or at the end of
+ * the run.
+ */
+static void
+store_extent (store_t *store, disk_t *disk, const fat_extent_t *extent)
+{
+    uint64_t csize = cluster_size(disk);
+    uint32_t per_read = (uint32_t) max((uint64_t) 1,
+                                       STORE_CHUNK_MAX / csize);
+    uint32_t cluster = extent->cluster;
+    uint32_t left = extent->count;
+    uint8_t *data;
+    uint64_t offset;
+    uint32_t n;
+    uint32_t i;
+
+    while (store->ok && left) {
+        n = min(left, per_read);
+
+        offset = (uint64_t) cluster_to_sector(disk, cluster - 2) *
+                        sector_size(disk);
+
+        data = disk_read_from(disk, offset, n * csize);
+        if (!data) {
+            store->ok = false;
+            return;
+        }
+
+        for (i = 0; i < n; i++) {
+            const uint8_t *c = data + (i * csize);
+
+            if (store->chunk_len + csize > STORE_CHUNK_MAX) {
+                store_cut(store);
+            }
+
+            if (!store->chunk_len) {
+                store->chunk_at = disk->offset + offset + (i * csize);
+            }
+
+            memcpy(store->chunk + store->chunk_len, c, csize);
+            store->chunk_len += csize;
+
+            if ((crc32c(0, c, csize) & STORE_CHUNK_MASK) ==
+                    STORE_CHUNK_MASK) {
+                store_cut(store);
+            }
+        }
+
+        myfree(data);
+
+        cluster += n;
+        left -= n;
+    }
+
+    store_cut(store);
+}
+
+/*
+ * store_snapshot
+ *
+ * Keep the image in the store as dir/name.manifest and the chunks it
+ * needs.
+ */
+boolean
+store_snapshot (disk_t *disk, const char *dir, const char *name)
+{
+    fat_extent_t *extents;
+    uint32_t number_of_extents;
+    store_t store;
+    uint64_t data_start;
+    uint64_t data_end;
+    int64_t size;
+    char *chunks;
+    char *manifest;
+    char *tmp;
+    uint32_t i;
+
+    if (!store_name_ok(name)) {
+        return (false);
+    }
+
+    chunks = dynprintf("%s/chunks", dir);
+
+    if (!store_mkdir(dir) || !store_mkdir(chunks)) {
+        myfree(chunks);
+        return (false);
+    }
+
+    myfree(chunks);
+
+    size = overlay_file_size(disk->filename);
+    if (size < 0) {
+        ERR("Cannot size %s", disk->filename);
+        return (false);
+    }
+
+    data_start = disk->offset +
+                    ((uint64_t) cluster_to_sector(disk, 0) * sector_size(disk));
+    data_end = disk->offset +
+                    ((uint64_t) cluster_to_sector(disk,
+                                                  total_clusters(disk) - 2) *
+                     sector_size(disk));
+    data_end = min(data_end, (uint64_t) size);
+
+    manifest = dynprintf("%s/%s.manifest", dir, name);
+    tmp = dynprintf("%s.tmp", manifest);
+
+    memset(&store, 0, sizeof(store));
+    store.dir = dir;
+    store.ok = true;
+    store.chunk = (typeof(store.chunk)) myzalloc(STORE_CHUNK_MAX,
+                                                 __FUNCTION__);
+
+    store.manifest = fopen(tmp, "w");
+    if (!store.manifest) {
+        ERR("Cannot create %s: %s", tmp, strerror(errno));
+        myfree(store.chunk);
+        myfree(manifest);
+        myfree(tmp);
+        return (false);
+    }
+
+    fprintf(store.manifest, "%s %u\n", STORE_MAGIC, STORE_VERSION);
+    fprintf(store.manifest, "size %" PRIu64 "\n", (uint64_t) size);
+    fprintf(store.manifest, "layout fat%" PRIu32 " %" PRIu64 " %" PRIu64
+            " %" PRIu64 " %" PRIu32 "\n", fat_type(disk),
+            (uint64_t) disk->offset, data_start,
+            (uint64_t) cluster_size(disk),
+            total_clusters(disk));
+
+    store_raw(&store, disk, 0, data_start);
+
+    extents = fat_used_extents(disk, &number_of_extents);
+
+    for (i = 0; store.ok && (i < number_of_extents); i++) {
+        store_extent(&store, disk, &extents[i]);
+    }
+
+    myfree(extents);
+
+    store_raw(&store, disk, data_end, (uint64_t) size);
+
+    if ((fflush(store.manifest) != 0) ||
+        (fdatasync(fileno(store.manifest)) < 0)) {
+        store.ok = false;
+    }
+
+    fclose(store.manifest);
+
+    if (store.ok && (rename(tmp, manifest) < 0)) {
+        ERR("Cannot create %s: %s", manifest, strerror(errno));
+        store.ok = false;
+    }
+
+    if (!store.ok) {
+        (void) unlink(tmp);
+    } else {
+        OUT("Snapshot %s: %" PRIu32 " chunks, %" PRIu64 " bytes, "
+            "%" PRIu32 " new, %" PRIu64 " bytes", manifest, store.chunks,
+            store.bytes, store.chunks_new, store.bytes_new);
+    }
+
+    myfree(store.chunk);
+    myfree(manifest);
+    myfree(tmp);
+
+    return (store.ok);
+}
+
+/*
+ * store_copy_chunk
+ *
+ * Copy a chunk into the image, sharing its blocks if the host filesystem
+ * can, else by reading and writing it.
+ */
+static boolean
+store_copy_chunk (int fd, int out, uint64_t at, uint64_t len)
+{
+    uint8_t *buf;
+    ssize_t got;
+    uint64_t done;
+
+    if (disk_copy_fds(fd, 0, out, at, len)) {
+        return (true);
+    }
+
+    buf = (typeof(buf)) myzalloc(STORE_CHUNK_MAX, __FUNCTION__);
+
+    for (done = 0; done < len; done += (uint64_t) got) {
+        got = pread(fd, buf, min(len - done, (uint64_t) STORE_CHUNK_MAX),
+                    (off_t) done);
+        if (got <= 0) {
+            if ((got < 0) && (errno == EINTR)) {
+                got = 0;
+                continue;
+            }
+
+            myfree(buf);
+            return (false);
+        }
+
+        if (!store_write_all(out, buf, (uint64_t) got, at + done)) {
+            myfree(buf);
+            return (false);
+        }
+    }
+
+    myfree(buf);
+
+    return (true);
+}
+
+/*
+ * store_materialize
+ *
+ * Rebuild the image kept as dir/name.manifest into filename. What no
+ * chunk covers is left as a hole.
+ */
+boolean
+store_materialize (const char *dir, const char *name, const char *filename)
+{
+    char line[MAX_STR];
+    char hex[STORE_HASH_HEX + 1];
+    char magic[32];
+    uint32_t version = 0;
+    uint32_t chunks = 0;
+    uint64_t size = 0;
+    uint64_t at;
+    uint64_t len;
+    boolean ok = true;
+    char *manifest;
+    char *path;
+    FILE *in;
+    int out;
+    int fd;
+
+    if (!store_name_ok(name)) {
+        return (false);
+    }
+
+    manifest = dynprintf("%s/%s.manifest", dir, name);
+
+    in = fopen(manifest, "r");
+    if (!in) {
+        ERR("Cannot open %s: %s", manifest, strerror(errno));
+        myfree(manifest);
+        return (false);
+    }
+
+    if (!fgets(line, sizeof(line), in) ||
+        (sscanf(line, "%31s %" SCNu32, magic, &version) != 2) ||
+        strcmp(magic, STORE_MAGIC) || (version != STORE_VERSION) ||
+        !fgets(line, sizeof(line), in) ||
+        (sscanf(line, "size %" SCNu64, &size) != 1)) {
+        ERR("%s is not a fatdisk store manifest", manifest);
+        fclose(in);
+        myfree(manifest);
+        return (false);
+    }
+
+    out = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if ((out < 0) || (ftruncate(out, (off_t) size) < 0)) {
+        ERR("Cannot create %s: %s", filename, strerror(errno));
+        if (out >= 0) {
+            close(out);
+        }
+        fclose(in);
+        myfree(manifest);
+        return (false);
+    }
+
+    while (ok && fgets(line, sizeof(line), in)) {
+        if (strncmp(line, "chunk ", 6)) {
+            continue;
+        }
+
+        if ((sscanf(line, "chunk %" SCNu64 " %" SCNu64 " %64s",
+                    &at, &len, hex) != 3) ||
+            (strspn(hex, "0123456789abcdef") != STORE_HASH_HEX) ||
+            (at + len > size)) {
+            ERR("Bad line in %s: %s", manifest, line);
+            ok = false;
+            break;
+        }
+
+        path = dynprintf("%s/chunks/%.2s/%s", dir, hex, hex);
+
+        fd = open(path, O_RDONLY);
+        if ((fd < 0) || !store_copy_chunk(fd, out, at, len)) {
+            ERR("Cannot copy chunk %s to %s: %s", path, filename,
+                strerror(errno));
+            ok = false;
+        }
+
+        if (fd >= 0) {
+            close(fd);
+        }
+
+        myfree(path);
+
+        chunks++;
+    }
+
+    if (ok && (fdatasync(out) < 0)) {
+        ERR("Cannot sync %s: %s", filename, strerror(errno));
+        ok = false;
+    }
+
+    close(out);
+    fclose(in);
+
+    if (ok) {
+        OUT("Materialized %s from %" PRIu32 " chunks, %" PRIu64 " bytes",
+            filename, chunks, size);
+    }
+
+    myfree(manifest);
+
+    return (ok);
+}
@@ -0,0 +1,17 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * A content addressed store of images, each kept as a manifest of chunks
+ * that are stored once however many images hold them.
+ */
+
+#ifndef __STORE_H__
+#define __STORE_H__
+
+boolean store_snapshot(disk_t *disk, const char *dir, const char *name);
+boolean store_materialize(const char *dir, const char *name,
+                          const char *filename);
+
+#endif
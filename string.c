@@ -359,6 +359,11 @@ boolean cat (void *addr, uint64_t offset, uint64_t len)
     return (true);
 }
 
+/*
+ * Number of regular expressions compiled, for --stats.
+ */
+uint64_t regcomp_count;
+
 /*
  * Match a regular expression
  */
@@ -378,6 +383,8 @@ boolean regexp_match (const char *reg, const char *find)
     /*
      * Compile regular expression
      */
+    regcomp_count++;
+
     ret = regcomp(&regex, reg, REG_ICASE | REG_NOSUB );
     if (ret) {
         DIE("Could not compile regex [%s]", reg);
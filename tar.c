@@ -0,0 +1,647 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * POSIX ustar archives, with pax headers for long names and FAT attributes.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+
+/*
+ * One ustar header block.
+ */
+typedef struct tar_header_ {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+static const uint8_t tar_zero[TAR_BLOCK_SIZE];
+
+/*
+ * tar_write
+ *
+ * Write all of a buffer, retrying short writes.
+ */
+boolean tar_write (int fd, const void *data, uint64_t len)
+{
+    const uint8_t *p = (const uint8_t *) data;
+    ssize_t done;
+
+    while (len) {
+        done = write(fd, p, len);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ERR("Failed to write archive: %s", strerror(errno));
+            return (false);
+        }
+
+        p += done;
+        len -= (uint64_t) done;
+    }
+
+    return (true);
+}
+
+/*
+ * tar_write_pad
+ *
+ * Pad what followed a header out to a whole block.
+ */
+boolean tar_write_pad (int fd, uint64_t size)
+{
+    uint64_t pad = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+
+    return (tar_write(fd, tar_zero, pad));
+}
+
+/*
+ * tar_octal
+ *
+ * Fill a numeric field with zero padded octal and a trailing nul. A value
+ * with too many digits for the field goes in GNU base 256 instead, as
+ * tar_number reads.
+ */
+static void tar_octal (char *field, uint32_t len, uint64_t value)
+{
+    uint8_t *p = (uint8_t *) field;
+    uint32_t bits = (len - 1) * 3;
+    uint32_t i;
+
+    if ((bits >= 64) || !(value >> bits)) {
+        field[len - 1] = '\0';
+
+        for (i = len - 1; i > 0; i--) {
+            field[i - 1] = (char) ('0' + (value & 7));
+            value >>= 3;
+        }
+
+        return;
+    }
+
+    for (i = len - 1; i > 0; i--) {
+        p[i] = (uint8_t) value;
+        value >>= 8;
+    }
+
+    p[0] = 0x80;
+}
+
+/*
+ * tar_pax_record
+ *
+ * Append a "len key=value\n" record, where len counts the whole record
+ * including its own digits.
+ */
+static char *tar_pax_record (char *records, const char *key,
+                             const char *value)
+{
+    uint32_t len = (uint32_t) (strlen(key) + strlen(value) + 3);
+    uint32_t total = len;
+    uint32_t want;
+    char digits[16];
+    char *record;
+    char *out;
+
+    /*
+     * Counting the digits can add a digit, so go until it settles.
+     */
+    for (;;) {
+        want = len + (uint32_t) snprintf(digits, sizeof(digits),
+                                         "%" PRIu32, total);
+        if (want == total) {
+            break;
+        }
+
+        total = want;
+    }
+
+    record = dynprintf("%" PRIu32 " %s=%s\n", total, key, value);
+
+    if (!records) {
+        return (record);
+    }
+
+    out = strappend(records, record);
+    myfree(records);
+    myfree(record);
+
+    return (out);
+}
+
+/*
+ * tar_split_name
+ *
+ * Fit a path into the ustar name and prefix fields, splitting at a slash.
+ * Returns false if it cannot fit.
+ */
+static boolean tar_split_name (tar_header_t *h, const char *name)
+{
+    uint32_t len = (uint32_t) strlen(name);
+    uint32_t i;
+
+    if (len <= sizeof(h->name)) {
+        memcpy(h->name, name, len);
+        return (true);
+    }
+
+    /*
+     * Dirs end in a slash, so look for one before the last character.
+     */
+    for (i = len - 1; i > 0; i--) {
+        if (name[i - 1] != '/') {
+            continue;
+        }
+
+        if (i - 1 > sizeof(h->prefix)) {
+            continue;
+        }
+
+        if (len - i > sizeof(h->name)) {
+            return (false);
+        }
+
+        memcpy(h->prefix, name, i - 1);
+        memcpy(h->name, name + i, len - i);
+
+        return (true);
+    }
+
+    return (false);
+}
+
+/*
+ * tar_write_block
+ *
+ * Checksum and write one header block.
+ */
+static boolean tar_write_block (int fd, tar_header_t *h)
+{
+    const uint8_t *p = (const uint8_t *) h;
+    uint32_t sum = 0;
+    uint32_t i;
+
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+    memset(h->chksum, ' ', sizeof(h->chksum));
+
+    for (i = 0; i < sizeof(*h); i++) {
+        sum += p[i];
+    }
+
+    /*
+     * Six digits, a nul and a space.
+     */
+    tar_octal(h->chksum, sizeof(h->chksum) - 1, sum);
+    h->chksum[7] = ' ';
+
+    return (tar_write(fd, h, sizeof(*h)));
+}
+
+/*
+ * tar_write_header
+ *
+ * Write the header for one entry. Names too long for ustar, and FAT
+ * attributes that tar has no field for, go first in a pax header.
+ */
+boolean tar_write_header (int fd, const char *name, char type, uint32_t mode,
+                          uint64_t size, time_t mtime, uint32_t attr)
+{
+    tar_header_t h;
+    char *records = 0;
+    boolean ok = true;
+
+    memset(&h, 0, sizeof(h));
+
+    if (!tar_split_name(&h, name)) {
+        records = tar_pax_record(records, "path", name);
+
+        memset(&h, 0, sizeof(h));
+        snprintf(h.name, sizeof(h.name), "%s", name);
+    }
+
+    if (attr) {
+        char value[16];
+
+        snprintf(value, sizeof(value), "0x%02" PRIx32, attr);
+        records = tar_pax_record(records, "FATDISK.attr", value);
+    }
+
+    if (records) {
+        tar_header_t x;
+        uint64_t len = strlen(records);
+
+        memset(&x, 0, sizeof(x));
+        snprintf(x.name, sizeof(x.name), "PaxHeaders/%.88s", name);
+        tar_octal(x.mode, sizeof(x.mode), 0644);
+        tar_octal(x.uid, sizeof(x.uid), 0);
+        tar_octal(x.gid, sizeof(x.gid), 0);
+        tar_octal(x.size, sizeof(x.size), len);
+        tar_octal(x.mtime, sizeof(x.mtime), (uint64_t) mtime);
+        x.typeflag = TAR_TYPE_PAX;
+
+        ok = tar_write_block(fd, &x) &&
+             tar_write(fd, records, len) &&
+             tar_write_pad(fd, len);
+
+        myfree(records);
+    }
+
+    if (!ok) {
+        return (false);
+    }
+
+    tar_octal(h.mode, sizeof(h.mode), mode);
+    tar_octal(h.uid, sizeof(h.uid), 0);
+    tar_octal(h.gid, sizeof(h.gid), 0);
+    tar_octal(h.size, sizeof(h.size), size);
+    tar_octal(h.mtime, sizeof(h.mtime), (uint64_t) mtime);
+    h.typeflag = type;
+
+    return (tar_write_block(fd, &h));
+}
+
+/*
+ * tar_write_end
+ *
+ * Two empty blocks end an archive.
+ */
+boolean tar_write_end (int fd)
+{
+    return (tar_write(fd, tar_zero, sizeof(tar_zero)) &&
+            tar_write(fd, tar_zero, sizeof(tar_zero)));
+}
+
+/*
+ * tar_read
+ *
+ * Read all of a buffer, retrying short reads. Running out is an error.
+ */
+boolean tar_read (int fd, void *data, uint64_t len)
+{
+    uint8_t *p = (uint8_t *) data;
+    ssize_t done;
+
+    while (len) {
+        done = read(fd, p, len);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            ERR("Failed to read archive: %s", strerror(errno));
+            return (false);
+        }
+
+        if (!done) {
+            ERR("Archive ends early, %" PRIu64 " bytes short", len);
+            return (false);
+        }
+
+        p += done;
+        len -= (uint64_t) done;
+    }
+
+    return (true);
+}
+
+/*
+ * tar_skip
+ *
+ * Read past the rest of the data of an entry of size bytes, of which done
+ * have been read already, and its padding.
+ */
+boolean tar_skip (int fd, uint64_t size, uint64_t done)
+{
+    uint8_t buf[TAR_BLOCK_SIZE * 8];
+    uint64_t chunk;
+    uint64_t len;
+
+    len = size - min(done, size) +
+          (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+
+    while (len) {
+        chunk = min(len, (uint64_t) sizeof(buf));
+
+        if (!tar_read(fd, buf, chunk)) {
+            return (false);
+        }
+
+        len -= chunk;
+    }
+
+    return (true);
+}
+
+/*
+ * tar_number
+ *
+ * Read a numeric field, in octal or in GNU base 256 if the top bit is set.
+ */
+static uint64_t tar_number (const char *field, uint32_t len)
+{
+    const uint8_t *p = (const uint8_t *) field;
+    uint64_t value = 0;
+    uint32_t i;
+
+    if (p[0] & 0x80) {
+        value = p[0] & 0x7f;
+
+        for (i = 1; i < len; i++) {
+            value = (value << 8) | p[i];
+        }
+
+        return (value);
+    }
+
+    for (i = 0; (i < len) && (field[i] == ' '); i++) {
+    }
+
+    for (; (i < len) && (field[i] >= '0') && (field[i] <= '7'); i++) {
+        value = (value << 3) | (uint64_t) (field[i] - '0');
+    }
+
+    return (value);
+}
+
+/*
+ * tar_string
+ *
+ * Copy a field that is only nul terminated if it is short.
+ */
+static char *tar_string (const char *field, uint32_t len)
+{
+    char *out = (char *) myzalloc(len + 1, __FUNCTION__);
+
+    memcpy(out, field, strnlen(field, len));
+
+    return (out);
+}
+
+/*
+ * tar_read_data
+ *
+ * Read the data of a pax or long name header into a nul terminated buffer.
+ */
+static char *tar_read_data (int fd, uint64_t size)
+{
+    uint64_t padded = size + (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) %
+                      TAR_BLOCK_SIZE;
+    char *data;
+
+    if (size > ONE_MEG) {
+        ERR("Archive header of %" PRIu64 " bytes is too large", size);
+        return (0);
+    }
+
+    data = (char *) myzalloc((uint32_t) padded + 1, __FUNCTION__);
+
+    if (!tar_read(fd, data, padded)) {
+        myfree(data);
+        return (0);
+    }
+
+    data[size] = '\0';
+
+    return (data);
+}
+
+/*
+ * What pax headers said about the entry that follows them.
+ */
+typedef struct tar_pax_ {
+    char *path;
+    char *linkpath;
+    uint64_t size;
+    time_t mtime;
+    uint32_t attr;
+    boolean size_set;
+    boolean mtime_set;
+} tar_pax_t;
+
+/*
+ * tar_parse_pax
+ *
+ * Pick out the records of a pax header that we know about.
+ */
+static void tar_parse_pax (tar_pax_t *pax, char *records, uint64_t size)
+{
+    char *end = records + size;
+    char *record = records;
+
+    while (record < end) {
+        char *next;
+        char *key;
+        char *value;
+        uint64_t len;
+
+        len = strtoull(record, &key, 10);
+        if (!len || (key == record) || (*key != ' ') ||
+            (len > (uint64_t) (end - record))) {
+            WARN("Bad pax record in archive");
+            return;
+        }
+
+        next = record + len;
+        next[-1] = '\0';
+        key++;
+
+        value = strchr(key, '=');
+        if (!value) {
+            record = next;
+            continue;
+        }
+
+        *value++ = '\0';
+
+        if (!strcmp(key, "path")) {
+            myfree(pax->path);
+            pax->path = dupstr(value, __FUNCTION__);
+        } else if (!strcmp(key, "linkpath")) {
+            myfree(pax->linkpath);
+            pax->linkpath = dupstr(value, __FUNCTION__);
+        } else if (!strcmp(key, "size")) {
+            pax->size = strtoull(value, 0, 10);
+            pax->size_set = true;
+        } else if (!strcmp(key, "mtime")) {
+            pax->mtime = (time_t) strtoll(value, 0, 10);
+            pax->mtime_set = true;
+        } else if (!strcmp(key, "FATDISK.attr")) {
+            pax->attr = (uint32_t) strtoul(value, 0, 0);
+        }
+
+        record = next;
+    }
+}
+
+/*
+ * tar_read_header
+ *
+ * Read the next entry header, applying any pax or GNU long name headers in
+ * front of it. Returns false at the end of the archive or on error, with
+ * failed set if it was an error. The caller must then read or skip the
+ * entry data.
+ */
+boolean tar_read_header (int fd, tar_entry_t *entry, boolean *failed)
+{
+    static const uint8_t zero[TAR_BLOCK_SIZE];
+    tar_pax_t pax = {0};
+    tar_header_t h;
+    uint64_t size;
+    ssize_t got;
+
+    memset(entry, 0, sizeof(*entry));
+    *failed = false;
+
+    for (;;) {
+        const uint8_t *p = (const uint8_t *) &h;
+        uint32_t sum = 0;
+        uint32_t i;
+
+        /*
+         * An archive that just stops between entries is taken as ended.
+         */
+        do {
+            got = read(fd, &h, 1);
+        } while ((got < 0) && (errno == EINTR));
+
+        if (got < 0) {
+            ERR("Failed to read archive: %s", strerror(errno));
+            *failed = true;
+            break;
+        }
+
+        if (!got) {
+            break;
+        }
+
+        if (!tar_read(fd, ((uint8_t *) &h) + 1, sizeof(h) - 1)) {
+            *failed = true;
+            break;
+        }
+
+        if (!memcmp(&h, zero, sizeof(h))) {
+            break;
+        }
+
+        for (i = 0; i < sizeof(h); i++) {
+            if ((i >= offsetof(tar_header_t, chksum)) &&
+                (i < offsetof(tar_header_t, chksum) + sizeof(h.chksum))) {
+                sum += ' ';
+            } else {
+                sum += p[i];
+            }
+        }
+
+        if (sum != tar_number(h.chksum, sizeof(h.chksum))) {
+            ERR("Bad checksum in archive header");
+            *failed = true;
+            break;
+        }
+
+        size = tar_number(h.size, sizeof(h.size));
+
+        /*
+         * Extended headers say things about the entry that follows.
+         */
+        if ((h.typeflag == TAR_TYPE_PAX) ||
+            (h.typeflag == TAR_TYPE_PAX_GLOBAL) ||
+            (h.typeflag == TAR_TYPE_GNU_LONGNAME)) {
+            char *data = tar_read_data(fd, size);
+
+            if (!data) {
+                *failed = true;
+                break;
+            }
+
+            if (h.typeflag == TAR_TYPE_GNU_LONGNAME) {
+                myfree(pax.path);
+                pax.path = data;
+                continue;
+            }
+
+            if (h.typeflag == TAR_TYPE_PAX) {
+                tar_parse_pax(&pax, data, size);
+            }
+
+            myfree(data);
+            continue;
+        }
+
+        entry->type = h.typeflag;
+        entry->mode = (uint32_t) tar_number(h.mode, sizeof(h.mode));
+        entry->size = pax.size_set ? pax.size : size;
+        entry->mtime = pax.mtime_set ? pax.mtime :
+                    (time_t) tar_number(h.mtime, sizeof(h.mtime));
+        entry->attr = pax.attr;
+
+        if (pax.linkpath) {
+            entry->linkname = pax.linkpath;
+        } else {
+            entry->linkname = tar_string(h.linkname, sizeof(h.linkname));
+        }
+
+        if (pax.path) {
+            entry->name = pax.path;
+        } else if (h.prefix[0] && !memcmp(h.magic, "ustar", 5)) {
+            char *prefix = tar_string(h.prefix, sizeof(h.prefix));
+            char *name = tar_string(h.name, sizeof(h.name));
+
+            entry->name = dynprintf("%s/%s", prefix, name);
+            myfree(prefix);
+            myfree(name);
+        } else {
+            entry->name = tar_string(h.name, sizeof(h.name));
+        }
+
+        return (true);
+    }
+
+    myfree(pax.path);
+    myfree(pax.linkpath);
+    memset(entry, 0, sizeof(*entry));
+
+    return (false);
+}
+
+/*
+ * tar_entry_free
+ *
+ * Free what tar_read_header allocated.
+ */
+void tar_entry_free (tar_entry_t *entry)
+{
+    myfree(entry->name);
+    entry->name = 0;
+
+    myfree(entry->linkname);
+    entry->linkname = 0;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * POSIX ustar archives, with pax headers for long names and FAT attributes.
+ */
+
+#ifndef __TAR_H__
+#define __TAR_H__
+
+#include <time.h>
+
+#define TAR_BLOCK_SIZE                  512
+
+/*
+ * Entry types.
+ */
+#define TAR_TYPE_FILE                   '0'
+#define TAR_TYPE_LINK                   '1'
+#define TAR_TYPE_DIR                    '5'
+#define TAR_TYPE_FILE_OLD               '\0'
+#define TAR_TYPE_PAX                    'x'
+#define TAR_TYPE_PAX_GLOBAL             'g'
+#define TAR_TYPE_GNU_LONGNAME           'L'
+
+/*
+ * One entry read from an archive, with any pax or GNU long name headers
+ * before it applied.
+ */
+typedef struct tar_entry_ {
+    char *name;
+    char *linkname;
+    char type;
+    uint32_t mode;
+    uint64_t size;
+    time_t mtime;
+    uint32_t attr;
+} tar_entry_t;
+
+boolean tar_write(int fd, const void *data, uint64_t len);
+boolean tar_write_header(int fd, const char *name, char type, uint32_t mode,
+                         uint64_t size, time_t mtime, uint32_t attr);
+boolean tar_write_pad(int fd, uint64_t size);
+boolean tar_write_end(int fd);
+
+boolean tar_read(int fd, void *data, uint64_t len);
+boolean tar_skip(int fd, uint64_t size, uint64_t done);
+boolean tar_read_header(int fd, tar_entry_t *entry, boolean *failed);
+void tar_entry_free(tar_entry_t *entry);
+
+#endif
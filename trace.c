@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * Timestamped trace events kept in a ring and written out at exit as
+ * Chrome trace-event JSON, for chrome://tracing or Perfetto.
+ */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "main.h"
+
+/*
+ * One event. Names are string constants so only the pointer is kept.
+ */
+typedef struct trace_event_ {
+    uint64_t ts_ns;
+    uint64_t dur_ns;
+    uint64_t offset;
+    uint64_t len;
+    const char *name;
+    char ph;
+    boolean io;
+    boolean cached;
+    char arg[64];
+} trace_event_t;
+
+boolean trace_enabled;
+
+static char *trace_filename;
+static trace_event_t *trace_ring;
+static uint64_t trace_count;
+static uint64_t trace_start_ns;
+
+/*
+ * trace_open
+ *
+ * Start recording events, to be written to filename at exit.
+ */
+boolean trace_open (const char *filename)
+{
+    if (trace_ring) {
+        return (true);
+    }
+
+    trace_ring = (typeof(trace_ring))
+                    myzalloc(sizeof(*trace_ring) * TRACE_RING_EVENTS,
+                             __FUNCTION__);
+
+    trace_filename = dupstr(filename, __FUNCTION__);
+    trace_start_ns = time_now_ns();
+    trace_count = 0;
+    trace_enabled = true;
+
+    return (true);
+}
+
+/*
+ * trace_next
+ *
+ * Next slot in the ring. Once full, the oldest events are overwritten.
+ */
+static trace_event_t *trace_next (const char *name, char ph)
+{
+    trace_event_t *ev = &trace_ring[trace_count % TRACE_RING_EVENTS];
+
+    trace_count++;
+
+    ev->ts_ns = time_now_ns();
+    ev->dur_ns = 0;
+    ev->name = name;
+    ev->ph = ph;
+    ev->io = false;
+    ev->arg[0] = '\0';
+
+    return (ev);
+}
+
+void trace_begin_ (const char *name, const char *arg)
+{
+    trace_event_t *ev = trace_next(name, 'B');
+
+    if (arg) {
+        strncpy(ev->arg, arg, sizeof(ev->arg) - 1);
+        ev->arg[sizeof(ev->arg) - 1] = '\0';
+    }
+}
+
+void trace_end_ (const char *name)
+{
+    trace_next(name, 'E');
+}
+
+/*
+ * trace_io_
+ *
+ * A complete event for one read or write, from start_ns until now.
+ */
+void trace_io_ (const char *name, uint64_t start_ns, uint64_t offset,
+                uint64_t len, boolean cached)
+{
+    trace_event_t *ev = trace_next(name, 'X');
+
+    if (start_ns && (start_ns < ev->ts_ns)) {
+        ev->dur_ns = ev->ts_ns - start_ns;
+        ev->ts_ns = start_ns;
+    }
+
+    ev->io = true;
+    ev->offset = offset;
+    ev->len = len;
+    ev->cached = cached;
+}
+
+/*
+ * trace_quote
+ *
+ * Write a string as a JSON string.
+ */
+static void trace_quote (FILE *fp, const char *s)
+{
+    fputc('"', fp);
+
+    for (; *s; s++) {
+        if ((*s == '"') || (*s == '\\')) {
+            fputc('\\', fp);
+            fputc(*s, fp);
+        } else if ((unsigned char) *s < ' ') {
+            fprintf(fp, "\\u%04x", (unsigned char) *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+
+    fputc('"', fp);
+}
+
+/*
+ * trace_flush
+ *
+ * Write what is in the ring out as Chrome trace JSON and stop tracing.
+ */
+void trace_flush (void)
+{
+    uint64_t first;
+    uint64_t i;
+    FILE *fp;
+
+    if (!trace_ring) {
+        return;
+    }
+
+    trace_enabled = false;
+
+    fp = fopen(trace_filename, "w");
+    if (!fp) {
+        ERR("Cannot write trace file %s", trace_filename);
+    } else {
+        first = 0;
+        if (trace_count > TRACE_RING_EVENTS) {
+            first = trace_count - TRACE_RING_EVENTS;
+        }
+
+        fprintf(fp, "{\"traceEvents\":[\n");
+
+        for (i = first; i < trace_count; i++) {
+            trace_event_t *ev = &trace_ring[i % TRACE_RING_EVENTS];
+            uint64_t ts = ev->ts_ns - trace_start_ns;
+
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,"
+                    "\"tid\":1,\"ts\":%" PRIu64 ".%03" PRIu64,
+                    i == first ? "" : ",\n",
+                    ev->name, ev->ph, ts / 1000, ts % 1000);
+
+            if (ev->ph == 'X') {
+                fprintf(fp, ",\"dur\":%" PRIu64 ".%03" PRIu64,
+                        ev->dur_ns / 1000, ev->dur_ns % 1000);
+            }
+
+            if (ev->io) {
+                fprintf(fp, ",\"args\":{\"offset\":%" PRIu64
+                        ",\"len\":%" PRIu64 ",\"cached\":%s}",
+                        ev->offset, ev->len, ev->cached ? "true" : "false");
+            } else if (ev->arg[0]) {
+                fprintf(fp, ",\"args\":{\"name\":");
+                trace_quote(fp, ev->arg);
+                fprintf(fp, "}");
+            }
+
+            fprintf(fp, "}");
+        }
+
+        fprintf(fp, "\n],\"otherData\":{\"events\":%" PRIu64
+                ",\"dropped\":%" PRIu64 "}}\n",
+                trace_count, first);
+
+        fclose(fp);
+    }
+
+    myfree(trace_ring);
+    trace_ring = 0;
+
+    myfree(trace_filename);
+    trace_filename = 0;
+}
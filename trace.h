@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * Timestamped trace events kept in a ring and written out at exit as
+ * Chrome trace-event JSON, for chrome://tracing or Perfetto.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+extern boolean trace_enabled;
+
+boolean trace_open(const char *filename);
+void trace_flush(void);
+
+void trace_begin_(const char *name, const char *arg);
+void trace_end_(const char *name);
+void trace_io_(const char *name, uint64_t start_ns, uint64_t offset,
+               uint64_t len, boolean cached);
+
+/*
+ * The name must be a string constant; only the pointer is kept. The arg is
+ * copied. Nothing is evaluated unless --trace was given.
+ */
+#define TRACE_BEGIN(__name__, __arg__)                                        \
+    do {                                                                      \
+        if (trace_enabled) {                                                  \
+            trace_begin_((__name__), (__arg__));                              \
+        }                                                                     \
+    } while (0)
+
+#define TRACE_END(__name__)                                                   \
+    do {                                                                      \
+        if (trace_enabled) {                                                  \
+            trace_end_((__name__));                                           \
+        }                                                                     \
+    } while (0)
+
+#define TRACE_IO(__name__, __start__, __offset__, __len__, __cached__)        \
+    do {                                                                      \
+        if (trace_enabled) {                                                  \
+            trace_io_((__name__), (__start__), (__offset__), (__len__),       \
+                      (__cached__));                                          \
+        }                                                                     \
+    } while (0)
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * Batches of writes queued on io_uring, so the device sees more than one
+ * at a time. Straight system calls, no liburing; anywhere io_uring cannot
+ * be had the callers write one at a time as before.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "main.h"
+
+/*
+ * Writes and bytes the kernel finished for us off the ring. These never
+ * show in /proc/self/io, so anyone counting system calls adds them on.
+ */
+uint64_t uring_writes;
+uint64_t uring_written;
+
+#if defined(ENABLE_IO_URING) && defined(__linux__)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Most bytes one queued write is asked for; a longer one finishes with
+ * pwrite.
+ */
+#define URING_WRITE_MAX                 (1U << 30)
+
+/*
+ * The rings as mapped from the kernel.
+ */
+struct uring_ {
+    int fd;
+    uint32_t entries;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/*
+ * uring_create
+ *
+ * Set up a ring of the given depth. Zero if the kernel has no io_uring or
+ * will not let us have one.
+ */
+uring_t *
+uring_create (uint32_t entries)
+{
+    struct io_uring_params p;
+    uring_t *ring;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+
+    fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        DBG("No io_uring: %s", strerror(errno));
+        return (0);
+    }
+
+    ring = (typeof(ring)) myzalloc(sizeof(*ring), __FUNCTION__);
+    ring->fd = fd;
+    ring->entries = p.sq_entries;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes +
+                    p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_ring_size = max(ring->sq_ring_size, ring->cq_ring_size);
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(0, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = 0;
+        uring_destroy(ring);
+        return (0);
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(0, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = 0;
+            uring_destroy(ring);
+            return (0);
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (typeof(ring->sqes))
+                    mmap(0, ring->sqes_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = 0;
+        uring_destroy(ring);
+        return (0);
+    }
+
+    ring->sq_head = (unsigned *) ((uint8_t *) ring->sq_ring + p.sq_off.head);
+    ring->sq_tail = (unsigned *) ((uint8_t *) ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)
+                    ((uint8_t *) ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)
+                    ((uint8_t *) ring->sq_ring + p.sq_off.array);
+    ring->cq_head = (unsigned *) ((uint8_t *) ring->cq_ring + p.cq_off.head);
+    ring->cq_tail = (unsigned *) ((uint8_t *) ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)
+                    ((uint8_t *) ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)
+                    ((uint8_t *) ring->cq_ring + p.cq_off.cqes);
+
+    return (ring);
+}
+
+/*
+ * uring_destroy
+ *
+ * Unmap the rings and close them.
+ */
+void
+uring_destroy (uring_t *ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    if (ring->cq_ring && (ring->cq_ring != ring->sq_ring)) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+
+    close(ring->fd);
+    myfree(ring);
+}
+
+/*
+ * uring_pwrite
+ *
+ * Write what a queued write left undone.
+ */
+static boolean
+uring_pwrite (int fd, const uint8_t *data, uint64_t len, uint64_t offset)
+{
+    ssize_t done;
+
+    while (len) {
+        done = pwrite(fd, data, len, (off_t) offset);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return (false);
+        }
+
+        data += done;
+        offset += (uint64_t) done;
+        len -= (uint64_t) done;
+    }
+
+    return (true);
+}
+
+/*
+ * uring_write
+ *
+ * Queue a batch of writes to fd at base plus their offsets, keeping the
+ * ring as full as it will go, and wait for them all. Returns false, having
+ * written nothing, if io_uring cannot be used; else sets ok false if any
+ * write failed, and depth to the most that were in flight at once.
+ */
+boolean
+uring_write (uring_t *ring, int fd, uint64_t base,
+             const uring_write_t *writes, uint32_t count,
+             boolean *ok, uint32_t *depth)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    boolean submitted = false;
+    uint32_t inflight = 0;
+    uint32_t next = 0;
+    uint32_t done = 0;
+    unsigned head;
+    unsigned tail;
+    int ret;
+
+    *ok = true;
+    *depth = 0;
+
+    while (done < count) {
+        /*
+         * Top the ring up.
+         */
+        tail = *ring->sq_tail;
+
+        while ((next < count) && (inflight < ring->entries)) {
+            const uring_write_t *w = &writes[next];
+            unsigned index = tail & *ring->sq_mask;
+
+            sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = fd;
+            sqe->off = base + w->offset;
+            sqe->addr = (uint64_t) (uintptr_t) w->data;
+            sqe->len = (uint32_t) min(w->len, (uint64_t) URING_WRITE_MAX);
+            sqe->user_data = next;
+
+            ring->sq_array[index] = index;
+            tail++;
+            next++;
+            inflight++;
+        }
+
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        *depth = max(*depth, inflight);
+
+        /*
+         * Hand over what the kernel has not taken yet and wait for at
+         * least one to finish.
+         */
+        ret = (int) syscall(__NR_io_uring_enter, ring->fd,
+                            tail - __atomic_load_n(ring->sq_head,
+                                                   __ATOMIC_ACQUIRE),
+                            1, IORING_ENTER_GETEVENTS, 0, 0);
+        if (ret < 0) {
+            if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)) {
+                continue;
+            }
+
+            if (!submitted) {
+                /*
+                 * Take them back off the ring; the caller writes them.
+                 */
+                __atomic_store_n(ring->sq_tail,
+                                 __atomic_load_n(ring->sq_head,
+                                                 __ATOMIC_ACQUIRE),
+                                 __ATOMIC_RELEASE);
+
+                DBG("io_uring refused: %s", strerror(errno));
+                return (false);
+            }
+
+            DIE("io_uring failed with writes in flight: %s",
+                strerror(errno));
+        }
+
+        submitted = true;
+
+        /*
+         * Reap what is done.
+         */
+        head = *ring->cq_head;
+
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            const uring_write_t *w;
+
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            w = &writes[cqe->user_data];
+
+            if (cqe->res < 0) {
+                ERR("Write of %" PRIu64 " bytes at %" PRIu64 " failed: %s",
+                    w->len, base + w->offset, strerror(-cqe->res));
+                *ok = false;
+            } else {
+                uring_writes++;
+                uring_written += (uint64_t) cqe->res;
+
+                if ((uint64_t) cqe->res < w->len) {
+                    if (!uring_pwrite(fd, w->data + cqe->res,
+                                      w->len - (uint64_t) cqe->res,
+                                      base + w->offset +
+                                      (uint64_t) cqe->res)) {
+                        ERR("Write of %" PRIu64 " bytes at %" PRIu64
+                            " failed: %s", w->len, base + w->offset,
+                            strerror(errno));
+                        *ok = false;
+                    }
+                }
+            }
+
+            head++;
+            inflight--;
+            done++;
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return (true);
+}
+
+#else
+
+/*
+ * uring_create
+ *
+ * No io_uring here.
+ */
+uring_t *
+uring_create (uint32_t entries)
+{
+    return (0);
+}
+
+/*
+ * uring_destroy
+ *
+ * Nothing to undo.
+ */
+void
+uring_destroy (uring_t *ring)
+{
+}
+
+/*
+ * uring_write
+ *
+ * Never used, as there is never a ring.
+ */
+boolean
+uring_write (uring_t *ring, int fd, uint64_t base,
+             const uring_write_t *writes, uint32_t count,
+             boolean *ok, uint32_t *depth)
+{
+    return (false);
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2013 Neil McGill
+ *
+ * See the LICENSE file for license.
+ *
+ * Batches of writes queued on io_uring, so the device sees more than one
+ * at a time.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+/*
+ * One write of a batch. The data must stay put until the batch is done.
+ */
+typedef struct uring_write_ {
+    uint64_t offset;
+    const uint8_t *data;
+    uint64_t len;
+} uring_write_t;
+
+typedef struct uring_ uring_t;
+
+extern uint64_t uring_writes;
+extern uint64_t uring_written;
+
+uring_t *uring_create(uint32_t entries);
+void uring_destroy(uring_t *ring);
+boolean uring_write(uring_t *ring, int fd, uint64_t base,
+                    const uring_write_t *writes, uint32_t count,
+                    boolean *ok, uint32_t *depth);
+
+#endif
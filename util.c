@@ -7,11 +7,19 @@
 #include "config.h"
 
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "main.h"
 
+/*
+ * Heap allocations made, for --stats.
+ */
+uint64_t alloc_count;
+
 void *myzalloc_ (uint32_t size,
                  const char *what,
                  const char *file,
@@ -24,6 +32,8 @@ void *myzalloc_ (uint32_t size,
         DIE("No memory, %s:%s():%u", file, func, line);
     }
 
+    alloc_count++;
+
 #ifdef ENABLE_PTRCHECK
     ptrcheck_alloc(ptr, what, size, file, func, line);
 #endif
@@ -43,6 +53,8 @@ void *mymalloc_ (uint32_t size,
         DIE("No memory, %s:%s():%u", file, func, line);
     }
 
+    alloc_count++;
+
 #ifdef ENABLE_PTRCHECK
     ptrcheck_alloc(ptr, what, size, file, func, line);
 #endif
@@ -58,7 +70,9 @@ void *myrealloc_ (void *ptr,
                   const uint32_t line)
 {
 #ifdef ENABLE_PTRCHECK
-    ptrcheck_free(ptr, file, func, line);
+    if (ptr) {
+        ptrcheck_free(ptr, file, func, line);
+    }
 #endif
 
     ptr = realloc(ptr, size);
@@ -66,6 +80,8 @@ void *myrealloc_ (void *ptr,
         DIE("No memory, %s:%s():%u", file, func, line);
     }
 
+    alloc_count++;
+
 #ifdef ENABLE_PTRCHECK
     ptrcheck_alloc(ptr, what, size, file, func, line);
 #endif
@@ -102,6 +118,8 @@ char *dupstr_ (const char *in,
         DIE("No memory, %s:%s():%u", file, func, line);
     }
 
+    alloc_count++;
+
 #ifdef ENABLE_PTRCHECK
     ptrcheck_alloc(ptr, what, size, file, func, line);
 #endif
@@ -122,6 +140,8 @@ char *duplstr_ (const char *in,
         DIE("No memory, %s:%s():%u", file, func, line);
     }
 
+    alloc_count++;
+
     char *p;
 
     p = ptr;
@@ -136,3 +156,428 @@ char *duplstr_ (const char *in,
 
     return (ptr);
 }
+
+/*
+ * crc32c
+ *
+ * Castagnoli CRC of a buffer. Start with crc 0 and pass the result back in
+ * to checksum data in pieces.
+ */
+uint32_t crc32c (uint32_t crc, const uint8_t *buf, uint64_t len)
+{
+    static uint32_t table[256];
+    static boolean init;
+    uint32_t i;
+    uint32_t j;
+    uint32_t c;
+
+    if (!init) {
+        for (i = 0; i < 256; i++) {
+            c = i;
+
+            for (j = 0; j < 8; j++) {
+                c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : (c >> 1);
+            }
+
+            table[i] = c;
+        }
+
+        init = true;
+    }
+
+    crc = ~crc;
+
+    while (len--) {
+        crc = table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    }
+
+    return (~crc);
+}
+
+/*
+ * sha256_block
+ *
+ * Mix one 64 byte block into the hash state.
+ */
+static void sha256_block (uint32_t state[8], const uint8_t *block)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+        0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+        0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+        0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t w[64];
+    uint32_t v[8];
+    uint32_t t1;
+    uint32_t t2;
+    uint32_t i;
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+    for (i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[i * 4] << 24) |
+               ((uint32_t) block[(i * 4) + 1] << 16) |
+               ((uint32_t) block[(i * 4) + 2] << 8) |
+               (uint32_t) block[(i * 4) + 3];
+    }
+
+    for (i = 16; i < 64; i++) {
+        w[i] = w[i - 16] + w[i - 7] +
+               (SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^
+                (w[i - 15] >> 3)) +
+               (SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^
+                (w[i - 2] >> 10));
+    }
+
+    memcpy(v, state, sizeof(v));
+
+    for (i = 0; i < 64; i++) {
+        t1 = v[7] +
+             (SHA256_ROR(v[4], 6) ^ SHA256_ROR(v[4], 11) ^
+              SHA256_ROR(v[4], 25)) +
+             ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i];
+        t2 = (SHA256_ROR(v[0], 2) ^ SHA256_ROR(v[0], 13) ^
+              SHA256_ROR(v[0], 22)) +
+             ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+        memmove(v + 1, v, 7 * sizeof(uint32_t));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+
+#undef SHA256_ROR
+
+    for (i = 0; i < 8; i++) {
+        state[i] += v[i];
+    }
+}
+
+/*
+ * sha256
+ *
+ * SHA-256 of a buffer, for naming data by its content.
+ */
+void sha256 (const uint8_t *buf, uint64_t len, uint8_t out[32])
+{
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    uint8_t tail[128];
+    uint64_t bits = len * 8;
+    uint64_t rest;
+    uint64_t pad;
+    uint32_t i;
+
+    while (len >= 64) {
+        sha256_block(state, buf);
+        buf += 64;
+        len -= 64;
+    }
+
+    /*
+     * The last of the data, a one bit, zeros, and the length in bits.
+     */
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, buf, len);
+    tail[len] = 0x80;
+
+    rest = (len < 56) ? 64 : 128;
+
+    for (pad = 0; pad < 8; pad++) {
+        tail[rest - 1 - pad] = (uint8_t) (bits >> (pad * 8));
+    }
+
+    sha256_block(state, tail);
+    if (rest == 128) {
+        sha256_block(state, tail + 64);
+    }
+
+    for (i = 0; i < 8; i++) {
+        out[i * 4] = (uint8_t) (state[i] >> 24);
+        out[(i * 4) + 1] = (uint8_t) (state[i] >> 16);
+        out[(i * 4) + 2] = (uint8_t) (state[i] >> 8);
+        out[(i * 4) + 3] = (uint8_t) state[i];
+    }
+}
+
+/*
+ * time_now_ns
+ *
+ * Monotonic clock in nanoseconds, for timing.
+ */
+uint64_t time_now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (((uint64_t) ts.tv_sec * 1000000000ULL) + (uint64_t) ts.tv_nsec);
+}
+
+/*
+ * arena_alloc
+ *
+ * Bump allocate from the arena. The memory is not zeroed and lives until
+ * the arena is released back past it.
+ */
+void *arena_alloc (arena_t *arena, uint32_t size)
+{
+    arena_block_t *block = arena->block;
+    uint8_t *ptr;
+
+    size = (size + 7) & ~7;
+
+    if (!block || (block->used + size > block->size)) {
+        block = arena->spare;
+
+        if (block && (block->size >= size)) {
+            arena->spare = block->prev;
+        } else {
+            uint32_t block_size = ARENA_BLOCK_SIZE;
+
+            if (size > block_size) {
+                block_size = size;
+            }
+
+            block = (typeof(block))
+                    mymalloc(sizeof(*block) + block_size, "arena block");
+            block->size = block_size;
+            arena->blocks++;
+        }
+
+        block->used = 0;
+        block->prev = arena->block;
+        arena->block = block;
+    }
+
+    ptr = ((uint8_t *) (block + 1)) + block->used;
+    block->used += size;
+
+    arena->allocs++;
+    arena->bytes += size;
+    if (arena->bytes > arena->bytes_peak) {
+        arena->bytes_peak = arena->bytes;
+    }
+
+    return (ptr);
+}
+
+/*
+ * arena_mark
+ *
+ * Remember where the arena is, to release back to later.
+ */
+arena_mark_t arena_mark (arena_t *arena)
+{
+    arena_mark_t mark;
+
+    mark.block = arena->block;
+    mark.used = arena->block ? arena->block->used : 0;
+    mark.bytes = arena->bytes;
+
+    return (mark);
+}
+
+/*
+ * arena_release
+ *
+ * Drop everything allocated since the mark. Blocks are kept for reuse, so
+ * this is normally just resetting the top block.
+ */
+void arena_release (arena_t *arena, arena_mark_t mark)
+{
+    arena_block_t *block;
+
+    while (arena->block != mark.block) {
+        block = arena->block;
+        arena->block = block->prev;
+
+        block->prev = arena->spare;
+        arena->spare = block;
+    }
+
+    if (arena->block) {
+        arena->block->used = mark.used;
+    }
+
+    arena->bytes = mark.bytes;
+}
+
+/*
+ * arena_destroy
+ *
+ * Free all arena memory.
+ */
+void arena_destroy (arena_t *arena)
+{
+    arena_block_t *block;
+
+    while ((block = arena->block)) {
+        arena->block = block->prev;
+        myfree(block);
+    }
+
+    while ((block = arena->spare)) {
+        arena->spare = block->prev;
+        myfree(block);
+    }
+
+    arena->bytes = 0;
+}
+
+/*
+ * arena_vprintf
+ *
+ * Like dynvprintf, but from the arena.
+ */
+char *arena_vprintf (arena_t *arena, const char *fmt, va_list args)
+{
+    va_list args2;
+    int32_t len;
+    char *ptr;
+
+    va_copy(args2, args);
+    len = vsnprintf(0, 0, fmt, args2);
+    va_end(args2);
+
+    ptr = (typeof(ptr)) arena_alloc(arena, len + 1);
+    vsnprintf(ptr, len + 1, fmt, args);
+
+    return (ptr);
+}
+
+/*
+ * arena_printf
+ *
+ * Like dynprintf, but from the arena.
+ */
+char *arena_printf (arena_t *arena, const char *fmt, ...)
+{
+    va_list args;
+    char *ptr;
+
+    va_start(args, fmt);
+    ptr = arena_vprintf(arena, fmt, args);
+    va_end(args);
+
+    return (ptr);
+}
+
+/*
+ * arena_duplstr
+ *
+ * Like duplstr, a lower case copy, but from the arena.
+ */
+char *arena_duplstr (arena_t *arena, const char *in)
+{
+    uint32_t len = (typeof(len)) strlen(in);
+    char *ptr = (typeof(ptr)) arena_alloc(arena, len + 1);
+    char *p = ptr;
+
+    while (*in) {
+        *p++ = tolower(*in++);
+    }
+
+    *p = '\0';
+
+    return (ptr);
+}
+
+/*
+ * slab_init
+ *
+ * A pool of fixed size objects, carved from chunks of objs_per_chunk.
+ */
+void slab_init (slab_t *slab, uint32_t obj_size, uint32_t objs_per_chunk)
+{
+    memset(slab, 0, sizeof(*slab));
+
+    if (obj_size < sizeof(void *)) {
+        obj_size = sizeof(void *);
+    }
+
+    slab->obj_size = (obj_size + 15) & ~15;
+    slab->objs_per_chunk = objs_per_chunk;
+}
+
+/*
+ * slab_alloc
+ *
+ * An object from the pool. Not zeroed.
+ */
+void *slab_alloc (slab_t *slab)
+{
+    void *obj;
+
+    if (!slab->free_list) {
+        uint8_t *chunk;
+        uint32_t i;
+
+        chunk = (typeof(chunk))
+                mymalloc(16 + (slab->obj_size * slab->objs_per_chunk),
+                         "slab chunk");
+
+        *(void **) chunk = slab->chunks;
+        slab->chunks = chunk;
+
+        for (i = 0; i < slab->objs_per_chunk; i++) {
+            obj = chunk + 16 + (i * slab->obj_size);
+            *(void **) obj = slab->free_list;
+            slab->free_list = obj;
+        }
+    }
+
+    obj = slab->free_list;
+    slab->free_list = *(void **) obj;
+
+    slab->objects++;
+    if (slab->objects > slab->objects_peak) {
+        slab->objects_peak = slab->objects;
+    }
+
+    return (obj);
+}
+
+/*
+ * slab_free
+ *
+ * Give an object back to the pool.
+ */
+void slab_free (slab_t *slab, void *obj)
+{
+    *(void **) obj = slab->free_list;
+    slab->free_list = obj;
+    slab->objects--;
+}
+
+/*
+ * slab_destroy
+ *
+ * Free every chunk, and so every object, at once.
+ */
+void slab_destroy (slab_t *slab)
+{
+    void *chunk;
+
+    while ((chunk = slab->chunks)) {
+        slab->chunks = *(void **) chunk;
+        myfree(chunk);
+    }
+
+    slab->free_list = 0;
+    slab->objects = 0;
+}